@@ -50,8 +50,16 @@ extern "C" {
 #define FUSE_CAP_POSIX_ACL	(1 << 18)
 #endif
 
+/*
+ * FUSE_CAP_READDIRPLUS: return the attributes of entries when reading
+ *		directories, through the readdirplus() method
+ * FUSE_CAP_WRITEBACK_CACHE: buffer writes in the kernel page cache,
+ *		the kernel being then in charge of the file size and mtime
+ */
 #define FUSE_CAP_BIG_WRITES	(1 << 5)
 #define FUSE_CAP_IOCTL_DIR	(1 << 11)
+#define FUSE_CAP_READDIRPLUS	(1 << 13)
+#define FUSE_CAP_WRITEBACK_CACHE	(1 << 16)
 
 /**
  * Ioctl flags
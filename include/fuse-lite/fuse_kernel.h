@@ -40,6 +40,7 @@
 #define __u64 uint64_t
 #define __u32 uint32_t
 #define __s32 int32_t
+#define __s64 int64_t
 #else
 #include <asm/types.h>
 #include <linux/major.h>
@@ -138,14 +139,26 @@ struct fuse_file_lock {
  * FUSE_BIG_WRITES: allow big writes to be issued to the file system
  * FUSE_DONT_MASK: don't apply umask to file mode on create operations
  * FUSE_HAS_IOCTL_DIR: kernel supports ioctl on directories
+ * FUSE_DO_READDIRPLUS: do READDIRPLUS (READDIR+LOOKUP in one)
+ * FUSE_WRITEBACK_CACHE: use writeback cache for buffered writes
  * FUSE_POSIX_ACL: kernel supports Posix ACLs
+ * FUSE_MAX_PAGES: init_out.max_pages contains the max number of req pages
  */
 #define FUSE_ASYNC_READ		(1 << 0)
 #define FUSE_POSIX_LOCKS	(1 << 1)
 #define FUSE_BIG_WRITES		(1 << 5)
 #define FUSE_DONT_MASK		(1 << 6)
 #define FUSE_HAS_IOCTL_DIR	(1 << 11)
+#define FUSE_DO_READDIRPLUS	(1 << 13)
+#define FUSE_WRITEBACK_CACHE	(1 << 16)
 #define FUSE_POSIX_ACL		(1 << 19)
+#define FUSE_MAX_PAGES		(1 << 22)
+
+/**
+ * Default and highest number of pages of a request
+ */
+#define FUSE_DEFAULT_MAX_PAGES	32
+#define FUSE_MAX_MAX_PAGES	256
 
 /**
  * Release flags
@@ -190,6 +203,14 @@ enum fuse_opcode {
 	FUSE_BMAP          = 37,
 	FUSE_DESTROY       = 38,
 	FUSE_IOCTL         = 39,
+	FUSE_READDIRPLUS   = 44,
+};
+
+enum fuse_notify_code {
+	FUSE_NOTIFY_POLL   = 1,
+	FUSE_NOTIFY_INVAL_INODE = 2,
+	FUSE_NOTIFY_INVAL_ENTRY = 3,
+	FUSE_NOTIFY_CODE_MAX,
 };
 
 /* The read buffer is required to be at least 8k, but may be much larger */
@@ -366,6 +387,8 @@ struct fuse_init_in {
 	__u32	flags;
 };
 
+#define FUSE_COMPAT_22_INIT_OUT_SIZE 24
+
 struct fuse_init_out {
 	__u32	major;
 	__u32	minor;
@@ -373,6 +396,10 @@ struct fuse_init_out {
 	__u32	flags;
 	__u32	unused;
 	__u32	max_write;
+	__u32	time_gran;
+	__u16	max_pages;
+	__u16	padding;
+	__u32	unused2[8];
 };
 
 struct fuse_interrupt_in {
@@ -427,6 +454,18 @@ struct fuse_out_header {
 	__u64	unique;
 };
 
+struct fuse_notify_inval_inode_out {
+	__u64	ino;
+	__s64	off;
+	__s64	len;
+};
+
+struct fuse_notify_inval_entry_out {
+	__u64	parent;
+	__u32	namelen;
+	__u32	padding;
+};
+
 struct fuse_dirent {
 	__u64	ino;
 	__u64	off;
@@ -439,3 +478,13 @@ struct fuse_dirent {
 #define FUSE_DIRENT_ALIGN(x) (((x) + sizeof(__u64) - 1) & ~(sizeof(__u64) - 1))
 #define FUSE_DIRENT_SIZE(d) \
 	FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + (d)->namelen)
+
+struct fuse_direntplus {
+	struct fuse_entry_out entry_out;
+	struct fuse_dirent dirent;
+};
+
+#define FUSE_NAME_OFFSET_DIRENTPLUS \
+	offsetof(struct fuse_direntplus, dirent.name)
+#define FUSE_DIRENTPLUS_SIZE(d) \
+	FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET_DIRENTPLUS + (d)->dirent.namelen)
@@ -837,6 +837,46 @@ struct fuse_lowlevel_ops {
 		       struct fuse_file_info *fi, unsigned flags,
 		       const void *in_buf, size_t in_bufsz, size_t out_bufsz);
 
+	/**
+	 * Read directory with attributes
+	 *
+	 * Send a buffer filled using fuse_add_direntry_plus(), with size
+	 * not exceeding the requested size.  Send an empty buffer on end
+	 * of stream.
+	 *
+	 * Only called when FUSE_CAP_READDIRPLUS has been requested and
+	 * is supported by the kernel, readdir() being then not called.
+	 * The lookup count of the entries returned with a non-zero
+	 * inode number is incremented, as for lookup().
+	 *
+	 * Valid replies:
+	 *   fuse_reply_buf
+	 *   fuse_reply_err
+	 *
+	 * @param req request handle
+	 * @param ino the inode number
+	 * @param size maximum number of bytes to send
+	 * @param off offset to continue reading the directory stream
+	 * @param fi file information
+	 */
+	void (*readdirplus) (fuse_req_t req, fuse_ino_t ino, size_t size,
+			     off_t off, struct fuse_file_info *fi);
+
+	/**
+	 * Lock the filesystem for processing a request
+	 *
+	 * Called before a request is passed to the filesystem, and
+	 * again with unlock set when its method has returned, so
+	 * that a filesystem served by a multi-threaded loop can decide
+	 * which requests are allowed to run concurrently.
+	 *
+	 * This is a libfuse-lite extension.
+	 *
+	 * @param userdata the user data passed to fuse_lowlevel_new()
+	 * @param opcode the kernel opcode of the request
+	 * @param unlock zero when locking, non-zero when unlocking
+	 */
+	void (*lock) (void *userdata, int opcode, int unlock);
 };
 
 /**
@@ -959,6 +999,41 @@ int fuse_reply_write(fuse_req_t req, size_t count);
  */
 int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size);
 
+/**
+ * Buffer of data for fuse_reply_data()
+ *
+ * The data is in memory at mem, or when mem is NULL, in the file
+ * designated by fd at position pos.
+ *
+ * This is a libfuse-lite extension.
+ */
+struct fuse_buf {
+	size_t size;
+	void *mem;
+	int fd;
+	off_t pos;
+};
+
+/**
+ * Reply with data from memory or from files
+ *
+ * When the system has splice(), the data held in files is passed to
+ * the kernel through a pipe, without being copied to user space.
+ * Otherwise, or when the pipe cannot hold the reply, the data is
+ * read into a temporary buffer.
+ *
+ * Possible requests:
+ *   read
+ *
+ * This is a libfuse-lite extension.
+ *
+ * @param req request handle
+ * @param bufs the buffers holding the data, in sequence
+ * @param count the number of buffers
+ * @return zero for success, -errno for failure to send reply
+ */
+int fuse_reply_data(fuse_req_t req, const struct fuse_buf *bufs, int count);
+
 #ifdef POSIXACLS
 /**
  * Reply with data vector
@@ -1054,6 +1129,26 @@ size_t fuse_add_direntry(fuse_req_t req, char *buf, size_t bufsize,
 			 const char *name, const struct stat *stbuf,
 			 off_t off);
 
+/**
+ * Add a directory entry with its attributes to the buffer
+ *
+ * Same as fuse_add_direntry(), the entry being followed by the
+ * attributes and timeouts from 'e', as for a lookup.  If e->ino is
+ * zero, only the name and type are used by the kernel, and the lookup
+ * count is not incremented.
+ *
+ * @param req request handle
+ * @param buf the point where the new entry will be added to the buffer
+ * @param bufsize remaining size of the buffer
+ * @param name the name of the entry
+ * @param e the entry parameters, as returned by lookup
+ * @param off the offset of the next entry
+ * @return the space needed for the entry
+ */
+size_t fuse_add_direntry_plus(fuse_req_t req, char *buf, size_t bufsize,
+			      const char *name,
+			      const struct fuse_entry_param *e, off_t off);
+
 /**
  * Reply to finish ioctl
  *
@@ -1067,6 +1162,44 @@ size_t fuse_add_direntry(fuse_req_t req, char *buf, size_t bufsize,
  */
 int fuse_reply_ioctl(fuse_req_t req, int result, const void *buf, size_t size);
 
+/* ----------------------------------------------------------- *
+ * Notification						       *
+ * ----------------------------------------------------------- */
+
+/**
+ * Notify to invalidate cache for an inode
+ *
+ * Requires protocol 7.12.  With a negative offset only the cached
+ * attributes are invalidated, which can safely be done from within
+ * a request handler.
+ *
+ * @param ch the channel through which to send the invalidation
+ * @param ino the inode number
+ * @param off the offset in the inode where to start invalidating
+ *            or negative to invalidate attributes only
+ * @param len the amount of cache to invalidate or 0 for all
+ * @return zero for success, -errno for failure
+ */
+int fuse_lowlevel_notify_inval_inode(struct fuse_chan *ch, fuse_ino_t ino,
+                                     off_t off, off_t len);
+
+/**
+ * Notify to invalidate parent attributes and the dentry matching
+ * parent/name
+ *
+ * Requires protocol 7.12.  The kernel locks the parent directory
+ * while invalidating, so this must not be called from a request
+ * handler, the caller of the request may hold that lock.
+ *
+ * @param ch the channel through which to send the invalidation
+ * @param parent inode number
+ * @param name file name
+ * @param namelen strlen() of file name
+ * @return zero for success, -errno for failure
+ */
+int fuse_lowlevel_notify_inval_entry(struct fuse_chan *ch, fuse_ino_t parent,
+                                     const char *name, size_t namelen);
+
 
 /* ----------------------------------------------------------- *
  * Utility functions					       *
@@ -1275,6 +1408,14 @@ void fuse_session_reset(struct fuse_session *se);
  */
 int fuse_session_exited(struct fuse_session *se);
 
+/**
+ * Get the user data provided to the session
+ *
+ * @param se the session
+ * @return the user data
+ */
+void *fuse_session_data(struct fuse_session *se);
+
 /**
  * Enter a single threaded event loop
  *
@@ -1286,10 +1427,16 @@ int fuse_session_loop(struct fuse_session *se);
 /**
  * Enter a multi-threaded event loop
  *
+ * The requests are processed by a fixed set of worker threads, while
+ * the calling thread waits for the session to exit.  The signals are
+ * blocked in the worker threads, so that they are delivered to the
+ * calling thread.
+ *
  * @param se the session
+ * @param threads the number of worker threads
  * @return 0 on success, -1 on error
  */
-int fuse_session_loop_mt(struct fuse_session *se);
+int fuse_session_loop_mt(struct fuse_session *se, int threads);
 
 /* ----------------------------------------------------------- *
  * Channel interface					       *
@@ -1361,6 +1508,17 @@ int fuse_chan_fd(struct fuse_chan *ch);
  */
 size_t fuse_chan_bufsize(struct fuse_chan *ch);
 
+/**
+ * Enlarge the minimal receive buffer size
+ *
+ * This is done when negotiating bigger requests with the kernel, the
+ * session loops reallocate their buffers before receiving again.
+ *
+ * @param ch the channel
+ * @param bufsize the new buffer size
+ */
+void fuse_chan_set_bufsize(struct fuse_chan *ch, size_t bufsize);
+
 /**
  * Query the user data
  *
@@ -155,6 +155,10 @@ static __inline__ int ntfs_attrs_walk(ntfs_attr_search_ctx *ctx)
  * @compression_block_size:		size of a compression block (cb)
  * @compression_block_size_bits:	log2 of the size of a cb
  * @compression_block_clusters:		number of clusters per cb
+ * @rl_elements:	number of elements of @rl indexed for vcn lookups,
+ *			including the terminator, zero when not indexed
+ * @rl_hint:		index of the runlist element found by the last lookup
+ * @rl_indexed:		runlist @rl_elements was computed for
  *
  * This structure exists purely to provide a mechanism of caching the runlist
  * of an attribute. If you want to operate on a particular attribute extent,
@@ -198,6 +202,9 @@ struct _ntfs_attr {
 	u8 compression_block_size_bits;
 	u8 compression_block_clusters;
 	s8 unused_runs; /* pre-reserved entries available */
+	int rl_elements;
+	int rl_hint;
+	runlist_element *rl_indexed;
 };
 
 /**
@@ -238,9 +245,19 @@ typedef enum {
 #define NAttrSetDataAppending(na)	set_nattr_flag(na, DataAppending)
 #define NAttrClearDataAppending(na)	clear_nattr_flag(na, DataAppending)
 
+/*
+ * The runlist index used for vcn lookups has to be dropped whenever
+ * the runlist of the attribute is reallocated, merged or truncated.
+ * It is not used while the runlist is dirty, and changing the dirty
+ * state also drops it.
+ */
+#define ntfs_attr_rl_changed(na)	((na)->rl_elements = 0)
+
 #define NAttrRunlistDirty(na)		test_nattr_flag(na, RunlistDirty)
-#define NAttrSetRunlistDirty(na)	set_nattr_flag(na, RunlistDirty)
-#define NAttrClearRunlistDirty(na)	clear_nattr_flag(na, RunlistDirty)
+#define NAttrSetRunlistDirty(na)	\
+	(ntfs_attr_rl_changed(na), set_nattr_flag(na, RunlistDirty))
+#define NAttrClearRunlistDirty(na)	\
+	(ntfs_attr_rl_changed(na), clear_nattr_flag(na, RunlistDirty))
 
 #define NAttrComprClosing(na)		test_nattr_flag(na, ComprClosing)
 #define NAttrSetComprClosing(na)	set_nattr_flag(na, ComprClosing)
@@ -298,6 +315,9 @@ extern void ntfs_attr_close(ntfs_attr *na);
 
 extern s64 ntfs_attr_pread(ntfs_attr *na, const s64 pos, s64 count,
 		void *b);
+extern void ntfs_attr_readahead_free(ntfs_inode *ni);
+extern void ntfs_attr_readahead_park(ntfs_inode *ni);
+extern void ntfs_attr_readahead_unpark(ntfs_inode *ni);
 extern s64 ntfs_attr_pwrite(ntfs_attr *na, const s64 pos, s64 count,
 		const void *b);
 extern int ntfs_attr_pclose(ntfs_attr *na);
@@ -315,6 +335,8 @@ extern int ntfs_attr_map_whole_runlist(ntfs_attr *na);
 
 extern LCN ntfs_attr_vcn_to_lcn(ntfs_attr *na, const VCN vcn);
 extern runlist_element *ntfs_attr_find_vcn(ntfs_attr *na, const VCN vcn);
+extern int ntfs_attr_map_extents(ntfs_attr *na, s64 pos, s64 count,
+		struct ntfs_device_iovec *iov, int max);
 
 extern int ntfs_attr_size_bounds_check(const ntfs_volume *vol,
 		const ATTR_TYPES type, const s64 size);
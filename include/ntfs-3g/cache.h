@@ -60,6 +60,52 @@ struct CACHED_LOOKUP {
 	u64 inum;
 } ;
 
+struct CACHED_CBLOCK {
+	struct CACHED_CBLOCK *next;
+	struct CACHED_CBLOCK *previous;
+	u8 *data;		/* decompressed compression block */
+	size_t datasize;
+		/* above fields must match "struct CACHED_GENERIC" */
+	u64 mref;		/* inode, with sequence number */
+	s64 index;		/* compression block in the file */
+	u32 cbused;		/* compressed bytes used for data */
+} ;
+
+struct CACHED_WOF {
+	struct CACHED_WOF *next;
+	struct CACHED_WOF *previous;
+	u8 *table;		/* chunk table, NULL if too big */
+	size_t tablesize;
+		/* above fields must match "struct CACHED_GENERIC" */
+	u64 mref;		/* inode, with sequence number */
+	int format;		/* compression format */
+} ;
+
+struct CACHED_MFTREC {
+	struct CACHED_MFTREC *next;
+	struct CACHED_MFTREC *previous;
+	MFT_RECORD *rec;	/* mst deprotected mft record */
+	size_t recsize;
+		/* above fields must match "struct CACHED_GENERIC" */
+	u64 inum;		/* mft record number */
+} ;
+
+struct CACHED_INDEX_BLOCK {
+	struct CACHED_INDEX_BLOCK *next;
+	struct CACHED_INDEX_BLOCK *previous;
+	INDEX_BLOCK *ib;	/* validated and mst deprotected index block */
+	size_t ibsize;
+		/* above fields must match "struct CACHED_GENERIC" */
+	u64 inum;		/* directory inode */
+	VCN vcn;		/* vcn of the index block */
+} ;
+
+struct INDEX_CACHE_STATS {
+	u64 inum;		/* directory inode */
+	unsigned long reads;
+	unsigned long hits;
+} ;
+
 enum {
 	CACHE_FREE = 1,
 	CACHE_NOHASH = 2
@@ -89,6 +135,7 @@ struct CACHE_HEADER {
 	unsigned long hits;
 	int fixed_size;
 	int max_hash;
+	struct CACHE_LOCK *lock;	/* serializes the threads, or NULL */
 	struct CACHED_GENERIC entry[0];
 } ;
 
@@ -106,6 +153,8 @@ int ntfs_invalidate_cache(struct CACHE_HEADER *cache,
 			cache_compare compare, int flags);
 int ntfs_remove_cache(struct CACHE_HEADER *cache,
 			struct CACHED_GENERIC *item, int flags);
+void ntfs_lock_cache(struct CACHE_HEADER *cache);
+void ntfs_unlock_cache(struct CACHE_HEADER *cache);
 
 void ntfs_create_lru_caches(ntfs_volume *vol);
 void ntfs_free_lru_caches(ntfs_volume *vol);
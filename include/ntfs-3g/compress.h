@@ -37,5 +37,28 @@ extern s64 ntfs_compressed_pwrite(ntfs_attr *na, runlist_element *brl, s64 wpos,
 extern int ntfs_compressed_close(ntfs_attr *na, runlist_element *brl,
 				s64 offs, VCN *update_from);
 
+extern int ntfs_set_compress_threads(ntfs_volume *vol, int count);
+
+extern int ntfs_set_compress_level(ntfs_volume *vol, int level);
+
+extern void ntfs_compress_release(ntfs_volume *vol);
+
+extern void ntfs_compress_dispatch(ntfs_volume *vol,
+			void (*process)(void *job, int i), void *job, int count);
+
+extern void ntfs_compressed_invalidate(ntfs_attr *na);
+
+#ifdef NTFS_TEST
+int test_compress_main(int argc, char *argv[]);
+#endif
+
+#if CACHE_CBLOCK_SIZE
+
+struct CACHED_GENERIC;
+
+extern int ntfs_compressed_cblock_hash(const struct CACHED_GENERIC *item);
+
+#endif
+
 #endif /* defined _NTFS_COMPRESS_H */
 
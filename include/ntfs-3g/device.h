@@ -90,8 +90,47 @@ struct ntfs_device {
 						   heads or -1. */
 	int d_sectors_per_track;		/* Disk geometry: number of
 						   sectors per track or -1. */
+	struct DEVICE_CACHE *d_cache;		/* Block cache or NULL. */
 };
 
+/*
+ * Options for the device block cache
+ */
+#define DCACHE_BLOCK_SIZE 4096	/* Default size of cached blocks */
+
+enum {
+	DCACHE_WRITEBACK = 1,	/* Delay writes until sync or eviction */
+	DCACHE_CLOCK = 2,	/* CLOCK eviction instead of LRU */
+} ;
+
+/**
+ * struct ntfs_device_cache_stats -
+ *
+ * Counters of the device block cache, as returned by
+ * ntfs_device_cache_stats().
+ */
+struct ntfs_device_cache_stats {
+	u64 hits;		/* Blocks found in the cache */
+	u64 misses;		/* Blocks read from the device */
+	u64 bypassed;		/* Requests not going through the cache */
+	u64 writebacks;		/* Dirty blocks written to the device */
+	u32 blocks;		/* Number of blocks in the cache */
+	u32 block_size;		/* Size of a block in bytes */
+	int flags;		/* DCACHE_* options */
+} ;
+
+/**
+ * struct ntfs_device_iovec -
+ *
+ * A segment of a batched device request : @count bytes at position @pos
+ * on the device, to be transferred to or from @buf.
+ */
+struct ntfs_device_iovec {
+	s64 pos;		/* Position on the device */
+	s64 count;		/* Number of bytes to transfer */
+	void *buf;		/* Memory buffer */
+} ;
+
 struct stat;
 
 /**
@@ -99,6 +138,15 @@ struct stat;
  *
  * The ntfs device operations defining all operations that can be performed on
  * the low level device described by an ntfs device structure.
+ *
+ * The preadv and pwritev operations are optional. When defined, they
+ * transfer a batch of segments in a single submission, each segment being
+ * completed unless an error or the end of the device is met. They return
+ * the number of bytes transferred from the start of the batch until the
+ * first incomplete segment, or -1 if nothing could be transferred.
+ *
+ * The fd operation is optional. When defined, it returns a file descriptor
+ * through which the device may be read by the system calls, such as splice().
  */
 struct ntfs_device_operations {
 	int (*open)(struct ntfs_device *dev, int flags);
@@ -113,6 +161,11 @@ struct ntfs_device_operations {
 	int (*stat)(struct ntfs_device *dev, struct stat *buf);
 	int (*ioctl)(struct ntfs_device *dev, unsigned long request,
 			void *argp);
+	s64 (*preadv)(struct ntfs_device *dev,
+			const struct ntfs_device_iovec *iov, int iovcnt);
+	s64 (*pwritev)(struct ntfs_device *dev,
+			const struct ntfs_device_iovec *iov, int iovcnt);
+	int (*fd)(struct ntfs_device *dev);
 };
 
 extern struct ntfs_device *ntfs_device_alloc(const char *name, const long state,
@@ -125,6 +178,12 @@ extern s64 ntfs_pread(struct ntfs_device *dev, const s64 pos, s64 count,
 extern s64 ntfs_pwrite(struct ntfs_device *dev, const s64 pos, s64 count,
 		const void *b);
 
+extern s64 ntfs_preadv(struct ntfs_device *dev,
+		const struct ntfs_device_iovec *iov, int iovcnt);
+extern s64 ntfs_pwritev(struct ntfs_device *dev,
+		const struct ntfs_device_iovec *iov, int iovcnt);
+
+extern int ntfs_device_fd(struct ntfs_device *dev);
 extern s64 ntfs_mst_pread(struct ntfs_device *dev, const s64 pos, s64 count,
 		const u32 bksize, void *b);
 extern s64 ntfs_mst_pwrite(struct ntfs_device *dev, const s64 pos, s64 count,
@@ -142,4 +201,11 @@ extern int ntfs_device_sectors_per_track_get(struct ntfs_device *dev);
 extern int ntfs_device_sector_size_get(struct ntfs_device *dev);
 extern int ntfs_device_block_size_set(struct ntfs_device *dev, int block_size);
 
+extern int ntfs_device_cache_init(struct ntfs_device *dev, s64 size,
+		u32 block_size, int flags);
+extern int ntfs_device_cache_flush(struct ntfs_device *dev);
+extern void ntfs_device_cache_free(struct ntfs_device *dev);
+extern int ntfs_device_cache_stats(struct ntfs_device *dev,
+		struct ntfs_device_cache_stats *stats);
+
 #endif /* defined _NTFS_DEVICE_H */
@@ -86,7 +86,22 @@ struct ntfs_device_operations;
 
 extern struct ntfs_device_operations ntfs_device_default_io_ops;
 
+#if !defined(HAVE_WINDOWS_H) && !defined(UEFI_DRIVER) \
+		&& defined(HAVE_LINUX_IO_URING_H)
+/* The io_uring operations may be selected when mounting */
+#define HAVE_NTFS_DEVICE_URING_IO_OPS 1
+extern struct ntfs_device_operations ntfs_device_unix_io_ops;
+extern struct ntfs_device_operations ntfs_device_uring_io_ops;
+#endif
+
 #endif /* NO_NTFS_DEVICE_DEFAULT_IO_OPS */
 
+#ifdef NTFS_TEST
+int test_uefi_io_main(int argc, char *argv[]);
+#ifdef HAVE_NTFS_DEVICE_URING_IO_OPS
+int test_uring_io_main(int argc, char *argv[]);
+#endif
+#endif
+
 #endif /* defined _NTFS_DEVICE_IO_H */
 
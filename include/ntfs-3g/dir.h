@@ -116,8 +116,20 @@ typedef int (*ntfs_filldir_t)(void *dirent, const ntfschar *name,
 		const int name_len, const int name_type, const s64 pos,
 		const MFT_REF mref, const unsigned dt_type);
 
+/*
+ * Same as "ntfs_filldir", with the FILE_NAME attribute of the entry as
+ * recorded in the index (sizes, times and flags included) as an extra
+ * argument, or NULL for the emulated "." and ".." entries.
+ */
+typedef int (*ntfs_filldir_fn_t)(void *dirent, const ntfschar *name,
+		const int name_len, const int name_type, const s64 pos,
+		const MFT_REF mref, const unsigned dt_type,
+		const FILE_NAME_ATTR *fn);
+
 extern int ntfs_readdir(ntfs_inode *dir_ni, s64 *pos,
 		void *dirent, ntfs_filldir_t filldir);
+extern int ntfs_readdir_fn(ntfs_inode *dir_ni, s64 *pos,
+		void *dirent, ntfs_filldir_fn_t filldir);
 
 ntfs_inode *ntfs_dir_parent_inode(ntfs_inode *ni);
 u32 ntfs_interix_types(ntfs_inode *ni);
@@ -156,6 +156,10 @@ extern int ntfs_index_remove(ntfs_inode *dir_ni, ntfs_inode *ni,
 
 extern INDEX_ROOT *ntfs_index_root_get(ntfs_inode *ni, ATTR_RECORD *attr);
 
+extern int ntfs_index_block_read(ntfs_attr *ia_na, VCN vcn, u8 vcn_size_bits,
+		u32 block_size, INDEX_BLOCK *dst, BOOL keep);
+extern void ntfs_index_block_forget(ntfs_volume *vol, u64 inum);
+
 extern VCN ntfs_ie_get_vcn(INDEX_ENTRY *ie);
 
 extern void ntfs_index_entry_mark_dirty(ntfs_index_context *ictx);
@@ -168,5 +172,13 @@ extern void ntfs_ih_filename_dump(INDEX_HEADER *ih);
 extern int ntfs_ie_add(ntfs_index_context *icx, INDEX_ENTRY *ie);
 extern int ntfs_index_rm(ntfs_index_context *icx);
 
+#if CACHE_INDEX_SIZE
+
+struct CACHED_GENERIC;
+
+extern int ntfs_index_block_hash(const struct CACHED_GENERIC *item);
+
+#endif
+
 #endif /* _NTFS_INDEX_H */
 
@@ -28,6 +28,8 @@
 /* Forward declaration */
 typedef struct _ntfs_inode ntfs_inode;
 
+struct NTFS_READAHEAD;
+
 #include "types.h"
 #include "layout.h"
 #include "support.h"
@@ -52,6 +54,7 @@ typedef enum {
 	NI_v3_Extensions,	/* 1: JPA v3.x extensions present. */
 	NI_TimesSet,		/* 1: Use times which were set */
 	NI_KnownSize,		/* 1: Set if sizes are meaningful */
+	NI_NoWof,		/* 1: Reparse point not compressed by WOF */
 } ntfs_inode_state_bits;
 
 #define  test_nino_flag(ni, flag)	   test_bit(NI_##flag, (ni)->state)
@@ -164,6 +167,14 @@ struct _ntfs_inode {
 	le32 security_id;
 	le64 quota_charged;
 	le64 usn;
+	struct NTFS_READAHEAD *readahead; /* Sequential read-ahead state of
+				   the unnamed DATA attribute, or NULL. */
+	ntfs_inode *next_shared; /* Next inode open by threads sharing
+				   the volume, see ntfs_inode_open() */
+	int shared_users;	/* Number of opens of a shared inode,
+				   zero if the inode is not shared. */
+	struct INODE_LOCK *lock; /* Lock of an inode shared by threads,
+				   see ntfs_inode_lock(), or NULL */
 };
 
 typedef enum {
@@ -180,9 +191,13 @@ extern ntfs_inode *ntfs_inode_base(ntfs_inode *ni);
 extern ntfs_inode *ntfs_inode_allocate(ntfs_volume *vol);
 
 extern ntfs_inode *ntfs_inode_open(ntfs_volume *vol, const MFT_REF mref);
+extern ntfs_inode *ntfs_inode_open_cached(ntfs_volume *vol,
+		const MFT_REF mref);
 
 extern int ntfs_inode_close(ntfs_inode *ni);
 extern int ntfs_inode_close_in_dir(ntfs_inode *ni, ntfs_inode *dir_ni);
+extern void ntfs_inode_lock(ntfs_inode *ni);
+extern void ntfs_inode_unlock(ntfs_inode *ni);
 
 #if CACHE_NIDATA_SIZE
 
@@ -218,6 +233,10 @@ extern int ntfs_inode_get_times(ntfs_inode *ni, char *value, size_t size);
 extern int ntfs_inode_set_times(ntfs_inode *ni, const char *value,
 			size_t size, int flags);
 
+#ifdef NTFS_TEST
+int test_inode_main(int argc, char *argv[]);
+#endif
+
 /* debugging */
 #ifdef DEBUG_DOUBLE_INODE
 extern void debug_double_inode(u64 inum, int add);
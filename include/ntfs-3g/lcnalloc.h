@@ -47,5 +47,11 @@ extern int ntfs_cluster_free_basic(ntfs_volume *vol, s64 lcn, s64 count);
 extern int ntfs_cluster_free(ntfs_volume *vol, ntfs_attr *na, VCN start_vcn,
 		s64 count);
 
+extern void ntfs_free_extents_release(ntfs_volume *vol);
+
+#ifdef NTFS_TEST
+int test_lcn_main(int argc, char *argv[]);
+#endif
+
 #endif /* defined _NTFS_LCNALLOC_H */
 
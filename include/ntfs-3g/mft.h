@@ -130,5 +130,36 @@ extern int ntfs_mft_record_free(ntfs_volume *vol, ntfs_inode *ni);
 
 extern int ntfs_mft_usn_dec(MFT_RECORD *mrec);
 
+extern int ntfs_mft_prefetch(ntfs_volume *vol, const MFT_REF *mrefs,
+		int count);
+
+/*
+ * Records selected by ntfs_mft_scan()
+ */
+enum {
+	MFT_SCAN_IN_USE = 1,	/* FILE records in use */
+	MFT_SCAN_DELETED = 2,	/* FILE records not in use */
+	MFT_SCAN_OTHERS = 4,	/* never used or unreadable records */
+	MFT_SCAN_ALL = 7
+} ;
+
+typedef int (*ntfs_mft_scan_callback)(void *data, s64 mft_no,
+		MFT_RECORD *m);
+
+extern int ntfs_mft_scan(ntfs_volume *vol, int which, int threads,
+		ntfs_mft_scan_callback callback, void *data);
+
+#ifdef NTFS_TEST
+int test_mft_main(int argc, char *argv[]);
+#endif
+
+#if CACHE_MFTREC_SIZE
+
+struct CACHED_GENERIC;
+
+extern int ntfs_mft_record_hash(const struct CACHED_GENERIC *item);
+
+#endif
+
 #endif /* defined _NTFS_MFT_H */
 
@@ -30,8 +30,14 @@
 extern int ntfs_mst_post_read_fixup(NTFS_RECORD *b, const u32 size);
 extern int ntfs_mst_post_read_fixup_warn(NTFS_RECORD *b, const u32 size,
 					BOOL warn);
+extern s64 ntfs_mst_post_read_fixup_records(void *b, const u32 size,
+					s64 count, BOOL warn, int *errs);
 extern int ntfs_mst_pre_write_fixup(NTFS_RECORD *b, const u32 size);
 extern void ntfs_mst_post_write_fixup(NTFS_RECORD *b);
 
+#ifdef NTFS_TEST
+int test_mst_main(int argc, char *argv[]);
+#endif
+
 #endif /* defined _NTFS_MST_H */
 
@@ -27,6 +27,11 @@
 #define CACHE_LOOKUP_SIZE 64	/* lookup cache, zero or >= 3 and not too big */
 #define CACHE_SECURID_SIZE 16    /* securid cache, zero or >= 3 and not too big */
 #define CACHE_LEGACY_SIZE 8    /* legacy cache size, zero or >= 3 and not too big */
+#define CACHE_CBLOCK_SIZE 16   /* decompressed blocks, zero or >= 3 and not too big */
+#define CACHE_WOF_SIZE 8	/* WOF chunk tables, zero or >= 3 and not too big */
+#define CACHE_MFTREC_SIZE 128	/* prefetched mft records, zero or >= 3 and not too big */
+#define CACHE_INDEX_SIZE 128	/* directory index blocks, zero or >= 3 and not too big */
+#define INDEX_STATS_DIRS 16	/* directories with index cache statistics */
 
 #define FORCE_FORMAT_v1x 0	/* Insert security data as in NTFS v1.x */
 #define OWNERFROMACL 1		/* Get the owner from ACL (not Windows owner) */
@@ -76,6 +81,70 @@ enum {
 
 #define SAFE_CAPACITY_FOR_BIG_WRITES 0x100000000LL
 
+/*
+ *		Parameters for sequential read-ahead
+ *
+ *	The read-ahead window starts at twice the size of the second
+ *	sequential read, and doubles on each prefetch up to the size set
+ *	by ntfs_set_readahead(). A buffer of the window size is allocated
+ *	for each file being read sequentially, and it is only kept while
+ *	the inode is cached for a few files whose prefetched data has not
+ *	been fully read.
+ */
+
+#define READAHEAD_MAX_SIZE 16777216 /* upper limit of read-ahead window */
+#define READAHEAD_KEPT_BUFFERS 4 /* max buffers kept by cached inodes */
+
+/*
+ *		Parameters for the mft record allocator
+ *
+ *	Free mft records are collected by batches from the mft bitmap,
+ *	so that creating many files does not scan the bitmap for each
+ *	of them.
+ */
+
+#define MFT_FREE_RECS 64 /* free mft records collected at once */
+
+/*
+ *		Parameters for mft record prefetching
+ *
+ *	Records requested by ntfs_mft_prefetch() are read in runs of
+ *	neighbouring records, the records in between which were not
+ *	requested being read and dropped when the gap is small.
+ */
+
+#define MFT_PREFETCH_SPAN 64 /* max records in a single read */
+#define MFT_PREFETCH_GAP 8 /* max unrequested records read to join runs */
+
+/*
+ *		Parameters for scanning the whole mft
+ *
+ *	The mft is read by ntfs_mft_scan() in chunks of MFT_SCAN_CHUNK
+ *	records, each chunk being processed by one of the worker threads
+ *	while the next ones are being read.
+ */
+
+#define MFT_SCAN_CHUNK 256 /* records read at once */
+#define MFT_SCAN_THREADS_MAX 16 /* upper limit of scanning threads */
+
+/*
+ *		Parameters for compression
+ *
+ *	The sub-blocks of a compression block may be compressed by
+ *	several threads, set by ntfs_set_compress_threads(). There are
+ *	only 16 sub-blocks in a compression block of 64KB.
+ */
+
+#define COMPRESS_THREADS_MAX 16 /* upper limit of compression threads */
+
+	/*
+	 * Levels set by ntfs_set_compress_level(), from the fastest
+	 * to the one producing the smallest output
+	 */
+#define COMPRESS_LEVEL_MIN 1
+#define COMPRESS_LEVEL_DEFAULT 3
+#define COMPRESS_LEVEL_MAX 5
+
 /*
  *		Parameters for runlists
  */
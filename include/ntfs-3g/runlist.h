@@ -53,6 +53,19 @@ extern runlist_element *ntfs_rl_extend(ntfs_attr *na, runlist_element *rl,
 			int more_entries);
 
 extern LCN ntfs_rl_vcn_to_lcn(const runlist_element *rl, const VCN vcn);
+extern int ntfs_rl_find_element(const runlist_element *rl, int count,
+		const VCN vcn);
+
+/* Max number of segments of a batched read or write over runs */
+#define RL_IOV_BATCH 32
+
+struct ntfs_device_iovec;
+
+extern s64 ntfs_rl_to_iovec(const ntfs_volume *vol,
+		const runlist_element **prl, s64 *pofs, s64 count, void *b,
+		BOOL zero, struct ntfs_device_iovec *iov, int *iovcnt);
+extern s64 ntfs_rl_iovec_done(const struct ntfs_device_iovec *iov,
+		int iovcnt, const void *b, s64 done);
 
 extern s64 ntfs_rl_pread(const ntfs_volume *vol, const runlist_element *rl,
 		const s64 pos, s64 count, void *b);
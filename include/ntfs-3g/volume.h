@@ -66,6 +66,8 @@ enum {
 	NTFS_MNT_EXCLUSIVE              = 0x08000000,
 	NTFS_MNT_RECOVER                = 0x10000000,
 	NTFS_MNT_IGNORE_HIBERFILE       = 0x20000000,
+	NTFS_MNT_IO_URING               = 0x40000000, /* Use io_uring if
+	                                               * available. */
 };
 typedef unsigned long ntfs_mount_flags;
 
@@ -118,6 +120,7 @@ typedef enum {
 	NV_Compression,		/* 1: allow compression */
 	NV_NoFixupWarn,		/* 1: Do not log fixup errors */
 	NV_FreeSpaceKnown,	/* 1: The free space is now known */
+	NV_FreeExtents,		/* 1: Index the free clusters */
 } ntfs_volume_state_bits;
 
 #define  test_nvol_flag(nv, flag)	 test_bit(NV_##flag, (nv)->state)
@@ -160,6 +163,10 @@ typedef enum {
 #define NVolSetFreeSpaceKnown(nv)	  set_nvol_flag(nv, FreeSpaceKnown)
 #define NVolClearFreeSpaceKnown(nv)	clear_nvol_flag(nv, FreeSpaceKnown)
 
+#define NVolFreeExtents(nv)		 test_nvol_flag(nv, FreeExtents)
+#define NVolSetFreeExtents(nv)		  set_nvol_flag(nv, FreeExtents)
+#define NVolClearFreeExtents(nv)	clear_nvol_flag(nv, FreeExtents)
+
 /*
  * NTFS version 1.1 and 1.2 are used by Windows NT4.
  * NTFS version 2.x is used by Windows 2000 Beta
@@ -208,11 +215,17 @@ struct _ntfs_volume {
 	u8 full_zones;		/* cluster zones which are full */
 	s64 mft_data_pos;	/* Mft record number at which to allocate the
 				   next mft record. */
+	s64 mft_free_recs[MFT_FREE_RECS]; /* Mft records known to be free,
+				   the next one to allocate being the last. */
+	int mft_free_count;	/* Count of entries in mft_free_recs. */
 	LCN mft_zone_start;	/* First cluster of the mft zone. */
 	LCN mft_zone_end;	/* First cluster beyond the mft zone. */
 	LCN mft_zone_pos;	/* Current position in the mft zone. */
 	LCN data1_zone_pos;	/* Current position in the first data zone. */
 	LCN data2_zone_pos;	/* Current position in the second data zone. */
+	struct FREE_EXTENTS *free_extents; /* Index of the free clusters,
+				   built on first allocation if NV_FreeExtents
+				   is set. */
 
 	s64 nr_clusters;	/* Volume size in clusters, hence also the
 				   number of bits in lcn_bitmap. */
@@ -269,6 +282,18 @@ struct _ntfs_volume {
 				   efs-encrypted files */
 	ntfs_volume_special_files special_files; /* Implementation of special files */
 	const char *abs_mnt_point; /* Mount point */
+	u32 readahead_size;	/* Max read-ahead window for sequential reads
+				   of file data, zero if no read-ahead */
+	u64 readahead_reads;	/* Reads of files eligible to read-ahead */
+	u64 readahead_hits;	/* Reads fully served by prefetched data */
+	u64 readahead_prefetches; /* Read-ahead windows read from device */
+	u32 readahead_kept;	/* Read-ahead buffers kept by cached inodes */
+	struct COMPRESS_POOL *compress_pool; /* Threads compressing data,
+				   NULL if compressing in calling thread */
+	int compress_level;	/* Compression level, zero for default */
+	struct VOLUME_LOCKS *locks; /* Locks of threads sharing the volume,
+				   NULL if not shared, see
+				   ntfs_volume_set_threaded() */
 #ifdef XATTR_MAPPINGS
 	struct XATTRMAPPING *xattr_mapping;
 #endif /* XATTR_MAPPINGS */
@@ -278,17 +303,43 @@ struct _ntfs_volume {
 #if CACHE_NIDATA_SIZE
 	struct CACHE_HEADER *nidata_cache;
 #endif
+	ntfs_inode *shared_inodes; /* Inodes open by threads sharing the
+				   volume, see ntfs_inode_open() */
 #if CACHE_LOOKUP_SIZE
 	struct CACHE_HEADER *lookup_cache;
 #endif
 #if CACHE_SECURID_SIZE
 	struct CACHE_HEADER *securid_cache;
 #endif
+#if CACHE_CBLOCK_SIZE
+	struct CACHE_HEADER *cblock_cache;
+#endif
+#if CACHE_WOF_SIZE
+	struct CACHE_HEADER *wof_cache;
+#endif
+#if CACHE_MFTREC_SIZE
+	struct CACHE_HEADER *mftrec_cache;
+#endif
+#if CACHE_INDEX_SIZE
+	struct CACHE_HEADER *index_cache;
+	struct INDEX_CACHE_STATS *index_stats;
+#endif
 #if CACHE_LEGACY_SIZE
 	struct CACHE_HEADER *legacy_cache;
 #endif
 };
 
+/*
+ *	Locks of a volume shared by several threads, see ntfs_volume_lock()
+ */
+
+typedef enum {
+	NTFS_LOCK_SECURITY,	/* security caches and indexes */
+	NTFS_LOCK_INODES,	/* open inodes and inode cache */
+	NTFS_LOCK_COUNTERS,	/* statistics */
+	NTFS_LOCK_COUNT
+} ntfs_volume_lock_id;
+
 extern const char *ntfs_home;
 
 extern ntfs_volume *ntfs_volume_alloc(void);
@@ -319,6 +370,10 @@ extern int ntfs_set_shown_files(ntfs_volume *vol,
 		BOOL show_sys_files, BOOL show_hid_files, BOOL hide_dot_files);
 extern int ntfs_set_locale(void);
 extern int ntfs_set_ignore_case(ntfs_volume *vol);
+extern int ntfs_set_readahead(ntfs_volume *vol, s64 size);
+extern int ntfs_volume_set_threaded(ntfs_volume *vol);
+extern void ntfs_volume_lock(ntfs_volume *vol, ntfs_volume_lock_id id);
+extern void ntfs_volume_unlock(ntfs_volume *vol, ntfs_volume_lock_id id);
 
 #endif /* defined _NTFS_VOLUME_H */
 
@@ -0,0 +1,44 @@
+/*
+ * wof.h - Exports for files compressed by the Windows Overlay Filter
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_WOF_H
+#define _NTFS_WOF_H
+
+#include "types.h"
+#include "attrib.h"
+
+extern BOOL ntfs_wof_compressed(ntfs_attr *na);
+
+extern s64 ntfs_wof_pread(ntfs_attr *na, s64 pos, s64 count, void *b);
+
+extern void ntfs_wof_invalidate(ntfs_inode *ni);
+
+#if CACHE_WOF_SIZE
+
+struct CACHED_GENERIC;
+
+extern int ntfs_wof_hash(const struct CACHED_GENERIC *item);
+
+#endif
+
+#ifdef NTFS_TEST
+int test_wof_main(int argc, char *argv[]);
+#endif
+
+#endif /* defined _NTFS_WOF_H */
@@ -61,6 +61,33 @@
 /* Define the following to force NTFS volumes to be opened read-only */
 /* #undef FORCE_READONLY */
 
+/*
+ * Size of the device block cache, in KB (0 to disable the cache).
+ * Disabled by default, the DiskIo read cache below already keeps
+ * the metadata, and both would hold the same data.
+ */
+#ifndef DEVICE_CACHE_SIZE
+#define DEVICE_CACHE_SIZE           0
+#endif
+
+/* Device block cache options (DCACHE_WRITEBACK, DCACHE_CLOCK) */
+#ifndef DEVICE_CACHE_FLAGS
+#define DEVICE_CACHE_FLAGS          0
+#endif
+
+/*
+ * Max size of the DiskIo read cache, in KB (0 to disable the cache).
+ * Less is used if the pool cannot provide that much memory.
+ */
+#ifndef DISK_CACHE_SIZE
+#define DISK_CACHE_SIZE             4096
+#endif
+
+/* Max read-ahead window for sequential file reads, in KB (0 to disable) */
+#ifndef READAHEAD_SIZE
+#define READAHEAD_SIZE              1024
+#endif
+
 /* Version information to be displayed by the driver. */
 #ifndef DRIVER_VERSION
 #define DRIVER_VERSION              DEV
@@ -97,6 +124,8 @@ typedef struct _EFI_NTFS_FILE {
 	INTN                             RefCount;
 	struct _EFI_FS                  *FileSystem;
 	VOID                            *NtfsInode;
+	/* Unnamed $DATA attribute, opened on first read, or NULL */
+	VOID                            *NtfsAttr;
 } EFI_NTFS_FILE;
 
 /* A file system instance */
@@ -109,6 +138,8 @@ typedef struct _EFI_FS {
 	EFI_DISK_IO_PROTOCOL            *DiskIo;
 	EFI_DISK_IO2_PROTOCOL           *DiskIo2;
 	EFI_DISK_IO2_TOKEN               DiskIo2Token;
+	VOID                            *DiskCache;
+	VOID                            *DiskQueue;
 	CHAR16                          *DevicePathString;
 	VOID                            *NtfsVolume;
 	CHAR16                          *NtfsVolumeLabel;
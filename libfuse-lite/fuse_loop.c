@@ -26,6 +26,17 @@ int fuse_session_loop(struct fuse_session *se)
 
     while (!fuse_session_exited(se)) {
         struct fuse_chan *tmpch = ch;
+        if (fuse_chan_bufsize(ch) > bufsize) {
+            /* bigger requests were negotiated */
+            char *newbuf = (char *) realloc(buf, fuse_chan_bufsize(ch));
+            if (!newbuf) {
+                fprintf(stderr, "fuse: failed to allocate read buffer\n");
+                res = -ENOMEM;
+                break;
+            }
+            buf = newbuf;
+            bufsize = fuse_chan_bufsize(ch);
+        }
         res = fuse_chan_recv(&tmpch, buf, bufsize);
         if (res == -EINTR)
             continue;
@@ -0,0 +1,169 @@
+/*
+    FUSE: Filesystem in Userspace
+    Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+    This program can be distributed under the terms of the GNU LGPLv2.
+    See the file COPYING.LIB.
+*/
+
+#include "config.h"
+#include "fuse_lowlevel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <pthread.h>
+
+struct fuse_mt;
+
+struct fuse_worker {
+    struct fuse_mt *mt;
+    pthread_t thread_id;
+    size_t bufsize;
+    char *buf;
+};
+
+struct fuse_mt {
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    struct fuse_worker *workers;
+    int numworker;
+    sem_t finish;
+    int error;
+};
+
+static void *fuse_do_work(void *data)
+{
+    struct fuse_worker *w = (struct fuse_worker *) data;
+    struct fuse_mt *mt = w->mt;
+
+    while (!fuse_session_exited(mt->se)) {
+        struct fuse_chan *ch = mt->ch;
+        int res;
+
+        /* only cancel while waiting for a request */
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        res = fuse_chan_recv(&ch, w->buf, w->bufsize);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (res == -EINTR)
+            continue;
+        if (res <= 0) {
+            if (res < 0) {
+                fuse_session_exit(mt->se);
+                mt->error = -1;
+            }
+            break;
+        }
+        fuse_session_process(mt->se, w->buf, res, ch);
+    }
+
+    sem_post(&mt->finish);
+    return NULL;
+}
+
+static int fuse_start_worker(struct fuse_worker *w)
+{
+    sigset_t oldset;
+    sigset_t newset;
+    int res;
+
+    w->bufsize = fuse_chan_bufsize(w->mt->ch);
+    w->buf = (char *) malloc(w->bufsize);
+    if (!w->buf) {
+        fprintf(stderr, "fuse: failed to allocate read buffer\n");
+        return -1;
+    }
+
+    /* Disallow signal reception in worker threads */
+    sigfillset(&newset);
+    pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+    res = pthread_create(&w->thread_id, NULL, fuse_do_work, w);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (res != 0) {
+        fprintf(stderr, "fuse: error creating thread: %s\n", strerror(res));
+        free(w->buf);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * The first request is INIT, which may enlarge the receive buffer,
+ * so it is processed before the workers allocate their buffers.
+ */
+static int fuse_do_first_request(struct fuse_mt *mt)
+{
+    size_t bufsize = fuse_chan_bufsize(mt->ch);
+    char *buf = (char *) malloc(bufsize);
+    int res;
+
+    if (!buf) {
+        fprintf(stderr, "fuse: failed to allocate read buffer\n");
+        return -1;
+    }
+    do {
+        struct fuse_chan *ch = mt->ch;
+
+        res = fuse_chan_recv(&ch, buf, bufsize);
+        if (res > 0)
+            fuse_session_process(mt->se, buf, res, ch);
+    } while ((res == -EINTR) && !fuse_session_exited(mt->se));
+    free(buf);
+    return res == -EINTR ? 0 : res;
+}
+
+int fuse_session_loop_mt(struct fuse_session *se, int threads)
+{
+    struct fuse_mt mt;
+    int res;
+    int i;
+
+    if (threads < 1)
+        threads = 1;
+    memset(&mt, 0, sizeof(struct fuse_mt));
+    mt.se = se;
+    mt.ch = fuse_session_next_chan(se, NULL);
+    mt.workers = (struct fuse_worker *)
+        calloc(threads, sizeof(struct fuse_worker));
+    if (!mt.workers) {
+        fprintf(stderr, "fuse: failed to allocate worker threads\n");
+        return -1;
+    }
+    sem_init(&mt.finish, 0, 0);
+
+    res = fuse_do_first_request(&mt);
+    if (res <= 0) {
+        if (res < 0)
+            mt.error = -1;
+        fuse_session_exit(se);
+        threads = 0;
+    }
+    for (i = 0; i < threads; i++) {
+        mt.workers[i].mt = &mt;
+        if (fuse_start_worker(&mt.workers[i])) {
+            mt.error = -1;
+            fuse_session_exit(se);
+            break;
+        }
+        mt.numworker++;
+    }
+
+    /* wait for a worker to leave, or for a signal to exit */
+    while (!fuse_session_exited(se) && mt.numworker)
+        sem_wait(&mt.finish);
+
+    for (i = 0; i < mt.numworker; i++)
+        pthread_cancel(mt.workers[i].thread_id);
+    for (i = 0; i < mt.numworker; i++) {
+        pthread_join(mt.workers[i].thread_id, NULL);
+        free(mt.workers[i].buf);
+    }
+    free(mt.workers);
+    sem_destroy(&mt.finish);
+
+    fuse_session_reset(se);
+    return mt.error;
+}
@@ -31,6 +31,11 @@
 #ifdef MAJOR_IN_SYSMACROS
 #include <sys/sysmacros.h>
 #endif
+#if defined(HAVE_SPLICE) && defined(HAVE_VMSPLICE)
+#define FUSE_USE_SPLICE 1
+#include <fcntl.h>
+#include <sys/uio.h>
+#endif
 
 #define PARAM(inarg) (((const char *)(inarg)) + sizeof(*(inarg)))
 #define OFFSET_MAX 0x7fffffffffffffffLL
@@ -70,7 +75,18 @@ struct fuse_ll {
     struct fuse_req interrupts;
     pthread_mutex_t lock;
     int got_destroy;
+#ifdef FUSE_USE_SPLICE
+    pthread_key_t pipe_key;
+#endif
+};
+
+#ifdef FUSE_USE_SPLICE
+struct fuse_ll_pipe {
+    size_t size;
+    int can_grow;
+    int pipe[2];
 };
+#endif
 
 static void convert_stat(const struct stat *stbuf, struct fuse_attr *attr)
 {
@@ -329,6 +345,34 @@ static void fill_entry(struct fuse_entry_out *arg,
     convert_stat(&e->attr, &arg->attr);
 }
 
+size_t fuse_add_direntry_plus(fuse_req_t req, char *buf, size_t bufsize,
+                              const char *name,
+                              const struct fuse_entry_param *e, off_t off)
+{
+    struct fuse_direntplus *dp;
+    unsigned namelen;
+    unsigned entlen;
+    size_t entsize;
+
+    (void) req;
+    namelen = strlen(name);
+    entlen = FUSE_NAME_OFFSET_DIRENTPLUS + namelen;
+    entsize = FUSE_DIRENT_ALIGN(entlen);
+    if (entsize <= bufsize && buf) {
+        dp = (struct fuse_direntplus *) buf;
+        memset(&dp->entry_out, 0, sizeof(dp->entry_out));
+        fill_entry(&dp->entry_out, e);
+        dp->dirent.ino = e->attr.st_ino;
+        dp->dirent.off = off;
+        dp->dirent.namelen = namelen;
+        dp->dirent.type = (e->attr.st_mode & 0170000) >> 12;
+        memcpy(dp->dirent.name, name, namelen);
+        if (entsize > entlen)
+            memset(buf + entlen, 0, entsize - entlen);
+    }
+    return entsize;
+}
+
 static void fill_open(struct fuse_open_out *arg,
                       const struct fuse_file_info *f)
 {
@@ -418,6 +462,213 @@ int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size)
     return send_reply_ok(req, buf, size);
 }
 
+#ifdef FUSE_USE_SPLICE
+static void fuse_ll_pipe_free(struct fuse_ll_pipe *llp)
+{
+    close(llp->pipe[0]);
+    close(llp->pipe[1]);
+    free(llp);
+}
+
+static void fuse_ll_pipe_destructor(void *data)
+{
+    fuse_ll_pipe_free((struct fuse_ll_pipe *) data);
+}
+
+static struct fuse_ll_pipe *fuse_ll_get_pipe(struct fuse_ll *f)
+{
+    struct fuse_ll_pipe *llp = pthread_getspecific(f->pipe_key);
+
+    if (llp == NULL) {
+        llp = (struct fuse_ll_pipe *) malloc(sizeof(struct fuse_ll_pipe));
+        if (llp == NULL)
+            return NULL;
+        if (pipe(llp->pipe) == -1) {
+            free(llp);
+            return NULL;
+        }
+        /* never block on a full pipe, there is no other reader */
+        fcntl(llp->pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(llp->pipe[1], F_SETFL, O_NONBLOCK);
+        fcntl(llp->pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(llp->pipe[1], F_SETFD, FD_CLOEXEC);
+        /* default capacity of a pipe */
+        llp->size = getpagesize() * 16;
+        llp->can_grow = 1;
+        pthread_setspecific(f->pipe_key, llp);
+    }
+    return llp;
+}
+
+/* Discard a pipe which may hold some unsent data */
+static void fuse_ll_clear_pipe(struct fuse_ll *f)
+{
+    struct fuse_ll_pipe *llp = pthread_getspecific(f->pipe_key);
+
+    if (llp) {
+        pthread_setspecific(f->pipe_key, NULL);
+        fuse_ll_pipe_free(llp);
+    }
+}
+
+/*
+ * Send a data reply by filling a pipe and splicing it to the device.
+ * Returns 1 if nothing was sent and the data has to be copied.
+ */
+static int fuse_send_data_splice(fuse_req_t req, struct fuse_out_header *out,
+                                 const struct fuse_buf *bufs, int count)
+{
+    struct fuse_ll *f = req->f;
+    struct fuse_ll_pipe *llp;
+    struct iovec iov;
+    size_t pagesize = getpagesize();
+    size_t needed;
+    size_t left;
+    off_t pos;
+    ssize_t res;
+    int i;
+
+    llp = fuse_ll_get_pipe(f);
+    if (llp == NULL)
+        return 1;
+
+    /* each segment uses its own pages in the pipe */
+    needed = pagesize;
+    for (i = 0; i < count; i++) {
+        pos = bufs[i].mem ? (off_t) (uintptr_t) bufs[i].mem : bufs[i].pos;
+        needed += (((size_t) pos & (pagesize - 1)) + bufs[i].size
+                   + pagesize - 1) & ~(pagesize - 1);
+    }
+    if (llp->size < needed) {
+        if (llp->can_grow) {
+#ifdef F_SETPIPE_SZ
+            res = fcntl(llp->pipe[0], F_SETPIPE_SZ, needed);
+            if (res == -1)
+                llp->can_grow = 0;
+            else
+                llp->size = res;
+#else
+            llp->can_grow = 0;
+#endif
+        }
+        if (llp->size < needed)
+            return 1;
+    }
+
+    iov.iov_base = out;
+    iov.iov_len = sizeof(struct fuse_out_header);
+    res = vmsplice(llp->pipe[1], &iov, 1, 0);
+    if (res != sizeof(struct fuse_out_header))
+        goto clear_pipe;
+    for (i = 0; i < count; i++) {
+        left = bufs[i].size;
+        pos = bufs[i].pos;
+        while (left) {
+            if (bufs[i].mem) {
+                iov.iov_base = (char *) bufs[i].mem + bufs[i].size - left;
+                iov.iov_len = left;
+                res = vmsplice(llp->pipe[1], &iov, 1, 0);
+            } else
+                res = splice(bufs[i].fd, &pos, llp->pipe[1], NULL, left, 0);
+            if (res <= 0)
+                goto clear_pipe;
+            left -= res;
+        }
+    }
+
+    res = splice(llp->pipe[0], NULL, fuse_chan_fd(req->ch), NULL, out->len,
+                 0);
+    if (res == -1) {
+        res = -errno;
+        /* ENOENT means the operation was interrupted */
+        if (!fuse_session_exited(fuse_chan_session(req->ch))
+            && res != -ENOENT)
+            perror("fuse: splicing to device");
+        fuse_ll_clear_pipe(f);
+    } else if ((size_t) res != out->len) {
+        res = -EIO;
+        fuse_ll_clear_pipe(f);
+    } else
+        res = 0;
+    free_req(req);
+    return res;
+
+ clear_pipe:
+    fuse_ll_clear_pipe(f);
+    return 1;
+}
+#endif /* FUSE_USE_SPLICE */
+
+/* Send a data reply by copying the data into a buffer */
+static int fuse_send_data_copy(fuse_req_t req, const struct fuse_buf *bufs,
+                               int count, size_t size)
+{
+    struct iovec iov[2];
+    char *buf;
+    char *p;
+    size_t left;
+    off_t pos;
+    ssize_t res;
+    int i;
+
+    buf = (char *) malloc(size ? size : 1);
+    if (buf == NULL)
+        return fuse_reply_err(req, ENOMEM);
+    p = buf;
+    for (i = 0; i < count; i++) {
+        if (bufs[i].mem)
+            memcpy(p, bufs[i].mem, bufs[i].size);
+        else {
+            left = bufs[i].size;
+            pos = bufs[i].pos;
+            while (left) {
+                res = pread(bufs[i].fd, p + bufs[i].size - left, left, pos);
+                if (res <= 0) {
+                    free(buf);
+                    return fuse_reply_err(req, res ? errno : EIO);
+                }
+                left -= res;
+                pos += res;
+            }
+        }
+        p += bufs[i].size;
+    }
+    iov[1].iov_base = buf;
+    iov[1].iov_len = size;
+    res = send_reply_iov(req, 0, iov, 2);
+    free(buf);
+    return res;
+}
+
+int fuse_reply_data(fuse_req_t req, const struct fuse_buf *bufs, int count)
+{
+    size_t size = 0;
+    int i;
+#ifdef FUSE_USE_SPLICE
+    struct fuse_ll *f = req->f;
+    struct fuse_out_header out;
+    int res;
+#endif
+
+    for (i = 0; i < count; i++)
+        size += bufs[i].size;
+#ifdef FUSE_USE_SPLICE
+    out.unique = req->unique;
+    out.error = 0;
+    out.len = sizeof(struct fuse_out_header) + size;
+    res = fuse_send_data_splice(req, &out, bufs, count);
+    if (res <= 0) {
+        /* the request has been freed */
+        if (f->debug)
+            fprintf(stderr, "   unique: %llu, spliced: %i (%s), outsize: %i\n",
+                    (unsigned long long) out.unique, res, strerror(-res),
+                    out.len);
+        return res;
+    }
+#endif
+    return fuse_send_data_copy(req, bufs, count, size);
+}
+
 int fuse_reply_statfs(fuse_req_t req, const struct statvfs *stbuf)
 {
     struct fuse_statfs_out arg;
@@ -488,6 +739,83 @@ int fuse_reply_ioctl(fuse_req_t req, int result, const void *buf, size_t size)
     return send_reply_iov(req, 0, iov, count);
 }
 
+static int send_notify_iov(struct fuse_ll *f, struct fuse_chan *ch,
+                           int notify_code, struct iovec *iov, int count)
+{
+    struct fuse_out_header out;
+
+    out.unique = 0;
+    out.error = notify_code;
+    iov[0].iov_base = &out;
+    iov[0].iov_len = sizeof(struct fuse_out_header);
+    out.len = iov_length(iov, count);
+
+    if (f->debug)
+        fprintf(stderr, "NOTIFY: code=%d count=%d length=%u\n",
+                notify_code, count, out.len);
+
+    return fuse_chan_send(ch, iov, count);
+}
+
+static struct fuse_ll *notify_ll(struct fuse_chan *ch)
+{
+    struct fuse_session *se;
+
+    se = ch ? fuse_chan_session(ch) : NULL;
+    return se ? (struct fuse_ll *) fuse_session_data(se) : NULL;
+}
+
+int fuse_lowlevel_notify_inval_inode(struct fuse_chan *ch, fuse_ino_t ino,
+                                     off_t off, off_t len)
+{
+    struct fuse_notify_inval_inode_out outarg;
+    struct fuse_ll *f;
+    struct iovec iov[2];
+
+    f = notify_ll(ch);
+    if (!f)
+        return -ENODEV;
+
+    if (f->conn.proto_minor < 12)
+        return -ENOSYS;
+
+    outarg.ino = ino;
+    outarg.off = off;
+    outarg.len = len;
+
+    iov[1].iov_base = &outarg;
+    iov[1].iov_len = sizeof(outarg);
+
+    return send_notify_iov(f, ch, FUSE_NOTIFY_INVAL_INODE, iov, 2);
+}
+
+int fuse_lowlevel_notify_inval_entry(struct fuse_chan *ch, fuse_ino_t parent,
+                                     const char *name, size_t namelen)
+{
+    struct fuse_notify_inval_entry_out outarg;
+    struct fuse_ll *f;
+    struct iovec iov[3];
+
+    f = notify_ll(ch);
+    if (!f)
+        return -ENODEV;
+
+    if (f->conn.proto_minor < 12)
+        return -ENOSYS;
+
+    outarg.parent = parent;
+    outarg.namelen = namelen;
+    outarg.padding = 0;
+
+    iov[1].iov_base = &outarg;
+    iov[1].iov_len = sizeof(outarg);
+	/* Note : const qualifier dropped, the name is sent with its nul */
+    iov[2].iov_base = (char *)(uintptr_t) name;
+    iov[2].iov_len = namelen + 1;
+
+    return send_notify_iov(f, ch, FUSE_NOTIFY_INVAL_ENTRY, iov, 3);
+}
+
 static void do_lookup(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
     const char *name = (const char *) inarg;
@@ -805,6 +1133,22 @@ static void do_readdir(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
         fuse_reply_err(req, ENOSYS);
 }
 
+static void do_readdirplus(fuse_req_t req, fuse_ino_t nodeid,
+                           const void *inarg)
+{
+    const struct fuse_read_in *arg = (const struct fuse_read_in *) inarg;
+    struct fuse_file_info fi;
+
+    memset(&fi, 0, sizeof(fi));
+    fi.fh = arg->fh;
+    fi.fh_old = fi.fh;
+
+    if (req->f->op.readdirplus)
+        req->f->op.readdirplus(req, nodeid, arg->size, arg->offset, &fi);
+    else
+        fuse_reply_err(req, ENOSYS);
+}
+
 static void do_releasedir(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
     const struct fuse_release_in *arg = (const struct fuse_release_in *) inarg;
@@ -1076,6 +1420,9 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
     struct fuse_init_out outarg;
     struct fuse_ll *f = req->f;
     size_t bufsize = fuse_chan_bufsize(req->ch);
+    size_t pagesize = getpagesize();
+    size_t outsize;
+    unsigned max_pages;
 
     (void) nodeid;
     if (f->debug) {
@@ -1110,6 +1457,10 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 	    f->conn.capable |= FUSE_CAP_BIG_WRITES;
 	if (arg->flags & FUSE_HAS_IOCTL_DIR)
 	    f->conn.capable |= FUSE_CAP_IOCTL_DIR;
+	if (arg->flags & FUSE_DO_READDIRPLUS)
+	    f->conn.capable |= FUSE_CAP_READDIRPLUS;
+	if (arg->flags & FUSE_WRITEBACK_CACHE)
+	    f->conn.capable |= FUSE_CAP_WRITEBACK_CACHE;
     } else {
         f->conn.async_read = 0;
         f->conn.max_readahead = 0;
@@ -1122,7 +1473,12 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
     }
 
     bufsize -= 4096;
-    if (bufsize < f->conn.max_write)
+	/* the buffer is enlarged if the kernel accepts more pages */
+    if ((arg->major > 7 || (arg->major == 7 && arg->minor >= 18))
+	&& (arg->flags & FUSE_MAX_PAGES)) {
+	if (FUSE_MAX_MAX_PAGES*pagesize < f->conn.max_write)
+	    f->conn.max_write = FUSE_MAX_MAX_PAGES*pagesize;
+    } else if (bufsize < f->conn.max_write)
         f->conn.max_write = bufsize;
 
     f->got_init = 1;
@@ -1142,6 +1498,21 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 	    outarg.minor = FUSE_KERNEL_MINOR_VERSION;
 	    if (f->conn.want & FUSE_CAP_IOCTL_DIR)
 		outarg.flags |= FUSE_HAS_IOCTL_DIR;
+	    if ((f->conn.want & f->conn.capable & FUSE_CAP_READDIRPLUS)
+		&& f->op.readdirplus)
+		outarg.flags |= FUSE_DO_READDIRPLUS;
+	    if (f->conn.want & f->conn.capable & FUSE_CAP_WRITEBACK_CACHE)
+		outarg.flags |= FUSE_WRITEBACK_CACHE;
+		/* requests are limited to 32 pages unless told otherwise */
+	    if ((arg->flags & FUSE_MAX_PAGES)
+		&& (f->conn.want
+			& (FUSE_CAP_BIG_WRITES | FUSE_CAP_WRITEBACK_CACHE))
+		&& (f->conn.max_write > FUSE_DEFAULT_MAX_PAGES*pagesize)) {
+		outarg.flags |= FUSE_MAX_PAGES;
+		max_pages = (f->conn.max_write + pagesize - 1)/pagesize;
+		outarg.max_pages = (max_pages > FUSE_MAX_MAX_PAGES
+				? FUSE_MAX_MAX_PAGES : max_pages);
+	    }
 #ifdef POSIXACLS
 	    if (f->conn.want & FUSE_CAP_DONT_MASK)
 		outarg.flags |= FUSE_DONT_MASK;
@@ -1172,6 +1543,17 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
         outarg.flags |= FUSE_POSIX_LOCKS;
     if (f->conn.want & FUSE_CAP_BIG_WRITES)
 	outarg.flags |= FUSE_BIG_WRITES;
+	/*
+	 * The kernel requires a receive buffer for max_write, which is
+	 * limited to the default buffer unless more pages are negotiated
+	 */
+    if (outarg.flags & FUSE_MAX_PAGES) {
+	if (f->conn.max_write > outarg.max_pages*pagesize)
+	    f->conn.max_write = outarg.max_pages*pagesize;
+	if (f->conn.max_write > bufsize)
+	    fuse_chan_set_bufsize(req->ch, f->conn.max_write + 4096);
+    } else if (f->conn.max_write > bufsize)
+	f->conn.max_write = bufsize;
     outarg.max_readahead = f->conn.max_readahead;
     outarg.max_write = f->conn.max_write;
 
@@ -1180,9 +1562,18 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
         fprintf(stderr, "   flags=0x%08x\n", outarg.flags);
         fprintf(stderr, "   max_readahead=0x%08x\n", outarg.max_readahead);
         fprintf(stderr, "   max_write=0x%08x\n", outarg.max_write);
+        if (outarg.flags & FUSE_MAX_PAGES)
+            fprintf(stderr, "   max_pages=%u\n", outarg.max_pages);
     }
 
-    send_reply_ok(req, &outarg, arg->minor < 5 ? 8 : sizeof(outarg));
+	/* the reply was extended in protocol 7.23 */
+    if (arg->minor < 5)
+        outsize = 8;
+    else if (arg->major == 7 && arg->minor < 23)
+        outsize = FUSE_COMPAT_22_INIT_OUT_SIZE;
+    else
+        outsize = sizeof(outarg);
+    send_reply_ok(req, &outarg, outsize);
 }
 
 static void do_destroy(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
@@ -1271,6 +1662,7 @@ static struct {
     [FUSE_INTERRUPT]   = { do_interrupt,   "INTERRUPT"   },
     [FUSE_BMAP]        = { do_bmap,        "BMAP"        },
     [FUSE_IOCTL]       = { do_ioctl,       "IOCTL"       },
+    [FUSE_READDIRPLUS] = { do_readdirplus, "READDIRPLUS" },
     [FUSE_DESTROY]     = { do_destroy,     "DESTROY"     },
 };
 
@@ -1320,6 +1712,7 @@ static void fuse_ll_process(void *data, const char *buf, size_t len,
              in->opcode != FUSE_INIT && in->opcode != FUSE_READ &&
              in->opcode != FUSE_WRITE && in->opcode != FUSE_FSYNC &&
              in->opcode != FUSE_RELEASE && in->opcode != FUSE_READDIR &&
+             in->opcode != FUSE_READDIRPLUS &&
              in->opcode != FUSE_FSYNCDIR && in->opcode != FUSE_RELEASEDIR) {
         fuse_reply_err(req, EACCES);
     } else if (in->opcode >= FUSE_MAXOP || !fuse_ll_ops[in->opcode].func)
@@ -1334,7 +1727,12 @@ static void fuse_ll_process(void *data, const char *buf, size_t len,
             if (intr)
                 fuse_reply_err(intr, EAGAIN);
         }
-        fuse_ll_ops[in->opcode].func(req, in->nodeid, inarg);
+        if (f->op.lock && in->opcode != FUSE_INTERRUPT) {
+            f->op.lock(f->userdata, in->opcode, 0);
+            fuse_ll_ops[in->opcode].func(req, in->nodeid, inarg);
+            f->op.lock(f->userdata, in->opcode, 1);
+        } else
+            fuse_ll_ops[in->opcode].func(req, in->nodeid, inarg);
     }
 }
 
@@ -1413,6 +1811,10 @@ static void fuse_ll_destroy(void *data)
             f->op.destroy(f->userdata);
     }
 
+#ifdef FUSE_USE_SPLICE
+    fuse_ll_clear_pipe(f);
+    pthread_key_delete(f->pipe_key);
+#endif
     pthread_mutex_destroy(&f->lock);
     free(f);
 }
@@ -1448,6 +1850,12 @@ struct fuse_session *fuse_lowlevel_new(struct fuse_args *args,
 
     if (fuse_opt_parse(args, f, fuse_ll_opts, fuse_ll_opt_proc) == -1)
         goto out_free;
+#ifdef FUSE_USE_SPLICE
+    if (pthread_key_create(&f->pipe_key, fuse_ll_pipe_destructor)) {
+        fprintf(stderr, "fuse: failed to create thread specific key\n");
+        goto out_free;
+    }
+#endif
 
     memcpy(&f->op, op, op_size);
     f->owner = getuid();
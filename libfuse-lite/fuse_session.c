@@ -110,6 +110,11 @@ void fuse_session_reset(struct fuse_session *se)
     se->exited = 0;
 }
 
+void *fuse_session_data(struct fuse_session *se)
+{
+    return se->data;
+}
+
 int fuse_session_exited(struct fuse_session *se)
 {
     if (se->op.exited)
@@ -152,6 +157,11 @@ size_t fuse_chan_bufsize(struct fuse_chan *ch)
     return ch->bufsize;
 }
 
+void fuse_chan_set_bufsize(struct fuse_chan *ch, size_t bufsize)
+{
+    ch->bufsize = bufsize;
+}
+
 void *fuse_chan_data(struct fuse_chan *ch)
 {
     return ch->data;
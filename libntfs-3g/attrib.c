@@ -60,6 +60,7 @@
 #include "lcnalloc.h"
 #include "dir.h"
 #include "compress.h"
+#include "wof.h"
 #include "bitmap.h"
 #include "logging.h"
 #include "misc.h"
@@ -568,6 +569,73 @@ void ntfs_attr_close(ntfs_attr *na)
 	free(na);
 }
 
+/*
+ *		Locate the runlist element containing a vcn
+ *
+ *	The number of elements in the runlist is recorded in the attribute,
+ *	so that fragmented runlists can be searched by dichotomy, and the
+ *	element found by the previous lookup and its successor are checked
+ *	first, as most accesses are sequential.
+ *	The runlist is walked from its start while it is being updated.
+ *
+ *	The runlist must be mapped and start at or before the vcn.
+ *	Returns the element containing the vcn, or the terminator
+ *	if the vcn is beyond the end of the mapped runlist.
+ */
+
+static runlist_element *ntfs_attr_rl_lookup(ntfs_attr *na, const VCN vcn)
+{
+	runlist_element *rl;
+	int count;
+	int hint;
+
+	rl = na->rl;
+	if (NAttrRunlistDirty(na)) {
+		while (rl->length && (vcn >= rl[1].vcn))
+			rl++;
+		return (rl);
+	}
+	if (!na->rl_elements || (na->rl_indexed != rl)) {
+		for (count=1; rl[count - 1].length; count++) { }
+		na->rl_elements = count;
+		na->rl_indexed = rl;
+		na->rl_hint = 0;
+	}
+	count = na->rl_elements;
+	hint = na->rl_hint;
+	if ((hint < (count - 1)) && (vcn >= rl[hint].vcn)) {
+		if (vcn < rl[hint + 1].vcn)
+			return (&rl[hint]);
+		if ((hint < (count - 2)) && (vcn < rl[hint + 2].vcn)) {
+			na->rl_hint = hint + 1;
+			return (&rl[hint + 1]);
+		}
+	}
+	hint = ntfs_rl_find_element(rl, count, vcn);
+	na->rl_hint = hint;
+	return (&rl[hint]);
+}
+
+/*
+ *		Convert a vcn to a lcn using the runlist index
+ *
+ *	Same as ntfs_rl_vcn_to_lcn(), applied to the runlist of @na.
+ */
+
+static LCN ntfs_attr_rl_vcn_to_lcn(ntfs_attr *na, const VCN vcn)
+{
+	runlist_element *rl;
+
+	if (!na->rl || (vcn < na->rl[0].vcn))
+		return (ntfs_rl_vcn_to_lcn(na->rl, vcn));
+	rl = ntfs_attr_rl_lookup(na, vcn);
+	if (rl->length && (rl->lcn >= (LCN)0))
+		return (rl->lcn + (vcn - rl->vcn));
+	if (rl->lcn < (LCN)0)
+		return (rl->lcn);
+	return ((LCN)LCN_ENOENT);
+}
+
 /**
  * ntfs_attr_map_runlist - map (a part of) a runlist of an ntfs attribute
  * @na:		ntfs attribute for which to map (part of) a runlist
@@ -585,7 +653,7 @@ int ntfs_attr_map_runlist(ntfs_attr *na, VCN vcn)
 	ntfs_log_trace("Entering for inode 0x%llx, attr 0x%x, vcn 0x%llx.\n",
 		(unsigned long long)na->ni->mft_no, le32_to_cpu(na->type), (long long)vcn);
 
-	lcn = ntfs_rl_vcn_to_lcn(na->rl, vcn);
+	lcn = ntfs_attr_rl_vcn_to_lcn(na, vcn);
 	if (lcn >= 0 || lcn == LCN_HOLE || lcn == LCN_ENOENT)
 		return 0;
 
@@ -603,6 +671,7 @@ int ntfs_attr_map_runlist(ntfs_attr *na, VCN vcn)
 				na->rl);
 		if (rl) {
 			na->rl = rl;
+			ntfs_attr_rl_changed(na);
 			ntfs_attr_put_search_ctx(ctx);
 			return 0;
 		}
@@ -665,6 +734,7 @@ static int ntfs_attr_map_partial_runlist(ntfs_attr *na, VCN vcn)
 				rl = na->rl;
 			if (rl) {
 				na->rl = rl;
+				ntfs_attr_rl_changed(na);
 				highest_vcn = sle64_to_cpu(a->highest_vcn);
 				if (highest_vcn < needed) {
 				/* corruption detection on unchanged runlists */
@@ -760,6 +830,7 @@ int ntfs_attr_map_whole_runlist(ntfs_attr *na)
 			if (!rl)
 				goto err_out;
 			na->rl = rl;
+			ntfs_attr_rl_changed(na);
 		}
 
 		/* Are we in the first extent? */
@@ -856,7 +927,7 @@ LCN ntfs_attr_vcn_to_lcn(ntfs_attr *na, const VCN vcn)
 			long)na->ni->mft_no, le32_to_cpu(na->type));
 retry:
 	/* Convert vcn to lcn. If that fails map the runlist and retry once. */
-	lcn = ntfs_rl_vcn_to_lcn(na->rl, vcn);
+	lcn = ntfs_attr_rl_vcn_to_lcn(na, vcn);
 	if (lcn >= 0)
 		return lcn;
 	if (!is_retry && !ntfs_attr_map_runlist(na, vcn)) {
@@ -913,14 +984,9 @@ retry:
 		goto map_rl;
 	if (vcn < rl[0].vcn)
 		goto map_rl;
-	while (rl->length) {
-		if (vcn < rl[1].vcn) {
-			if (rl->lcn >= (LCN)LCN_HOLE)
-				return rl;
-			break;
-		}
-		rl++;
-	}
+	rl = ntfs_attr_rl_lookup(na, vcn);
+	if (rl->length && (rl->lcn >= (LCN)LCN_HOLE))
+		return rl;
 	switch (rl->lcn) {
 	case (LCN)LCN_RL_NOT_MAPPED:
 		goto map_rl;
@@ -952,14 +1018,93 @@ map_rl:
 	return NULL;
 }
 
+/**
+ * ntfs_attr_map_extents - get the device extents holding a range of data
+ * @na:		non-resident ntfs attribute to map
+ * @pos:	position of the range in the attribute
+ * @count:	size of the range in bytes
+ * @iov:	array to fill with the device extents
+ * @max:	number of elements in @iov
+ *
+ * Get the positions on the device of the @count bytes at position @pos of
+ * the attribute @na, so that they can be read directly from the device.
+ * The range is described by the elements of @iov, their buf field being
+ * set to NULL. The range has to be within the data size of the attribute.
+ *
+ * Return the number of extents on success and -1 on error with errno set to
+ * the error code. The following error codes are defined:
+ *	EINVAL		Input parameter error.
+ *	EOPNOTSUPP	The data is resident, compressed or encrypted, or part
+ *			of the range is not allocated or not initialized.
+ *	E2BIG		The range needs more than @max extents.
+ *	EIO		I/O error or corrupt metadata.
+ */
+int ntfs_attr_map_extents(ntfs_attr *na, s64 pos, s64 count,
+			struct ntfs_device_iovec *iov, int max)
+{
+	const runlist_element *rl;
+	ntfs_volume *vol;
+	s64 ofs, size;
+	int n;
+
+	if (!na || !iov || (pos < 0) || (count < 0)
+	    || (pos + count > na->data_size)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (!NAttrNonResident(na)
+	    || (na->data_flags & ATTR_COMPRESSION_MASK)
+	    || NAttrEncrypted(na)
+	    || (pos + count > na->initialized_size)) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+	vol = na->ni->vol;
+	n = 0;
+	while (count > 0) {
+		rl = ntfs_attr_find_vcn(na, pos >> vol->cluster_size_bits);
+		if (!rl) {
+			if (errno == ENOENT)
+				errno = EIO;
+			return (-1);
+		}
+		if (rl->lcn < (LCN)0) {
+			errno = EOPNOTSUPP;
+			return (-1);
+		}
+		ofs = pos - (rl->vcn << vol->cluster_size_bits);
+		size = (rl->length << vol->cluster_size_bits) - ofs;
+		if (size > count)
+			size = count;
+		if (n && (iov[n - 1].pos + iov[n - 1].count
+				== (rl->lcn << vol->cluster_size_bits) + ofs))
+			iov[n - 1].count += size;
+		else {
+			if (n >= max) {
+				errno = E2BIG;
+				return (-1);
+			}
+			iov[n].pos = (rl->lcn << vol->cluster_size_bits) + ofs;
+			iov[n].count = size;
+			iov[n].buf = NULL;
+			n++;
+		}
+		pos += size;
+		count -= size;
+	}
+	return (n);
+}
+
 /**
  * ntfs_attr_pread_i - see description at ntfs_attr_pread()
  */ 
 static s64 ntfs_attr_pread_i(ntfs_attr *na, const s64 pos, s64 count, void *b)
 {
-	s64 br, to_read, ofs, total, total2, max_read, max_init;
+	struct ntfs_device_iovec iov[RL_IOV_BATCH];
+	s64 br, mapped, queued, ofs, total, total2, max_read, max_init;
 	ntfs_volume *vol;
-	runlist_element *rl;
+	const runlist_element *rl;
+	int i, n;
 	u16 efs_padding_length;
 
 	/* Sanity checking arguments is done in ntfs_attr_pread(). */
@@ -1093,7 +1238,7 @@ res_err_out:
 	 * length.
 	 */
 	ofs = pos - (rl->vcn << vol->cluster_size_bits);
-	for (; count; rl++, ofs = 0) {
+	while (count) {
 		if (rl->lcn == LCN_RL_NOT_MAPPED) {
 			rl = ntfs_attr_find_vcn(na, rl->vcn);
 			if (!rl) {
@@ -1112,49 +1257,49 @@ res_err_out:
 			ntfs_log_perror("%s: Zero run length", __FUNCTION__);
 			goto rl_err_out;
 		}
-		if (rl->lcn < (LCN)0) {
-			if (rl->lcn != (LCN)LCN_HOLE) {
-				ntfs_log_perror("%s: Bad run (%lld)", 
-						__FUNCTION__,
-						(long long)rl->lcn);
-				goto rl_err_out;
-			}
-			/* It is a hole, just zero the matching @b range. */
-			to_read = min(count, (rl->length <<
-					vol->cluster_size_bits) - ofs);
-			memset(b, 0, to_read);
-			/* Update progress counters. */
-			total += to_read;
-			count -= to_read;
-			b = (u8*)b + to_read;
-			continue;
+		if ((rl->lcn < (LCN)0) && (rl->lcn != (LCN)LCN_HOLE)) {
+			ntfs_log_perror("%s: Bad run (%lld)",
+					__FUNCTION__,
+					(long long)rl->lcn);
+			goto rl_err_out;
 		}
-		/* It is a real lcn, read it into @dst. */
-		to_read = min(count, (rl->length << vol->cluster_size_bits) -
-				ofs);
+		/*
+		 * Map the following runs up to the next unmapped one,
+		 * zeroing the matching @b range of holes, and read the
+		 * real lcns into @dst by a single batched request.
+		 */
+		n = RL_IOV_BATCH;
+		mapped = ntfs_rl_to_iovec(vol, &rl, &ofs, count, b, TRUE,
+				iov, &n);
+		if (n) {
+			for (queued = 0, i = 0; i < n; i++)
+				queued += iov[i].count;
 retry:
-		ntfs_log_trace("Reading %lld bytes from vcn %lld, lcn %lld, ofs"
-				" %lld.\n", (long long)to_read, (long long)rl->vcn,
-			       (long long )rl->lcn, (long long)ofs);
-		br = ntfs_pread(vol->dev, (rl->lcn << vol->cluster_size_bits) +
-				ofs, to_read, b);
-		/* If everything ok, update progress counters and continue. */
-		if (br > 0) {
-			total += br;
-			count -= br;
-			b = (u8*)b + br;
+			ntfs_log_trace("Reading %lld bytes in %d segments from "
+					"lcn %lld.\n", (long long)queued, n,
+					(long long)(iov[0].pos >>
+						vol->cluster_size_bits));
+			br = ntfs_preadv(vol->dev, iov, n);
+			if (br != queued) {
+				/* If the syscall was interrupted, try again. */
+				if (br == (s64)-1 && errno == EINTR)
+					goto retry;
+				if (br > 0)
+					total += ntfs_rl_iovec_done(iov, n, b,
+							br);
+				if (total)
+					return total;
+				if (!br)
+					errno = EIO;
+				ntfs_log_perror("%s: ntfs_pread failed",
+						__FUNCTION__);
+				return -1;
+			}
 		}
-		if (br == to_read)
-			continue;
-		/* If the syscall was interrupted, try again. */
-		if (br == (s64)-1 && errno == EINTR)
-			goto retry;
-		if (total)
-			return total;
-		if (!br)
-			errno = EIO;
-		ntfs_log_perror("%s: ntfs_pread failed", __FUNCTION__);
-		return -1;
+		/* Update progress counters. */
+		total += mapped;
+		count -= mapped;
+		b = (u8*)b + mapped;
 	}
 	/* Finally, return the number of bytes read. */
 	return total + total2;
@@ -1165,6 +1310,229 @@ rl_err_out:
 	return -1;
 }
 
+/*
+ *		Sequential read-ahead
+ *
+ *	Sequential reads of the unnamed data attribute of the files of
+ *	the user (not the metadata files such as $MFT) are detected by
+ *	comparing their position to the end of the previous read. While
+ *	the reads are sequential, a read-ahead window starting at twice
+ *	the read size is doubled on each prefetch, up to the size set by
+ *	ntfs_set_readahead(), and the data is read one window at a time
+ *	into a buffer along the runlist, so that the following reads are
+ *	served from memory.
+ *
+ *	The state is attached to the inode rather than to the ntfs_attr,
+ *	so that it survives the attribute and inode being closed and
+ *	reopened (from the inode cache) between requests, as done by
+ *	the fuse and UEFI read functions. The buffer is sized to the
+ *	current window, and when the inode is entered into the cache,
+ *	it is only kept if it still holds data to be read next, and
+ *	for no more than READAHEAD_KEPT_BUFFERS inodes.
+ *
+ *	When the volume is shared by threads, the state is protected by
+ *	the lock of the inode, and the count of kept buffers by the lock
+ *	of the open inodes, which is held when an inode is entered into
+ *	the cache or taken from it.
+ */
+
+struct NTFS_READAHEAD {
+	s64 next;	/* position of the next read if sequential */
+	s64 start;	/* position of the prefetched data */
+	s64 size;	/* size of the prefetched data */
+	u32 window;	/* current read-ahead window */
+	u32 bufsize;	/* size of buffer */
+	BOOL kept;	/* buffer kept while the inode is cached */
+	char *buf;	/* buffer of bufsize bytes, or NULL */
+} ;
+
+/*
+ *		Forget the prefetched data, when the attribute is changed
+ */
+
+static void ntfs_attr_readahead_drop(ntfs_attr *na)
+{
+	struct NTFS_READAHEAD *ra;
+
+	ra = na->ni->readahead;
+	if (ra && (na->type == AT_DATA) && !na->name_len) {
+		ra->size = 0;
+		ra->next = -1;
+		ra->window = 0;
+	}
+}
+
+/*
+ *		Free the read-ahead state of an inode being released
+ */
+
+void ntfs_attr_readahead_free(ntfs_inode *ni)
+{
+	if (ni->readahead) {
+		if (ni->readahead->kept) {
+			ntfs_volume_lock(ni->vol, NTFS_LOCK_INODES);
+			ni->vol->readahead_kept--;
+			ntfs_volume_unlock(ni->vol, NTFS_LOCK_INODES);
+		}
+		free(ni->readahead->buf);
+		free(ni->readahead);
+		ni->readahead = (struct NTFS_READAHEAD*)NULL;
+	}
+}
+
+/*
+ *		Release the read-ahead buffer of an inode entered into the cache
+ *
+ *	The buffer is only kept when the next sequential read is
+ *	expected to be served from it, and when there are not already
+ *	READAHEAD_KEPT_BUFFERS buffers kept, so that the inodes in the
+ *	cache do not hold large buffers which will never be used.
+ */
+
+void ntfs_attr_readahead_park(ntfs_inode *ni)
+{
+	struct NTFS_READAHEAD *ra;
+
+	ra = ni->readahead;
+	if (ra && ra->buf && !ra->kept) {
+		ntfs_volume_lock(ni->vol, NTFS_LOCK_INODES);
+		if (ra->size
+		    && (ra->next >= ra->start)
+		    && (ra->next < (ra->start + ra->size))
+		    && (ni->vol->readahead_kept < READAHEAD_KEPT_BUFFERS)) {
+			ra->kept = TRUE;
+			ni->vol->readahead_kept++;
+		} else {
+			free(ra->buf);
+			ra->buf = (char*)NULL;
+			ra->bufsize = 0;
+			ra->size = 0;
+		}
+		ntfs_volume_unlock(ni->vol, NTFS_LOCK_INODES);
+	}
+}
+
+/*
+ *		Take back the read-ahead buffer of an inode fetched from cache
+ */
+
+void ntfs_attr_readahead_unpark(ntfs_inode *ni)
+{
+	if (ni->readahead && ni->readahead->kept) {
+		ntfs_volume_lock(ni->vol, NTFS_LOCK_INODES);
+		ni->readahead->kept = FALSE;
+		ni->vol->readahead_kept--;
+		ntfs_volume_unlock(ni->vol, NTFS_LOCK_INODES);
+	}
+}
+
+/*
+ *		Read through the read-ahead buffer
+ *
+ *	Returns the number of bytes read, as ntfs_attr_pread()
+ */
+
+static s64 ntfs_attr_readahead_pread_i(ntfs_attr *na, s64 pos, s64 count,
+			void *b)
+{
+	struct NTFS_READAHEAD *ra;
+	ntfs_volume *vol;
+	s64 total;
+	s64 avail;
+	s64 ret;
+
+	vol = na->ni->vol;
+	ra = na->ni->readahead;
+	if (!ra) {
+		ra = (struct NTFS_READAHEAD*)ntfs_malloc(
+					sizeof(struct NTFS_READAHEAD));
+		if (!ra)
+			return (ntfs_attr_pread_i(na, pos, count, b));
+		ra->next = -1;
+		ra->start = 0;
+		ra->size = 0;
+		ra->window = 0;
+		ra->bufsize = 0;
+		ra->kept = FALSE;
+		ra->buf = (char*)NULL;
+		na->ni->readahead = ra;
+	}
+	ntfs_volume_lock(vol, NTFS_LOCK_COUNTERS);
+	vol->readahead_reads++;
+	ntfs_volume_unlock(vol, NTFS_LOCK_COUNTERS);
+		/* grow the window while the reads are sequential */
+	if (pos == ra->next) {
+		if (!ra->window)
+			ra->window = (count < vol->readahead_size/2
+					? 2*count : vol->readahead_size);
+		else
+			if (ra->window < vol->readahead_size/2)
+				ra->window <<= 1;
+			else
+				ra->window = vol->readahead_size;
+	} else
+		ra->window = 0;
+	ra->next = pos + count;
+	total = 0;
+		/* copy what has been prefetched */
+	if (ra->size && (pos >= ra->start) && (pos < (ra->start + ra->size))) {
+		avail = ra->start + ra->size - pos;
+		if (avail > count)
+			avail = count;
+		memcpy(b, &ra->buf[pos - ra->start], avail);
+		total = avail;
+		if (total == count) {
+			ntfs_volume_lock(vol, NTFS_LOCK_COUNTERS);
+			vol->readahead_hits++;
+			ntfs_volume_unlock(vol, NTFS_LOCK_COUNTERS);
+			return (total);
+		}
+	}
+		/* prefetch the next window if worth, or read directly */
+	if ((ra->window > (count - total)) && (ra->window > ra->bufsize)) {
+		free(ra->buf);
+		ra->buf = (char*)ntfs_malloc(ra->window);
+		ra->bufsize = (ra->buf ? ra->window : 0);
+		ra->size = 0;
+	}
+	if ((ra->window > (count - total)) && ra->buf) {
+		ret = ntfs_attr_pread_i(na, pos + total, ra->window, ra->buf);
+		if (ret > 0) {
+			ntfs_volume_lock(vol, NTFS_LOCK_COUNTERS);
+			vol->readahead_prefetches++;
+			ntfs_volume_unlock(vol, NTFS_LOCK_COUNTERS);
+			ra->start = pos + total;
+			ra->size = ret;
+			avail = count - total;
+			if (avail > ret)
+				avail = ret;
+			memcpy((char*)b + total, ra->buf, avail);
+			ret = avail;
+		} else
+			ra->size = 0;
+	} else
+		ret = ntfs_attr_pread_i(na, pos + total, count - total,
+					(char*)b + total);
+	if (ret < 0)
+		return (total ? total : ret);
+	return (total + ret);
+}
+
+/*
+ *		Read through the read-ahead buffer of a possibly shared inode
+ */
+
+static s64 ntfs_attr_readahead_pread(ntfs_attr *na, s64 pos, s64 count,
+			void *b)
+{
+	s64 ret;
+
+	ntfs_inode_lock(na->ni);
+	ret = ntfs_attr_readahead_pread_i(na, pos, count, b);
+	ntfs_inode_unlock(na->ni);
+	return (ret);
+}
+
 /**
  * ntfs_attr_pread - read from an attribute specified by an ntfs_attr structure
  * @na:		ntfs attribute to read from
@@ -1173,7 +1541,9 @@ rl_err_out:
  * @b:		output data buffer
  *
  * This function will read @count bytes starting at offset @pos from the ntfs
- * attribute @na into the data buffer @b.
+ * attribute @na into the data buffer @b. When read-ahead is enabled on the
+ * volume, sequential reads of the unnamed data attribute of a file are
+ * served from data prefetched in larger windows.
  *
  * On success, return the number of successfully read bytes. If this number is
  * lower than @count this means that the read reached end of file or that an
@@ -1200,7 +1570,19 @@ s64 ntfs_attr_pread(ntfs_attr *na, const s64 pos, s64 count, void *b)
 		       "%lld\n", (unsigned long long)na->ni->mft_no,
 		       le32_to_cpu(na->type), (long long)pos, (long long)count);
 
-	ret = ntfs_attr_pread_i(na, pos, count, b);
+	if ((na->ni->flags & FILE_ATTR_REPARSE_POINT)
+	    && ntfs_wof_compressed(na))
+		ret = ntfs_wof_pread(na, pos, count, b);
+	else if (na->ni->vol->readahead_size
+	    && (na->type == AT_DATA)
+	    && !na->name_len
+	    && (na->ni->mft_no >= FILE_first_user)
+	    && NAttrNonResident(na)
+	    && !NAttrEncrypted(na)
+	    && count)
+		ret = ntfs_attr_readahead_pread(na, pos, count, b);
+	else
+		ret = ntfs_attr_pread_i(na, pos, count, b);
 	
 	ntfs_log_leave("\n");
 	return ret;
@@ -2377,6 +2759,9 @@ s64 ntfs_attr_pwrite(ntfs_attr *na, const s64 pos, s64 count, const void *b)
 		ntfs_log_perror("%s", __FUNCTION__);
 		goto out;
 	}
+	ntfs_attr_readahead_drop(na);
+	ntfs_compressed_invalidate(na);
+	ntfs_wof_invalidate(na->ni);
 
 		/*
 		 * Compressed attributes may be written partially, so
@@ -2625,7 +3010,6 @@ s64 ntfs_attr_mst_pread(ntfs_attr *na, const s64 pos, const s64 bk_cnt,
 		const u32 bk_size, void *dst)
 {
 	s64 br;
-	u8 *end;
 	BOOL warn;
 
 	ntfs_log_trace("Entering for inode 0x%llx, attr type 0x%x, pos 0x%llx.\n",
@@ -2642,9 +3026,7 @@ s64 ntfs_attr_mst_pread(ntfs_attr *na, const s64 pos, const s64 bk_cnt,
 	br /= bk_size;
 		/* log errors unless silenced */
 	warn = !na->ni || !na->ni->vol || !NVolNoFixupWarn(na->ni->vol);
-	for (end = (u8*)dst + br * bk_size; (u8*)dst < end; dst = (u8*)dst +
-			bk_size)
-		ntfs_mst_post_read_fixup_warn((NTFS_RECORD*)dst, bk_size, warn);
+	ntfs_mst_post_read_fixup_records(dst, bk_size, br, warn, (int*)NULL);
 	/* Finally, return the number of blocks read. */
 	return br;
 }
@@ -4723,6 +5105,9 @@ int ntfs_attr_rm(ntfs_attr *na)
 
 	ntfs_log_trace("Entering for inode 0x%llx, attr 0x%x.\n",
 		(long long) na->ni->mft_no, le32_to_cpu(na->type));
+	ntfs_attr_readahead_drop(na);
+	ntfs_compressed_invalidate(na);
+	ntfs_wof_invalidate(na->ni);
 
 	/* Free cluster allocation. */
 	if (NAttrNonResident(na)) {
@@ -5123,6 +5508,7 @@ int ntfs_attr_make_non_resident(ntfs_attr *na,
 	NAttrSetNonResident(na);
 	NAttrSetBeingNonResident(na);
 	na->rl = rl;
+	ntfs_attr_rl_changed(na);
 	na->allocated_size = new_allocated_size;
 	na->data_size = na->initialized_size = le32_to_cpu(a->value_length);
 	/*
@@ -6753,6 +7139,9 @@ static int ntfs_attr_truncate_i(ntfs_attr *na, const s64 newsize,
 	ntfs_log_enter("Entering for inode %lld, attr 0x%x, size %lld\n",
 		       (unsigned long long)na->ni->mft_no, le32_to_cpu(na->type),
 		       (long long)newsize);
+	ntfs_attr_readahead_drop(na);
+	ntfs_compressed_invalidate(na);
+	ntfs_wof_invalidate(na->ni);
 
 	if (na->data_size == newsize) {
 		ntfs_log_trace("Size is already ok\n");
@@ -7164,63 +7553,112 @@ int ntfs_attr_remove(ntfs_inode *ni, const ATTR_TYPES type, ntfschar *name,
 	return ret;
 }
 
-/* Below macros are 32-bit ready. */
-#define BCX(x) ((x) - (((x) >> 1) & 0x77777777) - \
-		      (((x) >> 2) & 0x33333333) - \
-		      (((x) >> 3) & 0x11111111))
-#define BITCOUNT(x) (((BCX(x) + (BCX(x) >> 4)) & 0x0F0F0F0F) % 255)
+/*
+ *		Count the bits set in a 64-bit word
+ *
+ *	On aarch64 the compiler builtin is expanded to Neon instructions,
+ *	elsewhere the bits are added in parallel within the word.
+ */
 
-static u8 *ntfs_init_lut256(void)
+#if defined(__GNUC__) && defined(__aarch64__)
+#define ntfs_popcount64(x) __builtin_popcountll(x)
+#else
+static inline unsigned int ntfs_popcount64(u64 x)
 {
-	int i;
-	u8 *lut;
-	
-	lut = ntfs_malloc(256);
-	if (lut)
-		for(i = 0; i < 256; i++)
-			*(lut + i) = 8 - BITCOUNT(i);
-	return lut;
+	x -= (x >> 1) & 0x5555555555555555ULL;
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return ((x * 0x0101010101010101ULL) >> 56);
+}
+#endif
+
+/*
+ *	On x86, use the popcnt instruction (SSE4.2 and later) when the
+ *	processor has it. This requires the runtime cpu detection from
+ *	libgcc, which is not available in the UEFI driver.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+		&& !defined(UEFI_DRIVER)
+#define NTFS_POPCNT_DISPATCH 1
+#endif
+
+static s64 ntfs_count_bits_generic(const u64 *p, size_t n)
+{
+	s64 count;
+	size_t i;
+
+	count = 0;
+	for (i = 0; i < n; i++)
+		count += ntfs_popcount64(p[i]);
+	return (count);
+}
+
+#ifdef NTFS_POPCNT_DISPATCH
+
+__attribute__((target("popcnt")))
+static s64 ntfs_count_bits_popcnt(const u64 *p, size_t n)
+{
+	s64 c0, c1, c2, c3;
+	size_t i;
+
+		/* independent sums, so that popcnt can be pipelined */
+	c0 = c1 = c2 = c3 = 0;
+	for (i = 0; (i + 4) <= n; i += 4) {
+		c0 += __builtin_popcountll(p[i]);
+		c1 += __builtin_popcountll(p[i + 1]);
+		c2 += __builtin_popcountll(p[i + 2]);
+		c3 += __builtin_popcountll(p[i + 3]);
+	}
+	for ( ; i < n; i++)
+		c0 += __builtin_popcountll(p[i]);
+	return (c0 + c1 + c2 + c3);
+}
+
+#endif /* NTFS_POPCNT_DISPATCH */
+
+/*
+ *		Count the bits set in a buffer
+ *
+ *	The buffer must be aligned to a 64-bit boundary
+ */
+
+static s64 ntfs_count_bits(const u8 *buf, size_t size)
+{
+	s64 count;
+	size_t n;
+
+	n = size >> 3;
+#ifdef NTFS_POPCNT_DISPATCH
+	if (__builtin_cpu_supports("popcnt"))
+		count = ntfs_count_bits_popcnt((const u64*)buf, n);
+	else
+#endif
+		count = ntfs_count_bits_generic((const u64*)buf, n);
+	for (n <<= 3; n < size; n++)
+		count += ntfs_popcount64(buf[n]);
+	return (count);
 }
 
 s64 ntfs_attr_get_free_bits(ntfs_attr *na)
 {
-	u8 *buf, *lut;
+	u8 *buf;
 	s64 br      = 0;
 	s64 total   = 0;
 	s64 nr_free = 0;
 
-	lut = ntfs_init_lut256();
-	if (!lut)
-		return -1;
-	
 	buf = ntfs_malloc(65536);
 	if (!buf)
-		goto out;
+		return -1;
 
 	while (1) {
-		u32 *p;
 		br = ntfs_attr_pread(na, total, 65536, buf);
 		if (br <= 0)
 			break;
 		total += br;
-		p = (u32 *)buf + br / 4 - 1;
-		for (; (u8 *)p >= buf; p--) {
-			nr_free += lut[ *p        & 255] + 
-			           lut[(*p >>  8) & 255] + 
-			           lut[(*p >> 16) & 255] + 
-			           lut[(*p >> 24)      ];
-		}
-		switch (br % 4) {
-			case 3:  nr_free += lut[*(buf + br - 3)];
-			/* FALLTHRU */
-			case 2:  nr_free += lut[*(buf + br - 2)];
-			/* FALLTHRU */
-			case 1:  nr_free += lut[*(buf + br - 1)];
-		}
+		nr_free += (br << 3) - ntfs_count_bits(buf, br);
 	}
 	free(buf);
-out:
-	free(lut);
 	if (!total || br < 0)
 		return -1;
 	return nr_free;
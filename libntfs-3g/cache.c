@@ -29,10 +29,17 @@
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#ifdef ENABLE_VOLUME_LOCKS
+#include <pthread.h>
+#endif
 
 #include "types.h"
 #include "security.h"
 #include "cache.h"
+#include "compress.h"
+#include "wof.h"
+#include "mft.h"
+#include "index.h"
 #include "misc.h"
 #include "logging.h"
 
@@ -52,8 +59,48 @@
  *	shortage of memory, data is simply not cached.
  *	When there is a hashing bug, hashing is dropped, and sequential
  *	searches are used.
+ *
+ *	Each cache has its own lock, so that a cache may be used by
+ *	concurrent threads. The functions below take the lock, and a
+ *	caller using an entry after it has been fetched or entered has
+ *	to hold the lock until it is done with the entry, by means of
+ *	ntfs_lock_cache() and ntfs_unlock_cache(). The lock is recursive,
+ *	and a thread holding it must not request a volume lock (see
+ *	ntfs_volume_lock()).
+ */
+
+#ifdef ENABLE_VOLUME_LOCKS
+
+struct CACHE_LOCK {
+	pthread_mutex_t mutex;
+} ;
+
+#endif /* ENABLE_VOLUME_LOCKS */
+
+/*
+ *		Lock a cache for using its entries
+ */
+
+void ntfs_lock_cache(struct CACHE_HEADER *cache)
+{
+#ifdef ENABLE_VOLUME_LOCKS
+	if (cache && cache->lock)
+		pthread_mutex_lock(&cache->lock->mutex);
+#endif
+}
+
+/*
+ *		Unlock a cache locked by ntfs_lock_cache()
  */
 
+void ntfs_unlock_cache(struct CACHE_HEADER *cache)
+{
+#ifdef ENABLE_VOLUME_LOCKS
+	if (cache && cache->lock)
+		pthread_mutex_unlock(&cache->lock->mutex);
+#endif
+}
+
 /*
  *		Enter a new hash index, after a new record has been inserted
  *
@@ -154,6 +201,7 @@ struct CACHED_GENERIC *ntfs_fetch_cache(struct CACHE_HEADER *cache,
 
 	current = (struct CACHED_GENERIC*)NULL;
 	if (cache) {
+		ntfs_lock_cache(cache);
 		if (cache->dohash) {
 			/*
 			 * When possible, use the hash table to
@@ -200,6 +248,7 @@ struct CACHED_GENERIC *ntfs_fetch_cache(struct CACHE_HEADER *cache,
 			}
 		}
 		cache->reads++;
+		ntfs_unlock_cache(cache);
 	}
 	return (current);
 }
@@ -220,6 +269,7 @@ struct CACHED_GENERIC *ntfs_enter_cache(struct CACHE_HEADER *cache,
 
 	current = (struct CACHED_GENERIC*)NULL;
 	if (cache) {
+		ntfs_lock_cache(cache);
 		if (cache->dohash) {
 			/*
 			 * When possible, use the hash table to
@@ -324,6 +374,7 @@ struct CACHED_GENERIC *ntfs_enter_cache(struct CACHE_HEADER *cache,
 				inserthashindex(cache,current);
 		}
 		cache->writes++;
+		ntfs_unlock_cache(cache);
 	}
 	return (current);
 }
@@ -386,6 +437,7 @@ int ntfs_invalidate_cache(struct CACHE_HEADER *cache,
 	current = (struct CACHED_GENERIC*)NULL;
 	count = 0;
 	if (cache) {
+		ntfs_lock_cache(cache);
 		if (!(flags & CACHE_NOHASH) && cache->dohash) {
 			/*
 			 * When possible, use the hash table to
@@ -427,6 +479,7 @@ int ntfs_invalidate_cache(struct CACHE_HEADER *cache,
 				}
 			}
 		}
+		ntfs_unlock_cache(cache);
 	}
 	return (count);
 }
@@ -438,10 +491,12 @@ int ntfs_remove_cache(struct CACHE_HEADER *cache,
 
 	count = 0;
 	if (cache) {
+		ntfs_lock_cache(cache);
 		if (cache->dohash)
 			drophashindex(cache,item,cache->dohash(item));
 		do_invalidate(cache,item,flags);
 		count++;
+		ntfs_unlock_cache(cache);
 	}
 	return (count);
 }
@@ -461,6 +516,12 @@ static void ntfs_free_cache(struct CACHE_HEADER *cache)
 			if (entry->variable)
 				free(entry->variable);
 		}
+#ifdef ENABLE_VOLUME_LOCKS
+		if (cache->lock) {
+			pthread_mutex_destroy(&cache->lock->mutex);
+			free(cache->lock);
+		}
+#endif
 		free(cache);
 	}
 }
@@ -482,6 +543,9 @@ static struct CACHE_HEADER *ntfs_create_cache(const char *name,
 	struct HASH_ENTRY *ph;
 	struct HASH_ENTRY *qh;
 	struct HASH_ENTRY **px;
+#ifdef ENABLE_VOLUME_LOCKS
+	pthread_mutexattr_t attr;
+#endif
 	size_t size;
 	int i;
 
@@ -490,6 +554,22 @@ static struct CACHE_HEADER *ntfs_create_cache(const char *name,
 		size += item_count*sizeof(struct HASH_ENTRY)
 			 + max_hash*sizeof(struct HASH_ENTRY*);
 	cache = (struct CACHE_HEADER*)ntfs_malloc(size);
+#ifdef ENABLE_VOLUME_LOCKS
+	if (cache) {
+		cache->lock = (struct CACHE_LOCK*)
+				ntfs_malloc(sizeof(struct CACHE_LOCK));
+		if (cache->lock) {
+			pthread_mutexattr_init(&attr);
+			pthread_mutexattr_settype(&attr,
+					PTHREAD_MUTEX_RECURSIVE);
+			pthread_mutex_init(&cache->lock->mutex, &attr);
+			pthread_mutexattr_destroy(&attr);
+		} else {
+			free(cache);
+			cache = (struct CACHE_HEADER*)NULL;
+		}
+	}
+#endif
 	if (cache) {
 				/* header */
 		cache->name = name;
@@ -505,6 +585,9 @@ static struct CACHE_HEADER *ntfs_create_cache(const char *name,
 		cache->reads = 0;
 		cache->writes = 0;
 		cache->hits = 0;
+#ifndef ENABLE_VOLUME_LOCKS
+		cache->lock = (struct CACHE_LOCK*)NULL;
+#endif
 		/* chain the data entries, and mark an invalid entry */
 		cache->most_recent_entry = (struct CACHED_GENERIC*)NULL;
 		cache->oldest_entry = (struct CACHED_GENERIC*)NULL;
@@ -584,6 +667,32 @@ void ntfs_create_lru_caches(ntfs_volume *vol)
 	vol->legacy_cache = ntfs_create_cache("legacy",(cache_free)NULL,
 		(cache_hash)NULL, sizeof(struct CACHED_PERMISSIONS_LEGACY), CACHE_LEGACY_SIZE, 0);
 #endif
+#if CACHE_CBLOCK_SIZE
+		 /* decompressed compression blocks */
+	vol->cblock_cache = ntfs_create_cache("cblock",(cache_free)NULL,
+		ntfs_compressed_cblock_hash, sizeof(struct CACHED_CBLOCK),
+		CACHE_CBLOCK_SIZE, 2*CACHE_CBLOCK_SIZE);
+#endif
+#if CACHE_WOF_SIZE
+		 /* chunk tables of WOF compressed files */
+	vol->wof_cache = ntfs_create_cache("wof",(cache_free)NULL,
+		ntfs_wof_hash, sizeof(struct CACHED_WOF),
+		CACHE_WOF_SIZE, 2*CACHE_WOF_SIZE);
+#endif
+#if CACHE_MFTREC_SIZE
+		 /* prefetched mft records */
+	vol->mftrec_cache = ntfs_create_cache("mftrec",(cache_free)NULL,
+		ntfs_mft_record_hash, sizeof(struct CACHED_MFTREC),
+		CACHE_MFTREC_SIZE, 2*CACHE_MFTREC_SIZE);
+#endif
+#if CACHE_INDEX_SIZE
+		 /* directory index blocks */
+	vol->index_cache = ntfs_create_cache("index",(cache_free)NULL,
+		ntfs_index_block_hash, sizeof(struct CACHED_INDEX_BLOCK),
+		CACHE_INDEX_SIZE, 2*CACHE_INDEX_SIZE);
+	vol->index_stats = (struct INDEX_CACHE_STATS*)ntfs_calloc(
+		INDEX_STATS_DIRS*sizeof(struct INDEX_CACHE_STATS));
+#endif
 }
 
 /*
@@ -605,4 +714,17 @@ void ntfs_free_lru_caches(ntfs_volume *vol)
 #if CACHE_LEGACY_SIZE
 	ntfs_free_cache(vol->legacy_cache);
 #endif
+#if CACHE_CBLOCK_SIZE
+	ntfs_free_cache(vol->cblock_cache);
+#endif
+#if CACHE_WOF_SIZE
+	ntfs_free_cache(vol->wof_cache);
+#endif
+#if CACHE_MFTREC_SIZE
+	ntfs_free_cache(vol->mftrec_cache);
+#endif
+#if CACHE_INDEX_SIZE
+	ntfs_free_cache(vol->index_cache);
+	free(vol->index_stats);
+#endif
 }
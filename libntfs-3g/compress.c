@@ -40,7 +40,11 @@
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#ifdef ENABLE_COMPRESS_THREADS
+#include <pthread.h>
+#endif
 
+#include "param.h"
 #include "attrib.h"
 #include "debug.h"
 #include "volume.h"
@@ -51,6 +55,7 @@
 #include "lcnalloc.h"
 #include "logging.h"
 #include "misc.h"
+#include "cache.h"
 
 #undef le16_to_cpup 
 /* the standard le16_to_cpup() crashes for unaligned data on some processors */ 
@@ -71,22 +76,43 @@ typedef enum {
 	NTFS_SB_IS_COMPRESSED	=	0x8000,
 } ntfs_compression_constants;
 
-/* Match length at or above which ntfs_best_match() will stop searching for
- * longer matches.  */
-#define NICE_MATCH_LEN 18
-
-/* Maximum number of potential matches that ntfs_best_match() will consider at
- * each position.  */
-#define MAX_SEARCH_DEPTH 24
-
 /* log base 2 of the number of entries in the hash table for match-finding.  */
 #define HASH_SHIFT 14
 
 /* Constant for the multiplicative hash function.  */
 #define HASH_MULTIPLIER 0x1E35A7BD
 
+/*
+ *		Compression levels
+ *
+ *	Each level sets the effort spent searching for matches :
+ *	- nice_len : match length at or above which ntfs_best_match()
+ *	  stops searching for longer matches,
+ *	- depth : maximum number of potential matches which
+ *	  ntfs_best_match() considers at each position,
+ *	- lazy : whether a match is deferred when the next position
+ *	  has a longer one (otherwise the first match is output).
+ *
+ *	The default level is the one which has always been used.
+ */
+
+struct COMPRESS_LEVEL {
+	int nice_len;
+	int depth;
+	BOOL lazy;
+} ;
+
+static const struct COMPRESS_LEVEL compress_levels[] = {
+	{   8,    4, FALSE },	/* 1 : fastest */
+	{  12,    8, FALSE },
+	{  18,   24, TRUE },	/* 3 : default */
+	{  64,  128, TRUE },
+	{ 4098, 4096, TRUE },	/* 5 : best */
+} ;
+
 struct COMPRESS_CONTEXT {
 	const unsigned char *inbuf;
+	const struct COMPRESS_LEVEL *level;
 	int bufsize;
 	int size;
 	int rel;
@@ -138,13 +164,14 @@ static inline unsigned int ntfs_hash(const u8 *p)
  *	Note: for the following reasons, this function is not guaranteed to find
  *	*the* longest match up to pctx->mxsz:
  *
- *	(1) If this function finds a match of NICE_MATCH_LEN bytes or greater,
- *	    it ends early because a match this long is good enough and it's not
- *	    worth spending more time searching.
+ *	(1) If this function finds a match of the nice length of the
+ *	    compression level or greater, it ends early because a match this
+ *	    long is good enough and it's not worth spending more time searching.
  *
- *	(2) If this function considers MAX_SEARCH_DEPTH matches with a single
- *	    position, it ends early and returns the longest match found so far.
- *	    This saves a lot of time on degenerate inputs.
+ *	(2) If this function considers as many matches with a single position
+ *	    as the depth of the compression level, it ends early and returns the
+ *	    longest match found so far.  This saves a lot of time on degenerate
+ *	    inputs.
  */
 static void ntfs_best_match(struct COMPRESS_CONTEXT *pctx, const int i,
 			    int best_len)
@@ -153,8 +180,8 @@ static void ntfs_best_match(struct COMPRESS_CONTEXT *pctx, const int i,
 	const u8 * const strptr = &inbuf[i]; /* String we're matching against */
 	s16 * const prev = pctx->prev;
 	const int max_len = min(pctx->bufsize - i, pctx->mxsz);
-	const int nice_len = min(NICE_MATCH_LEN, max_len);
-	int depth_remaining = MAX_SEARCH_DEPTH;
+	const int nice_len = min(pctx->level->nice_len, max_len);
+	int depth_remaining = pctx->level->depth;
 	const u8 *best_matchptr = strptr;
 	unsigned int hash;
 	s16 cur_match;
@@ -274,7 +301,7 @@ static void ntfs_skip_position(struct COMPRESS_CONTEXT *pctx, const int i)
  */
 
 static unsigned int ntfs_compress_block(const char *inbuf, const int bufsize,
-				char *outbuf)
+				char *outbuf, const struct COMPRESS_LEVEL *level)
 {
 	struct COMPRESS_CONTEXT *pctx;
 	int i; /* current position */
@@ -302,6 +329,7 @@ static unsigned int ntfs_compress_block(const char *inbuf, const int bufsize,
 	memset(pctx->head, 0xFF, sizeof(pctx->head));
 
 	pctx->inbuf = (const unsigned char*)inbuf;
+	pctx->level = level;
 	pctx->bufsize = bufsize;
 	xout = 2;
 	i = 0;
@@ -318,7 +346,8 @@ static unsigned int ntfs_compress_block(const char *inbuf, const int bufsize,
 		/* This implementation uses "lazy" parsing: it always chooses
 		 * the longest match, unless the match at the next position is
 		 * longer.  This is the same strategy used by the high
-		 * compression modes of zlib.  */
+		 * compression modes of zlib.  The fast levels use "greedy"
+		 * parsing instead, always choosing the current match.  */
 
 		if (!have_match) {
 			/* Find the longest match at the current position.  But
@@ -341,7 +370,8 @@ static unsigned int ntfs_compress_block(const char *inbuf, const int bufsize,
 			bp_cur = bp;
 			offs = pctx->rel;
 
-			if (pctx->size >= NICE_MATCH_LEN) {
+			if ((pctx->size >= level->nice_len)
+			    || !level->lazy) {
 
 				/* Choose long matches immediately.  */
 
@@ -446,23 +476,79 @@ static unsigned int ntfs_compress_block(const char *inbuf, const int bufsize,
 	return (xout);
 }
 
+/*
+ *		Copy a phrase from the already decompressed data
+ *
+ *	The phrase starts @offs bytes before @dest and is @length bytes
+ *	long, it overlaps the destination when @offs is less than @length.
+ *	When there is enough room up to @limit, the copy is made in 8-byte
+ *	chunks and may go up to 7 bytes beyond the phrase. The extra bytes
+ *	are overwritten later, either by the next tokens or by zeroes
+ *	when the sub-block is complete.
+ */
+
+static inline void ntfs_copy_phrase(u8 *dest, unsigned int offs,
+			unsigned int length, const u8 *limit)
+{
+	const u8 *src;
+	u8 *end;
+	unsigned int n;
+
+	src = dest - offs;
+	end = dest + length;
+	if ((offs >= 8) && ((end + 8) <= limit)) {
+		/* fast path : the chunks never overlap */
+		do {
+			memcpy(dest, src, 8);
+			dest += 8;
+			src += 8;
+		} while (dest < end);
+	} else if (offs >= length) {
+		memcpy(dest, src, length);
+	} else if (offs == 1) {
+		/* a repeated byte */
+		memset(dest, *src, length);
+	} else {
+		/*
+		 * Short overlapping phrase : the copied data is periodic,
+		 * so the pattern can be doubled on each copy.
+		 */
+		n = offs;
+		while ((dest + n) < end) {
+			memcpy(dest, src, n);
+			dest += n;
+			n = dest - src;
+		}
+		memcpy(dest, src, end - dest);
+	}
+}
+
 /**
- * ntfs_decompress - decompress a compression block into an array of pages
+ * ntfs_decompress_part - decompress the beginning of a compression block
  * @dest:	buffer to which to write the decompressed data
  * @dest_size:	size of buffer @dest in bytes
  * @cb_start:	compression block to decompress
  * @cb_size:	size of compression block @cb_start in bytes
+ * @cb_used:	returned count of bytes used in @cb_start, or NULL
  *
  * This decompresses the compression block @cb_start into the destination
- * buffer @dest.
+ * buffer @dest, until @dest is full.
  *
  * @cb_start is a pointer to the compression block which needs decompressing
  * and @cb_size is the size of @cb_start in bytes (8-64kiB).
  *
+ * A tag of eight symbols is copied at once, and phrases are copied by
+ * chunks, when this cannot overflow the current sub-block. Near the end
+ * of a sub-block, each byte is checked.
+ *
+ * As phrases never refer to a previous sub-block, decompression can be
+ * resumed at the end of @dest by decompressing from @cb_start plus the
+ * returned @cb_used, unless it is zero.
+ *
  * Return 0 if success or -EOVERFLOW on error in the compressed stream.
  */
-static int ntfs_decompress(u8 *dest, const u32 dest_size,
-		u8 *const cb_start, const u32 cb_size)
+static int ntfs_decompress_part(u8 *dest, const u32 dest_size,
+		u8 *const cb_start, const u32 cb_size, u32 *cb_used)
 {
 	/*
 	 * Pointers into the compressed data, i.e. the compression block (cb),
@@ -479,6 +565,10 @@ static int ntfs_decompress(u8 *dest, const u32 dest_size,
 	/* Variables for tag and token parsing. */
 	u8 tag;			/* Current tag. */
 	int token;		/* Loop counter for the eight tokens in tag. */
+	unsigned int lg;	/* Bits of the offset beyond 4 in a phrase. */
+	unsigned int pt;	/* Phrase token. */
+	unsigned int offs;	/* Offset of phrase back from dest. */
+	unsigned int length;	/* Length of phrase. */
 
 	ntfs_log_trace("Entering, cb_size = 0x%x.\n", (unsigned)cb_size);
 do_next_sb:
@@ -488,11 +578,21 @@ do_next_sb:
 	 * Have we reached the end of the compression block or the end of the
 	 * decompressed data?  The latter can happen for example if the current
 	 * position in the compression block is one byte before its end so the
-	 * first two checks do not detect it.
+	 * first two checks do not detect it. When a single byte is left, it
+	 * is taken as a header the missing upper byte of which is zero,
+	 * rather than reading beyond the compression block.
 	 */
-	if (cb == cb_end || !le16_to_cpup((le16*)cb) || dest == dest_end) {
+	if ((cb == cb_end) || (dest == dest_end)
+	    || (((cb + 1) == cb_end) ? !*cb : !le16_to_cpup((le16*)cb))) {
 		if (dest_end > dest)
 			memset(dest, 0, dest_end - dest);
+		/*
+		 * A symbol stored beyond a full sub-block may have been
+		 * dropped at the end of dest, decompression cannot be
+		 * resumed then.
+		 */
+		if (cb_used)
+			*cb_used = (dest > dest_end ? 0 : cb - cb_start);
 		ntfs_log_debug("Completed. Returning success (0).\n");
 		return 0;
 	}
@@ -531,107 +631,102 @@ do_next_sb:
 	/* This sb is compressed, decompress it into destination. */
 	/* Forward to the first tag in the sub-block. */
 	cb += 2;
-do_next_tag:
-	if (cb == cb_sb_end) {
-		/* Check if the decompressed sub-block was not full-length. */
-		if (dest < dest_sb_end) {
-			int nr_bytes = dest_sb_end - dest;
-
-			ntfs_log_debug("Filling incomplete sub-block with zeroes.\n");
-			/* Zero remainder and update destination position. */
-			memset(dest, 0, nr_bytes);
-			dest += nr_bytes;
+	lg = 0;
+	while (cb < cb_sb_end) {
+		/* Get the next tag and advance to first token. */
+		tag = *cb++;
+		if (!tag && ((cb + 8) <= cb_sb_end)
+		    && ((dest + 8) <= dest_sb_end)) {
+			/* Eight symbols, copy them at once. */
+			memcpy(dest, cb, 8);
+			dest += 8;
+			cb += 8;
+			continue;
 		}
-		/* We have finished the current sub-block. */
-		goto do_next_sb;
-	}
-	/* Check we are still in range. */
-	if (cb > cb_sb_end || dest > dest_sb_end)
-		goto return_overflow;
-	/* Get the next tag and advance to first token. */
-	tag = *cb++;
-	/* Parse the eight tokens described by the tag. */
-	for (token = 0; token < 8; token++, tag >>= 1) {
-		u16 lg, pt, length, max_non_overlap;
-		register u16 i;
-		u8 *dest_back_addr;
-
-		/* Check if we are done / still in range. */
-		if (cb >= cb_sb_end || dest > dest_sb_end)
-			break;
-		/* Determine token type and parse appropriately.*/
-		if ((tag & NTFS_TOKEN_MASK) == NTFS_SYMBOL_TOKEN) {
+		/* Parse the eight tokens described by the tag. */
+		for (token = 0; (token < 8) && (cb < cb_sb_end);
+						token++, tag >>= 1) {
+			if ((tag & NTFS_TOKEN_MASK) == NTFS_SYMBOL_TOKEN) {
+				/*
+				 * We have a symbol token, copy the symbol
+				 * across, if there is room for it.
+				 */
+				if (dest >= dest_sb_end) {
+					/*
+					 * A symbol beyond a full sub-block
+					 * has always been accepted when it
+					 * ends the sub-block : it goes before
+					 * the next sub-block, which is shifted.
+					 * Just never store it beyond the
+					 * buffer.
+					 */
+					if ((cb + 1) != cb_sb_end)
+						goto return_overflow;
+					if (dest < dest_end)
+						*dest = *cb;
+					dest++;
+					cb++;
+					continue;
+				}
+				*dest++ = *cb++;
+				continue;
+			}
 			/*
-			 * We have a symbol token, copy the symbol across, and
-			 * advance the source and destination positions.
+			 * We have a phrase token. Make sure it is not the
+			 * first tag in the sb and it is complete.
 			 */
-			*dest++ = *cb++;
-			/* Continue with the next token. */
-			continue;
-		}
-		/*
-		 * We have a phrase token. Make sure it is not the first tag in
-		 * the sb as this is illegal and would confuse the code below.
-		 */
-		if (dest == dest_sb_start)
-			goto return_overflow;
-		/*
-		 * Determine the number of bytes to go back (p) and the number
-		 * of bytes to copy (l). We use an optimized algorithm in which
-		 * we first calculate log2(current destination position in sb),
-		 * which allows determination of l and p in O(1) rather than
-		 * O(n). We just need an arch-optimized log2() function now.
-		 */
-		lg = 0;
-		for (i = dest - dest_sb_start - 1; i >= 0x10; i >>= 1)
-			lg++;
-		/* Get the phrase token into i. */
-		pt = le16_to_cpup((le16*)cb);
-		/*
-		 * Calculate starting position of the byte sequence in
-		 * the destination using the fact that p = (pt >> (12 - lg)) + 1
-		 * and make sure we don't go too far back.
-		 */
-		dest_back_addr = dest - (pt >> (12 - lg)) - 1;
-		if (dest_back_addr < dest_sb_start)
-			goto return_overflow;
-		/* Now calculate the length of the byte sequence. */
-		length = (pt & (0xfff >> lg)) + 3;
-		/* Verify destination is in range. */
-		if (dest + length > dest_sb_end)
-			goto return_overflow;
-		/* The number of non-overlapping bytes. */
-		max_non_overlap = dest - dest_back_addr;
-		if (length <= max_non_overlap) {
-			/* The byte sequence doesn't overlap, just copy it. */
-			memcpy(dest, dest_back_addr, length);
-			/* Advance destination pointer. */
-			dest += length;
-		} else {
+			if ((dest == dest_sb_start) || ((cb + 2) > cb_sb_end))
+				goto return_overflow;
 			/*
-			 * The byte sequence does overlap, copy non-overlapping
-			 * part and then do a slow byte by byte copy for the
-			 * overlapping part. Also, advance the destination
-			 * pointer.
+			 * The split of the token between offset and length
+			 * depends on log2(current destination position in
+			 * sb), which only grows within a sub-block.
 			 */
-			memcpy(dest, dest_back_addr, max_non_overlap);
-			dest += max_non_overlap;
-			dest_back_addr += max_non_overlap;
-			length -= max_non_overlap;
-			while (length--)
-				*dest++ = *dest_back_addr++;
+			while ((dest - dest_sb_start) > (0x10 << lg))
+				lg++;
+			pt = le16_to_cpup((le16*)cb);
+			cb += 2;
+			offs = (pt >> (12 - lg)) + 1;
+			length = (pt & (0xfff >> lg)) + 3;
+			/* Make sure we don't go too far back or forth. */
+			if ((offs > (unsigned int)(dest - dest_sb_start))
+			    || (length > (unsigned int)(dest_sb_end - dest)))
+				goto return_overflow;
+			ntfs_copy_phrase(dest, offs, length, dest_sb_end);
+			dest += length;
 		}
-		/* Advance source position and continue with the next token. */
-		cb += 2;
 	}
-	/* No tokens left in the current tag. Continue with the next tag. */
-	goto do_next_tag;
+	/* Check if the decompressed sub-block was not full-length. */
+	if (dest < dest_sb_end) {
+		ntfs_log_debug("Filling incomplete sub-block with zeroes.\n");
+		/* Zero remainder and update destination position. */
+		memset(dest, 0, dest_sb_end - dest);
+		dest = dest_sb_end;
+	}
+	/* We have finished the current sub-block. */
+	goto do_next_sb;
 return_overflow:
 	errno = EOVERFLOW;
 	ntfs_log_perror("Failed to decompress file");
 	return -1;
 }
 
+/**
+ * ntfs_decompress - decompress a compression block into an array of pages
+ * @dest:	buffer to which to write the decompressed data
+ * @dest_size:	size of buffer @dest in bytes
+ * @cb_start:	compression block to decompress
+ * @cb_size:	size of compression block @cb_start in bytes
+ *
+ * Return 0 if success or -EOVERFLOW on error in the compressed stream.
+ */
+static int ntfs_decompress(u8 *dest, const u32 dest_size,
+		u8 *const cb_start, const u32 cb_size)
+{
+	return (ntfs_decompress_part(dest, dest_size, cb_start, cb_size,
+			(u32*)NULL));
+}
+
 /**
  * ntfs_is_cb_compressed - internal function, do not use
  *
@@ -685,6 +780,90 @@ restart:
 	return FALSE;
 }
 
+#if CACHE_CBLOCK_SIZE
+
+/*
+ *		Cache of decompressed compression blocks
+ *
+ *	Reads of compressed files smaller than a compression block would
+ *	decompress the same block again and again, so the decompressed
+ *	blocks of the unnamed data attribute are kept in an LRU cache.
+ *	As decompression stops after the requested data, only the
+ *	beginning of a block may be cached. A read beyond it decompresses
+ *	from the end of the cached data up to the requested data, as
+ *	phrases never refer to a previous sub-block, and the longer
+ *	beginning replaces the cached one.
+ *	The key includes the sequence number of the inode, so that the
+ *	blocks of a deleted file cannot be found for a new one reusing
+ *	its inode. The blocks of a file are invalidated whenever its data
+ *	is changed.
+ */
+
+static int cblock_compare(const struct CACHED_GENERIC *cached,
+			const struct CACHED_GENERIC *item)
+{
+	const struct CACHED_CBLOCK *c = (const struct CACHED_CBLOCK*)cached;
+	const struct CACHED_CBLOCK *i = (const struct CACHED_CBLOCK*)item;
+
+	return ((c->mref != i->mref) || (c->index != i->index));
+}
+
+static int cblock_inode_compare(const struct CACHED_GENERIC *cached,
+			const struct CACHED_GENERIC *item)
+{
+	return (((const struct CACHED_CBLOCK*)cached)->mref
+			!= ((const struct CACHED_CBLOCK*)item)->mref);
+}
+
+int ntfs_compressed_cblock_hash(const struct CACHED_GENERIC *item)
+{
+	const struct CACHED_CBLOCK *cblock;
+
+	cblock = (const struct CACHED_CBLOCK*)item;
+	return ((MREF(cblock->mref) + cblock->index)
+					% (2*CACHE_CBLOCK_SIZE));
+}
+
+static BOOL ntfs_compressed_cacheable(ntfs_attr *na)
+{
+	return (na->ni->vol->cblock_cache
+		&& (na->type == AT_DATA)
+		&& !na->name_len);
+}
+
+static void ntfs_compressed_cblock_key(struct CACHED_CBLOCK *item,
+			ntfs_attr *na, VCN vcn)
+{
+	item->mref = MK_MREF(na->ni->mft_no,
+			le16_to_cpu(na->ni->mrec->sequence_number));
+	item->index = vcn >> (na->compression_block_size_bits
+				- na->ni->vol->cluster_size_bits);
+}
+
+#endif /* CACHE_CBLOCK_SIZE */
+
+/**
+ * ntfs_compressed_invalidate - forget the decompressed blocks of a file
+ * @na:		attribute being changed
+ *
+ * To be called before any change to the data of an attribute.
+ */
+
+void ntfs_compressed_invalidate(ntfs_attr *na)
+{
+#if CACHE_CBLOCK_SIZE
+	struct CACHED_CBLOCK item;
+
+	if (ntfs_compressed_cacheable(na)
+	    && na->ni->vol->cblock_cache->most_recent_entry) {
+		ntfs_compressed_cblock_key(&item, na, 0);
+		ntfs_invalidate_cache(na->ni->vol->cblock_cache,
+				GENERIC(&item), cblock_inode_compare,
+				CACHE_NOHASH);
+	}
+#endif
+}
+
 /**
  * ntfs_compressed_attr_pread - read from a compressed attribute
  * @na:		ntfs attribute to read from
@@ -719,6 +898,13 @@ s64 ntfs_compressed_attr_pread(ntfs_attr *na, s64 pos, s64 count, void *b)
 	ATTR_FLAGS data_flags;
 	FILE_ATTR_FLAGS compression;
 	unsigned int nr_cbs, cb_clusters;
+#if CACHE_CBLOCK_SIZE
+	struct CACHED_CBLOCK item;
+	struct CACHED_CBLOCK *cached;
+	BOOL cacheable;
+#endif
+	u32 prefix;	/* decompressed size already got from the cache */
+	u32 cb_used;	/* compressed size used for the prefix */
 
 	if (!na || !na->ni) {
 		errno = EINVAL;
@@ -807,12 +993,53 @@ s64 ntfs_compressed_attr_pread(ntfs_attr *na, s64 pos, s64 count, void *b)
 	nr_cbs = (end_vcn - start_vcn) << vol->cluster_size_bits >>
 			na->compression_block_size_bits;
 	cb_end = cb + cb_size;
+#if CACHE_CBLOCK_SIZE
+	cacheable = ntfs_compressed_cacheable(na);
+#endif
 do_next_cb:
 	nr_cbs--;
 	cb_pos = cb;
 	vcn = start_vcn;
 	start_vcn += cb_clusters;
 
+	prefix = 0;
+	cb_used = 0;
+#if CACHE_CBLOCK_SIZE
+	if (cacheable) {
+		ntfs_compressed_cblock_key(&item, na, vcn);
+		ntfs_lock_cache(vol->cblock_cache);
+		cached = (struct CACHED_CBLOCK*)ntfs_fetch_cache(
+				vol->cblock_cache, GENERIC(&item),
+				cblock_compare);
+		to_read = min(count, cb_size - ofs);
+			/*
+			 * Only the beginning of the block may be cached,
+			 * the rest is decompressed after it.
+			 */
+		if (cached && (cached->datasize < (ofs + to_read))) {
+			if (cached->cbused) {
+				prefix = cached->datasize;
+				cb_used = cached->cbused;
+				memcpy(dest, cached->data, prefix);
+			} else
+				vol->cblock_cache->hits--;
+			ntfs_invalidate_cache(vol->cblock_cache,
+					GENERIC(&item), cblock_compare, 0);
+			cached = (struct CACHED_CBLOCK*)NULL;
+		}
+		if (cached) {
+			memcpy(b, cached->data + ofs, to_read);
+			total += to_read;
+			count -= to_read;
+			b = (u8*)b + to_read;
+			ofs = 0;
+		}
+		ntfs_unlock_cache(vol->cblock_cache);
+		if (cached)
+			goto next_cb;
+	}
+#endif
+
 	/* Check whether the compression block is sparse. */
 	rl = ntfs_attr_find_vcn(na, vcn);
 	if (!rl || rl->lcn < LCN_HOLE) {
@@ -892,6 +1119,7 @@ do_next_cb:
 	} else {
 		s64 tdata_size, tinitialized_size;
 		u32 decompsz;
+		u32 used;
 
 		/*
 		 * Compressed cb, decompress it into the temporary buffer, then
@@ -952,7 +1180,8 @@ do_next_cb:
 		/* Do not decompress beyond the requested block */
 		to_read = min(count, cb_size - ofs);
 		decompsz = ((ofs + to_read - 1) | (NTFS_SB_SIZE - 1)) + 1;
-		if (ntfs_decompress(dest, decompsz, cb, cb_size) < 0) {
+		if (ntfs_decompress_part(dest + prefix, decompsz - prefix,
+				cb + cb_used, cb_size - cb_used, &used) < 0) {
 			err = errno;
 			free(cb);
 			free(dest);
@@ -961,12 +1190,24 @@ do_next_cb:
 			errno = err;
 			return -1;
 		}
+#if CACHE_CBLOCK_SIZE
+		if (cacheable) {
+			item.data = dest;
+			item.datasize = decompsz;
+			item.cbused = cb_used + used;
+			ntfs_enter_cache(vol->cblock_cache, GENERIC(&item),
+					cblock_compare);
+		}
+#endif
 		memcpy(b, dest + ofs, to_read);
 		total += to_read;
 		count -= to_read;
 		b = (u8*)b + to_read;
 		ofs = 0;
 	}
+#if CACHE_CBLOCK_SIZE
+next_cb:
+#endif
 	/* Do we have more work to do? */
 	if (nr_cbs)
 		goto do_next_cb;
@@ -1059,6 +1300,289 @@ static s32 write_clusters(ntfs_volume *vol, const runlist_element *rl,
 }
 
 
+/*
+ *		Compression of the sub-blocks of a compression block
+ *
+ *	Each sub-block is compressed independently into its own slot
+ *	of the output buffer, then the slots are concatenated in order.
+ *	The slots have the 4100 bytes which ntfs_compress_block() may
+ *	write to, so that compressing a sub-block never overwrites the
+ *	beginning of the next slot, being filled by another thread.
+ */
+
+#define NTFS_SB_SLOT (NTFS_SB_SIZE + 4)
+
+struct COMPRESS_JOB {
+	const char *inbuf;
+	char *outbuf;
+	unsigned int *sizes;	/* compressed size of each sub-block */
+	const struct COMPRESS_LEVEL *level;
+	u32 insz;
+	int count;		/* count of sub-blocks */
+} ;
+
+static void ntfs_compress_sb(void *arg, int i)
+{
+	struct COMPRESS_JOB *job;
+	u32 p;
+	unsigned int bsz;
+
+	job = (struct COMPRESS_JOB*)arg;
+	p = (u32)i*NTFS_SB_SIZE;
+	if ((p + NTFS_SB_SIZE) < job->insz)
+		bsz = NTFS_SB_SIZE;
+	else
+		bsz = job->insz - p;
+	job->sizes[i] = ntfs_compress_block(&job->inbuf[p], bsz,
+				&job->outbuf[i*NTFS_SB_SLOT], job->level);
+}
+
+#ifdef ENABLE_COMPRESS_THREADS
+
+/*
+ *	The worker threads share the items of one task at a time with the
+ *	thread requesting it, the items being the sub-blocks of a
+ *	compression block, or any other independent work. They are
+ *	started by ntfs_set_compress_threads() and live until the volume
+ *	is released.
+ */
+
+struct COMPRESS_TASK {
+	void (*process)(void *job, int i);
+	void *job;
+	int count;		/* count of items */
+	int next;		/* next item to process */
+	int pending;		/* items not processed yet */
+} ;
+
+struct COMPRESS_POOL {
+	pthread_mutex_t serial;	/* one task at a time */
+	pthread_mutex_t lock;	/* protects the fields below */
+	pthread_cond_t work;	/* a task is available */
+	pthread_cond_t done;	/* all the items are processed */
+	struct COMPRESS_TASK *task;
+	BOOL stop;
+	int count;		/* count of worker threads */
+	pthread_t threads[COMPRESS_THREADS_MAX];
+} ;
+
+/*
+ *		Process items of the current task while there are some
+ *
+ *	Called with the pool lock held
+ */
+
+static void ntfs_compress_work(struct COMPRESS_POOL *pool,
+			struct COMPRESS_TASK *task)
+{
+	int i;
+
+	while (task->next < task->count) {
+		i = task->next++;
+		pthread_mutex_unlock(&pool->lock);
+		task->process(task->job, i);
+		pthread_mutex_lock(&pool->lock);
+		if (!--task->pending)
+			pthread_cond_signal(&pool->done);
+	}
+}
+
+static void *ntfs_compress_worker(void *arg)
+{
+	struct COMPRESS_POOL *pool;
+
+	pool = (struct COMPRESS_POOL*)arg;
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->stop) {
+		if (pool->task && (pool->task->next < pool->task->count))
+			ntfs_compress_work(pool, pool->task);
+		else
+			pthread_cond_wait(&pool->work, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return ((void*)NULL);
+}
+
+/*
+ *		Process all the items of a task using the worker threads
+ */
+
+static void ntfs_compress_parallel(struct COMPRESS_POOL *pool,
+			void (*process)(void *job, int i), void *job, int count)
+{
+	struct COMPRESS_TASK task;
+
+	task.process = process;
+	task.job = job;
+	task.count = count;
+	task.next = 0;
+	task.pending = count;
+	pthread_mutex_lock(&pool->serial);
+	pthread_mutex_lock(&pool->lock);
+	pool->task = &task;
+	pthread_cond_broadcast(&pool->work);
+	ntfs_compress_work(pool, &task);
+	while (task.pending)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pool->task = (struct COMPRESS_TASK*)NULL;
+	pthread_mutex_unlock(&pool->lock);
+	pthread_mutex_unlock(&pool->serial);
+}
+
+static void ntfs_compress_pool_stop(struct COMPRESS_POOL *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = TRUE;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (i=0; i<pool->count; i++)
+		pthread_join(pool->threads[i], (void**)NULL);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_mutex_destroy(&pool->serial);
+	free(pool);
+}
+
+#endif /* ENABLE_COMPRESS_THREADS */
+
+/**
+ * ntfs_set_compress_threads - set the count of threads used for compressing
+ * @vol:	volume the files of which are compressed
+ * @count:	count of threads, including the calling thread
+ *
+ * Compressing a compression block is shared by @count threads, the
+ * extra ones being started by this function. A count of 1 (the default)
+ * compresses in the calling thread.
+ *
+ * Return 0 on success and -1 on error with errno set to the error code.
+ */
+
+int ntfs_set_compress_threads(ntfs_volume *vol, int count)
+{
+#ifdef ENABLE_COMPRESS_THREADS
+	struct COMPRESS_POOL *pool;
+	int err;
+#endif
+	int res;
+
+	res = -1;
+	if (!vol || (count < 1) || (count > COMPRESS_THREADS_MAX)) {
+		errno = EINVAL;
+		ntfs_log_error("Bad count of compression threads\n");
+		return (-1);
+	}
+	ntfs_compress_release(vol);
+	if (count == 1)
+		return (0);
+#ifdef ENABLE_COMPRESS_THREADS
+	pool = (struct COMPRESS_POOL*)ntfs_malloc(sizeof(struct COMPRESS_POOL));
+	if (pool) {
+		pthread_mutex_init(&pool->serial, (pthread_mutexattr_t*)NULL);
+		pthread_mutex_init(&pool->lock, (pthread_mutexattr_t*)NULL);
+		pthread_cond_init(&pool->work, (pthread_condattr_t*)NULL);
+		pthread_cond_init(&pool->done, (pthread_condattr_t*)NULL);
+		pool->task = (struct COMPRESS_TASK*)NULL;
+		pool->stop = FALSE;
+		pool->count = 0;
+		err = 0;
+		while (!err && (pool->count < (count - 1))) {
+			err = pthread_create(&pool->threads[pool->count],
+					(pthread_attr_t*)NULL,
+					ntfs_compress_worker, pool);
+			if (!err)
+				pool->count++;
+		}
+		if (err) {
+			ntfs_compress_pool_stop(pool);
+			errno = err;
+			ntfs_log_perror("Failed to start compression threads");
+		} else {
+			vol->compress_pool = pool;
+			res = 0;
+		}
+	}
+#else
+	errno = EOPNOTSUPP;
+	ntfs_log_error("Compression threads are not supported\n");
+#endif
+	return (res);
+}
+
+/**
+ * ntfs_set_compress_level - set the compression level
+ * @vol:	volume the files of which are compressed
+ * @level:	level from COMPRESS_LEVEL_MIN (fastest) to
+ *		COMPRESS_LEVEL_MAX (smallest output)
+ *
+ * The level only applies to data written later, the data already
+ * compressed is left as is.
+ *
+ * Return 0 on success and -1 on error with errno set to the error code.
+ */
+
+int ntfs_set_compress_level(ntfs_volume *vol, int level)
+{
+	int res;
+
+	res = -1;
+	if (vol && (level >= COMPRESS_LEVEL_MIN)
+	    && (level <= COMPRESS_LEVEL_MAX)) {
+		vol->compress_level = level;
+		res = 0;
+	} else {
+		errno = EINVAL;
+		ntfs_log_error("Bad compression level %d\n", level);
+	}
+	return (res);
+}
+
+/**
+ * ntfs_compress_dispatch - process independent items in parallel
+ * @vol:	volume the compression threads of which are used
+ * @process:	function processing the item @i of @job
+ * @job:	the items to process
+ * @count:	count of items
+ *
+ * The items are shared by the compression threads and the calling
+ * thread, or all processed in the calling thread when there are no
+ * compression threads. The function returns when all the items have
+ * been processed, so @process has to record its own errors in @job.
+ */
+
+void ntfs_compress_dispatch(ntfs_volume *vol,
+			void (*process)(void *job, int i), void *job, int count)
+{
+	int i;
+
+#ifdef ENABLE_COMPRESS_THREADS
+	if (vol->compress_pool && (count > 1)) {
+		ntfs_compress_parallel(vol->compress_pool,
+					process, job, count);
+		return;
+	}
+#endif
+	for (i=0; i<count; i++)
+		process(job, i);
+}
+
+/**
+ * ntfs_compress_release - stop the compression threads of a volume
+ * @vol:	volume the threads of which are stopped
+ */
+
+void ntfs_compress_release(ntfs_volume *vol)
+{
+#ifdef ENABLE_COMPRESS_THREADS
+	if (vol->compress_pool) {
+		ntfs_compress_pool_stop(vol->compress_pool);
+		vol->compress_pool = (struct COMPRESS_POOL*)NULL;
+	}
+#endif
+}
+
 /*
  *		Compress and write a set of blocks
  *
@@ -1074,14 +1598,15 @@ static s32 ntfs_comp_set(ntfs_attr *na, runlist_element *rl,
 	ntfs_volume *vol;
 	char *outbuf;
 	char *pbuf;
+	struct COMPRESS_JOB job;
 	u32 compsz;
 	s32 written;
 	s32 rounded;
 	unsigned int clsz;
-	u32 p;
 	unsigned int sz;
-	unsigned int bsz;
+	BOOL parallel;
 	BOOL fail;
+	int i;
 	BOOL allzeroes;
 		/* a single compressed zero */
 	static char onezero[] = { 0x01, 0xb0, 0x00, 0x00 } ;
@@ -1093,21 +1618,36 @@ static s32 ntfs_comp_set(ntfs_attr *na, runlist_element *rl,
 	vol = na->ni->vol;
 	written = -1; /* default return */
 	clsz = 1 << vol->cluster_size_bits;
-		/* may need 2 extra bytes per block and 2 more bytes */
+		/* a slot per block, with 4 extra bytes, and 2 more bytes */
 	outbuf = (char*)ntfs_malloc(na->compression_block_size
-			+ 2*(na->compression_block_size/NTFS_SB_SIZE)
+			+ 4*(na->compression_block_size/NTFS_SB_SIZE)
 			+ 2);
-	if (outbuf) {
-		fail = FALSE;
+	job.count = (insz + NTFS_SB_SIZE - 1)/NTFS_SB_SIZE;
+	job.sizes = (unsigned int*)ntfs_malloc(job.count*sizeof(unsigned int));
+	if (outbuf && job.sizes) {
+		job.inbuf = inbuf;
+		job.outbuf = outbuf;
+		job.insz = insz;
+		job.level = &compress_levels[(vol->compress_level
+				? vol->compress_level : COMPRESS_LEVEL_DEFAULT)
+					- COMPRESS_LEVEL_MIN];
+		parallel = FALSE;
+#ifdef ENABLE_COMPRESS_THREADS
+		if (vol->compress_pool && (job.count > 1)) {
+			ntfs_compress_parallel(vol->compress_pool,
+					ntfs_compress_sb, &job, job.count);
+			parallel = TRUE;
+		}
+#endif
+		fail = FALSE;
 		compsz = 0;
 		allzeroes = TRUE;
-		for (p=0; (p<insz) && !fail; p+=NTFS_SB_SIZE) {
-			if ((p + NTFS_SB_SIZE) < insz)
-				bsz = NTFS_SB_SIZE;
-			else
-				bsz = insz - p;
-			pbuf = &outbuf[compsz];
-			sz = ntfs_compress_block(&inbuf[p],bsz,pbuf);
+			/* append the compressed sub-blocks in order */
+		for (i=0; (i<job.count) && !fail; i++) {
+			if (!parallel)
+				ntfs_compress_sb(&job, i);
+			pbuf = &outbuf[i*NTFS_SB_SLOT];
+			sz = job.sizes[i];
 			/* fail if all the clusters (or more) are needed */
 			if (!sz || ((compsz + sz + clsz + 2)
 					 > na->compression_block_size))
@@ -1133,6 +1673,7 @@ static s32 ntfs_comp_set(ntfs_attr *na, runlist_element *rl,
 						break;
 					}
 				}
+			memmove(&outbuf[compsz], pbuf, sz);
 			compsz += sz;
 			}
 		}
@@ -1156,8 +1697,9 @@ static s32 ntfs_comp_set(ntfs_attr *na, runlist_element *rl,
 		} else
 			if (!fail)
 				written = 0;
-		free(outbuf);
 	}
+	free(job.sizes);
+	free(outbuf);
 	return (written);
 }
 
@@ -1429,6 +1971,7 @@ static int ntfs_compress_overwr_free(ntfs_attr *na, runlist_element *rl,
 		*++xrl = *frl; /* terminator */
 	na->compressed_size -= (s64)freed << vol->cluster_size_bits;
 	}
+	ntfs_attr_rl_changed(na);
 	return (res);
 }
 
@@ -1962,3 +2505,910 @@ int ntfs_compressed_close(ntfs_attr *na, runlist_element *wrl, s64 offs,
 		done = FALSE;
 	return (!done);
 }
+
+#ifdef NTFS_TEST
+
+#include <time.h>
+#include <sys/time.h>
+
+#include "dir.h"
+
+/*
+ *		Decompress a compression block the former way
+ *
+ *	This is the byte by byte decoder which ntfs_decompress() replaced,
+ *	kept for checking that both accept the same streams and produce
+ *	the same data. It may read one byte beyond @cb_size and store one
+ *	byte beyond @dest_size, so both buffers need some spare room.
+ */
+
+static int test_decompress_ref(u8 *dest, const u32 dest_size,
+		u8 *const cb_start, const u32 cb_size)
+{
+	u8 *cb_end = cb_start + cb_size;
+	u8 *cb = cb_start;
+	u8 *cb_sb_start;
+	u8 *cb_sb_end;
+	u8 *dest_end = dest + dest_size;
+	u8 *dest_sb_start;
+	u8 *dest_sb_end;
+	u8 tag;
+	int token;
+
+do_next_sb:
+	if (cb == cb_end || !le16_to_cpup((le16*)cb) || dest == dest_end) {
+		if (dest_end > dest)
+			memset(dest, 0, dest_end - dest);
+		return 0;
+	}
+	dest_sb_start = dest;
+	dest_sb_end = dest + NTFS_SB_SIZE;
+	if (dest_sb_end > dest_end)
+		goto return_overflow;
+	if (cb + 6 > cb_end)
+		goto return_overflow;
+	cb_sb_start = cb;
+	cb_sb_end = cb_sb_start + (le16_to_cpup((le16*)cb) & NTFS_SB_SIZE_MASK)
+			+ 3;
+	if (cb_sb_end > cb_end)
+		goto return_overflow;
+	if (!(le16_to_cpup((le16*)cb) & NTFS_SB_IS_COMPRESSED)) {
+		cb += 2;
+		if (cb_sb_end - cb != NTFS_SB_SIZE)
+			goto return_overflow;
+		memcpy(dest, cb, NTFS_SB_SIZE);
+		cb += NTFS_SB_SIZE;
+		dest += NTFS_SB_SIZE;
+		goto do_next_sb;
+	}
+	cb += 2;
+do_next_tag:
+	if (cb == cb_sb_end) {
+		if (dest < dest_sb_end) {
+			memset(dest, 0, dest_sb_end - dest);
+			dest = dest_sb_end;
+		}
+		goto do_next_sb;
+	}
+	if (cb > cb_sb_end || dest > dest_sb_end)
+		goto return_overflow;
+	tag = *cb++;
+	for (token = 0; token < 8; token++, tag >>= 1) {
+		u16 lg, pt, length, max_non_overlap;
+		register u16 i;
+		u8 *dest_back_addr;
+
+		if (cb >= cb_sb_end || dest > dest_sb_end)
+			break;
+		if ((tag & NTFS_TOKEN_MASK) == NTFS_SYMBOL_TOKEN) {
+			*dest++ = *cb++;
+			continue;
+		}
+		if (dest == dest_sb_start)
+			goto return_overflow;
+		lg = 0;
+		for (i = dest - dest_sb_start - 1; i >= 0x10; i >>= 1)
+			lg++;
+		pt = le16_to_cpup((le16*)cb);
+		dest_back_addr = dest - (pt >> (12 - lg)) - 1;
+		if (dest_back_addr < dest_sb_start)
+			goto return_overflow;
+		length = (pt & (0xfff >> lg)) + 3;
+		if (dest + length > dest_sb_end)
+			goto return_overflow;
+		max_non_overlap = dest - dest_back_addr;
+		if (length <= max_non_overlap) {
+			memcpy(dest, dest_back_addr, length);
+			dest += length;
+		} else {
+			memcpy(dest, dest_back_addr, max_non_overlap);
+			dest += max_non_overlap;
+			dest_back_addr += max_non_overlap;
+			length -= max_non_overlap;
+			while (length--)
+				*dest++ = *dest_back_addr++;
+		}
+		cb += 2;
+	}
+	goto do_next_tag;
+return_overflow:
+	errno = EOVERFLOW;
+	return -1;
+}
+
+static u32 test_compress_random(u32 *seed)
+{
+	*seed = *seed*1103515245 + 12345;
+	return ((*seed >> 8) & 0xffffff);
+}
+
+/*
+ *		Fill a buffer with test data
+ *
+ *	The kinds of data are text, short periods, long runs, a random
+ *	mix of random bytes and repeated sequences, and random bytes.
+ */
+
+enum { TEST_TEXT, TEST_PERIODS, TEST_RUNS, TEST_MIX, TEST_RANDOM,
+		TEST_KINDS } ;
+
+static const char *test_compress_kinds[] = {
+	"C source text", "short periods", "long runs",
+	"random mix", "random bytes"
+} ;
+
+static void test_compress_fill(u8 *buf, u32 size, int kind, u32 *seed)
+{
+	static const char *words[] = {
+		"\tif (", "ni", "->", "vol", "na", "return (", ");\n",
+		" = ", "0", "NULL", "}\n", "\t\t", "le16_to_cpu(",
+		"ntfs_attr_pread", "(", ", ", "size", " + ", "int ",
+		"while (", ") {\n", "errno = ", "EIO", "/* ", " */\n",
+		"the ", "inode ", "attribute ", "is ", "not ", "found",
+	} ;
+	u32 pos;
+	u32 len;
+	u32 offs;
+	u32 i;
+
+	pos = 0;
+	while (pos < size) {
+		switch (kind) {
+		case TEST_TEXT :
+			i = test_compress_random(seed)
+				% (sizeof(words)/sizeof(words[0]));
+			len = strlen(words[i]);
+			if (len > (size - pos))
+				len = size - pos;
+			memcpy(&buf[pos], words[i], len);
+			break;
+		case TEST_PERIODS :
+			offs = test_compress_random(seed) % 7 + 2;
+			len = test_compress_random(seed) % 200 + offs;
+			if (len > (size - pos))
+				len = size - pos;
+			for (i=0; i<len; i++)
+				buf[pos + i] = (i < offs
+					? test_compress_random(seed)
+					: buf[pos + i - offs]);
+			break;
+		case TEST_RUNS :
+			len = test_compress_random(seed) % 2000 + 50;
+			if (len > (size - pos))
+				len = size - pos;
+			memset(&buf[pos], test_compress_random(seed) & 3, len);
+			break;
+		case TEST_MIX :
+			len = test_compress_random(seed) % 300 + 1;
+			if (len > (size - pos))
+				len = size - pos;
+			if ((pos > 0) && (test_compress_random(seed) & 1)) {
+				offs = test_compress_random(seed) % pos + 1;
+				for (i=0; i<len; i++)
+					buf[pos + i] = buf[pos + i - offs];
+			} else
+				for (i=0; i<len; i++)
+					buf[pos + i] = test_compress_random(seed)
+							% 16;
+			break;
+		default :
+			len = size - pos;
+			for (i=0; i<len; i++)
+				buf[pos + i] = test_compress_random(seed);
+			break;
+		}
+		pos += len;
+	}
+}
+
+/*
+ *		Build a compression block from data
+ *
+ *	@cb needs room for 4098 bytes per sub-block, plus 4 bytes.
+ *	Returns the size of the compression block, ending with two
+ *	null bytes, or 0 if compression failed.
+ */
+
+static u32 test_compress_build(u8 *cb, const u8 *data, u32 size,
+			const struct COMPRESS_LEVEL *level)
+{
+	char sb[NTFS_SB_SIZE + 4];
+	u32 pos;
+	u32 cbsz;
+	unsigned int bsz;
+	unsigned int sz;
+
+	cbsz = 0;
+	for (pos=0; pos<size; pos+=bsz) {
+		bsz = (size - pos < NTFS_SB_SIZE ? size - pos : NTFS_SB_SIZE);
+		sz = ntfs_compress_block((const char*)&data[pos], bsz,
+					sb, level);
+		if (!sz)
+			return (0);
+		memcpy(&cb[cbsz], sb, sz);
+		cbsz += sz;
+	}
+	cb[cbsz++] = 0;
+	cb[cbsz++] = 0;
+	return (cbsz);
+}
+
+/*
+ *		Build a sub-block with a symbol beyond its end
+ *
+ *	A few symbols are followed by a phrase filling the sub-block,
+ *	then by a symbol, which the former decoder stored beyond the
+ *	sub-block. The stray symbol is the last byte of the sub-block,
+ *	unless @extra is set.
+ */
+
+static u32 test_compress_trailing(u8 *cb, BOOL extra, u32 *seed)
+{
+	u32 k;
+	u32 i;
+	u32 sz;
+	u16 pt;
+
+	k = test_compress_random(seed) % 6 + 1;
+	sz = 2;
+	cb[sz++] = 1 << k;
+	for (i=0; i<k; i++)
+		cb[sz++] = test_compress_random(seed);
+	pt = NTFS_SB_SIZE - k - 3;
+	cb[sz++] = pt & 255;
+	cb[sz++] = pt >> 8;
+	cb[sz++] = test_compress_random(seed);
+	if (extra)
+		cb[sz++] = test_compress_random(seed);
+	cb[0] = (sz - 3) & 255;
+	cb[1] = 0xb0 + (((sz - 3) >> 8) & 15);
+	return (sz);
+}
+
+/*
+ *		Check the decoder against the former one
+ *
+ *	Valid compression blocks of all kinds and levels are damaged in
+ *	various ways and both decoders must give the same result and,
+ *	on success, the same data. Undamaged blocks must decompress to
+ *	the original data. The buffers given to ntfs_decompress() have
+ *	no spare room, so that a memory checker catches overflows.
+ */
+
+static int test_compress_fuzz(int count, u32 seed)
+{
+	u8 *data;
+	u8 *cb;
+	u8 *cbcopy;
+	u8 *ref;
+	u8 *dest;
+	u32 size;
+	u32 cbsz;
+	u32 dsz;
+	u32 pos;
+	u32 i;
+	int kind;
+	int level;
+	int mutation;
+	int rref;
+	int rnew;
+	int n;
+	int ok;
+	int accepted;
+	int errors;
+	u32 levels;
+
+	data = (u8*)ntfs_malloc(65536);
+	cb = (u8*)ntfs_malloc(16*NTFS_SB_SLOT + 4*NTFS_SB_SIZE + 16);
+	ref = (u8*)ntfs_malloc(65536 + 16);
+	if (!data || !cb || !ref) {
+		free(data);
+		free(cb);
+		free(ref);
+		return (1);
+	}
+	levels = ntfs_log_clear_levels(NTFS_LOG_LEVEL_PERROR);
+	ok = 0;
+	accepted = 0;
+	errors = 0;
+	for (n=0; n<count; n++) {
+		kind = test_compress_random(&seed) % TEST_KINDS;
+		level = test_compress_random(&seed)
+				% (COMPRESS_LEVEL_MAX - COMPRESS_LEVEL_MIN + 1);
+		if (test_compress_random(&seed) & 1)
+			size = 65536;
+		else
+			size = test_compress_random(&seed) % 65536 + 1;
+		test_compress_fill(data, size, kind, &seed);
+		cbsz = test_compress_build(cb, data, size,
+					&compress_levels[level]);
+		if (!cbsz) {
+			errors++;
+			break;
+		}
+		dsz = (size + NTFS_SB_SIZE - 1) & ~(NTFS_SB_SIZE - 1);
+		mutation = test_compress_random(&seed) % 7;
+		switch (mutation) {
+		case 1 : /* flip a few bits */
+			i = test_compress_random(&seed) % 8 + 1;
+			while (i--) {
+				pos = test_compress_random(&seed) % cbsz;
+				cb[pos] ^= 1 << (test_compress_random(&seed)
+						% 8);
+			}
+			break;
+		case 2 : /* truncate */
+			cbsz = test_compress_random(&seed) % cbsz + 1;
+			break;
+		case 3 : /* overwrite with random bytes */
+			pos = test_compress_random(&seed) % cbsz;
+			i = test_compress_random(&seed) % 64 + 1;
+			while (i-- && (pos < cbsz))
+				cb[pos++] = test_compress_random(&seed);
+			break;
+		case 4 : /* random stream */
+			cbsz = test_compress_random(&seed)
+					% (4*NTFS_SB_SIZE) + 1;
+			for (i=0; i<cbsz; i++)
+				cb[i] = test_compress_random(&seed);
+			if (test_compress_random(&seed) & 1)
+				cb[1] = 0xb0
+				    + (test_compress_random(&seed) & 15);
+			break;
+		case 5 : /* a symbol beyond the end of a sub-block */
+			pos = test_compress_trailing(cb,
+				!(test_compress_random(&seed) % 4), &seed);
+			i = test_compress_random(&seed) % 3;
+			if (i == 1) {
+				cb[pos++] = 0;
+				cb[pos++] = 0;
+			}
+			if (i == 2)
+				pos += test_compress_build(&cb[pos], data,
+					test_compress_random(&seed)
+						% NTFS_SB_SIZE + 1,
+					&compress_levels[level]);
+			cbsz = pos;
+			dsz = (test_compress_random(&seed) % 3 + 1)
+					*NTFS_SB_SIZE;
+			break;
+		case 6 : /* decompress a part */
+			dsz = (test_compress_random(&seed) % 16 + 1)
+					*NTFS_SB_SIZE;
+			break;
+		default :
+			break;
+		}
+			/* exact buffers for the current decoder */
+		cbcopy = (u8*)ntfs_malloc(cbsz);
+		dest = (u8*)ntfs_malloc(dsz);
+		if (!cbcopy || !dest) {
+			free(cbcopy);
+			free(dest);
+			errors++;
+			break;
+		}
+		memcpy(cbcopy, cb, cbsz);
+		memset(&cb[cbsz], 0, 16);
+		rref = test_decompress_ref(ref, dsz, cb, cbsz);
+		rnew = ntfs_decompress(dest, dsz, cbcopy, cbsz);
+		if ((rref != rnew)
+		    || (!rnew && memcmp(ref, dest, dsz))
+		    || (!mutation && (rnew || memcmp(data, dest, size)))) {
+			if (errors++ < 10)
+				printf("case %d (%s, level %d, mutation %d)"
+					" : former %d, current %d\n",
+					n, test_compress_kinds[kind],
+					level + COMPRESS_LEVEL_MIN,
+					mutation, rref, rnew);
+		} else {
+			ok++;
+			if (!rnew)
+				accepted++;
+		}
+		free(cbcopy);
+		free(dest);
+	}
+	ntfs_log_set_levels(levels & NTFS_LOG_LEVEL_PERROR);
+	printf("%d cases, %d same results (%d accepted), %d differences\n",
+		n, ok, accepted, errors);
+	free(data);
+	free(cb);
+	free(ref);
+	return (errors != 0);
+}
+
+/*
+ *		Compare the speed of the decoder with the former one
+ *
+ *	A 64KB block of each kind of data, or of the beginning of
+ *	a file, compressed at the default level, is decompressed
+ *	repeatedly for about a second by each decoder.
+ */
+
+static int test_compress_speed(const char *name)
+{
+	FILE *f;
+	u8 *data;
+	u8 *cb;
+	u8 *dest;
+	u32 size;
+	u32 cbsz;
+	u32 seed;
+	double secs[2];
+	clock_t start;
+	long count;
+	long i;
+	int kind;
+	int err;
+
+	data = (u8*)ntfs_malloc(65536);
+	cb = (u8*)ntfs_malloc(16*NTFS_SB_SLOT + 16);
+	dest = (u8*)ntfs_malloc(65536 + 16);
+	err = 0;
+	for (kind=0; data && cb && dest && !err && (kind<TEST_KINDS);
+						kind++) {
+		size = 65536;
+		if (name) {
+			f = fopen(name, "rb");
+			size = (f ? fread(data, 1, 65536, f) : 0);
+			if (f)
+				fclose(f);
+			if (!size) {
+				printf("Could not read %s\n", name);
+				err = 1;
+				break;
+			}
+		} else {
+			seed = kind + 1;
+			test_compress_fill(data, size, kind, &seed);
+		}
+		cbsz = test_compress_build(cb, data, size,
+			&compress_levels[COMPRESS_LEVEL_DEFAULT
+					- COMPRESS_LEVEL_MIN]);
+		size = (size + NTFS_SB_SIZE - 1) & ~(NTFS_SB_SIZE - 1);
+		count = 1;
+		do {
+			start = clock();
+			for (i=0; i<count; i++)
+				err |= test_decompress_ref(dest, size,
+							cb, cbsz);
+			secs[0] = (double)(clock() - start)/CLOCKS_PER_SEC;
+			start = clock();
+			for (i=0; i<count; i++)
+				err |= ntfs_decompress(dest, size, cb, cbsz);
+			secs[1] = (double)(clock() - start)/CLOCKS_PER_SEC;
+			count <<= 1;
+		} while (!err && (secs[0] < 1.0) && (secs[1] < 1.0));
+		count >>= 1;
+		printf("%-16s %5.3f ratio, former %7.1f MB/s,"
+				" current %7.1f MB/s\n",
+			(name ? name : test_compress_kinds[kind]),
+			(double)cbsz/size,
+			(secs[0] > 0 ? count*(size/1048576.0)/secs[0] : 0),
+			(secs[1] > 0 ? count*(size/1048576.0)/secs[1] : 0));
+		if (name)
+			break;
+	}
+	if (err)
+		printf("** decompression failed **\n");
+	free(data);
+	free(cb);
+	free(dest);
+	return (err != 0);
+}
+
+static s64 test_compress_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, (struct timezone*)NULL);
+	return ((s64)tv.tv_sec*1000000 + tv.tv_usec);
+}
+
+/*
+ *		Compress data with several counts of threads
+ *
+ *	24MB of text-like data, or the beginning of a file, are compressed
+ *	by 64KB compression blocks as ntfs_comp_set() does, with 1, 2, 4...
+ *	threads up to @max. The compressed data must be the same whatever
+ *	the count of threads, and decompress to the original data.
+ */
+
+static int test_compress_threads(const char *name, int max)
+{
+	struct COMPRESS_JOB job;
+	unsigned int sizes[16];
+	ntfs_volume *vol;
+	FILE *f;
+	u8 *data;
+	u8 *ref;
+	u8 *out;
+	u8 *dest;
+	char *outbuf;
+	u32 size;
+	u32 seed;
+	u32 pos;
+	u32 bsz;
+	u32 compsz;
+	u32 refsz;
+	s64 start;
+	s64 usecs;
+	int threads;
+	int err;
+	int i;
+
+	size = 24*1048576;
+	vol = ntfs_volume_alloc();
+	data = (u8*)ntfs_malloc(size);
+	ref = (u8*)ntfs_malloc(size + size/8);
+	out = (u8*)ntfs_malloc(size + size/8);
+	dest = (u8*)ntfs_malloc(65536);
+	outbuf = (char*)ntfs_malloc(16*NTFS_SB_SLOT);
+	err = !vol || !data || !ref || !out || !dest || !outbuf;
+	if (!err && name) {
+		f = fopen(name, "rb");
+		size = (f ? fread(data, 1, size, f) : 0);
+		if (f)
+			fclose(f);
+		if (!size) {
+			printf("Could not read %s\n", name);
+			err = 1;
+		}
+	} else if (!err) {
+		seed = 1;
+		for (pos=0; pos<size; pos+=65536)
+			test_compress_fill(&data[pos], 65536,
+				((pos >> 16) & 1 ? TEST_MIX : TEST_TEXT),
+				&seed);
+	}
+	refsz = 0;
+	job.inbuf = (const char*)NULL;
+	job.outbuf = outbuf;
+	job.sizes = sizes;
+	job.level = &compress_levels[COMPRESS_LEVEL_DEFAULT
+					- COMPRESS_LEVEL_MIN];
+	for (threads=1; !err && (threads<=max); threads<<=1) {
+		if (ntfs_set_compress_threads(vol, threads)) {
+			err = 1;
+			break;
+		}
+		compsz = 0;
+		start = test_compress_now();
+		for (pos=0; pos<size; pos+=bsz) {
+			bsz = (size - pos < 65536 ? size - pos : 65536);
+			job.inbuf = (const char*)&data[pos];
+			job.insz = bsz;
+			job.count = (bsz + NTFS_SB_SIZE - 1)/NTFS_SB_SIZE;
+			ntfs_compress_dispatch(vol, ntfs_compress_sb,
+						&job, job.count);
+			for (i=0; i<job.count; i++) {
+				memcpy(&out[compsz], &outbuf[i*NTFS_SB_SLOT],
+					sizes[i]);
+				compsz += sizes[i];
+			}
+			out[compsz++] = 0;
+			out[compsz++] = 0;
+		}
+		usecs = test_compress_now() - start;
+		if (threads == 1) {
+				/* check the reference output */
+			memcpy(ref, out, compsz);
+			refsz = compsz;
+			for (pos=0, compsz=0; !err && (pos<size); pos+=bsz) {
+				bsz = (size - pos < 65536 ? size - pos : 65536);
+				for (i=compsz; le16_to_cpup((le16*)&out[i]);
+				    i+=(le16_to_cpup((le16*)&out[i])
+						& NTFS_SB_SIZE_MASK) + 3) { }
+				err = ntfs_decompress(dest, 65536,
+						&out[compsz], i + 2 - compsz)
+					|| memcmp(dest, &data[pos], bsz);
+				compsz = i + 2;
+			}
+			if (err)
+				printf("** data differ after decompression **\n");
+		} else if ((compsz != refsz) || memcmp(out, ref, refsz)) {
+			printf("** compressed data differ with %d threads **\n",
+				threads);
+			err = 1;
+		}
+		printf("%2d threads : %7.1f MB/s, %u bytes compressed"
+				" into %u\n",
+			threads, (usecs > 0 ? size/(double)usecs : 0.0),
+			size, refsz);
+	}
+	if (vol)
+		ntfs_compress_release(vol);
+	free(vol);
+	free(data);
+	free(ref);
+	free(out);
+	free(dest);
+	free(outbuf);
+	return (err != 0);
+}
+
+/*
+ *		Compress data at each level
+ *
+ *	The files, or 4MB of each kind of generated data, are compressed
+ *	by 4KB sub-blocks at each level, every sub-block being checked by
+ *	decompressing it. The speed and the compressed/original ratio are
+ *	reported for each file and level.
+ */
+
+static int test_compress_levels(int count, char *names[])
+{
+	char out[NTFS_SB_SIZE + 4];
+	u8 dest[NTFS_SB_SIZE];
+	FILE *f;
+	u8 *data;
+	u32 size;
+	u32 seed;
+	u32 pos;
+	u32 bsz;
+	u32 compsz;
+	unsigned int sz;
+	double secs;
+	clock_t start;
+	clock_t ticks;
+	int level;
+	int n;
+	int err;
+
+	size = 4*1048576;
+	data = (u8*)ntfs_malloc(size);
+	err = !data;
+	if (!err)
+		printf("%-16s level   MB/s   ratio\n", "");
+	for (n=0; !err && (n<(count ? count : TEST_KINDS - 1)); n++) {
+		if (count) {
+			f = fopen(names[n], "rb");
+			size = (f ? fread(data, 1, 4*1048576, f) : 0);
+			if (f)
+				fclose(f);
+			if (!size) {
+				printf("Could not read %s\n", names[n]);
+				err = 1;
+				break;
+			}
+		} else {
+			seed = n + 1;
+			test_compress_fill(data, size, n, &seed);
+		}
+		for (level=COMPRESS_LEVEL_MIN; !err
+				&& (level<=COMPRESS_LEVEL_MAX); level++) {
+			compsz = 0;
+			ticks = 0;
+			for (pos=0; !err && (pos<size); pos+=bsz) {
+				bsz = (size - pos < NTFS_SB_SIZE
+					? size - pos : NTFS_SB_SIZE);
+				start = clock();
+				sz = ntfs_compress_block((const char*)&data[pos],
+					bsz, out, &compress_levels[level
+						- COMPRESS_LEVEL_MIN]);
+				ticks += clock() - start;
+				compsz += sz;
+				out[sz] = 0;
+				out[sz + 1] = 0;
+				err = !sz || ntfs_decompress(dest, NTFS_SB_SIZE,
+						(u8*)out, sz + 2)
+					|| memcmp(dest, &data[pos], bsz);
+			}
+			secs = (double)ticks/CLOCKS_PER_SEC;
+			printf("%-16s   %d   %7.1f  %5.3f\n",
+				(count ? names[n] : test_compress_kinds[n]),
+				level,
+				(secs > 0 ? size/1048576.0/secs : 0.0),
+				(double)compsz/size);
+		}
+	}
+	if (err)
+		printf("** compression failed **\n");
+	free(data);
+	return (err != 0);
+}
+
+#if CACHE_CBLOCK_SIZE
+
+/*
+ *		Read a compressed file in 4KB chunks
+ *
+ *	The chunks are read sequentially, at random places in the whole
+ *	file, or at random places in its first eight compression blocks,
+ *	and checked against the data written.
+ *
+ *	Returns the count of bad chunks
+ */
+
+static int test_compress_chunks(ntfs_attr *na, const u8 *data, u32 size,
+			int how, int count, u32 seed)
+{
+	u8 buf[4096];
+	u32 pos;
+	u32 span;
+	int bad;
+	int i;
+
+	bad = 0;
+	span = (how == 2 ? 8*na->compression_block_size : size);
+	if (span > size)
+		span = size;
+	for (i=0; i<count; i++) {
+		if (how)
+			pos = (test_compress_random(&seed)
+					% (span/sizeof(buf)))*sizeof(buf);
+		else
+			pos = (i*sizeof(buf)) % (size - sizeof(buf) + 1);
+		if ((ntfs_attr_pread(na, pos, sizeof(buf), buf)
+						!= sizeof(buf))
+		    || memcmp(buf, &data[pos], sizeof(buf)))
+			bad++;
+	}
+	return (bad);
+}
+
+/*
+ *		Read a compressed file with and without the block cache
+ *
+ *	A 24MB compressed file of text and mixed data is created in the
+ *	root directory of a volume, read in 4KB chunks without and with
+ *	the cache of decompressed blocks, then deleted.
+ *
+ *	Returns 0 if the test passed
+ */
+
+static int test_compress_read(const char *name, int count)
+{
+	static const char *hows[] = {
+		"sequential", "random over the file", "random in 8 blocks"
+	} ;
+	static const char fname[] = "ntfs-test-cblock";
+	struct CACHE_HEADER *cache;
+	ntfs_volume *vol;
+	ntfs_inode *root_ni;
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	ntfschar *uname;
+	u8 *data;
+	u32 size;
+	u32 seed;
+	u32 pos;
+	unsigned long reads;
+	unsigned long hits;
+	double secs;
+	clock_t start;
+	int how;
+	int cached;
+	int bad;
+	int len;
+
+	size = 24*1048576;
+	data = (u8*)ntfs_malloc(size);
+	vol = ntfs_mount(name, 0);
+	if (!vol || !data) {
+		printf("Could not mount %s\n", name);
+		free(data);
+		return (1);
+	}
+	seed = 1;
+	for (pos=0; pos<size; pos+=65536)
+		test_compress_fill(&data[pos], 65536,
+			((pos >> 16) & 1 ? TEST_MIX : TEST_TEXT), &seed);
+	bad = 0;
+	cache = vol->cblock_cache;
+	NVolSetCompression(vol);
+	uname = (ntfschar*)NULL;
+	len = ntfs_mbstoucs(fname, &uname);
+	root_ni = ntfs_inode_open(vol, FILE_root);
+	ni = (root_ni && (len > 0)
+			? ntfs_create(root_ni, const_cpu_to_le32(0),
+				uname, len, S_IFREG)
+			: (ntfs_inode*)NULL);
+	na = (ntfs_attr*)NULL;
+	if (ni) {
+		ni->flags |= FILE_ATTR_COMPRESSED;
+		na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	}
+	if (!na || !NAttrCompressed(na)
+	    || (ntfs_attr_pwrite(na, 0, size, data) != size)
+	    || ntfs_attr_pclose(na)) {
+		printf("Could not create the compressed file /%s\n", fname);
+		bad++;
+	}
+		/* reopen, to read as a file already created */
+	if (na) {
+		ntfs_attr_close(na);
+		na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+		if (!na)
+			bad++;
+	}
+	for (how=0; !bad && (how<3); how++) {
+		for (cached=0; cached<2; cached++) {
+			vol->cblock_cache = (cached ? cache
+					: (struct CACHE_HEADER*)NULL);
+			ntfs_compressed_invalidate(na);
+			reads = (cache ? cache->reads : 0);
+			hits = (cache ? cache->hits : 0);
+			start = clock();
+			bad += test_compress_chunks(na, data, size, how,
+					count, 1);
+			secs = (double)(clock() - start)/CLOCKS_PER_SEC;
+			if (cache) {
+				reads = cache->reads - reads;
+				hits = cache->hits - hits;
+			}
+			printf("%-20s %s : %d reads in %.3fs",
+				hows[how], (cached ? "cache   " : "no cache"),
+				count, secs);
+			if (cached)
+				printf(", %lu hits out of %lu\n", hits, reads);
+			else
+				printf("\n");
+		}
+	}
+	vol->cblock_cache = cache;
+	if (bad)
+		printf("** data differ **\n");
+	if (na)
+		ntfs_attr_close(na);
+	if (ni) {
+		/* ntfs_delete() always closes ni and root_ni */
+		if (ntfs_delete(vol, (char*)NULL, ni, root_ni, uname, len))
+			bad++;
+		root_ni = (ntfs_inode*)NULL;
+	}
+	if (root_ni && ntfs_inode_close(root_ni))
+		bad++;
+	free(uname);
+	free(data);
+	if (ntfs_umount(vol, FALSE))
+		bad++;
+	printf("%s\n", (bad ? "** failed **" : "passed"));
+	return (bad != 0);
+}
+
+#endif /* CACHE_CBLOCK_SIZE */
+
+/**
+ * test_compress_main - Compression test: Program start (main)
+ * @argc:
+ * @argv:
+ *
+ * "fuzz [count [seed]]" checks the decoder against the former one,
+ * "speed [file]" compares their speeds, "threads [max [file]]" compares
+ * the speeds of compressing by several threads, "levels [file...]"
+ * compares the compression levels, "read image [count]" reads a
+ * compressed file with and without the cache of decompressed blocks.
+ *
+ * Returns 0 if the test passed
+ */
+int test_compress_main(int argc, char *argv[])
+{
+	int res;
+
+	res = 1;
+	if ((argc >= 2) && (argc <= 4) && !strcmp(argv[1], "fuzz"))
+		res = test_compress_fuzz(argc > 2 ? atoi(argv[2]) : 100000,
+				argc > 3 ? strtoul(argv[3], (char**)NULL, 0)
+					: 1);
+	else if ((argc >= 2) && (argc <= 3) && !strcmp(argv[1], "speed"))
+		res = test_compress_speed(argc > 2 ? argv[2]
+					: (const char*)NULL);
+	else if ((argc >= 2) && (argc <= 4) && !strcmp(argv[1], "threads"))
+		res = test_compress_threads(argc > 3 ? argv[3]
+					: (const char*)NULL,
+				argc > 2 ? atoi(argv[2]) : 4);
+	else if ((argc >= 2) && !strcmp(argv[1], "levels"))
+		res = test_compress_levels(argc - 2, &argv[2]);
+#if CACHE_CBLOCK_SIZE
+	else if ((argc >= 3) && (argc <= 4) && !strcmp(argv[1], "read"))
+		res = test_compress_read(argv[2],
+				argc > 3 ? atoi(argv[3]) : 6144);
+#endif
+	else
+		printf("compress [fuzz|speed|threads|levels|read] {args}\n");
+	return (res);
+}
+
+#endif
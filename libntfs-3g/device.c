@@ -71,6 +71,9 @@
 #ifdef ENABLE_HD
 #include <hd.h>
 #endif
+#ifdef ENABLE_VOLUME_LOCKS
+#include <pthread.h>
+#endif
 
 #include "types.h"
 #include "mst.h"
@@ -138,6 +141,7 @@ struct ntfs_device *ntfs_device_alloc(const char *name, const long state,
 		dev->d_private = priv_data;
 		dev->d_heads = -1;
 		dev->d_sectors_per_track = -1;
+		dev->d_cache = NULL;
 	}
 	return dev;
 }
@@ -163,6 +167,7 @@ int ntfs_device_free(struct ntfs_device *dev)
 		errno = EBUSY;
 		return -1;
 	}
+	ntfs_device_cache_free(dev);
 	free(dev->d_name);
 	free(dev);
 	return 0;
@@ -179,14 +184,880 @@ int ntfs_device_sync(struct ntfs_device *dev)
 	int ret;
 	struct ntfs_device_operations *dops;
 
-	if (NDevDirty(dev)) {
+	ret = 0;
+	if (dev->d_cache && ntfs_device_cache_flush(dev))
+		ret = -1;
+	if (!ret && NDevDirty(dev)) {
 		dops = dev->d_ops;
 		ret = dops->sync(dev);
-	} else
-		ret = 0;
+	}
 	return ret;
 }
 
+/*
+ *		Read from the device, looping on partial reads
+ *
+ *	Same as ntfs_pread(), bypassing the block cache.
+ */
+
+static s64 ntfs_device_pread(struct ntfs_device *dev, const s64 pos,
+			s64 count, void *b)
+{
+	s64 br, total;
+	struct ntfs_device_operations *dops;
+
+	dops = dev->d_ops;
+
+	for (total = 0; count; count -= br, total += br) {
+		br = dops->pread(dev, (char*)b + total, count, pos + total);
+		/* If everything ok, continue. */
+		if (br > 0)
+			continue;
+		/* If EOF or error return number of bytes read. */
+		if (!br || total)
+			return total;
+		/* Nothing read and error, return error status. */
+		return br;
+	}
+	/* Finally, return the number of bytes read. */
+	return total;
+}
+
+/*
+ *		Write to the device, looping on partial writes
+ *
+ *	Same as ntfs_pwrite(), bypassing the block cache, and not
+ *	syncing the device.
+ */
+
+static s64 ntfs_device_pwrite(struct ntfs_device *dev, const s64 pos,
+			s64 count, const void *b)
+{
+	s64 written, total;
+	struct ntfs_device_operations *dops;
+
+	dops = dev->d_ops;
+
+	for (total = 0; count; count -= written, total += written) {
+		written = dops->pwrite(dev, (const char*)b + total, count,
+				       pos + total);
+		/* If everything ok, continue. */
+		if (written > 0)
+			continue;
+		/*
+		 * If nothing written or error return number of bytes written.
+		 */
+		if (!written || total)
+			break;
+		/* Nothing written and error, return error status. */
+		total = written;
+		break;
+	}
+	return total;
+}
+
+/*
+ *		Device block cache
+ *
+ *	An optional cache of fixed size device blocks, between ntfs_pread()
+ *	and ntfs_pwrite() and the device operations, so that the metadata
+ *	which is read over and over ($MFT records, $Bitmap chunks, index
+ *	blocks) does not have to be read again from the device.
+ *
+ *	Requests spanning more than DCACHE_MAX_BLOCKS blocks bypass the
+ *	cache, so that streaming file data does not evict the metadata.
+ *	In a batched read, the consecutive bypassing segments are still
+ *	submitted together to the device.
+ *	The cached copy of overlapping blocks is updated on such writes,
+ *	and dirty blocks are copied over the data read on such reads.
+ *
+ *	When DCACHE_WRITEBACK is set, small writes only update the cache,
+ *	and the dirty blocks are written when evicted or when the device
+ *	is synced. This is disabled on devices mounted with "-o sync".
+ *
+ *	Blocks are evicted in LRU order, or according to the CLOCK
+ *	algorithm (which only has to set a bit on a hit) if DCACHE_CLOCK
+ *	is set.
+ *
+ *	On a read, each run of consecutive missed blocks is read from the
+ *	device in a single request.
+ *
+ *	When the volume is shared by threads, the cache is protected by
+ *	a mutex, which is not held while bypassing requests and missed
+ *	blocks are being read from the device. Missed blocks are only
+ *	inserted into the cache if no write went through the cache while
+ *	they were being read, as their data could be stale. The mutex is
+ *	however held while dirty blocks are written back on eviction.
+ */
+
+#define DCACHE_MAX_BLOCKS 16	/* largest request going through the cache */
+#define DCACHE_MIN_BLOCKS 16	/* smallest cache */
+
+struct DCACHE_BLOCK {
+	s64 blkno;		/* block number, -1 if unused */
+	int hnext;		/* next block in hash chain, -1 if none */
+	int prev;		/* previous block in LRU list */
+	int next;		/* next block in LRU list */
+	u32 length;		/* valid bytes, less than a block at device end */
+	u8 dirty;
+	u8 referenced;		/* CLOCK reference bit */
+} ;
+
+struct DEVICE_CACHE {
+	u8 *data;
+	struct DCACHE_BLOCK *blocks;
+	int *hash;
+	int hash_mask;
+	int count;
+	u32 block_size;
+	int block_size_bits;
+	int mru;		/* most recently used block */
+	int lru;		/* least recently used block */
+	int hand;		/* CLOCK hand */
+	int dirty;		/* count of dirty blocks */
+	s64 writes;		/* count of writes through the cache */
+	struct ntfs_device_cache_stats stats;
+#ifdef ENABLE_VOLUME_LOCKS
+	pthread_mutex_t mutex;
+#endif
+} ;
+
+static void ntfs_dcache_lock(struct DEVICE_CACHE *cache
+			__attribute__((unused)))
+{
+#ifdef ENABLE_VOLUME_LOCKS
+	pthread_mutex_lock(&cache->mutex);
+#endif
+}
+
+static void ntfs_dcache_unlock(struct DEVICE_CACHE *cache
+			__attribute__((unused)))
+{
+#ifdef ENABLE_VOLUME_LOCKS
+	pthread_mutex_unlock(&cache->mutex);
+#endif
+}
+
+static int ntfs_dcache_hash(const struct DEVICE_CACHE *cache, s64 blkno)
+{
+	return ((int)(blkno ^ (blkno >> 16)) & cache->hash_mask);
+}
+
+/*
+ *		Locate a cached block
+ *
+ *	Returns the index of the block, or -1 if it is not cached
+ */
+
+static int ntfs_dcache_find(const struct DEVICE_CACHE *cache, s64 blkno)
+{
+	int i;
+
+	i = cache->hash[ntfs_dcache_hash(cache, blkno)];
+	while ((i >= 0) && (cache->blocks[i].blkno != blkno))
+		i = cache->blocks[i].hnext;
+	return (i);
+}
+
+static void ntfs_dcache_unhash(struct DEVICE_CACHE *cache, int i)
+{
+	int *pi;
+
+	pi = &cache->hash[ntfs_dcache_hash(cache, cache->blocks[i].blkno)];
+	while ((*pi >= 0) && (*pi != i))
+		pi = &cache->blocks[*pi].hnext;
+	if (*pi == i)
+		*pi = cache->blocks[i].hnext;
+	cache->blocks[i].blkno = -1;
+	cache->blocks[i].hnext = -1;
+}
+
+static void ntfs_dcache_enhash(struct DEVICE_CACHE *cache, int i, s64 blkno)
+{
+	int h;
+
+	h = ntfs_dcache_hash(cache, blkno);
+	cache->blocks[i].blkno = blkno;
+	cache->blocks[i].hnext = cache->hash[h];
+	cache->hash[h] = i;
+}
+
+/*
+ *		Record an access to a block
+ */
+
+static void ntfs_dcache_touch(struct DEVICE_CACHE *cache, int i)
+{
+	struct DCACHE_BLOCK *blk;
+
+	blk = &cache->blocks[i];
+	if (cache->stats.flags & DCACHE_CLOCK)
+		blk->referenced = 1;
+	else
+		if (cache->mru != i) {
+			/* unlink, knowing i is not the head */
+			cache->blocks[blk->prev].next = blk->next;
+			if (blk->next >= 0)
+				cache->blocks[blk->next].prev = blk->prev;
+			else
+				cache->lru = blk->prev;
+			/* insert as head */
+			blk->prev = -1;
+			blk->next = cache->mru;
+			cache->blocks[cache->mru].prev = i;
+			cache->mru = i;
+		}
+}
+
+static void ntfs_dcache_clean(struct DEVICE_CACHE *cache, int i)
+{
+	if (cache->blocks[i].dirty) {
+		cache->blocks[i].dirty = 0;
+		cache->dirty--;
+	}
+}
+
+static void ntfs_dcache_mark_dirty(struct DEVICE_CACHE *cache, int i)
+{
+	if (!cache->blocks[i].dirty) {
+		cache->blocks[i].dirty = 1;
+		cache->dirty++;
+	}
+}
+
+/*
+ *		Write a dirty block to the device
+ *
+ *	Returns zero if successful
+ */
+
+static int ntfs_dcache_writeback(struct ntfs_device *dev, int i)
+{
+	struct DEVICE_CACHE *cache;
+	struct DCACHE_BLOCK *blk;
+	s64 written;
+
+	cache = dev->d_cache;
+	blk = &cache->blocks[i];
+	written = ntfs_device_pwrite(dev, blk->blkno << cache->block_size_bits,
+			blk->length, cache->data
+				+ ((s64)i << cache->block_size_bits));
+	if (written != (s64)blk->length) {
+		if (written >= 0)
+			errno = EIO;
+		ntfs_log_perror("Failed to write back cached block %lld",
+				(long long)blk->blkno);
+		return (-1);
+	}
+	cache->stats.writebacks++;
+	ntfs_dcache_clean(cache, i);
+	return (0);
+}
+
+/*
+ *		Get a block to be reused, writing it back if dirty
+ *
+ *	The block is unhashed, and it is not marked as used.
+ *	Returns the index of the block, or -1 if writing back failed
+ */
+
+static int ntfs_dcache_victim(struct ntfs_device *dev)
+{
+	struct DEVICE_CACHE *cache;
+	int i;
+
+	cache = dev->d_cache;
+	if (cache->stats.flags & DCACHE_CLOCK) {
+		i = cache->hand;
+		while (cache->blocks[i].referenced) {
+			cache->blocks[i].referenced = 0;
+			i = (i + 1 < cache->count ? i + 1 : 0);
+		}
+		cache->hand = (i + 1 < cache->count ? i + 1 : 0);
+	} else
+		i = cache->lru;
+	if (cache->blocks[i].dirty && ntfs_dcache_writeback(dev, i))
+		return (-1);
+	if (cache->blocks[i].blkno >= 0)
+		ntfs_dcache_unhash(cache, i);
+	return (i);
+}
+
+/*
+ *		Read a block from the device into the cache
+ *
+ *	Returns the index of the block,
+ *		-1 if there was an error (errno set)
+ *		-2 if the block is beyond the end of the device
+ */
+
+static int ntfs_dcache_fill(struct ntfs_device *dev, s64 blkno)
+{
+	struct DEVICE_CACHE *cache;
+	s64 br;
+	int i;
+
+	cache = dev->d_cache;
+	i = ntfs_dcache_victim(dev);
+	if (i >= 0) {
+		br = ntfs_device_pread(dev, blkno << cache->block_size_bits,
+			cache->block_size,
+			cache->data + ((s64)i << cache->block_size_bits));
+		if (br > 0) {
+			cache->blocks[i].length = br;
+			ntfs_dcache_enhash(cache, i, blkno);
+		} else
+			i = (br ? -1 : -2);
+	}
+	return (i);
+}
+
+/*
+ *		Apply a bypassing request to a cached block
+ *
+ *	When @read is set, the cached data is copied to the buffer if
+ *	the block is dirty, otherwise the written data is copied to the
+ *	cache, and the block is marked clean if fully overwritten.
+ */
+
+static void ntfs_dcache_overlap_block(struct DEVICE_CACHE *cache, int i,
+			s64 pos, s64 count, const void *b, BOOL read)
+{
+	struct DCACHE_BLOCK *blk;
+	s64 start, end;
+	u8 *data;
+
+	blk = &cache->blocks[i];
+	start = blk->blkno << cache->block_size_bits;
+	end = start + blk->length;
+	if (start < pos)
+		start = pos;
+	if (end > (pos + count))
+		end = pos + count;
+	if (start < end) {
+		data = cache->data + ((s64)i << cache->block_size_bits)
+				+ (start & (cache->block_size - 1));
+		if (read) {
+			if (blk->dirty)
+				memcpy((char*)b + (start - pos), data,
+					end - start);
+		} else {
+			memcpy(data, (const char*)b + (start - pos),
+					end - start);
+			if (!(start & (cache->block_size - 1))
+			    && ((end - start) == blk->length))
+				ntfs_dcache_clean(cache, i);
+		}
+	}
+}
+
+/*
+ *		Apply a bypassing request to the cached blocks
+ *
+ *	The blocks in the range are looked up, unless there are more
+ *	of them than blocks in the cache.
+ */
+
+static void ntfs_dcache_overlap(struct DEVICE_CACHE *cache, s64 pos,
+			s64 count, const void *b, BOOL read)
+{
+	s64 first, last;
+	s64 blkno;
+	int i;
+
+	first = pos >> cache->block_size_bits;
+	last = (pos + count - 1) >> cache->block_size_bits;
+	if ((last - first) < cache->count) {
+		for (blkno=first; blkno<=last; blkno++) {
+			i = ntfs_dcache_find(cache, blkno);
+			if (i >= 0)
+				ntfs_dcache_overlap_block(cache, i,
+						pos, count, b, read);
+		}
+	} else {
+		for (i=0; i<cache->count; i++)
+			if ((cache->blocks[i].blkno >= first)
+			    && (cache->blocks[i].blkno <= last))
+				ntfs_dcache_overlap_block(cache, i,
+						pos, count, b, read);
+	}
+}
+
+/*
+ *		Read a run of missed blocks
+ *
+ *	The blocks are read from the device in a single request, without
+ *	holding the cache lock, and they are inserted into the cache
+ *	unless they have been cached or written meanwhile. The part of
+ *	the blocks from @pos, up to @count bytes, is copied to @b.
+ *
+ *	Must be called with the cache locked, which it is on return.
+ *	Returns the count of bytes copied, which is lower than requested
+ *	if the end of the device was reached, or -1 if there was an
+ *	error (errno set)
+ */
+
+static s64 ntfs_dcache_read_run(struct ntfs_device *dev, s64 blkno, int n,
+			s64 pos, s64 count, char *b)
+{
+	struct DEVICE_CACHE *cache;
+	u8 *buf;
+	u8 *data;
+	s64 writes;
+	s64 total;
+	s64 br;
+	u32 length;
+	u32 ofs;
+	u32 len;
+	int i;
+	int k;
+
+	cache = dev->d_cache;
+	buf = (u8*)ntfs_malloc((s64)n << cache->block_size_bits);
+	if (!buf)
+		return (-1);
+	writes = cache->writes;
+	ntfs_dcache_unlock(cache);
+	br = ntfs_device_pread(dev, blkno << cache->block_size_bits,
+			(s64)n << cache->block_size_bits, buf);
+	ntfs_dcache_lock(cache);
+	if (br > 0) {
+		total = 0;
+		ofs = pos & (cache->block_size - 1);
+		for (k=0; (k<n) && count
+				&& (((s64)k << cache->block_size_bits) < br); k++) {
+			data = buf + ((s64)k << cache->block_size_bits);
+			length = cache->block_size;
+			if (length > (br - ((s64)k << cache->block_size_bits)))
+				length = br - ((s64)k << cache->block_size_bits);
+			i = ntfs_dcache_find(cache, blkno + k);
+			if (i >= 0)
+				length = cache->blocks[i].length;
+			else
+				if (writes == cache->writes) {
+					i = ntfs_dcache_victim(dev);
+					if (i >= 0) {
+						memcpy(cache->data + ((s64)i
+						    << cache->block_size_bits),
+						    data, length);
+						cache->blocks[i].length = length;
+						ntfs_dcache_enhash(cache, i,
+								blkno + k);
+					}
+				}
+			if (i >= 0) {
+				ntfs_dcache_touch(cache, i);
+				data = cache->data
+					+ ((s64)i << cache->block_size_bits);
+			}
+			if (ofs >= length)
+				break;
+			len = length - ofs;
+			if (len > count)
+				len = count;
+			memcpy(b + total, data + ofs, len);
+			total += len;
+			count -= len;
+			ofs = 0;
+		}
+		br = total;
+	}
+	free(buf);
+	return (br);
+}
+
+/*
+ *		Read through the cache
+ */
+
+static s64 ntfs_dcache_pread(struct ntfs_device *dev, s64 pos, s64 count,
+			void *b)
+{
+	struct DEVICE_CACHE *cache;
+	struct DCACHE_BLOCK *blk;
+	s64 blkno;
+	s64 last;
+	s64 total;
+	s64 br;
+	u32 ofs;
+	u32 len;
+	int i;
+	int n;
+
+	cache = dev->d_cache;
+	blkno = pos >> cache->block_size_bits;
+	last = (pos + count - 1) >> cache->block_size_bits;
+	if ((last - blkno) >= DCACHE_MAX_BLOCKS) {
+		br = ntfs_device_pread(dev, pos, count, b);
+		ntfs_dcache_lock(cache);
+		cache->stats.bypassed++;
+		if ((br > 0) && cache->dirty)
+			ntfs_dcache_overlap(cache, pos, br, b, TRUE);
+		ntfs_dcache_unlock(cache);
+		return (br);
+	}
+	total = 0;
+	ntfs_dcache_lock(cache);
+	while (count) {
+		ofs = pos & (cache->block_size - 1);
+		i = ntfs_dcache_find(cache, blkno);
+		if (i < 0) {
+			/* read all the following missed blocks at once */
+			n = 1;
+			while (((blkno + n) <= last)
+			    && (ntfs_dcache_find(cache, blkno + n) < 0))
+				n++;
+			cache->stats.misses += n;
+			br = ntfs_dcache_read_run(dev, blkno, n, pos, count,
+					(char*)b + total);
+			if (br <= 0) {
+				if (br && !total)
+					total = -1;
+				break;
+			}
+			total += br;
+			pos += br;
+			count -= br;
+			blkno += n;
+			if (count
+			    && (br < (((s64)n << cache->block_size_bits) - ofs)))
+				break;
+		} else {
+			cache->stats.hits++;
+			len = cache->block_size - ofs;
+			if (len > count)
+				len = count;
+			ntfs_dcache_touch(cache, i);
+			blk = &cache->blocks[i];
+			if (ofs >= blk->length)
+				break;
+			if (len > (blk->length - ofs))
+				len = blk->length - ofs;
+			memcpy((char*)b + total, cache->data
+				+ ((s64)i << cache->block_size_bits) + ofs, len);
+			total += len;
+			pos += len;
+			count -= len;
+			blkno++;
+		}
+	}
+	ntfs_dcache_unlock(cache);
+	return (total);
+}
+
+/*
+ *		Batched read through the cache
+ *
+ *	The consecutive segments which bypass the cache are submitted
+ *	together by the preadv method of the device, and the dirty
+ *	cached blocks are copied over them. The other segments are read
+ *	through the cache in sequence.
+ *
+ *	Returns the count of bytes read up to the first segment which
+ *	could not be fully read, or -1 if nothing could be read
+ */
+
+static s64 ntfs_dcache_preadv(struct ntfs_device *dev,
+			const struct ntfs_device_iovec *iov, int iovcnt)
+{
+	struct DEVICE_CACHE *cache;
+	s64 total;
+	s64 size;
+	s64 done;
+	s64 br;
+	int i;
+	int k;
+	int n;
+
+	cache = dev->d_cache;
+	total = 0;
+	for (i=0; i<iovcnt; i+=n) {
+		size = 0;
+		for (n=0; ((i + n) < iovcnt)
+		    && ((((iov[i + n].pos + iov[i + n].count - 1)
+				>> cache->block_size_bits)
+			- (iov[i + n].pos >> cache->block_size_bits))
+				>= DCACHE_MAX_BLOCKS); n++)
+			size += iov[i + n].count;
+		if (n) {
+			br = dev->d_ops->preadv(dev, &iov[i], n);
+			ntfs_dcache_lock(cache);
+			cache->stats.bypassed += n;
+			if ((br > 0) && cache->dirty) {
+				done = 0;
+				for (k=0; (k<n) && (done<br); k++) {
+					ntfs_dcache_overlap(cache, iov[i + k].pos,
+						(iov[i + k].count < (br - done)
+						    ? iov[i + k].count
+						    : br - done),
+						iov[i + k].buf, TRUE);
+					done += iov[i + k].count;
+				}
+			}
+			ntfs_dcache_unlock(cache);
+		} else {
+			n = 1;
+			size = iov[i].count;
+			br = (size ? ntfs_dcache_pread(dev, iov[i].pos, size,
+					iov[i].buf) : 0);
+		}
+		if (br < 0)
+			return (total ? total : br);
+		total += br;
+		if (br < size)
+			break;
+	}
+	return (total);
+}
+
+/*
+ *		Write through the cache
+ */
+
+static s64 ntfs_dcache_pwrite(struct ntfs_device *dev, s64 pos, s64 count,
+			const void *b)
+{
+	struct DEVICE_CACHE *cache;
+	struct DCACHE_BLOCK *blk;
+	s64 blkno;
+	s64 total;
+	s64 written;
+	u32 ofs;
+	u32 len;
+	int i;
+
+	cache = dev->d_cache;
+	blkno = pos >> cache->block_size_bits;
+	total = 0;
+	if ((cache->stats.flags & DCACHE_WRITEBACK)
+	    && !NDevSync(dev)
+	    && ((((pos + count - 1) >> cache->block_size_bits) - blkno)
+			< DCACHE_MAX_BLOCKS)) {
+		ntfs_dcache_lock(cache);
+		while (count) {
+			ofs = pos & (cache->block_size - 1);
+			len = cache->block_size - ofs;
+			if (len > count)
+				len = count;
+			i = ntfs_dcache_find(cache, blkno);
+			if ((i < 0) && !ofs && (len == cache->block_size)) {
+				/* full block, no need to read it */
+				i = ntfs_dcache_victim(dev);
+				if (i >= 0) {
+					cache->blocks[i].length = len;
+					ntfs_dcache_enhash(cache, i, blkno);
+				}
+			} else
+				if (i < 0)
+					i = ntfs_dcache_fill(dev, blkno);
+			if (i < 0)
+				break;
+			blk = &cache->blocks[i];
+			if (ofs > blk->length)
+				break;
+			ntfs_dcache_touch(cache, i);
+			memcpy(cache->data + ((s64)i << cache->block_size_bits)
+					+ ofs, (const char*)b + total, len);
+			if ((ofs + len) > blk->length)
+				blk->length = ofs + len;
+			ntfs_dcache_mark_dirty(cache, i);
+			total += len;
+			pos += len;
+			count -= len;
+			blkno++;
+		}
+		cache->writes++;
+		ntfs_dcache_unlock(cache);
+		/* anything which could not be cached is written directly */
+		if (!count)
+			return (total);
+	} else {
+		ntfs_dcache_lock(cache);
+		cache->stats.bypassed++;
+		ntfs_dcache_unlock(cache);
+	}
+	written = ntfs_device_pwrite(dev, pos, count, (const char*)b + total);
+	if (written > 0) {
+		ntfs_dcache_lock(cache);
+		cache->writes++;
+		ntfs_dcache_overlap(cache, pos, written,
+				(const char*)b + total, FALSE);
+		ntfs_dcache_unlock(cache);
+		total += written;
+	}
+	return (total ? total : written);
+}
+
+/**
+ * ntfs_device_cache_init - set up a block cache for a device
+ * @dev:	device to cache
+ * @size:	size of the cache in bytes, zero to remove the cache
+ * @block_size:	size of the cached blocks, a power of two
+ * @flags:	DCACHE_WRITEBACK and/or DCACHE_CLOCK
+ *
+ * Set up a cache of @size bytes for the device @dev, replacing the current
+ * cache if any (dirty blocks are written first). This is generally done
+ * right after mounting, according to the mount options.
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_device_cache_init(struct ntfs_device *dev, s64 size,
+		u32 block_size, int flags)
+{
+	struct DEVICE_CACHE *cache;
+	int count;
+	int buckets;
+	int bits;
+	int i;
+
+	if (!dev || (size < 0) || (block_size < NTFS_BLOCK_SIZE)
+	    || (block_size & (block_size - 1))) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (dev->d_cache) {
+		if (ntfs_device_cache_flush(dev))
+			return (-1);
+		ntfs_device_cache_free(dev);
+	}
+	if (!size)
+		return (0);
+	for (bits=0; (1U << bits) < block_size; bits++) { }
+	count = size >> bits;
+	if (count < DCACHE_MIN_BLOCKS)
+		count = DCACHE_MIN_BLOCKS;
+	for (buckets=1; buckets < 2*count; buckets <<= 1) { }
+	cache = (struct DEVICE_CACHE*)ntfs_calloc(sizeof(struct DEVICE_CACHE));
+	if (!cache)
+		return (-1);
+	cache->data = (u8*)ntfs_malloc((s64)count << bits);
+	cache->blocks = (struct DCACHE_BLOCK*)
+			ntfs_malloc(count*sizeof(struct DCACHE_BLOCK));
+	cache->hash = (int*)ntfs_malloc(buckets*sizeof(int));
+	if (!cache->data || !cache->blocks || !cache->hash) {
+		free(cache->data);
+		free(cache->blocks);
+		free(cache->hash);
+		free(cache);
+		return (-1);
+	}
+	for (i=0; i<buckets; i++)
+		cache->hash[i] = -1;
+	for (i=0; i<count; i++) {
+		cache->blocks[i].blkno = -1;
+		cache->blocks[i].hnext = -1;
+		cache->blocks[i].prev = i - 1;
+		cache->blocks[i].next = (i + 1 < count ? i + 1 : -1);
+		cache->blocks[i].length = 0;
+		cache->blocks[i].dirty = 0;
+		cache->blocks[i].referenced = 0;
+	}
+	cache->hash_mask = buckets - 1;
+	cache->count = count;
+	cache->block_size = block_size;
+	cache->block_size_bits = bits;
+	cache->mru = 0;
+	cache->lru = count - 1;
+	cache->hand = 0;
+	cache->dirty = 0;
+	cache->writes = 0;
+	cache->stats.blocks = count;
+	cache->stats.block_size = block_size;
+	cache->stats.flags = flags & (DCACHE_WRITEBACK | DCACHE_CLOCK);
+#ifdef ENABLE_VOLUME_LOCKS
+	pthread_mutex_init(&cache->mutex, (pthread_mutexattr_t*)NULL);
+#endif
+	dev->d_cache = cache;
+	ntfs_log_debug("Device cache of %d blocks of %u bytes\n",
+			count, (unsigned int)block_size);
+	return (0);
+}
+
+/**
+ * ntfs_device_cache_flush - write the dirty cached blocks to the device
+ * @dev:	device whose cache is to be flushed
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_device_cache_flush(struct ntfs_device *dev)
+{
+	struct DEVICE_CACHE *cache;
+	int err;
+	int i;
+
+	err = 0;
+	cache = dev->d_cache;
+	if (cache) {
+		ntfs_dcache_lock(cache);
+		if (cache->dirty && NDevReadOnly(dev)) {
+			errno = EROFS;
+			err = -1;
+		} else if (cache->dirty) {
+			NDevSetDirty(dev);
+			for (i=0; i<cache->count; i++)
+				if (cache->blocks[i].dirty
+				    && ntfs_dcache_writeback(dev, i))
+					err = -1;
+		}
+		ntfs_dcache_unlock(cache);
+	}
+	return (err);
+}
+
+/**
+ * ntfs_device_cache_free - release the block cache of a device
+ * @dev:	device whose cache is to be released
+ *
+ * Dirty blocks are not written, ntfs_device_cache_flush() has to be
+ * called first if needed.
+ */
+void ntfs_device_cache_free(struct ntfs_device *dev)
+{
+	struct DEVICE_CACHE *cache;
+
+	cache = dev->d_cache;
+	if (cache) {
+		if (cache->dirty)
+			ntfs_log_error("Discarding %d dirty cached blocks\n",
+					cache->dirty);
+		ntfs_log_debug("Device cache: %llu hits %llu misses"
+				" %llu bypassed %llu writebacks\n",
+				(unsigned long long)cache->stats.hits,
+				(unsigned long long)cache->stats.misses,
+				(unsigned long long)cache->stats.bypassed,
+				(unsigned long long)cache->stats.writebacks);
+#ifdef ENABLE_VOLUME_LOCKS
+		pthread_mutex_destroy(&cache->mutex);
+#endif
+		free(cache->data);
+		free(cache->blocks);
+		free(cache->hash);
+		free(cache);
+		dev->d_cache = NULL;
+	}
+}
+
+/**
+ * ntfs_device_cache_stats - get the counters of the block cache of a device
+ * @dev:	device whose cache is queried
+ * @stats:	returned counters
+ *
+ * Return 0 on success or -1 with errno set to ENOENT if the device has
+ * no cache.
+ */
+int ntfs_device_cache_stats(struct ntfs_device *dev,
+		struct ntfs_device_cache_stats *stats)
+{
+	if (!dev->d_cache) {
+		errno = ENOENT;
+		return (-1);
+	}
+	ntfs_dcache_lock(dev->d_cache);
+	*stats = dev->d_cache->stats;
+	ntfs_dcache_unlock(dev->d_cache);
+	return (0);
+}
+
 /**
  * ntfs_pread - positioned read from disk
  * @dev:	device to read from
@@ -195,7 +1066,8 @@ int ntfs_device_sync(struct ntfs_device *dev)
  * @b:		output data buffer
  *
  * This function will read @count bytes from device @dev at position @pos into
- * the data buffer @b.
+ * the data buffer @b. If the device has a block cache, small reads are
+ * served from it.
  *
  * On success, return the number of successfully read bytes. If this number is
  * lower than @count this means that we have either reached end of file or
@@ -208,9 +1080,6 @@ int ntfs_device_sync(struct ntfs_device *dev)
  */
 s64 ntfs_pread(struct ntfs_device *dev, const s64 pos, s64 count, void *b)
 {
-	s64 br, total;
-	struct ntfs_device_operations *dops;
-
 	ntfs_log_trace("pos %lld, count %lld\n",(long long)pos,(long long)count);
 	
 	if (!b || count < 0 || pos < 0) {
@@ -219,22 +1088,9 @@ s64 ntfs_pread(struct ntfs_device *dev, const s64 pos, s64 count, void *b)
 	}
 	if (!count)
 		return 0;
-	
-	dops = dev->d_ops;
-
-	for (total = 0; count; count -= br, total += br) {
-		br = dops->pread(dev, (char*)b + total, count, pos + total);
-		/* If everything ok, continue. */
-		if (br > 0)
-			continue;
-		/* If EOF or error return number of bytes read. */
-		if (!br || total)
-			return total;
-		/* Nothing read and error, return error status. */
-		return br;
-	}
-	/* Finally, return the number of bytes read. */
-	return total;
+	if (dev->d_cache)
+		return (ntfs_dcache_pread(dev, pos, count, b));
+	return (ntfs_device_pread(dev, pos, count, b));
 }
 
 /**
@@ -245,7 +1101,8 @@ s64 ntfs_pread(struct ntfs_device *dev, const s64 pos, s64 count, void *b)
  * @b:		data buffer to write to disk
  *
  * This function will write @count bytes from data buffer @b to the device @dev
- * at position @pos.
+ * at position @pos. If the device has a write-back block cache, small writes
+ * are only stored into the cache until the device is synced.
  *
  * On success, return the number of successfully written bytes. If this number
  * is lower than @count this means that the write has been interrupted in
@@ -259,7 +1116,7 @@ s64 ntfs_pread(struct ntfs_device *dev, const s64 pos, s64 count, void *b)
 s64 ntfs_pwrite(struct ntfs_device *dev, const s64 pos, s64 count,
 		const void *b)
 {
-	s64 written, total, ret = -1;
+	s64 total, ret = -1;
 	struct ntfs_device_operations *dops;
 
 	ntfs_log_trace("pos %lld, count %lld\n",(long long)pos,(long long)count);
@@ -278,21 +1135,10 @@ s64 ntfs_pwrite(struct ntfs_device *dev, const s64 pos, s64 count,
 	dops = dev->d_ops;
 
 	NDevSetDirty(dev);
-	for (total = 0; count; count -= written, total += written) {
-		written = dops->pwrite(dev, (const char*)b + total, count,
-				       pos + total);
-		/* If everything ok, continue. */
-		if (written > 0)
-			continue;
-		/*
-		 * If nothing written or error return number of bytes written.
-		 */
-		if (!written || total)
-			break;
-		/* Nothing written and error, return error status. */
-		total = written;
-		break;
-	}
+	if (dev->d_cache)
+		total = ntfs_dcache_pwrite(dev, pos, count, b);
+	else
+		total = ntfs_device_pwrite(dev, pos, count, b);
 	if (NDevSync(dev) && total && dops->sync(dev)) {
 		total--; /* on sync error, return partially written */
 	}
@@ -301,6 +1147,137 @@ out:
 	return ret;
 }
 
+/**
+ * ntfs_device_fd - get a file descriptor for reading the device directly
+ * @dev:	device to get the file descriptor of
+ *
+ * Return the file descriptor through which the device @dev may be read
+ * by the system calls, bypassing the device operations. This is only
+ * possible when the device operations define an fd method, and when there
+ * is no block cache, as the cache may hold blocks not yet written.
+ *
+ * On error, return -1 with errno set to EOPNOTSUPP.
+ */
+int ntfs_device_fd(struct ntfs_device *dev)
+{
+	if (!dev->d_ops->fd || dev->d_cache) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	return (dev->d_ops->fd(dev));
+}
+
+/**
+ * ntfs_preadv - batched positioned read from disk
+ * @dev:	device to read from
+ * @iov:	segments to read
+ * @iovcnt:	number of segments
+ *
+ * This function will read each segment of @iov, that is @iov[i].count bytes
+ * at position @iov[i].pos on device @dev into the buffer @iov[i].buf. When
+ * the device operations have a preadv method, the whole batch is submitted
+ * at once, except the segments small enough to go through the block cache
+ * of the device, if any. Otherwise the segments are read in sequence.
+ *
+ * On success, return the number of bytes read from the start of the batch
+ * until the first segment which could not be fully read. This is lower than
+ * the total size of the segments if the end of the device was reached or if
+ * an error was encountered.
+ *
+ * On error and nothing has been read, return -1 with errno set appropriately.
+ */
+s64 ntfs_preadv(struct ntfs_device *dev, const struct ntfs_device_iovec *iov,
+		int iovcnt)
+{
+	s64 br, total;
+	int i;
+
+	if (!iov || iovcnt < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (dev->d_ops->preadv)
+		return (dev->d_cache
+			? ntfs_dcache_preadv(dev, iov, iovcnt)
+			: dev->d_ops->preadv(dev, iov, iovcnt));
+	total = 0;
+	for (i=0; i<iovcnt; i++) {
+		br = ntfs_pread(dev, iov[i].pos, iov[i].count, iov[i].buf);
+		if (br < 0)
+			return (total ? total : br);
+		total += br;
+		if (br < iov[i].count)
+			break;
+	}
+	return (total);
+}
+
+/**
+ * ntfs_pwritev - batched positioned write to disk
+ * @dev:	device to write to
+ * @iov:	segments to write
+ * @iovcnt:	number of segments
+ *
+ * This function will write each segment of @iov, that is @iov[i].count bytes
+ * from the buffer @iov[i].buf to position @iov[i].pos on device @dev. When
+ * the device operations have a pwritev method and there is no block cache,
+ * the whole batch is submitted at once, otherwise the segments are written
+ * in sequence. On a device opened for synchronous writing, the device is
+ * only synced once, after the whole batch has been written.
+ *
+ * On success, return the number of bytes written from the start of the
+ * batch until the first segment which could not be fully written.
+ *
+ * On error and nothing has been written, return -1 with errno set
+ * appropriately.
+ */
+s64 ntfs_pwritev(struct ntfs_device *dev, const struct ntfs_device_iovec *iov,
+		int iovcnt)
+{
+	s64 written, total;
+	int i;
+
+	if (!iov || iovcnt < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (NDevReadOnly(dev)) {
+		errno = EROFS;
+		return -1;
+	}
+	NDevSetDirty(dev);
+	if (!dev->d_cache && dev->d_ops->pwritev)
+		total = dev->d_ops->pwritev(dev, iov, iovcnt);
+	else {
+		total = 0;
+		for (i=0; i<iovcnt; i++) {
+			if (!iov[i].buf || (iov[i].count < 0)
+			    || (iov[i].pos < 0)) {
+				errno = EINVAL;
+				written = -1;
+			} else if (!iov[i].count)
+				written = 0;
+			else if (dev->d_cache)
+				written = ntfs_dcache_pwrite(dev, iov[i].pos,
+						iov[i].count, iov[i].buf);
+			else
+				written = ntfs_device_pwrite(dev, iov[i].pos,
+						iov[i].count, iov[i].buf);
+			if (written < 0) {
+				if (!total)
+					total = written;
+				break;
+			}
+			total += written;
+			if (written < iov[i].count)
+				break;
+		}
+	}
+	if (NDevSync(dev) && (total > 0) && dev->d_ops->sync(dev))
+		total--; /* on sync error, return partially written */
+	return (total);
+}
+
 /**
  * ntfs_mst_pread - multi sector transfer (mst) positioned read
  * @dev:	device to read from
@@ -333,7 +1310,7 @@ out:
 s64 ntfs_mst_pread(struct ntfs_device *dev, const s64 pos, s64 count,
 		const u32 bksize, void *b)
 {
-	s64 br, i;
+	s64 br;
 
 	if (bksize & (bksize - 1) || bksize % NTFS_BLOCK_SIZE) {
 		errno = EINVAL;
@@ -350,9 +1327,8 @@ s64 ntfs_mst_pread(struct ntfs_device *dev, const s64 pos, s64 count,
 	 * magic will be detected later on.
 	 */
 	count = br / bksize;
-	for (i = 0; i < count; ++i)
-		ntfs_mst_post_read_fixup((NTFS_RECORD*)
-				((u8*)b + i * bksize), bksize);
+	ntfs_mst_post_read_fixup_records(b, bksize, count, TRUE,
+				(int*)NULL);
 	/* Finally, return the number of complete blocks read. */
 	return count;
 }
@@ -251,7 +251,6 @@ u64 ntfs_inode_lookup_by_name(ntfs_inode *dir_ni,
 {
 	VCN vcn;
 	u64 mref = 0;
-	s64 br;
 	ntfs_volume *vol;
 	ntfs_attr_search_ctx *ctx;
 	INDEX_ROOT *ir;
@@ -397,22 +396,9 @@ u64 ntfs_inode_lookup_by_name(ntfs_inode *dir_ni,
 descend_into_child_node:
 
 	/* Read the index block starting at vcn. */
-	br = ntfs_attr_mst_pread(ia_na, vcn << index_vcn_size_bits, 1,
-			index_block_size, ia);
-	if (br != 1) {
-		if (br != -1)
-			errno = EIO;
-		ntfs_log_perror("Failed to read vcn 0x%llx from inode %lld",
-			       	(unsigned long long)vcn,
-				(unsigned long long)ia_na->ni->mft_no);
-		goto close_err_out;
-	}
-
-	if (ntfs_index_block_inconsistent((INDEX_BLOCK*)ia, index_block_size,
-			ia_na->ni->mft_no, vcn)) {
-		errno = EIO;
+	if (ntfs_index_block_read(ia_na, vcn, index_vcn_size_bits,
+			index_block_size, ia, TRUE))
 		goto close_err_out;
-	}
 	index_end = (u8*)&ia->index + le32_to_cpu(ia->index.index_length);
 
 	/* The first index entry. */
@@ -559,11 +545,14 @@ u64 ntfs_inode_lookup_by_mbsname(ntfs_inode *dir_ni, const char *name)
 			item.name = const_name;
 			item.namesize = strlen(const_name) + 1;
 			item.parent = dir_ni->mft_no;
+			ntfs_lock_cache(dir_ni->vol->lookup_cache);
 			cached = (struct CACHED_LOOKUP*)ntfs_fetch_cache(
 					dir_ni->vol->lookup_cache,
 					GENERIC(&item), lookup_cache_compare);
-			if (cached) {
+			if (cached)
 				inum = cached->inum;
+			ntfs_unlock_cache(dir_ni->vol->lookup_cache);
+			if (cached) {
 				if (inum == (u64)-1)
 					errno = ENOENT;
 			} else {
@@ -626,11 +615,13 @@ void ntfs_inode_update_mbsname(ntfs_inode *dir_ni, const char *name, u64 inum)
 			item.namesize = strlen(item.name) + 1;
 			item.parent = dir_ni->mft_no;
 			item.inum = inum;
+			ntfs_lock_cache(dir_ni->vol->lookup_cache);
 			cached = (struct CACHED_LOOKUP*)ntfs_enter_cache(
 					dir_ni->vol->lookup_cache,
 					GENERIC(&item), lookup_cache_compare);
 			if (cached)
 				cached->inum = inum;
+			ntfs_unlock_cache(dir_ni->vol->lookup_cache);
 			if (cached_name)
 				free(cached_name);
 		}
@@ -700,16 +691,19 @@ ntfs_inode *ntfs_pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
 		if (*fullname) {
 			item.pathname = fullname;
 			item.varsize = strlen(fullname) + 1;
+			ntfs_lock_cache(vol->xinode_cache);
 			cached = (struct CACHED_INODE*)ntfs_fetch_cache(
 				vol->xinode_cache, GENERIC(&item),
 				inode_cache_compare);
+			if (cached)
+				inum = MREF(cached->inum);
+			ntfs_unlock_cache(vol->xinode_cache);
 		} else
 			cached = (struct CACHED_INODE*)NULL;
 		if (cached) {
 			/*
 			 * return opened inode if found in cache
 			 */
-			inum = MREF(cached->inum);
 			ni = ntfs_inode_open(vol, inum);
 			if (!ni) {
 				ntfs_log_debug("Cannot open inode %llu: %s.\n",
@@ -744,12 +738,14 @@ ntfs_inode *ntfs_pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
 		if (!parent) {
 			item.pathname = fullname;
 			item.varsize = strlen(fullname) + 1;
+			ntfs_lock_cache(vol->xinode_cache);
 			cached = (struct CACHED_INODE*)ntfs_fetch_cache(
 					vol->xinode_cache, GENERIC(&item),
 					inode_cache_compare);
 			if (cached) {
 				inum = cached->inum;
 			}
+			ntfs_unlock_cache(vol->xinode_cache);
 		}
 			/*
 			 * if not in cache, translate, search, then
@@ -947,7 +943,7 @@ static u32 ntfs_dir_entry_type(ntfs_inode *dir_ni, MFT_REF mref,
  * callback.
  */
 static int ntfs_filldir(ntfs_inode *dir_ni, s64 *pos,
-		INDEX_ENTRY *ie, void *dirent, ntfs_filldir_t filldir)
+		INDEX_ENTRY *ie, void *dirent, ntfs_filldir_fn_t filldir)
 {
 	FILE_NAME_ATTR *fn = &ie->key.file_name;
 	unsigned dt_type;
@@ -983,7 +979,7 @@ static int ntfs_filldir(ntfs_inode *dir_ni, s64 *pos,
 			res = filldir(dirent, fn->file_name,
 					fn->file_name_length,
 					fn->file_name_type, *pos,
-					mref, dt_type);
+					mref, dt_type, fn);
 		} else {
 			loname = (ntfschar*)ntfs_malloc(2*fn->file_name_length);
 			if (loname) {
@@ -995,7 +991,7 @@ static int ntfs_filldir(ntfs_inode *dir_ni, s64 *pos,
 				res = filldir(dirent, loname,
 					fn->file_name_length,
 					fn->file_name_type, *pos,
-					mref, dt_type);
+					mref, dt_type, fn);
 				free(loname);
 			} else
 				res = -1;
@@ -1064,6 +1060,28 @@ err_out:
 	return ERR_MREF(-1);
 }
 
+/*
+ *		Pass an entry to a filldir callback not interested in
+ *	the FILE_NAME attribute
+ */
+
+struct filldir_plain {
+	void *dirent;
+	ntfs_filldir_t filldir;
+} ;
+
+static int ntfs_filldir_plain(void *dirent, const ntfschar *name,
+		const int name_len, const int name_type, const s64 pos,
+		const MFT_REF mref, const unsigned dt_type,
+		const FILE_NAME_ATTR *fn __attribute__((unused)))
+{
+	struct filldir_plain *plain;
+
+	plain = (struct filldir_plain*)dirent;
+	return (plain->filldir(plain->dirent, name, name_len, name_type,
+			pos, mref, dt_type));
+}
+
 /**
  * ntfs_readdir - read the contents of an ntfs directory
  * @dir_ni:	ntfs inode of current directory
@@ -1084,6 +1102,32 @@ err_out:
  */
 int ntfs_readdir(ntfs_inode *dir_ni, s64 *pos,
 		void *dirent, ntfs_filldir_t filldir)
+{
+	struct filldir_plain plain;
+
+	if (!filldir) {
+		errno = EINVAL;
+		return -1;
+	}
+	plain.dirent = dirent;
+	plain.filldir = filldir;
+	return (ntfs_readdir_fn(dir_ni, pos, &plain, ntfs_filldir_plain));
+}
+
+/**
+ * ntfs_readdir_fn - read the contents of an ntfs directory with file names
+ * @dir_ni:	ntfs inode of current directory
+ * @pos:	current position in directory
+ * @dirent:	context for filldir callback supplied by the caller
+ * @filldir:	filldir callback supplied by the caller
+ *
+ * Same as ntfs_readdir(), the @filldir callback also getting the FILE_NAME
+ * attribute recorded in the index for each entry, so that the caller can
+ * get the sizes, times and flags of the entries without opening their
+ * inodes.  The FILE_NAME attribute is NULL for the "." and ".." entries.
+ */
+int ntfs_readdir_fn(ntfs_inode *dir_ni, s64 *pos,
+		void *dirent, ntfs_filldir_fn_t filldir)
 {
 	s64 i_size, br, ia_pos, bmp_pos, ia_start, ia_offset;
 	ntfs_volume *vol;
@@ -1138,7 +1182,7 @@ int ntfs_readdir(ntfs_inode *dir_ni, s64 *pos,
 		rc = filldir(dirent, dotdot, 1, FILE_NAME_POSIX, *pos,
 				MK_MREF(dir_ni->mft_no,
 				le16_to_cpu(dir_ni->mrec->sequence_number)),
-				NTFS_DT_DIR);
+				NTFS_DT_DIR, (const FILE_NAME_ATTR*)NULL);
 		if (rc < 0)
 			goto err_out;
 		++*pos;
@@ -1155,7 +1199,8 @@ int ntfs_readdir(ntfs_inode *dir_ni, s64 *pos,
 		if (rc > 0)
 			goto done;
 		rc = filldir(dirent, dotdot, 2, FILE_NAME_POSIX, *pos,
-				parent_mref, NTFS_DT_DIR);
+				parent_mref, NTFS_DT_DIR,
+				(const FILE_NAME_ATTR*)NULL);
 		if (rc < 0)
 			goto err_out;
 		++*pos;
@@ -1320,21 +1365,14 @@ find_next_index_buffer:
 
 	ntfs_log_debug("Handling index block 0x%llx.\n", (long long)bmp_pos);
 
-	/* Read the index block starting at bmp_pos. */
-	br = ntfs_attr_mst_pread(ia_na, bmp_pos << index_block_size_bits, 1,
-			index_block_size, ia);
-	if (br != 1) {
-		if (br != -1)
-			errno = EIO;
-		ntfs_log_perror("Failed to read index block\n");
-		goto err_out;
-	}
-
+	/*
+	 * Read the index block starting at bmp_pos, blocks read from
+	 * device are not cached, as all of them are read once.
+	 */
 	ia_start = ia_pos & ~(s64)(index_block_size - 1);
-	if (ntfs_index_block_inconsistent((INDEX_BLOCK*)ia, index_block_size,
-			ia_na->ni->mft_no, ia_start >> index_vcn_size_bits)) {
-		goto dir_err_out;
-	}
+	if (ntfs_index_block_read(ia_na, ia_start >> index_vcn_size_bits,
+			index_vcn_size_bits, index_block_size, ia, FALSE))
+		goto err_out;
 	index_end = (u8*)&ia->index + le32_to_cpu(ia->index.index_length);
 
 
@@ -2146,6 +2184,10 @@ search:
 					"Leaving inconsistent metadata.\n");
 		}
 #endif
+
+	/* the inode number may be reused for another directory */
+	if (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)
+		ntfs_index_block_forget(ni->vol, ni->mft_no);
 	if (ntfs_mft_record_free(ni->vol, ni)) {
 		err = errno;
 		ntfs_log_error("Failed to free base MFT record.  "
@@ -47,6 +47,7 @@
 #include "bitmap.h"
 #include "reparse.h"
 #include "misc.h"
+#include "cache.h"
 
 /**
  * ntfs_index_entry_mark_dirty - mark an index entry dirty
@@ -80,6 +81,274 @@ static VCN ntfs_ib_pos_to_vcn(ntfs_index_context *icx, s64 pos)
 	return pos >> icx->vcn_size_bits;
 }
 
+#if CACHE_INDEX_SIZE
+
+/*
+ *		Compare two entries of the index block cache
+ */
+
+static int index_block_compare(const struct CACHED_GENERIC *cached,
+			const struct CACHED_GENERIC *item)
+{
+	return ((((const struct CACHED_INDEX_BLOCK*)cached)->inum
+			!= ((const struct CACHED_INDEX_BLOCK*)item)->inum)
+		|| (((const struct CACHED_INDEX_BLOCK*)cached)->vcn
+			!= ((const struct CACHED_INDEX_BLOCK*)item)->vcn));
+}
+
+/*
+ *		Compare the directories of two entries of the index block cache
+ */
+
+static int index_dir_compare(const struct CACHED_GENERIC *cached,
+			const struct CACHED_GENERIC *item)
+{
+	return (((const struct CACHED_INDEX_BLOCK*)cached)->inum
+			!= ((const struct CACHED_INDEX_BLOCK*)item)->inum);
+}
+
+/*
+ *		Hash an entry of the index block cache
+ */
+
+int ntfs_index_block_hash(const struct CACHED_GENERIC *item)
+{
+	const struct CACHED_INDEX_BLOCK *entry;
+
+	entry = (const struct CACHED_INDEX_BLOCK*)item;
+	return ((entry->inum*7 + entry->vcn) % (2*CACHE_INDEX_SIZE));
+}
+
+/*
+ *		Check whether the blocks of an index may be cached
+ *
+ *	Only directory indexes are cached, so that the blocks are
+ *	identified by the inode and the vcn, whatever the index.
+ */
+
+static BOOL ntfs_index_block_cacheable(ntfs_inode *ni,
+			const ntfschar *name, u32 name_len)
+{
+	return (ni->vol->index_cache
+		&& (name_len == 4)
+		&& !memcmp(name, NTFS_INDEX_I30, 4*sizeof(ntfschar)));
+}
+
+/*
+ *		Account a read of an index block in the statistics
+ *	of its directory
+ *
+ *	Statistics are kept for a few directories, the one with the
+ *	fewest reads is replaced when there is no room for a new one.
+ */
+
+static void ntfs_index_block_count(ntfs_volume *vol, u64 inum, BOOL hit)
+{
+	struct INDEX_CACHE_STATS *stats;
+	struct INDEX_CACHE_STATS *least;
+	int i;
+
+	stats = vol->index_stats;
+	if (stats) {
+		least = stats;
+		i = 0;
+		while ((i < INDEX_STATS_DIRS)
+		    && stats[i].reads
+		    && (stats[i].inum != inum)) {
+			if (stats[i].reads < least->reads)
+				least = &stats[i];
+			i++;
+		}
+		if (i < INDEX_STATS_DIRS)
+			least = &stats[i];
+		if (!least->reads || (least->inum != inum)) {
+			least->inum = inum;
+			least->reads = 0;
+			least->hits = 0;
+		}
+		least->reads++;
+		if (hit)
+			least->hits++;
+	}
+}
+
+/*
+ *		Get an index block from the cache
+ *
+ *	Returns TRUE if the block was found and copied to @dst
+ */
+
+static BOOL ntfs_index_block_cached_read(ntfs_attr *ia_na, VCN vcn,
+			u32 block_size, INDEX_BLOCK *dst)
+{
+	struct CACHED_INDEX_BLOCK item;
+	struct CACHED_INDEX_BLOCK *cached;
+	BOOL found;
+
+	found = FALSE;
+	if (ntfs_index_block_cacheable(ia_na->ni, ia_na->name,
+					ia_na->name_len)) {
+		item.inum = ia_na->ni->mft_no;
+		item.vcn = vcn;
+		item.ib = (INDEX_BLOCK*)NULL;
+		item.ibsize = 0;
+			/* the statistics are protected by the cache lock */
+		ntfs_lock_cache(ia_na->ni->vol->index_cache);
+		cached = (struct CACHED_INDEX_BLOCK*)ntfs_fetch_cache(
+				ia_na->ni->vol->index_cache, GENERIC(&item),
+				index_block_compare);
+		if (cached && (cached->ibsize == block_size)) {
+			memcpy(dst, cached->ib, block_size);
+			found = TRUE;
+		}
+		ntfs_index_block_count(ia_na->ni->vol, item.inum, found);
+		ntfs_unlock_cache(ia_na->ni->vol->index_cache);
+	}
+	return (found);
+}
+
+/*
+ *		Enter an index block into the cache
+ *
+ *	The block must have been checked or just written, an older
+ *	copy is replaced, as ntfs_enter_cache() does not update an
+ *	existing entry.
+ */
+
+static void ntfs_index_block_cached_write(ntfs_attr *ia_na, VCN vcn,
+			u32 block_size, const INDEX_BLOCK *ib)
+{
+	struct CACHED_INDEX_BLOCK item;
+
+	if (ntfs_index_block_cacheable(ia_na->ni, ia_na->name,
+					ia_na->name_len)) {
+		item.inum = ia_na->ni->mft_no;
+		item.vcn = vcn;
+		item.ib = (INDEX_BLOCK*)ib;
+		item.ibsize = block_size;
+		ntfs_lock_cache(ia_na->ni->vol->index_cache);
+		ntfs_invalidate_cache(ia_na->ni->vol->index_cache,
+				GENERIC(&item), index_block_compare, 0);
+		ntfs_enter_cache(ia_na->ni->vol->index_cache,
+				GENERIC(&item), index_block_compare);
+		ntfs_unlock_cache(ia_na->ni->vol->index_cache);
+	}
+}
+
+/*
+ *		Drop an index block from the cache
+ */
+
+static void ntfs_index_block_cached_drop(ntfs_index_context *icx, VCN vcn)
+{
+	struct CACHED_INDEX_BLOCK item;
+
+	if (ntfs_index_block_cacheable(icx->ni, icx->name, icx->name_len)) {
+		item.inum = icx->ni->mft_no;
+		item.vcn = vcn;
+		item.ib = (INDEX_BLOCK*)NULL;
+		item.ibsize = 0;
+		ntfs_invalidate_cache(icx->ni->vol->index_cache,
+				GENERIC(&item), index_block_compare, 0);
+	}
+}
+
+#else /* CACHE_INDEX_SIZE */
+
+static BOOL ntfs_index_block_cached_read(ntfs_attr *ia_na
+				__attribute__((unused)),
+			VCN vcn __attribute__((unused)),
+			u32 block_size __attribute__((unused)),
+			INDEX_BLOCK *dst __attribute__((unused)))
+{
+	return (FALSE);
+}
+
+static void ntfs_index_block_cached_write(ntfs_attr *ia_na
+				__attribute__((unused)),
+			VCN vcn __attribute__((unused)),
+			u32 block_size __attribute__((unused)),
+			const INDEX_BLOCK *ib __attribute__((unused)))
+{
+}
+
+static void ntfs_index_block_cached_drop(ntfs_index_context *icx
+				__attribute__((unused)),
+			VCN vcn __attribute__((unused)))
+{
+}
+
+#endif /* CACHE_INDEX_SIZE */
+
+/**
+ * ntfs_index_block_forget - drop the cached index blocks of a directory
+ * @vol:	volume the directory belongs to
+ * @inum:	inode number of the directory
+ *
+ * Drop all the index blocks of directory @inum from the cache of index
+ * blocks, this must be done when the directory is deleted, as its inode
+ * number may be reused for a new directory.
+ */
+void ntfs_index_block_forget(ntfs_volume *vol __attribute__((unused)),
+			u64 inum __attribute__((unused)))
+{
+#if CACHE_INDEX_SIZE
+	struct CACHED_INDEX_BLOCK item;
+
+	if (vol->index_cache) {
+		item.inum = inum;
+		item.vcn = 0;
+		item.ib = (INDEX_BLOCK*)NULL;
+		item.ibsize = 0;
+		ntfs_invalidate_cache(vol->index_cache, GENERIC(&item),
+				index_dir_compare, CACHE_NOHASH);
+	}
+#endif
+}
+
+/**
+ * ntfs_index_block_read - read an index block of a directory
+ * @ia_na:		opened index allocation attribute
+ * @vcn:		vcn of the index block
+ * @vcn_size_bits:	log2 of the size of an index vcn
+ * @block_size:		size of the index block
+ * @dst:		where to store the index block
+ * @keep:		TRUE if a block read from the device is to be cached
+ *
+ * Get an index block from the cache of directory index blocks, or read it
+ * from the device and check it is consistent.  Blocks read when scanning a
+ * whole directory should not be kept, so that they do not evict the nodes
+ * used for lookups.
+ *
+ * Return 0 on success and -1 on error with errno set to the error code.
+ */
+int ntfs_index_block_read(ntfs_attr *ia_na, VCN vcn, u8 vcn_size_bits,
+		u32 block_size, INDEX_BLOCK *dst, BOOL keep)
+{
+	s64 br;
+
+	if (ntfs_index_block_cached_read(ia_na, vcn, block_size, dst))
+		return (0);
+	br = ntfs_attr_mst_pread(ia_na, vcn << vcn_size_bits, 1,
+			block_size, dst);
+	if (br != 1) {
+		if (br != -1)
+			errno = EIO;
+		ntfs_log_perror("Failed to read index block %lld of inode %lld",
+				(long long)vcn,
+				(long long)ia_na->ni->mft_no);
+		return (-1);
+	}
+	if (ntfs_index_block_inconsistent(dst, block_size,
+			ia_na->ni->mft_no, vcn)) {
+		errno = EIO;
+		return (-1);
+	}
+	if (keep)
+		ntfs_index_block_cached_write(ia_na, vcn, block_size, dst);
+	return (0);
+}
+
 static int ntfs_ib_write(ntfs_index_context *icx, INDEX_BLOCK *ib)
 {
 	s64 ret, vcn = sle64_to_cpu(ib->index_block_vcn);
@@ -91,8 +360,10 @@ static int ntfs_ib_write(ntfs_index_context *icx, INDEX_BLOCK *ib)
 	if (ret != 1) {
 		ntfs_log_perror("Failed to write index block %lld, inode %llu",
 			(long long)vcn, (unsigned long long)icx->ni->mft_no);
+		ntfs_index_block_cached_drop(icx, vcn);
 		return STATUS_ERROR;
 	}
+	ntfs_index_block_cached_write(icx->ia_na, vcn, icx->block_size, ib);
 	
 	return STATUS_OK;
 }
@@ -687,29 +958,10 @@ static ntfs_attr *ntfs_ia_open(ntfs_index_context *icx, ntfs_inode *ni)
 
 static int ntfs_ib_read(ntfs_index_context *icx, VCN vcn, INDEX_BLOCK *dst)
 {
-	s64 pos, ret;
-
 	ntfs_log_trace("vcn: %lld\n", (long long)vcn);
 	
-	pos = ntfs_ib_vcn_to_pos(icx, vcn);
-
-	ret = ntfs_attr_mst_pread(icx->ia_na, pos, 1, icx->block_size, (u8 *)dst);
-	if (ret != 1) {
-		if (ret == -1)
-			ntfs_log_perror("Failed to read index block");
-		else 
-			ntfs_log_error("Failed to read full index block at "
-				       "%lld\n", (long long)pos);
-		return -1;
-	}
-	
-	if (ntfs_index_block_inconsistent((INDEX_BLOCK*)dst, icx->block_size,
-				icx->ia_na->ni->mft_no, vcn)) {
-		errno = EIO;
-		return -1;
-	}
-	
-	return 0;
+	return (ntfs_index_block_read(icx->ia_na, vcn, icx->vcn_size_bits,
+			icx->block_size, dst, TRUE));
 }
 
 static int ntfs_icx_parent_inc(ntfs_index_context *icx)
@@ -1049,6 +1301,7 @@ static int ntfs_ibm_set(ntfs_index_context *icx, VCN vcn)
 
 static int ntfs_ibm_clear(ntfs_index_context *icx, VCN vcn)
 {
+	ntfs_index_block_cached_drop(icx, vcn);
 	return ntfs_ibm_modify(icx, vcn, 0);
 }
 
@@ -1921,7 +2174,7 @@ int ntfs_index_rm(ntfs_index_context *icx)
 
 	ntfs_log_trace("Entering\n");
 	
-	if (!icx || (icx->is_in_root && !icx->ib) || (!icx->is_in_root && !icx->ir) || ntfs_ie_end(icx->entry)) {
+	if (!icx || (icx->is_in_root && !icx->ir) || (!icx->is_in_root && !icx->ib) || ntfs_ie_end(icx->entry)) {
 		ntfs_log_error("Invalid arguments.\n");
 		errno = EINVAL;
 		goto err_out;
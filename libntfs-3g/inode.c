@@ -36,6 +36,9 @@
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#ifdef ENABLE_VOLUME_LOCKS
+#include <pthread.h>
+#endif
 
 #include "param.h"
 #include "compat.h"
@@ -56,6 +59,16 @@
 #include "misc.h"
 #include "xattrs.h"
 
+#ifdef ENABLE_VOLUME_LOCKS
+
+struct INODE_LOCK {
+	pthread_mutex_t mutex;
+} ;
+
+#endif /* ENABLE_VOLUME_LOCKS */
+
+static void ntfs_inode_unshare(ntfs_inode *ni);
+
 ntfs_inode *ntfs_inode_base(ntfs_inode *ni)
 {
 	if (ni->nr_extents == -1)
@@ -126,6 +139,16 @@ static void __ntfs_inode_release(ntfs_inode *ni)
 			       (long long)ni->mft_no);
 	if (NInoAttrList(ni) && ni->attr_list)
 		free(ni->attr_list);
+	ntfs_attr_readahead_free(ni);
+		/* an inode may be released while open, when deleted */
+	if (ni->shared_users)
+		ntfs_inode_unshare(ni);
+#ifdef ENABLE_VOLUME_LOCKS
+	if (ni->lock) {
+		pthread_mutex_destroy(&ni->lock->mutex);
+		free(ni->lock);
+	}
+#endif
 	free(ni->mrec);
 	free(ni);
 	return;
@@ -448,8 +471,10 @@ void ntfs_inode_invalidate(ntfs_volume *vol, const MFT_REF mref)
 	item.ni = (ntfs_inode*)NULL;
 	item.pathname = (const char*)NULL;
 	item.varsize = 0;
+	ntfs_volume_lock(vol, NTFS_LOCK_INODES);
 	ntfs_invalidate_cache(vol->nidata_cache,
 				GENERIC(&item),idata_cache_compare,CACHE_FREE);
+	ntfs_volume_unlock(vol, NTFS_LOCK_INODES);
 }
 
 #endif
@@ -498,6 +523,231 @@ void debug_double_inode(u64 inum, int add)
 
 #endif /* DEBUG_DOUBLE_INODE */
 
+/*
+ *		Inodes open by threads sharing a volume
+ *
+ *	When a volume is shared by threads (see ntfs_volume_set_threaded()),
+ *	the threads which only read run concurrently, and they may open the
+ *	same inode. The open inodes are then recorded in a list, so that
+ *	ntfs_inode_open() returns the same ntfs_inode to all the threads,
+ *	with a count of users, instead of opening a second copy, and the
+ *	inode is only closed or entered into the cache when its last user
+ *	closes it. The list and the inode cache are protected by the
+ *	NTFS_LOCK_INODES lock of the volume, which is however not held
+ *	while reading an inode from the device : if another thread has
+ *	opened the same inode meanwhile, the copy just read is dropped.
+ *	As the inode cache is only used with this lock held, freeing
+ *	an inode dropped from the cache never waits for the lock.
+ *
+ *	Each shared inode also has a lock, for the threads to serialize
+ *	their use of the inode (see ntfs_inode_lock()).
+ */
+
+/*
+ *		Record a newly opened inode as shared
+ *
+ *	Returns 0 if successful, or -1 if there was no memory for the lock
+ */
+
+static int ntfs_inode_share(ntfs_inode *ni)
+{
+#ifdef ENABLE_VOLUME_LOCKS
+	pthread_mutexattr_t attr;
+
+	if (!ni->lock) {
+		ni->lock = (struct INODE_LOCK*)ntfs_malloc(
+					sizeof(struct INODE_LOCK));
+		if (!ni->lock)
+			return (-1);
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+		pthread_mutex_init(&ni->lock->mutex, &attr);
+		pthread_mutexattr_destroy(&attr);
+	}
+#endif
+	ni->shared_users = 1;
+	ni->next_shared = ni->vol->shared_inodes;
+	ni->vol->shared_inodes = ni;
+	return (0);
+}
+
+/*
+ *		Remove an inode from the list of shared inodes
+ */
+
+static void ntfs_inode_unshare(ntfs_inode *ni)
+{
+	ntfs_inode **pni;
+
+	ntfs_volume_lock(ni->vol, NTFS_LOCK_INODES);
+	pni = &ni->vol->shared_inodes;
+	while (*pni && (*pni != ni))
+		pni = &(*pni)->next_shared;
+	if (*pni)
+		*pni = ni->next_shared;
+	ni->next_shared = (ntfs_inode*)NULL;
+	ni->shared_users = 0;
+	ntfs_volume_unlock(ni->vol, NTFS_LOCK_INODES);
+}
+
+/*
+ *		Get a new use of a shared inode
+ *
+ *	Returns the inode, or NULL if it is not open
+ */
+
+static ntfs_inode *ntfs_inode_get_shared(ntfs_volume *vol, u64 inum)
+{
+	ntfs_inode *ni;
+
+	ni = vol->shared_inodes;
+	while (ni && (ni->mft_no != inum))
+		ni = ni->next_shared;
+	if (ni)
+		ni->shared_users++;
+	return (ni);
+}
+
+/*
+ *		Drop a use of a shared inode
+ *
+ *	The inode is no more shared when its last user is closing it.
+ *
+ *	Returns TRUE if the inode is still used and must not be closed
+ */
+
+static BOOL ntfs_inode_put_shared(ntfs_inode *ni)
+{
+	BOOL busy;
+
+	busy = FALSE;
+	if (--ni->shared_users)
+		busy = TRUE;
+	else
+		ntfs_inode_unshare(ni);
+	return (busy);
+}
+
+/*
+ *		Lock an inode shared by threads
+ *
+ *	The lock is recursive. A thread holding the lock of an inode may
+ *	lock another one only if it is an entry of the directory it has
+ *	locked (for instance when listing a directory with the attributes
+ *	of its entries), so that the locks are always taken in the same
+ *	order. The lock has to be released before closing the inode.
+ *	Nothing is done when the volume is not shared.
+ */
+
+void ntfs_inode_lock(ntfs_inode *ni __attribute__((unused)))
+{
+#ifdef ENABLE_VOLUME_LOCKS
+	if (ni->lock)
+		pthread_mutex_lock(&ni->lock->mutex);
+#endif
+}
+
+/*
+ *		Release a lock taken by ntfs_inode_lock()
+ */
+
+void ntfs_inode_unlock(ntfs_inode *ni __attribute__((unused)))
+{
+#ifdef ENABLE_VOLUME_LOCKS
+	if (ni->lock)
+		pthread_mutex_unlock(&ni->lock->mutex);
+#endif
+}
+
+#if CACHE_NIDATA_SIZE
+
+/*
+ *		Take an inode out of the inode cache
+ *
+ *	Returns the inode, or NULL if it is not in the cache
+ */
+
+static ntfs_inode *ntfs_inode_uncache(ntfs_volume *vol, const MFT_REF mref)
+{
+	struct CACHED_NIDATA item;
+	struct CACHED_NIDATA *cached;
+	ntfs_inode *ni;
+
+	item.inum = MREF(mref);
+	item.pathname = (const char*)NULL;
+	item.varsize = 0;
+	ni = (ntfs_inode*)NULL;
+	ntfs_lock_cache(vol->nidata_cache);
+	cached = (struct CACHED_NIDATA*)ntfs_fetch_cache(vol->nidata_cache,
+				GENERIC(&item),idata_cache_compare);
+	if (cached) {
+		ni = cached->ni;
+		/* do not keep open entries in cache */
+		ntfs_remove_cache(vol->nidata_cache,
+				(struct CACHED_GENERIC*)cached,0);
+	}
+	ntfs_unlock_cache(vol->nidata_cache);
+	if (ni)
+		ntfs_attr_readahead_unpark(ni);
+	return (ni);
+}
+
+#else /* CACHE_NIDATA_SIZE */
+
+static ntfs_inode *ntfs_inode_uncache(ntfs_volume *vol __attribute__((unused)),
+			const MFT_REF mref __attribute__((unused)))
+{
+	return ((ntfs_inode*)NULL);
+}
+
+#endif /* CACHE_NIDATA_SIZE */
+
+/*
+ *		Open an inode of a volume shared by threads
+ *
+ *	The inode is taken from the list of open inodes or from the
+ *	cache, or read from the device if @cached is FALSE.
+ *
+ *	Returns the inode, or NULL with errno set
+ */
+
+static ntfs_inode *ntfs_inode_open_shared(ntfs_volume *vol,
+			const MFT_REF mref, BOOL cached)
+{
+	ntfs_inode *ni;
+	ntfs_inode *other;
+
+	ntfs_volume_lock(vol, NTFS_LOCK_INODES);
+	ni = ntfs_inode_get_shared(vol, MREF(mref));
+	if (!ni) {
+		ni = ntfs_inode_uncache(vol, mref);
+		if (!ni && !cached) {
+				/* do not stall the other opens while reading */
+			ntfs_volume_unlock(vol, NTFS_LOCK_INODES);
+			ni = ntfs_inode_real_open(vol, mref);
+			ntfs_volume_lock(vol, NTFS_LOCK_INODES);
+			if (ni) {
+				other = ntfs_inode_get_shared(vol, MREF(mref));
+				if (!other)
+					other = ntfs_inode_uncache(vol, mref);
+				if (other) {
+					__ntfs_inode_release(ni);
+					ni = other;
+				}
+			}
+		}
+		if (ni && !ni->shared_users && ntfs_inode_share(ni)) {
+			ntfs_inode_real_close(ni);
+			ni = (ntfs_inode*)NULL;
+			errno = ENOMEM;
+		}
+		if (!ni && cached)
+			errno = ENOENT;
+	}
+	ntfs_volume_unlock(vol, NTFS_LOCK_INODES);
+	return (ni);
+}
+
 /*
  *		Open an inode
  *
@@ -506,6 +756,8 @@ void debug_double_inode(u64 inum, int add)
  *	**NEVER REOPEN** an inode, this can lead to a duplicated
  * 	cache entry (hard to detect), and to an obsolete one being
  *	reused. System files are however protected from being cached.
+ *	When the volume is shared by threads, an inode open by another
+ *	thread is however returned again.
  */
 
 ntfs_inode *ntfs_inode_open(ntfs_volume *vol, const MFT_REF mref)
@@ -514,7 +766,11 @@ ntfs_inode *ntfs_inode_open(ntfs_volume *vol, const MFT_REF mref)
 #if CACHE_NIDATA_SIZE
 	struct CACHED_NIDATA item;
 	struct CACHED_NIDATA *cached;
+#endif
 
+	if (vol->locks)
+		return (ntfs_inode_open_shared(vol, mref, FALSE));
+#if CACHE_NIDATA_SIZE
 		/* fetch idata from cache */
 	item.inum = MREF(mref);
 	debug_double_inode(item.inum, 1);
@@ -527,6 +783,7 @@ ntfs_inode *ntfs_inode_open(ntfs_volume *vol, const MFT_REF mref)
 		/* do not keep open entries in cache */
 		ntfs_remove_cache(vol->nidata_cache,
 				(struct CACHED_GENERIC*)cached,0);
+		ntfs_attr_readahead_unpark(ni);
 	} else {
 		ni = ntfs_inode_real_open(vol, mref);
 	}
@@ -539,6 +796,31 @@ ntfs_inode *ntfs_inode_open(ntfs_volume *vol, const MFT_REF mref)
 	return (ni);
 }
 
+/*
+ *		Open an inode only if it is recorded in the cache
+ *
+ *	This is for getting the current state of an inode when it is
+ *	available without reading the device, the caller falling back to
+ *	other sources (such as the directory index) otherwise.
+ *
+ *	Returns the inode, or NULL with errno set to ENOENT if the
+ *		inode is not in the cache
+ */
+
+ntfs_inode *ntfs_inode_open_cached(ntfs_volume *vol, const MFT_REF mref)
+{
+	ntfs_inode *ni;
+
+	if (vol->locks)
+		return (ntfs_inode_open_shared(vol, mref, TRUE));
+	ni = ntfs_inode_uncache(vol, mref);
+	if (ni)
+		debug_double_inode(ni->mft_no, 1);
+	else
+		errno = ENOENT;
+	return (ni);
+}
+
 /*
  *		Close an inode entry
  *
@@ -549,7 +831,7 @@ ntfs_inode *ntfs_inode_open(ntfs_volume *vol, const MFT_REF mref)
  *	against being cached.
  */
 
-int ntfs_inode_close(ntfs_inode *ni)
+static int ntfs_inode_close_i(ntfs_inode *ni)
 {
 	int res;
 #if CACHE_NIDATA_SIZE
@@ -580,6 +862,7 @@ int ntfs_inode_close(ntfs_inode *ni)
 				item.pathname = (const char*)NULL;
 				item.varsize = 0;
 				debug_cached_inode(ni);
+				ntfs_attr_readahead_park(ni);
 				ntfs_enter_cache(ni->vol->nidata_cache,
 					GENERIC(&item), idata_cache_compare);
 			}
@@ -595,6 +878,25 @@ int ntfs_inode_close(ntfs_inode *ni)
 	return (res);
 }
 
+int ntfs_inode_close(ntfs_inode *ni)
+{
+	ntfs_volume *vol;
+	int res;
+
+	if (ni && ni->vol->locks) {
+		vol = ni->vol;
+		ntfs_volume_lock(vol, NTFS_LOCK_INODES);
+			/* leave a shared inode to its last user */
+		if (ni->shared_users && ntfs_inode_put_shared(ni))
+			res = 0;
+		else
+			res = ntfs_inode_close_i(ni);
+		ntfs_volume_unlock(vol, NTFS_LOCK_INODES);
+	} else
+		res = ntfs_inode_close_i(ni);
+	return (res);
+}
+
 /**
  * ntfs_extent_inode_open - load an extent inode and attach it to its base
  * @base_ni:	base ntfs inode
@@ -639,6 +941,8 @@ ntfs_inode *ntfs_extent_inode_open(ntfs_inode *base_ni, const leMFT_REF mref)
 	ntfs_log_enter("Opening extent inode %lld (base mft record %lld).\n",
 			(unsigned long long)mft_no,
 			(unsigned long long)base_ni->mft_no);
+		/* the base inode may be shared by threads */
+	ntfs_volume_lock(base_ni->vol, NTFS_LOCK_INODES);
 	
 	if (!base_ni->mft_no) {
 			/*
@@ -718,6 +1022,7 @@ ntfs_inode *ntfs_extent_inode_open(ntfs_inode *base_ni, const leMFT_REF mref)
 	}
 	base_ni->extent_nis[base_ni->nr_extents++] = ni;
 out:
+	ntfs_volume_unlock(base_ni->vol, NTFS_LOCK_INODES);
 	ntfs_log_leave("\n");
 	return ni;
 err_out:
@@ -1654,3 +1959,355 @@ int ntfs_inode_set_times(ntfs_inode *ni, const char *value, size_t size,
 			errno = EEXIST;
 	return (ret);
 }
+
+#ifdef NTFS_TEST
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "unistr.h"
+
+#ifdef ENABLE_VOLUME_LOCKS
+
+/*
+ *	The clients look up, open and read the files of a directory
+ *	concurrently, as the requests of lowntfs-3g do on a mount with
+ *	several threads. A latency is added to every read from the
+ *	device by interposing the device operations, and the direct
+ *	access to the file descriptor is disabled.
+ */
+
+#define TEST_INODE_DIR "ntfs-test-inode"
+#define TEST_INODE_SIZE 16384	/* size of each test file */
+
+struct TEST_INODE_CLIENT {
+	pthread_t thread;
+	ntfs_volume *vol;
+	u64 dir_inum;
+	int first;
+	int step;
+	int count;
+	int bad;
+} ;
+
+static struct ntfs_device_operations *test_inode_dev_ops;
+static struct ntfs_device_operations test_inode_ops;
+static int test_inode_latency;	/* microseconds per device read */
+
+static s64 test_inode_pread(struct ntfs_device *dev, void *buf, s64 count,
+			s64 offset)
+{
+	usleep(test_inode_latency);
+	return (test_inode_dev_ops->pread(dev, buf, count, offset));
+}
+
+static s64 test_inode_preadv(struct ntfs_device *dev,
+			const struct ntfs_device_iovec *iov, int iovcnt)
+{
+	usleep(test_inode_latency);
+	return (test_inode_dev_ops->preadv(dev, iov, iovcnt));
+}
+
+static s64 test_inode_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, (struct timezone*)NULL);
+	return ((s64)tv.tv_sec*1000000 + tv.tv_usec);
+}
+
+/*
+ *		Fill the data of a test file, each file having its own
+ */
+
+static void test_inode_fill(u8 *buf, int num)
+{
+	int i;
+
+	for (i=0; i<TEST_INODE_SIZE; i++)
+		buf[i] = (u8)(num*7 + i/512);
+}
+
+/*
+ *		Look up a test file, as for a lookup request
+ *
+ *	Returns the inode number, or -1 if not found
+ */
+
+static u64 test_inode_lookup(ntfs_volume *vol, u64 dir_inum, int num)
+{
+	ntfs_inode *dir_ni;
+	char name[32];
+	u64 inum;
+
+	inum = (u64)-1;
+	snprintf(name, sizeof(name), "f%d", num);
+	dir_ni = ntfs_inode_open(vol, dir_inum);
+	if (dir_ni) {
+		ntfs_inode_lock(dir_ni);
+		inum = ntfs_inode_lookup_by_mbsname(dir_ni, name);
+		ntfs_inode_unlock(dir_ni);
+		if (ntfs_inode_close(dir_ni))
+			inum = (u64)-1;
+	}
+	return (inum);
+}
+
+/*
+ *		A client : look up, get the size of and read its files
+ */
+
+static void *test_inode_client(void *arg)
+{
+	struct TEST_INODE_CLIENT *client;
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	u8 expected[TEST_INODE_SIZE];
+	u8 buf[TEST_INODE_SIZE];
+	u64 inum;
+	int i;
+
+	client = (struct TEST_INODE_CLIENT*)arg;
+	for (i=client->first; i<client->count; i+=client->step) {
+		inum = test_inode_lookup(client->vol, client->dir_inum, i);
+		ni = (inum != (u64)-1
+			? ntfs_inode_open(client->vol, MREF(inum))
+			: (ntfs_inode*)NULL);
+		if (!ni) {
+			client->bad++;
+			continue;
+		}
+		ntfs_inode_lock(ni);
+		na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+		test_inode_fill(expected, i);
+		if (!na || (na->data_size != TEST_INODE_SIZE)
+		    || (ntfs_attr_pread(na, 0, TEST_INODE_SIZE, buf)
+				!= TEST_INODE_SIZE)
+		    || memcmp(buf, expected, TEST_INODE_SIZE))
+			client->bad++;
+		ntfs_attr_close(na);
+		ntfs_inode_unlock(ni);
+		if (ntfs_inode_close(ni))
+			client->bad++;
+	}
+	return ((void*)NULL);
+}
+
+/*
+ *		Create the test files, unless they are already present
+ *
+ *	Returns the count of failures
+ */
+
+static int test_inode_create(const char *name, int count)
+{
+	ntfs_volume *vol;
+	ntfs_inode *dir_ni;
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	ntfschar *uname;
+	u8 buf[TEST_INODE_SIZE];
+	char fname[32];
+	u64 inum;
+	int len;
+	int bad;
+	int i;
+
+	vol = ntfs_mount(name, 0);
+	if (!vol) {
+		printf("Could not mount %s\n", name);
+		return (1);
+	}
+	bad = 0;
+	dir_ni = ntfs_inode_open(vol, FILE_root);
+	inum = (dir_ni
+		? ntfs_inode_lookup_by_mbsname(dir_ni, TEST_INODE_DIR)
+		: (u64)-1);
+	if (dir_ni && (inum == (u64)-1)) {
+		uname = (ntfschar*)NULL;
+		len = ntfs_mbstoucs(TEST_INODE_DIR, &uname);
+		ni = (len > 0
+			? ntfs_create(dir_ni, const_cpu_to_le32(0),
+				uname, len, S_IFDIR)
+			: (ntfs_inode*)NULL);
+		free(uname);
+		if (!ni)
+			bad++;
+		if (ntfs_inode_close(dir_ni))
+			bad++;
+		dir_ni = ni;
+	} else {
+		if (ntfs_inode_close(dir_ni))
+			bad++;
+		dir_ni = (inum != (u64)-1
+			? ntfs_inode_open(vol, MREF(inum))
+			: (ntfs_inode*)NULL);
+	}
+	for (i=0; (i<count) && dir_ni; i++) {
+		snprintf(fname, sizeof(fname), "f%d", i);
+		if (ntfs_inode_lookup_by_mbsname(dir_ni, fname) != (u64)-1)
+			continue;
+		uname = (ntfschar*)NULL;
+		len = ntfs_mbstoucs(fname, &uname);
+		ni = (len > 0
+			? ntfs_create(dir_ni, const_cpu_to_le32(0),
+				uname, len, S_IFREG)
+			: (ntfs_inode*)NULL);
+		free(uname);
+		na = (ni ? ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0)
+			: (ntfs_attr*)NULL);
+		test_inode_fill(buf, i);
+		if (!na || (ntfs_attr_pwrite(na, 0, TEST_INODE_SIZE, buf)
+				!= TEST_INODE_SIZE))
+			bad++;
+		ntfs_attr_close(na);
+			/* the size is updated in the directory being open */
+		if (!ni || ntfs_inode_close_in_dir(ni, dir_ni))
+			bad++;
+	}
+	if (!dir_ni || ntfs_inode_close(dir_ni))
+		bad++;
+	if (ntfs_umount(vol, FALSE))
+		bad++;
+	return (bad);
+}
+
+/*
+ *		Read the files with a count of concurrent clients
+ *
+ *	The volume is mounted read-only for each count, so that the
+ *	caches are cold, and shared by the clients.
+ *
+ *	Returns the count of failures, and the elapsed time
+ */
+
+static int test_inode_run(const char *name, int count, int clients,
+			s64 *elapsed)
+{
+	struct TEST_INODE_CLIENT client[64];
+	ntfs_volume *vol;
+	ntfs_inode *root_ni;
+	s64 start;
+	u64 inum;
+	int started;
+	int bad;
+	int i;
+
+	vol = ntfs_mount(name, NTFS_MNT_RDONLY);
+	if (!vol) {
+		printf("Could not mount %s\n", name);
+		return (1);
+	}
+	bad = 0;
+	if (ntfs_volume_set_threaded(vol))
+		bad++;
+	root_ni = ntfs_inode_open(vol, FILE_root);
+	inum = (root_ni
+		? ntfs_inode_lookup_by_mbsname(root_ni, TEST_INODE_DIR)
+		: (u64)-1);
+	if (!root_ni || ntfs_inode_close(root_ni) || (inum == (u64)-1))
+		bad++;
+	test_inode_dev_ops = vol->dev->d_ops;
+	test_inode_ops = *test_inode_dev_ops;
+	test_inode_ops.pread = test_inode_pread;
+	if (test_inode_ops.preadv)
+		test_inode_ops.preadv = test_inode_preadv;
+	test_inode_ops.fd = NULL;
+	vol->dev->d_ops = &test_inode_ops;
+	start = test_inode_now();
+	started = 0;
+	for (i=0; !bad && (i<clients); i++) {
+		client[i].vol = vol;
+		client[i].dir_inum = MREF(inum);
+		client[i].first = i;
+		client[i].step = clients;
+		client[i].count = count;
+		client[i].bad = 0;
+		if (pthread_create(&client[i].thread, (pthread_attr_t*)NULL,
+				test_inode_client, &client[i]))
+			bad++;
+		else
+			started++;
+	}
+	for (i=0; i<started; i++) {
+		pthread_join(client[i].thread, (void**)NULL);
+		bad += client[i].bad;
+	}
+	*elapsed = test_inode_now() - start;
+	vol->dev->d_ops = test_inode_dev_ops;
+	if (ntfs_umount(vol, FALSE))
+		bad++;
+	return (bad);
+}
+
+/*
+ *		Read files by concurrent clients
+ *
+ *	@count files are created in a directory of the volume if not
+ *	present, then they are looked up and read by 1, 2, 4... clients
+ *	up to @max, with a latency of @latency microseconds added to
+ *	every read from the device. The files are left on the volume.
+ *
+ *	Returns 0 if the test passed
+ */
+
+static int test_inode_threads(const char *name, int count, int max,
+			int latency)
+{
+	s64 elapsed;
+	s64 single;
+	int clients;
+	int bad;
+
+	bad = test_inode_create(name, count);
+	if (bad)
+		printf("Could not create the files in /%s\n", TEST_INODE_DIR);
+	test_inode_latency = latency;
+	single = 0;
+	if (max > 64)
+		max = 64;
+	for (clients=1; !bad && (clients<=max); clients<<=1) {
+		bad += test_inode_run(name, count, clients, &elapsed);
+		if (!single)
+			single = elapsed;
+		printf("%2d clients : %d files in %lld ms, speedup %.2f\n",
+			clients, count, (long long)(elapsed/1000),
+			(elapsed ? (double)single/elapsed : 0.0));
+	}
+	printf("%s\n", (bad ? "** failed **" : "passed"));
+	return (bad != 0);
+}
+
+#endif /* ENABLE_VOLUME_LOCKS */
+
+/**
+ * test_inode_main - Shared inodes test: Program start (main)
+ * @argc:
+ * @argv:
+ *
+ * "threads image [count [max [latency]]]" reads files on a volume
+ * by concurrent clients.
+ *
+ * Returns 0 if the test passed
+ */
+int test_inode_main(int argc, char *argv[])
+{
+	int res;
+
+	res = 1;
+	if ((argc >= 3) && (argc <= 6) && !strcmp(argv[1], "threads")) {
+#ifdef ENABLE_VOLUME_LOCKS
+		res = test_inode_threads(argv[2],
+				(argc > 3 ? atoi(argv[3]) : 1000),
+				(argc > 4 ? atoi(argv[4]) : 8),
+				(argc > 5 ? atoi(argv[5]) : 1000));
+#else
+		printf("Sharing a volume between threads is not supported\n");
+#endif
+	} else
+		printf("inode [threads] {args}\n");
+	return (res);
+}
+
+#endif
@@ -192,6 +192,748 @@ static int bitmap_writeback(ntfs_volume *vol, s64 pos, s64 size, void *b,
 	return 0;
 }
 
+/*
+ *		Free extent index
+ *
+ *	When NV_FreeExtents is set, the free clusters are recorded as
+ *	extents in memory. The index is built from $Bitmap on the first
+ *	allocation, then kept in sync by the allocation and free functions,
+ *	so that clusters can be allocated without scanning the bitmap.
+ *
+ *	Each extent is in two AVL trees, both ordered by lcn : the tree of
+ *	all the extents, used for merging freed clusters with their
+ *	neighbours, and the tree of the extents having the same size class
+ *	in the same zone, used for selecting the extent to allocate from.
+ *	Short extents are classed by their exact length, and longer ones by
+ *	the log2 of their length. Extents never cross a zone boundary.
+ */
+
+#define FREE_EXTENT_ZONES	3	/* mft, data1, data2 */
+#define FREE_EXTENT_EXACT	16	/* lengths below have their own class */
+#define FREE_EXTENT_CLASSES	(FREE_EXTENT_EXACT + 60)
+#define FREE_EXTENT_PROBES	8	/* extents checked in a size class */
+#define FREE_EXTENT_BSIZE	(16*NTFS_LCNALLOC_BSIZE)
+
+enum {
+	BY_LCN,		/* tree of all extents */
+	BY_CLASS	/* tree of the extents of a size class in a zone */
+} ;
+
+struct FREE_EXTENT_LINK {
+	struct FREE_EXTENT *child[2];
+	int height;
+} ;
+
+struct FREE_EXTENT {
+	struct FREE_EXTENT_LINK link[2];
+	LCN lcn;
+	s64 length;
+} ;
+
+struct FREE_EXTENTS {
+	struct FREE_EXTENT *all;
+	struct FREE_EXTENT *classes[FREE_EXTENT_ZONES][FREE_EXTENT_CLASSES];
+	s64 count;
+} ;
+
+static int free_extent_height(const struct FREE_EXTENT *fe, int t)
+{
+	return (fe ? fe->link[t].height : 0);
+}
+
+static void free_extent_set_height(struct FREE_EXTENT *fe, int t)
+{
+	int hl, hr;
+
+	hl = free_extent_height(fe->link[t].child[0], t);
+	hr = free_extent_height(fe->link[t].child[1], t);
+	fe->link[t].height = (hl > hr ? hl : hr) + 1;
+}
+
+/*
+ *		Rotate a subtree, making its child on side dir the new root
+ */
+
+static struct FREE_EXTENT *free_extent_rotate(struct FREE_EXTENT *fe,
+			int t, int dir)
+{
+	struct FREE_EXTENT *top;
+
+	top = fe->link[t].child[dir];
+	fe->link[t].child[dir] = top->link[t].child[!dir];
+	top->link[t].child[!dir] = fe;
+	free_extent_set_height(fe, t);
+	free_extent_set_height(top, t);
+	return (top);
+}
+
+/*
+ *		Restore the AVL balance of a subtree after an insertion
+ *	or a removal below its root
+ *
+ *	Returns the new root of the subtree
+ */
+
+static struct FREE_EXTENT *free_extent_balance(struct FREE_EXTENT *fe, int t)
+{
+	struct FREE_EXTENT *child;
+	int diff, dir;
+
+	free_extent_set_height(fe, t);
+	diff = free_extent_height(fe->link[t].child[1], t)
+			- free_extent_height(fe->link[t].child[0], t);
+	if ((diff > 1) || (diff < -1)) {
+		dir = (diff > 0);
+		child = fe->link[t].child[dir];
+		if (free_extent_height(child->link[t].child[!dir], t)
+		    > free_extent_height(child->link[t].child[dir], t))
+			fe->link[t].child[dir] = free_extent_rotate(child,
+						t, !dir);
+		fe = free_extent_rotate(fe, t, dir);
+	}
+	return (fe);
+}
+
+static struct FREE_EXTENT *free_extent_insert(struct FREE_EXTENT *root,
+			struct FREE_EXTENT *fe, int t)
+{
+	int dir;
+
+	if (!root) {
+		fe->link[t].child[0] = fe->link[t].child[1] = NULL;
+		fe->link[t].height = 1;
+		return (fe);
+	}
+	dir = (fe->lcn > root->lcn);
+	root->link[t].child[dir] = free_extent_insert(root->link[t].child[dir],
+				fe, t);
+	return (free_extent_balance(root, t));
+}
+
+static struct FREE_EXTENT *free_extent_remove_first(struct FREE_EXTENT *root,
+			int t, struct FREE_EXTENT **first)
+{
+	if (!root->link[t].child[0]) {
+		*first = root;
+		return (root->link[t].child[1]);
+	}
+	root->link[t].child[0] = free_extent_remove_first(
+				root->link[t].child[0], t, first);
+	return (free_extent_balance(root, t));
+}
+
+static struct FREE_EXTENT *free_extent_remove(struct FREE_EXTENT *root,
+			struct FREE_EXTENT *fe, int t)
+{
+	struct FREE_EXTENT *first;
+	struct FREE_EXTENT *right;
+	int dir;
+
+	if (!root)
+		return (NULL);
+	if (root == fe) {
+		if (!fe->link[t].child[1])
+			return (fe->link[t].child[0]);
+		right = free_extent_remove_first(fe->link[t].child[1],
+					t, &first);
+		first->link[t].child[0] = fe->link[t].child[0];
+		first->link[t].child[1] = right;
+		return (free_extent_balance(first, t));
+	}
+	dir = (fe->lcn > root->lcn);
+	root->link[t].child[dir] = free_extent_remove(root->link[t].child[dir],
+				fe, t);
+	return (free_extent_balance(root, t));
+}
+
+/*
+ *		Find the extent starting at the highest lcn not greater than
+ *	@lcn (or the lowest lcn not lower than @lcn if @after is set)
+ *
+ *	Returns NULL if there is none
+ */
+
+static struct FREE_EXTENT *free_extent_find(struct FREE_EXTENT *root,
+			LCN lcn, int t, BOOL after)
+{
+	struct FREE_EXTENT *found;
+
+	found = (struct FREE_EXTENT*)NULL;
+	while (root && (root->lcn != lcn)) {
+		if ((root->lcn > lcn) == after)
+			found = root;
+		root = root->link[t].child[root->lcn < lcn];
+	}
+	return (root ? root : found);
+}
+
+/*
+ *		Get the index of the zone containing a cluster
+ */
+
+static int free_extent_zone(const ntfs_volume *vol, LCN lcn)
+{
+	if (lcn < vol->mft_zone_start)
+		return (2);
+	if (lcn < vol->mft_zone_end)
+		return (0);
+	return (1);
+}
+
+/*
+ *		Get the first cluster beyond the zone containing a cluster
+ */
+
+static LCN free_extent_zone_end(const ntfs_volume *vol, LCN lcn)
+{
+	if (lcn < vol->mft_zone_start)
+		return (vol->mft_zone_start);
+	if (lcn < vol->mft_zone_end)
+		return (vol->mft_zone_end);
+	return (vol->nr_clusters);
+}
+
+/*
+ *		Get the first cluster of a zone, by its index
+ */
+
+static LCN free_extent_zone_start(const ntfs_volume *vol, int zone)
+{
+	if (zone == 2)
+		return (0);
+	if (!zone)
+		return (vol->mft_zone_start);
+	return (vol->mft_zone_end);
+}
+
+/*
+ *		Get the size class of an extent
+ *
+ *	Lengths lower than FREE_EXTENT_EXACT are their own class, the
+ *	next classes are for lengths from 16 to 31, 32 to 63, etc.
+ */
+
+static int free_extent_class(s64 length)
+{
+	int c;
+
+	if (length < FREE_EXTENT_EXACT)
+		return (length);
+	for (c = FREE_EXTENT_EXACT - 4; length > 1; c++)
+		length >>= 1;
+	return (c);
+}
+
+static void free_extent_link(ntfs_volume *vol, struct FREE_EXTENT *fe)
+{
+	struct FREE_EXTENT **root;
+
+	root = &vol->free_extents->classes[free_extent_zone(vol, fe->lcn)]
+				[free_extent_class(fe->length)];
+	*root = free_extent_insert(*root, fe, BY_CLASS);
+}
+
+static void free_extent_unlink(ntfs_volume *vol, struct FREE_EXTENT *fe)
+{
+	struct FREE_EXTENT **root;
+
+	root = &vol->free_extents->classes[free_extent_zone(vol, fe->lcn)]
+				[free_extent_class(fe->length)];
+	*root = free_extent_remove(*root, fe, BY_CLASS);
+}
+
+static void free_extent_free_tree(struct FREE_EXTENT *root)
+{
+	if (root) {
+		free_extent_free_tree(root->link[BY_LCN].child[0]);
+		free_extent_free_tree(root->link[BY_LCN].child[1]);
+		free(root);
+	}
+}
+
+/**
+ * ntfs_free_extents_release - free the index of free clusters
+ * @vol:	ntfs volume
+ *
+ * The index is rebuilt on next allocation if NV_FreeExtents is still set.
+ */
+void ntfs_free_extents_release(ntfs_volume *vol)
+{
+	if (vol->free_extents) {
+		free_extent_free_tree(vol->free_extents->all);
+		free(vol->free_extents);
+		vol->free_extents = (struct FREE_EXTENTS*)NULL;
+	}
+}
+
+/*
+ *		Record free clusters into the index
+ *
+ *	The clusters are split at zone boundaries and merged with the
+ *	adjacent extents of the same zone.
+ *
+ *	Returns 0 if successful, or -1 if the clusters overlap an extent
+ *	or memory is short, the index is then unchanged for the clusters
+ *	which could not be recorded.
+ */
+
+static int ntfs_free_extents_insert(ntfs_volume *vol, LCN lcn, s64 count)
+{
+	struct FREE_EXTENTS *fx;
+	struct FREE_EXTENT *prev;
+	struct FREE_EXTENT *next;
+	struct FREE_EXTENT *fe;
+	LCN end;
+	int zone;
+
+	fx = vol->free_extents;
+	while (count > 0) {
+		end = free_extent_zone_end(vol, lcn);
+		if (end > lcn + count)
+			end = lcn + count;
+		zone = free_extent_zone(vol, lcn);
+		prev = free_extent_find(fx->all, lcn, BY_LCN, FALSE);
+		next = free_extent_find(fx->all, lcn, BY_LCN, TRUE);
+		if ((prev && (prev->lcn + prev->length > lcn))
+		    || (next && (next->lcn < end))) {
+			errno = EIO;
+			return (-1);
+		}
+		if (prev && ((prev->lcn + prev->length) != lcn
+			    || (free_extent_zone(vol, prev->lcn) != zone)))
+			prev = (struct FREE_EXTENT*)NULL;
+		if (next && ((next->lcn != end)
+			    || (free_extent_zone(vol, next->lcn) != zone)))
+			next = (struct FREE_EXTENT*)NULL;
+		if (prev && next) {
+			free_extent_unlink(vol, prev);
+			free_extent_unlink(vol, next);
+			fx->all = free_extent_remove(fx->all, next, BY_LCN);
+			prev->length = next->lcn + next->length - prev->lcn;
+			free(next);
+			fx->count--;
+			free_extent_link(vol, prev);
+		} else if (prev) {
+			free_extent_unlink(vol, prev);
+			prev->length += end - lcn;
+			free_extent_link(vol, prev);
+		} else if (next) {
+			/* nothing in between, the lcn order is kept */
+			free_extent_unlink(vol, next);
+			next->length += next->lcn - lcn;
+			next->lcn = lcn;
+			free_extent_link(vol, next);
+		} else {
+			fe = (struct FREE_EXTENT*)ntfs_malloc(sizeof(*fe));
+			if (!fe)
+				return (-1);
+			fe->lcn = lcn;
+			fe->length = end - lcn;
+			fx->all = free_extent_insert(fx->all, fe, BY_LCN);
+			free_extent_link(vol, fe);
+			fx->count++;
+		}
+		count -= end - lcn;
+		lcn = end;
+	}
+	return (0);
+}
+
+/*
+ *		Remove clusters being allocated from an extent
+ *
+ *	Returns 0 if successful, or -1 if memory is short, the extent
+ *	is then unchanged
+ */
+
+static int ntfs_free_extents_take(ntfs_volume *vol, struct FREE_EXTENT *fe,
+			LCN lcn, s64 count)
+{
+	struct FREE_EXTENTS *fx;
+	struct FREE_EXTENT *tail;
+	s64 tail_length;
+
+	fx = vol->free_extents;
+	tail_length = fe->lcn + fe->length - lcn - count;
+	tail = (struct FREE_EXTENT*)NULL;
+	if ((lcn > fe->lcn) && tail_length) {
+		tail = (struct FREE_EXTENT*)ntfs_malloc(sizeof(*tail));
+		if (!tail)
+			return (-1);
+	}
+	free_extent_unlink(vol, fe);
+	if (lcn > fe->lcn) {
+		fe->length = lcn - fe->lcn;
+		free_extent_link(vol, fe);
+		if (tail) {
+			tail->lcn = lcn + count;
+			tail->length = tail_length;
+			fx->all = free_extent_insert(fx->all, tail, BY_LCN);
+			free_extent_link(vol, tail);
+			fx->count++;
+		}
+	} else if (tail_length) {
+		/* nothing in between, the lcn order is kept */
+		fe->lcn = lcn + count;
+		fe->length = tail_length;
+		free_extent_link(vol, fe);
+	} else {
+		fx->all = free_extent_remove(fx->all, fe, BY_LCN);
+		free(fe);
+		fx->count--;
+	}
+	return (0);
+}
+
+/*
+ *		Record clusters which have been freed in $Bitmap
+ *
+ *	If the index gets out of sync, it is dropped, to be rebuilt
+ *	from $Bitmap on next allocation.
+ */
+
+static void ntfs_free_extents_freed(ntfs_volume *vol, LCN lcn, s64 count)
+{
+	if (vol->free_extents && ntfs_free_extents_insert(vol, lcn, count)) {
+		ntfs_log_error("Could not index free clusters (%lld, %lld), "
+				"dropping the index\n",
+				(long long)lcn, (long long)count);
+		ntfs_free_extents_release(vol);
+	}
+}
+
+/*
+ *		Build the index of free clusters from $Bitmap
+ *
+ *	Returns 0 if successful, or -1 with errno set
+ */
+
+static int ntfs_free_extents_build(ntfs_volume *vol)
+{
+	u8 *buf;
+	s64 br, bits, i;
+	LCN pos, run;
+	int err;
+
+	vol->free_extents = (struct FREE_EXTENTS*)
+				ntfs_calloc(sizeof(struct FREE_EXTENTS));
+	buf = (u8*)ntfs_malloc(FREE_EXTENT_BSIZE);
+	if (!vol->free_extents || !buf)
+		goto err_out;
+	run = -1;
+	for (pos = 0; pos < vol->nr_clusters; pos += bits) {
+		br = ntfs_attr_pread(vol->lcnbmp_na, pos >> 3,
+					FREE_EXTENT_BSIZE, buf);
+		if (br <= 0) {
+			if (!br)
+				errno = EIO;
+			goto err_out;
+		}
+		bits = br << 3;
+		if (bits > vol->nr_clusters - pos)
+			bits = vol->nr_clusters - pos;
+		i = 0;
+		while (i < bits) {
+			/* Skip whole bytes when possible */
+			if (!(i & 7) && (i + 8 <= bits)
+			    && ((buf[i >> 3] == 0xff)
+				|| (!buf[i >> 3] && (run >= 0)))) {
+				if (buf[i >> 3] && (run >= 0)) {
+					if (ntfs_free_extents_insert(vol,
+							run, pos + i - run))
+						goto err_out;
+					run = -1;
+				}
+				i += 8;
+				continue;
+			}
+			if (buf[i >> 3] & (1 << (i & 7))) {
+				if (run >= 0) {
+					if (ntfs_free_extents_insert(vol,
+							run, pos + i - run))
+						goto err_out;
+					run = -1;
+				}
+			} else
+				if (run < 0)
+					run = pos + i;
+			i++;
+		}
+	}
+	if ((run >= 0)
+	    && ntfs_free_extents_insert(vol, run, vol->nr_clusters - run))
+		goto err_out;
+	free(buf);
+	ntfs_log_debug("Free extent index : %lld extents\n",
+			(long long)vol->free_extents->count);
+	return (0);
+err_out:
+	err = errno;
+	free(buf);
+	ntfs_free_extents_release(vol);
+	errno = err;
+	return (-1);
+}
+
+/*
+ *		Find the first extent of a size class starting at or after
+ *	@pos which is big enough for @count clusters
+ *
+ *	Only a few extents are checked, as in the class of @count some
+ *	may be too small.
+ *
+ *	Returns NULL if there is none
+ */
+
+static struct FREE_EXTENT *free_extent_find_fit(struct FREE_EXTENT *root,
+			LCN pos, s64 count)
+{
+	struct FREE_EXTENT *fe;
+	int probes;
+
+	fe = free_extent_find(root, pos, BY_CLASS, TRUE);
+	for (probes = 1; fe && (fe->length < count)
+			&& (probes < FREE_EXTENT_PROBES); probes++)
+		fe = free_extent_find(root, fe->lcn + 1, BY_CLASS, TRUE);
+	if (fe && (fe->length < count))
+		fe = (struct FREE_EXTENT*)NULL;
+	return (fe);
+}
+
+/*
+ *		Select the extent to allocate from in a zone
+ *
+ *	As the bitmap scan does, the clusters are allocated at @pos if
+ *	the extent containing it has room for @count clusters from
+ *	there, otherwise in the first extent big enough after @pos,
+ *	wrapping to the start of the zone. All the size classes big
+ *	enough are searched, so that the allocation is sequential. If no
+ *	extent is big enough, the longest of the next few extents is
+ *	selected, wrapping likewise.
+ *	The lcn to allocate at is returned in @plcn.
+ *
+ *	Returns NULL if the zone has no free cluster
+ */
+
+static struct FREE_EXTENT *ntfs_free_extents_select(ntfs_volume *vol,
+			int zone, s64 count, LCN pos, LCN *plcn)
+{
+	struct FREE_EXTENT **classes;
+	struct FREE_EXTENT *best;
+	struct FREE_EXTENT *fe;
+	int c, probes, wrap;
+
+	classes = vol->free_extents->classes[zone];
+		/* the extent containing pos */
+	fe = free_extent_find(vol->free_extents->all, pos, BY_LCN, FALSE);
+	if (fe && (free_extent_zone(vol, fe->lcn) == zone)
+	    && (fe->lcn + fe->length >= pos + count)) {
+		*plcn = pos;
+		return (fe);
+	}
+		/* the first big enough after pos, then from zone start */
+	best = (struct FREE_EXTENT*)NULL;
+	for (wrap = 0; !best && (wrap < 2); wrap++) {
+		for (c = free_extent_class(count);
+				c < FREE_EXTENT_CLASSES; c++) {
+			if (!classes[c])
+				continue;
+			fe = free_extent_find_fit(classes[c],
+					(wrap ? 0 : pos), count);
+			if (fe && (!best || (fe->lcn < best->lcn)))
+				best = fe;
+		}
+	}
+	if (best) {
+		*plcn = best->lcn;
+		return (best);
+	}
+		/* if there is none, use the longest of the next ones */
+	for (wrap = 0; !best && (wrap < 2); wrap++) {
+		fe = free_extent_find(vol->free_extents->all,
+				(wrap ? free_extent_zone_start(vol, zone) : pos),
+				BY_LCN, TRUE);
+		for (probes = 0; fe && (probes < FREE_EXTENT_PROBES)
+			    && (free_extent_zone(vol, fe->lcn) == zone);
+				probes++) {
+			if (!best || (fe->length > best->length))
+				best = fe;
+			fe = free_extent_find(vol->free_extents->all,
+					fe->lcn + 1, BY_LCN, TRUE);
+		}
+	}
+	if (!best)
+		return ((struct FREE_EXTENT*)NULL);
+	*plcn = best->lcn;
+	return (best);
+}
+
+/*
+ *		Allocate clusters from an extent and append them to a runlist
+ *
+ *	Returns 0 if successful, or -1 with errno set
+ */
+
+static int ntfs_free_extents_alloc(ntfs_volume *vol, struct FREE_EXTENT *fe,
+			LCN lcn, s64 count, runlist **prl, int *prlpos,
+			int *prlsize, VCN start_vcn)
+{
+	runlist *rl;
+	runlist *trl;
+	int rlpos;
+
+	rl = *prl;
+	rlpos = *prlpos;
+	if ((rlpos + 2) * (int)sizeof(runlist) >= *prlsize) {
+		trl = realloc(rl, *prlsize + 4096);
+		if (!trl) {
+			errno = ENOMEM;
+			return (-1);
+		}
+		*prlsize += 4096;
+		*prl = rl = trl;
+	}
+	if (ntfs_free_extents_take(vol, fe, lcn, count))
+		return (-1);
+	if (ntfs_bitmap_set_run(vol->lcnbmp_na, lcn, count)) {
+		ntfs_log_perror("Failed to allocate clusters (%lld, %lld)",
+				(long long)lcn, (long long)count);
+		/* the bitmap state is unknown */
+		ntfs_free_extents_release(vol);
+		return (-1);
+	}
+	if (NVolFreeSpaceKnown(vol)) {
+		if (vol->free_clusters < count)
+			ntfs_log_error("Not enough free clusters (%lld)!\n",
+					(long long)vol->free_clusters);
+		else
+			vol->free_clusters -= count;
+	}
+	if (rlpos && (rl[rlpos - 1].lcn + rl[rlpos - 1].length == lcn))
+		rl[rlpos - 1].length += count;
+	else {
+		rl[rlpos].vcn = (rlpos ? rl[rlpos - 1].vcn
+				+ rl[rlpos - 1].length : start_vcn);
+		rl[rlpos].lcn = lcn;
+		rl[rlpos].length = count;
+		*prlpos = ++rlpos;
+	}
+	ntfs_log_debug("RUN:   %-16lld %-16lld %-16lld\n",
+		       (long long)rl[rlpos - 1].vcn,
+		       (long long)rl[rlpos - 1].lcn,
+		       (long long)rl[rlpos - 1].length);
+	return (0);
+}
+
+/*
+ *		Allocate clusters using the free extent index
+ *
+ *	This follows the policy of the bitmap based allocator : clusters
+ *	are first allocated at @start_lcn as long as they are free, then
+ *	from the current zone, and from the other zones in the same order.
+ *	Within a zone, extents big enough for the remaining clusters are
+ *	preferred, so that fewer and larger runs are allocated.
+ */
+
+static runlist *ntfs_cluster_alloc_indexed(ntfs_volume *vol, VCN start_vcn,
+		s64 count, LCN start_lcn, const NTFS_CLUSTER_ALLOCATION_ZONES zone)
+{
+	static const u8 zone_order[][3] = {
+		{ ZONE_MFT, ZONE_DATA1, ZONE_DATA2 },
+		{ ZONE_DATA1, ZONE_DATA2, ZONE_MFT },
+		{ ZONE_DATA2, ZONE_DATA1, ZONE_MFT },
+	} ;
+	const u8 *order;
+	struct FREE_EXTENT *fe;
+	runlist *rl;
+	LCN pos, zone_pos, lcn;
+	s64 clusters, len;
+	int i, err, rlpos, rlsize;
+	u8 search_zone;
+	BOOL used_zone_pos;
+
+	rl = (runlist*)NULL;
+	rlpos = rlsize = 0;
+	pos = start_lcn;
+	if (pos < 0)
+		pos = (zone == DATA_ZONE ? vol->data1_zone_pos
+				: vol->mft_zone_pos);
+	i = free_extent_zone(vol, pos);
+	order = zone_order[i];
+	search_zone = order[0];
+	clusters = count;
+	used_zone_pos = (start_lcn < 0);
+
+	if (start_lcn >= 0) {
+		fe = free_extent_find(vol->free_extents->all, start_lcn,
+					BY_LCN, FALSE);
+		if (fe && (fe->lcn + fe->length > start_lcn)) {
+			len = fe->lcn + fe->length - start_lcn;
+			if (len > clusters)
+				len = clusters;
+			if (ntfs_free_extents_alloc(vol, fe, start_lcn, len,
+					&rl, &rlpos, &rlsize, start_vcn))
+				goto err_ret;
+			clusters -= len;
+		}
+	}
+	for (i = 0; clusters && (i < FREE_EXTENT_ZONES); i++) {
+		search_zone = order[i];
+		if (search_zone == ZONE_MFT)
+			zone_pos = vol->mft_zone_pos;
+		else if (search_zone == ZONE_DATA1)
+			zone_pos = vol->data1_zone_pos;
+		else
+			zone_pos = vol->data2_zone_pos;
+		if (i || (start_lcn < 0))
+			pos = zone_pos;
+		used_zone_pos = TRUE;
+		while (clusters) {
+			fe = ntfs_free_extents_select(vol, search_zone >> 1,
+					clusters, pos, &lcn);
+			if (!fe)
+				break;
+			len = fe->lcn + fe->length - lcn;
+			if (len > clusters)
+				len = clusters;
+			pos = lcn + len;
+			if (ntfs_free_extents_alloc(vol, fe, lcn, len,
+					&rl, &rlpos, &rlsize, start_vcn))
+				goto err_ret;
+			clusters -= len;
+		}
+		if (clusters) {
+			ntfs_log_trace("Zone %d is full.\n", search_zone);
+			vol->full_zones |= search_zone;
+		}
+	}
+	if (clusters) {
+		ntfs_log_trace("All zones are finished, no space on device.\n");
+		errno = ENOSPC;
+		goto err_ret;
+	}
+	if (used_zone_pos)
+		ntfs_cluster_update_zone_pos(vol, search_zone,
+				rl[rlpos - 1].lcn + rl[rlpos - 1].length
+					+ NTFS_LCNALLOC_SKIP);
+	rl[rlpos].vcn = rl[rlpos - 1].vcn + rl[rlpos - 1].length;
+	rl[rlpos].lcn = LCN_RL_NOT_MAPPED;
+	rl[rlpos].length = 0;
+	return (rl);
+err_ret:
+	err = errno;
+	if (rlpos) {
+		rl[rlpos].vcn = rl[rlpos - 1].vcn + rl[rlpos - 1].length;
+		rl[rlpos].lcn = LCN_RL_NOT_MAPPED;
+		rl[rlpos].length = 0;
+		ntfs_cluster_free_from_rl(vol, rl);
+	}
+	free(rl);
+	errno = err;
+	ntfs_log_perror("Failed to allocate clusters");
+	return ((runlist*)NULL);
+}
+
 /**
  * ntfs_cluster_alloc - allocate clusters on an ntfs volume
  * @vol:	mounted ntfs volume on which to allocate the clusters
@@ -231,6 +973,9 @@ static int bitmap_writeback(ntfs_volume *vol, s64 pos, s64 size, void *b,
  *   1) implements MFT zone reservation
  *   2) causes reduction in fragmentation. 
  * The code is not optimized for speed.
+ *
+ * When NV_FreeExtents is set, the free clusters are instead searched for in
+ * an index of free extents, following the same zone policy.
  */
 runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 		LCN start_lcn, const NTFS_CLUSTER_ALLOCATION_ZONES zone)
@@ -272,6 +1017,16 @@ runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 		goto out;
 	}
 
+	if (NVolFreeExtents(vol)) {
+		if (vol->free_extents || !ntfs_free_extents_build(vol)) {
+			rl = ntfs_cluster_alloc_indexed(vol, start_vcn, count,
+					start_lcn, zone);
+			goto out;
+		}
+		ntfs_log_perror("Failed to build the free extent index");
+		NVolClearFreeExtents(vol);
+	}
+
 	buf = ntfs_malloc(NTFS_LCNALLOC_BSIZE);
 	if (!buf)
 		goto out;
@@ -602,6 +1357,7 @@ int ntfs_cluster_free_from_rl(ntfs_volume *vol, runlist *rl)
 						(long long)rl->length);
 				goto out;
 			}
+			ntfs_free_extents_freed(vol, rl->lcn, rl->length);
 			nr_freed += rl->length ; 
 		}
 	}
@@ -641,6 +1397,7 @@ int ntfs_cluster_free_basic(ntfs_volume *vol, s64 lcn, s64 count)
 					(long long)count);
 				goto out;
 		}
+		ntfs_free_extents_freed(vol, lcn, count);
 		nr_freed += count; 
 	}
 	ret = 0;
@@ -714,6 +1471,7 @@ int ntfs_cluster_free(ntfs_volume *vol, ntfs_attr *na, VCN start_vcn, s64 count)
 		if (ntfs_bitmap_clear_run(vol->lcnbmp_na, rl->lcn + delta,
 					  to_free))
 			goto leave;
+		ntfs_free_extents_freed(vol, rl->lcn + delta, to_free);
 		nr_freed = to_free;
 	} 
 
@@ -751,6 +1509,7 @@ int ntfs_cluster_free(ntfs_volume *vol, ntfs_attr *na, VCN start_vcn, s64 count)
 						__FUNCTION__);
 				goto out;
 			}
+			ntfs_free_extents_freed(vol, rl->lcn, to_free);
 			nr_freed += to_free;
 		}
 
@@ -777,3 +1536,312 @@ leave:
 	ntfs_log_leave("\n");
 	return ret;
 }
+
+#ifdef NTFS_TEST
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#include <time.h>
+
+static u32 test_lcn_random(u32 *seed)
+{
+	*seed = *seed*1103515245 + 12345;
+	return ((*seed >> 8) & 0xffffff);
+}
+
+/*
+ *		Check the free extent index against $Bitmap
+ *
+ *	Every free run in $Bitmap, split at the zone boundaries, must be
+ *	an extent of the index, in the same order, and every extent must
+ *	be in the tree of its size class.
+ *
+ *	Returns the count of differences
+ */
+
+static int test_lcn_check(ntfs_volume *vol, u8 *bm, s64 bmsize)
+{
+	struct FREE_EXTENTS *fx;
+	struct FREE_EXTENT *fe;
+	LCN lcn, end, zone_end;
+	s64 count;
+	int bad;
+
+	fx = vol->free_extents;
+	if (!fx || (ntfs_attr_pread(vol->lcnbmp_na, 0, bmsize, bm)
+							!= bmsize)) {
+		printf("No index or could not read $Bitmap\n");
+		return (1);
+	}
+	bad = 0;
+	count = 0;
+	fe = free_extent_find(fx->all, 0, BY_LCN, TRUE);
+	lcn = 0;
+	while (lcn < vol->nr_clusters) {
+		if (bm[lcn >> 3] & (1 << (lcn & 7))) {
+			lcn++;
+			continue;
+		}
+		zone_end = free_extent_zone_end(vol, lcn);
+		end = lcn + 1;
+		while ((end < zone_end) && !(bm[end >> 3] & (1 << (end & 7))))
+			end++;
+		if (!fe || (fe->lcn != lcn) || (fe->length != end - lcn)) {
+			if (bad++ < 10)
+				printf("free run (%lld, %lld), extent"
+					" (%lld, %lld)\n",
+					(long long)lcn, (long long)(end - lcn),
+					(long long)(fe ? fe->lcn : -1),
+					(long long)(fe ? fe->length : 0));
+		}
+		if (fe) {
+			if (free_extent_find(fx->classes
+					[free_extent_zone(vol, fe->lcn)]
+					[free_extent_class(fe->length)],
+					fe->lcn, BY_CLASS, FALSE) != fe)
+				bad++;
+			fe = free_extent_find(fx->all, fe->lcn + 1,
+					BY_LCN, TRUE);
+		}
+		count++;
+		lcn = end;
+	}
+	if (fe || (count != fx->count)) {
+		printf("%lld free runs, %lld extents\n",
+			(long long)count, (long long)fx->count);
+		bad++;
+	}
+	return (bad);
+}
+
+/*
+ *		Allocate and free clusters by both allocators
+ *
+ *	The free space of the volume is first fragmented by marking
+ *	short runs as used in $Bitmap. The same sequence of random sized
+ *	allocations is then made by the bitmap scan and by the free extent
+ *	index, half of them are freed, then the rest. The index is checked
+ *	against $Bitmap after each step, and $Bitmap must be back to its
+ *	fragmented state in the end. The original $Bitmap and zone
+ *	positions are restored before unmounting.
+ *
+ *	The placements are compared : the index must not split the
+ *	allocations into more runs than the bitmap scan, and it must
+ *	allocate as sequentially, so an allocation starting before the
+ *	end of the previous one is counted as a step back. So that the
+ *	comparison is meaningful, all the allocations must fit in three
+ *	quarters of the free space left by the fragmentation.
+ *
+ *	Returns 0 if the test passed
+ */
+
+static int test_lcn_alloc(const char *name, int count, u32 seed)
+{
+	ntfs_volume *vol;
+	runlist **rls;
+	LCN *first[2];
+	s64 runs[2];
+	int backs[2];
+	LCN prev_end;
+	u8 *orig;
+	u8 *bm;
+	u8 *check;
+	s64 bmsize;
+	s64 free_clusters;
+	s64 wanted;
+	LCN zone_pos[3];
+	LCN lcn;
+	u32 rnd;
+	u32 n;
+	clock_t start;
+	double secs;
+	int mode;
+	int bad;
+	int done;
+	int same;
+	int i;
+
+	vol = ntfs_mount(name, 0);
+	if (!vol) {
+		printf("Could not mount %s\n", name);
+		return (1);
+	}
+	bmsize = vol->lcnbmp_na->data_size;
+	orig = (u8*)ntfs_malloc(bmsize);
+	bm = (u8*)ntfs_malloc(bmsize);
+	check = (u8*)ntfs_malloc(bmsize);
+	rls = (runlist**)ntfs_calloc(count*sizeof(runlist*));
+	first[0] = (LCN*)ntfs_malloc(count*sizeof(LCN));
+	first[1] = (LCN*)ntfs_malloc(count*sizeof(LCN));
+	bad = 1;
+	if (!orig || !bm || !check || !rls || !first[0] || !first[1]
+	    || (ntfs_attr_pread(vol->lcnbmp_na, 0, bmsize, orig) != bmsize))
+		goto out;
+		/* fragment the free space */
+	memcpy(bm, orig, bmsize);
+	rnd = seed;
+	lcn = 0;
+	while (lcn < vol->nr_clusters) {
+		lcn += test_lcn_random(&rnd) % 256 + 1;
+		for (n = test_lcn_random(&rnd) % 16 + 1;
+				n && (lcn < vol->nr_clusters); n--, lcn++)
+			bm[lcn >> 3] |= 1 << (lcn & 7);
+	}
+	if (ntfs_attr_pwrite(vol->lcnbmp_na, 0, bmsize, bm) != bmsize)
+		goto restore;
+	free_clusters = 0;
+	for (lcn=0; lcn<vol->nr_clusters; lcn++)
+		if (!(bm[lcn >> 3] & (1 << (lcn & 7))))
+			free_clusters++;
+	wanted = 0;
+	rnd = seed;
+	for (i=0; i<count; i++)
+		wanted += test_lcn_random(&rnd) % 128 + 1;
+	if (4*wanted > 3*free_clusters) {
+		printf("%lld clusters wanted, %lld free : use a bigger"
+				" volume or a lower count\n",
+			(long long)wanted, (long long)free_clusters);
+		bad = 1;
+		goto restore;
+	}
+	zone_pos[0] = vol->mft_zone_pos;
+	zone_pos[1] = vol->data1_zone_pos;
+	zone_pos[2] = vol->data2_zone_pos;
+	bad = 0;
+	for (mode=0; mode<2; mode++) {
+		if (mode)
+			NVolSetFreeExtents(vol);
+		else
+			NVolClearFreeExtents(vol);
+		vol->mft_zone_pos = zone_pos[0];
+		vol->data1_zone_pos = zone_pos[1];
+		vol->data2_zone_pos = zone_pos[2];
+		vol->full_zones = 0;
+		rnd = seed;
+		runs[mode] = 0;
+		backs[mode] = 0;
+		prev_end = 0;
+		done = 0;
+		start = clock();
+		for (i=0; i<count; i++) {
+			rls[i] = ntfs_cluster_alloc(vol, 0,
+					test_lcn_random(&rnd) % 128 + 1,
+					-1, DATA_ZONE);
+			if (!rls[i])
+				break;
+			first[mode][i] = rls[i][0].lcn;
+			if (rls[i][0].lcn < prev_end)
+				backs[mode]++;
+			for (n=0; rls[i][n].length; n++)
+				runs[mode]++;
+			prev_end = rls[i][n - 1].lcn + rls[i][n - 1].length;
+			done++;
+		}
+		secs = (double)(clock() - start)/CLOCKS_PER_SEC;
+		if (done < count) {
+			printf("Allocation %d failed : %s\n", done,
+				strerror(errno));
+			bad++;
+		}
+		printf("%s : %d allocations in %.3fs, %.2f runs"
+				" per allocation, %d steps back\n",
+			(mode ? "index " : "bitmap"), done, secs,
+			(done ? (double)runs[mode]/done : 0.0),
+			backs[mode]);
+		if (mode)
+			bad += test_lcn_check(vol, check, bmsize);
+		for (i=0; i<done; i++)
+			if ((i & 1) && rls[i]) {
+				if (ntfs_cluster_free_from_rl(vol, rls[i]))
+					bad++;
+				free(rls[i]);
+				rls[i] = (runlist*)NULL;
+			}
+		if (mode)
+			bad += test_lcn_check(vol, check, bmsize);
+		for (i=0; i<done; i++)
+			if (rls[i]) {
+				if (ntfs_cluster_free_from_rl(vol, rls[i]))
+					bad++;
+				free(rls[i]);
+				rls[i] = (runlist*)NULL;
+			}
+		if (mode) {
+			bad += test_lcn_check(vol, check, bmsize);
+			printf("index  : %lld free extents\n",
+				(long long)(vol->free_extents
+					? vol->free_extents->count : 0));
+		}
+		if ((ntfs_attr_pread(vol->lcnbmp_na, 0, bmsize, check)
+							!= bmsize)
+		    || memcmp(check, bm, bmsize)) {
+			printf("$Bitmap not restored by freeing\n");
+			bad++;
+		}
+	}
+	if (!bad) {
+		same = 0;
+		for (i=0; i<count; i++)
+			if (first[0][i] == first[1][i])
+				same++;
+		printf("%d allocations at the same lcn\n", same);
+		if (runs[1] > runs[0]) {
+			printf("More runs allocated by the index\n");
+			bad++;
+		}
+		if (backs[1] > backs[0]) {
+			printf("Less sequential allocations by the index\n");
+			bad++;
+		}
+	}
+	vol->mft_zone_pos = zone_pos[0];
+	vol->data1_zone_pos = zone_pos[1];
+	vol->data2_zone_pos = zone_pos[2];
+	vol->full_zones = 0;
+restore:
+	NVolClearFreeExtents(vol);
+	ntfs_free_extents_release(vol);
+	if (ntfs_attr_pwrite(vol->lcnbmp_na, 0, bmsize, orig) != bmsize) {
+		printf("Could not restore $Bitmap\n");
+		bad++;
+	}
+out:
+	free(orig);
+	free(bm);
+	free(check);
+	free(rls);
+	free(first[0]);
+	free(first[1]);
+	if (ntfs_umount(vol, FALSE))
+		bad++;
+	printf("%s\n", (bad ? "** failed **" : "passed"));
+	return (bad != 0);
+}
+
+/**
+ * test_lcn_main - Cluster allocation test: Program start (main)
+ * @argc:
+ * @argv:
+ *
+ * "alloc image [count [seed]]" compares the allocators on a copy of
+ * a volume, which is restored afterwards.
+ *
+ * Returns 0 if the test passed
+ */
+int test_lcn_main(int argc, char *argv[])
+{
+	int res;
+
+	res = 1;
+	if ((argc >= 3) && (argc <= 5) && !strcmp(argv[1], "alloc"))
+		res = test_lcn_alloc(argv[2],
+				(argc > 3 ? atoi(argv[3]) : 3000),
+				(argc > 4 ? strtoul(argv[4], (char**)NULL, 0)
+					: 1));
+	else
+		printf("lcn [alloc] {args}\n");
+	return (res);
+}
+
+#endif
@@ -43,6 +43,9 @@
 #include <limits.h>
 #endif
 #include <time.h>
+#ifdef ENABLE_MFT_SCAN_THREADS
+#include <pthread.h>
+#endif
 
 #include "compat.h"
 #include "types.h"
@@ -55,9 +58,140 @@
 #include "layout.h"
 #include "lcnalloc.h"
 #include "mft.h"
+#include "mst.h"
+#include "cache.h"
 #include "logging.h"
 #include "misc.h"
 
+#if CACHE_MFTREC_SIZE
+
+/*
+ *		Compare two entries of the mft record cache
+ */
+
+static int mftrec_compare(const struct CACHED_GENERIC *cached,
+			const struct CACHED_GENERIC *item)
+{
+	return (((const struct CACHED_MFTREC*)cached)->inum
+			!= ((const struct CACHED_MFTREC*)item)->inum);
+}
+
+/*
+ *		Hash an entry of the mft record cache
+ */
+
+int ntfs_mft_record_hash(const struct CACHED_GENERIC *item)
+{
+	return (((const struct CACHED_MFTREC*)item)->inum
+					% (2*CACHE_MFTREC_SIZE));
+}
+
+/*
+ *		Get an mft record from the cache of prefetched records
+ *
+ *	A prefetched record is only used once : it is removed from the
+ *	cache when it is used, the inode built from it is then kept in
+ *	the inode caches.
+ *
+ *	Returns TRUE if the record was found and copied to @m
+ */
+
+static BOOL ntfs_mft_cached_read(const ntfs_volume *vol, const MFT_REF mref,
+			MFT_RECORD *m)
+{
+	struct CACHED_MFTREC item;
+	struct CACHED_MFTREC *cached;
+	BOOL found;
+
+	found = FALSE;
+	if (vol->mftrec_cache) {
+		item.inum = MREF(mref);
+		item.rec = (MFT_RECORD*)NULL;
+		item.recsize = 0;
+		ntfs_lock_cache(vol->mftrec_cache);
+		cached = (struct CACHED_MFTREC*)ntfs_fetch_cache(
+				vol->mftrec_cache, GENERIC(&item),
+				mftrec_compare);
+		if (cached) {
+			memcpy(m, cached->rec, vol->mft_record_size);
+			ntfs_remove_cache(vol->mftrec_cache,
+				(struct CACHED_GENERIC*)cached, 0);
+			found = TRUE;
+		}
+		ntfs_unlock_cache(vol->mftrec_cache);
+	}
+	return (found);
+}
+
+/*
+ *		Drop prefetched copies of mft records being written
+ */
+
+static void ntfs_mft_cached_drop(const ntfs_volume *vol, VCN m, s64 count)
+{
+	struct CACHED_MFTREC item;
+
+	if (vol->mftrec_cache) {
+		item.rec = (MFT_RECORD*)NULL;
+		item.recsize = 0;
+		for (item.inum=m; item.inum<(u64)(m + count); item.inum++)
+			ntfs_invalidate_cache(vol->mftrec_cache,
+				GENERIC(&item), mftrec_compare, 0);
+	}
+}
+
+#else /* CACHE_MFTREC_SIZE */
+
+static BOOL ntfs_mft_cached_read(const ntfs_volume *vol
+				__attribute__((unused)),
+			const MFT_REF mref __attribute__((unused)),
+			MFT_RECORD *m __attribute__((unused)))
+{
+	return (FALSE);
+}
+
+static void ntfs_mft_cached_drop(const ntfs_volume *vol
+				__attribute__((unused)),
+			VCN m __attribute__((unused)),
+			s64 count __attribute__((unused)))
+{
+}
+
+#endif /* CACHE_MFTREC_SIZE */
+
+/*
+ *		Read mft records, with or without warning about bad fixups
+ *
+ *	When the volume is shared by threads, a copy of the attribute
+ *	of $MFT is used, so that the runlist lookup hint is not shared.
+ *	The runlist has then been fully mapped, so that it is never
+ *	changed by a read.
+ *
+ *	Returns the number of records read, or -1 with errno set
+ */
+
+static s64 ntfs_mft_records_pread(const ntfs_volume *vol, VCN m,
+			s64 count, MFT_RECORD *b, BOOL warn)
+{
+	ntfs_attr mft_na;
+	ntfs_attr *na;
+	s64 br;
+
+	na = vol->mft_na;
+	if (vol->locks) {
+		mft_na = *vol->mft_na;
+		na = &mft_na;
+	}
+	br = ntfs_attr_pread(na, m << vol->mft_record_size_bits,
+			count << vol->mft_record_size_bits, b);
+	if (br > 0) {
+		br >>= vol->mft_record_size_bits;
+		ntfs_mst_post_read_fixup_records(b, vol->mft_record_size,
+				br, warn, (int*)NULL);
+	}
+	return (br);
+}
+
 /**
  * ntfs_mft_records_read - read records from the mft from disk
  * @vol:	volume to read from
@@ -104,8 +238,7 @@ int ntfs_mft_records_read(const ntfs_volume *vol, const MFT_REF mref,
 				vol->mft_record_size_bits);
 		return -1;
 	}
-	br = ntfs_attr_mst_pread(vol->mft_na, m << vol->mft_record_size_bits,
-			count, vol->mft_record_size, b);
+	br = ntfs_mft_records_pread(vol, m, count, b, !NVolNoFixupWarn(vol));
 	if (br != count) {
 		if (br != -1)
 			errno = EIO;
@@ -164,6 +297,7 @@ int ntfs_mft_records_write(const ntfs_volume *vol, const MFT_REF mref,
 				vol->mft_record_size_bits);
 		return -1;
 	}
+	ntfs_mft_cached_drop(vol, m, count);
 	if (m < vol->mftmirr_size) {
 		if (!vol->mftmirr_na) {
 			errno = EINVAL;
@@ -362,7 +496,8 @@ int ntfs_file_record_read(const ntfs_volume *vol, const MFT_REF mref,
 		if (!m)
 			return -1;
 	}
-	if (ntfs_mft_record_read(vol, mref, m))
+	if (!ntfs_mft_cached_read(vol, mref, m)
+	    && ntfs_mft_record_read(vol, mref, m))
 		goto err_out;
 
 	if (ntfs_mft_record_check(vol, mref, m))
@@ -385,6 +520,462 @@ err_out:
 	return -1;
 }
 
+#if CACHE_MFTREC_SIZE
+
+static int mftrec_sort(const void *p1, const void *p2)
+{
+	s64 r1 = *(const s64*)p1;
+	s64 r2 = *(const s64*)p2;
+
+	return (r1 < r2 ? -1 : (r1 > r2 ? 1 : 0));
+}
+
+/*
+ *		Read a run of mft records and cache the requested ones
+ *
+ *	@recs[] are the requested records, in increasing order, all of
+ *	them within the run. Records which cannot be mst deprotected
+ *	are not cached, an error will be reported when they are read
+ *	again when opening the inode.
+ *
+ *	Returns the number of records cached
+ */
+
+static int ntfs_mft_prefetch_run(ntfs_volume *vol, const s64 *recs,
+			int count, MFT_RECORD *buf)
+{
+	struct CACHED_MFTREC item;
+	MFT_RECORD *m;
+	s64 first;
+	s64 span;
+	int cached;
+	int i;
+
+	cached = 0;
+	first = recs[0];
+	span = recs[count - 1] - first + 1;
+		/* do not warn about records which were never used */
+	if (ntfs_mft_records_pread(vol, first, span, buf, FALSE) == span) {
+		for (i=0; i<count; i++) {
+			m = (MFT_RECORD*)((char*)buf
+				+ ((recs[i] - first) << vol->mft_record_size_bits));
+			if (ntfs_is_file_record(m->magic)) {
+				item.inum = recs[i];
+				item.rec = m;
+				item.recsize = vol->mft_record_size;
+				if (ntfs_enter_cache(vol->mftrec_cache,
+					GENERIC(&item), mftrec_compare))
+					cached++;
+			}
+		}
+	}
+	return (cached);
+}
+
+#endif /* CACHE_MFTREC_SIZE */
+
+/**
+ * ntfs_mft_prefetch - prefetch a set of mft records
+ * @vol:	volume to read from
+ * @mrefs:	mft references of the records to prefetch
+ * @count:	number of references in @mrefs
+ *
+ * Read the mft records designated by @mrefs (for instance the entries of a
+ * directory about to be looked up one by one) and keep them in the cache of
+ * prefetched records, so that opening their inodes does not read from the
+ * device again.  The references are sorted and neighbouring records are
+ * read together, so that the whole set is fetched by a few large reads.
+ *
+ * Records already cached and records beyond the initialized part of the mft
+ * are skipped, and no more records than the cache can hold are fetched.
+ * Prefetching is only a hint : records which cannot be read are silently
+ * skipped and will be read again when their inodes are opened.
+ *
+ * Return the number of records prefetched, or -1 with errno set to EINVAL
+ * if the arguments are not valid.
+ */
+int ntfs_mft_prefetch(ntfs_volume *vol, const MFT_REF *mrefs, int count)
+{
+#if CACHE_MFTREC_SIZE
+	struct CACHED_MFTREC item;
+	MFT_RECORD *buf;
+	s64 *recs;
+	s64 limit;
+	int kept;
+	int start;
+	int i, j;
+#endif
+	int done;
+
+	if (!vol || !vol->mft_na || (count < 0) || (count && !mrefs)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	done = 0;
+#if CACHE_MFTREC_SIZE
+	if (!vol->mftrec_cache || !count)
+		return (0);
+	recs = (s64*)ntfs_malloc(min(count, CACHE_MFTREC_SIZE)*sizeof(s64));
+	buf = (MFT_RECORD*)ntfs_malloc(MFT_PREFETCH_SPAN
+					* vol->mft_record_size);
+	if (recs && buf) {
+			/* collect the records not cached yet */
+		limit = vol->mft_na->initialized_size
+					>> vol->mft_record_size_bits;
+		item.rec = (MFT_RECORD*)NULL;
+		item.recsize = 0;
+		kept = 0;
+		for (i=0; (i<count) && (kept<CACHE_MFTREC_SIZE); i++) {
+			item.inum = MREF(mrefs[i]);
+			if ((item.inum < (u64)limit)
+			    && !ntfs_fetch_cache(vol->mftrec_cache,
+					GENERIC(&item), mftrec_compare))
+				recs[kept++] = item.inum;
+		}
+		if (kept > 1) {
+			qsort(recs, kept, sizeof(s64), mftrec_sort);
+			for (i=1, j=1; i<kept; i++)
+				if (recs[i] != recs[j - 1])
+					recs[j++] = recs[i];
+			kept = j;
+		}
+			/* read by runs of close records */
+		start = 0;
+		for (i=1; i<=kept; i++) {
+			if ((i == kept)
+			    || (recs[i] - recs[i - 1] > MFT_PREFETCH_GAP + 1)
+			    || (recs[i] - recs[start] >= MFT_PREFETCH_SPAN)) {
+				done += ntfs_mft_prefetch_run(vol,
+					&recs[start], i - start, buf);
+				start = i;
+			}
+		}
+	}
+	free(buf);
+	free(recs);
+#endif
+	return (done);
+}
+
+/*
+ *		Scanning the whole mft
+ *
+ *	The mft is read sequentially in chunks of MFT_SCAN_CHUNK records
+ *	by the calling thread, and the chunks are processed (mst fixups
+ *	and callbacks) by worker threads, several chunks being buffered
+ *	so that reading goes on while the records are being processed.
+ */
+
+enum {
+	SCAN_CHUNK_FREE,	/* may be filled */
+	SCAN_CHUNK_FILLED,	/* ready to be processed */
+	SCAN_CHUNK_BUSY		/* being filled or processed */
+} ;
+
+struct SCANNED_CHUNK {
+	MFT_RECORD *buf;
+	s64 first;		/* first record in the chunk */
+	int count;		/* count of records in the chunk */
+	int state;
+} ;
+
+struct MFT_SCAN {
+	ntfs_volume *vol;
+	ntfs_mft_scan_callback callback;
+	void *data;
+	int which;		/* records selected */
+	int res;		/* first non-zero callback result */
+#ifdef ENABLE_MFT_SCAN_THREADS
+	pthread_mutex_t lock;	/* protects the chunk states, res and end */
+	pthread_cond_t filled;	/* a chunk is ready to be processed */
+	pthread_cond_t emptied;	/* a chunk has been processed */
+	BOOL end;		/* no more chunks to read */
+	int nchunks;
+	struct SCANNED_CHUNK chunks[2*MFT_SCAN_THREADS_MAX];
+#endif
+} ;
+
+/*
+ *		Read a chunk of raw mft records
+ *
+ *	Returns 0 if successful
+ *		-1 if there was an error (errno set)
+ */
+
+static int ntfs_mft_scan_read(ntfs_volume *vol, struct SCANNED_CHUNK *chunk,
+			s64 first, int count)
+{
+	s64 size;
+	s64 br;
+
+	size = (s64)count << vol->mft_record_size_bits;
+	br = ntfs_attr_pread(vol->mft_na, first << vol->mft_record_size_bits,
+			size, chunk->buf);
+	if (br != size) {
+		if (br >= 0)
+			errno = EIO;
+		ntfs_log_perror("Failed to read the mft from record %lld",
+				(long long)first);
+		return (-1);
+	}
+	chunk->first = first;
+	chunk->count = count;
+	return (0);
+}
+
+/*
+ *		Apply the fixups to the records of a chunk and submit
+ *	the selected ones to the callback
+ *
+ *	Returns 0 or the first non-zero value returned by the callback
+ */
+
+static int ntfs_mft_scan_chunk(struct MFT_SCAN *scan,
+			struct SCANNED_CHUNK *chunk)
+{
+	ntfs_volume *vol;
+	MFT_RECORD *m;
+	int which;
+	int res;
+	int i;
+
+	vol = scan->vol;
+	res = 0;
+	ntfs_mst_post_read_fixup_records(chunk->buf, vol->mft_record_size,
+				chunk->count, FALSE, (int*)NULL);
+	for (i=0; (i<chunk->count) && !res; i++) {
+		m = (MFT_RECORD*)((char*)chunk->buf
+				+ ((s64)i << vol->mft_record_size_bits));
+		if (!ntfs_is_file_record(m->magic))
+			which = MFT_SCAN_OTHERS;
+		else
+			if (m->flags & MFT_RECORD_IN_USE)
+				which = MFT_SCAN_IN_USE;
+			else
+				which = MFT_SCAN_DELETED;
+		if (which & scan->which)
+			res = scan->callback(scan->data, chunk->first + i, m);
+	}
+	return (res);
+}
+
+/*
+ *		Scan the mft in the calling thread only
+ */
+
+static int ntfs_mft_scan_serial(struct MFT_SCAN *scan, s64 nr_records)
+{
+	struct SCANNED_CHUNK chunk;
+	s64 first;
+	int count;
+	int res;
+
+	res = 0;
+	chunk.buf = (MFT_RECORD*)ntfs_malloc(MFT_SCAN_CHUNK
+				* scan->vol->mft_record_size);
+	if (!chunk.buf)
+		res = -1;
+	for (first=0; (first<nr_records) && !res; first+=count) {
+		count = min(nr_records - first, MFT_SCAN_CHUNK);
+		if (ntfs_mft_scan_read(scan->vol, &chunk, first, count))
+			res = -1;
+		else
+			res = ntfs_mft_scan_chunk(scan, &chunk);
+	}
+	free(chunk.buf);
+	return (res);
+}
+
+#ifdef ENABLE_MFT_SCAN_THREADS
+
+static void *ntfs_mft_scan_worker(void *arg)
+{
+	struct MFT_SCAN *scan;
+	struct SCANNED_CHUNK *chunk;
+	BOOL done;
+	int res;
+	int i;
+
+	scan = (struct MFT_SCAN*)arg;
+	done = FALSE;
+	pthread_mutex_lock(&scan->lock);
+	do {
+		chunk = (struct SCANNED_CHUNK*)NULL;
+		for (i=0; i<scan->nchunks; i++)
+			if ((scan->chunks[i].state == SCAN_CHUNK_FILLED)
+			    && (!chunk
+				|| (scan->chunks[i].first < chunk->first)))
+				chunk = &scan->chunks[i];
+		if (chunk) {
+			chunk->state = SCAN_CHUNK_BUSY;
+			res = 0;
+			if (!scan->res) {
+				pthread_mutex_unlock(&scan->lock);
+				res = ntfs_mft_scan_chunk(scan, chunk);
+				pthread_mutex_lock(&scan->lock);
+			}
+			if (res && !scan->res)
+				scan->res = res;
+			chunk->state = SCAN_CHUNK_FREE;
+			pthread_cond_signal(&scan->emptied);
+		} else
+			if (scan->end)
+				done = TRUE;
+			else
+				pthread_cond_wait(&scan->filled, &scan->lock);
+	} while (!done);
+	pthread_mutex_unlock(&scan->lock);
+	return ((void*)NULL);
+}
+
+/*
+ *		Scan the mft, reading in the calling thread and processing
+ *	the records in worker threads
+ */
+
+static int ntfs_mft_scan_parallel(struct MFT_SCAN *scan, s64 nr_records,
+			int threads)
+{
+	pthread_t workers[MFT_SCAN_THREADS_MAX];
+	struct SCANNED_CHUNK *chunk;
+	s64 first;
+	int started;
+	int count;
+	int err;
+	int i;
+
+	err = 0;
+	scan->end = FALSE;
+	scan->nchunks = 2*threads;
+	for (i=0; i<scan->nchunks; i++) {
+		scan->chunks[i].state = SCAN_CHUNK_FREE;
+		scan->chunks[i].buf = (MFT_RECORD*)NULL;
+	}
+	for (i=0; (i<scan->nchunks) && !err; i++) {
+		scan->chunks[i].buf = (MFT_RECORD*)ntfs_malloc(MFT_SCAN_CHUNK
+					* scan->vol->mft_record_size);
+		if (!scan->chunks[i].buf)
+			err = errno;
+	}
+	pthread_mutex_init(&scan->lock, (pthread_mutexattr_t*)NULL);
+	pthread_cond_init(&scan->filled, (pthread_condattr_t*)NULL);
+	pthread_cond_init(&scan->emptied, (pthread_condattr_t*)NULL);
+	started = 0;
+	while (!err && (started < threads)) {
+		err = pthread_create(&workers[started], (pthread_attr_t*)NULL,
+				ntfs_mft_scan_worker, scan);
+		if (!err)
+			started++;
+		else
+			ntfs_log_error("Failed to start mft scanning"
+					" threads\n");
+	}
+	first = 0;
+	pthread_mutex_lock(&scan->lock);
+	while (!err && !scan->res && (first < nr_records)) {
+		chunk = (struct SCANNED_CHUNK*)NULL;
+		for (i=0; (i<scan->nchunks) && !chunk; i++)
+			if (scan->chunks[i].state == SCAN_CHUNK_FREE)
+				chunk = &scan->chunks[i];
+		if (chunk) {
+			chunk->state = SCAN_CHUNK_BUSY;
+			pthread_mutex_unlock(&scan->lock);
+			count = min(nr_records - first, MFT_SCAN_CHUNK);
+			if (ntfs_mft_scan_read(scan->vol, chunk, first, count))
+				err = errno;
+			pthread_mutex_lock(&scan->lock);
+			if (err)
+				chunk->state = SCAN_CHUNK_FREE;
+			else {
+				chunk->state = SCAN_CHUNK_FILLED;
+				pthread_cond_signal(&scan->filled);
+				first += count;
+			}
+		} else
+			pthread_cond_wait(&scan->emptied, &scan->lock);
+	}
+	scan->end = TRUE;
+	pthread_cond_broadcast(&scan->filled);
+	pthread_mutex_unlock(&scan->lock);
+	for (i=0; i<started; i++)
+		pthread_join(workers[i], (void**)NULL);
+	pthread_cond_destroy(&scan->emptied);
+	pthread_cond_destroy(&scan->filled);
+	pthread_mutex_destroy(&scan->lock);
+	for (i=0; i<scan->nchunks; i++)
+		free(scan->chunks[i].buf);
+	if (err && !scan->res) {
+		errno = err;
+		return (-1);
+	}
+	return (scan->res);
+}
+
+#endif /* ENABLE_MFT_SCAN_THREADS */
+
+/**
+ * ntfs_mft_scan - apply a function to all the records of the mft
+ * @vol:	volume to scan
+ * @which:	records selected, a combination of MFT_SCAN_IN_USE,
+ *		MFT_SCAN_DELETED and MFT_SCAN_OTHERS, or MFT_SCAN_ALL
+ * @threads:	count of threads calling @callback
+ * @callback:	function called for each record selected
+ * @data:	opaque argument passed to @callback
+ *
+ * Read the whole initialized part of the mft of @vol in large sequential
+ * chunks, apply the mst fixups, and call @callback(@data, mft_no, m) for
+ * each record selected by @which. The records in use and the deleted ones
+ * are told apart by the in-use flag in the record. Other records are those
+ * which have no FILE magic, because they were never used or because their
+ * fixups failed.
+ *
+ * When @threads is 1, the records are processed in the calling thread in
+ * increasing order. Otherwise, the chunks are processed by @threads worker
+ * threads while the calling thread reads the next chunks. The callback is
+ * then called concurrently, in no defined order. It should only examine
+ * the record, which is valid until it returns, and it must not use the
+ * library functions which are not thread-safe, such as opening inodes.
+ *
+ * When @callback returns a non-zero value, the scan stops as soon as
+ * possible and this value is returned.
+ *
+ * Return 0 when all the records have been scanned, the non-zero value
+ * returned by @callback if it stopped the scan, or -1 with errno set if
+ * the mft could not be read or the arguments are invalid.
+ */
+int ntfs_mft_scan(ntfs_volume *vol, int which, int threads,
+		ntfs_mft_scan_callback callback, void *data)
+{
+	struct MFT_SCAN *scan;
+	s64 nr_records;
+	int res;
+
+	if (!vol || !vol->mft_na || !callback
+	    || (which & ~MFT_SCAN_ALL)
+	    || (threads < 1) || (threads > MFT_SCAN_THREADS_MAX)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	scan = (struct MFT_SCAN*)ntfs_malloc(sizeof(struct MFT_SCAN));
+	if (!scan)
+		return (-1);
+	scan->vol = vol;
+	scan->callback = callback;
+	scan->data = data;
+	scan->which = which;
+	scan->res = 0;
+	nr_records = vol->mft_na->initialized_size
+				>> vol->mft_record_size_bits;
+#ifdef ENABLE_MFT_SCAN_THREADS
+	if (threads > 1)
+		res = ntfs_mft_scan_parallel(scan, nr_records, threads);
+	else
+#endif
+		res = ntfs_mft_scan_serial(scan, nr_records);
+	free(scan);
+	return (res);
+}
+
 /**
  * ntfs_mft_record_layout - layout an mft record into a memory buffer
  * @vol:	volume to which the mft record will belong
@@ -529,29 +1120,35 @@ static int ntfs_is_mft(ntfs_inode *ni)
 #define RESERVED_MFT_RECORDS   64
 
 /**
- * ntfs_mft_bitmap_find_free_rec - find a free mft record in the mft bitmap
- * @vol:	volume on which to search for a free mft record
+ * ntfs_mft_bitmap_find_free_recs - find free mft records in the mft bitmap
+ * @vol:	volume on which to search for free mft records
  * @base_ni:	open base inode if allocating an extent mft record or NULL
+ * @recs:	where to store the numbers of the free mft records found
+ * @count:	maximum number of free mft records to return
  *
- * Search for a free mft record in the mft bitmap attribute on the ntfs volume
- * @vol.
+ * Search for free mft records in the mft bitmap attribute on the ntfs volume
+ * @vol.  The search stops at the end of the bitmap page in which the first
+ * free mft record is found.
  *
  * If @base_ni is NULL start the search at the default allocator position.
  *
  * If @base_ni is not NULL start the search at the mft record after the base
  * mft record @base_ni.
  *
- * Return the free mft record on success and -1 on error with errno set to the
- * error code.  An error code of ENOSPC means that there are no free mft
- * records in the currently initialized mft bitmap.
+ * Return the number of free mft records stored into @recs, in increasing
+ * order, on success and -1 on error with errno set to the error code.  An
+ * error code of ENOSPC means that there are no free mft records in the
+ * currently initialized mft bitmap.
  */
-static int ntfs_mft_bitmap_find_free_rec(ntfs_volume *vol, ntfs_inode *base_ni)
+static int ntfs_mft_bitmap_find_free_recs(ntfs_volume *vol,
+		ntfs_inode *base_ni, s64 *recs, int count)
 {
 	s64 pass_end, ll, data_pos, pass_start, ofs, bit;
 	ntfs_attr *mftbmp_na;
 	u8 *buf, *byte;
 	unsigned int size;
 	u8 pass, b;
+	int found = 0;
 	int ret = -1;
 
 	ntfs_log_enter("Entering\n");
@@ -638,12 +1235,20 @@ static int ntfs_mft_bitmap_find_free_rec(ntfs_volume *vol, ntfs_inode *base_ni)
 					continue;
 				
 				/* Note: ffz() result must be zero based. */
-				b = ntfs_ffz((unsigned long)*byte);
-				if (b < 8 && b >= (bit & 7)) {
-					free(buf);
-					ret = data_pos + (bit & ~7ull) + b;
-					goto leave;
+				for (b = ntfs_ffz((unsigned long)*byte);
+						b < 8 && found < count; b++) {
+					ll = data_pos + (bit & ~7ull) + b;
+					if (b >= (bit & 7) && !(*byte & (1 << b))
+							&& ll < pass_end)
+						recs[found++] = ll;
 				}
+				if (found >= count)
+					break;
+			}
+			if (found) {
+				free(buf);
+				ret = found;
+				goto leave;
 			}
 			ntfs_log_debug("After inner for loop: size 0x%x, "
 					"data_pos 0x%llx, bit 0x%llx, "
@@ -683,6 +1288,108 @@ leave:
 	return ret;
 }
 
+/**
+ * ntfs_mft_bitmap_find_free_rec - find a free mft record in the mft bitmap
+ * @vol:	volume on which to search for a free mft record
+ * @base_ni:	open base inode if allocating an extent mft record or NULL
+ *
+ * Return the free mft record on success and -1 on error with errno set to the
+ * error code, as ntfs_mft_bitmap_find_free_recs() does.
+ */
+static s64 ntfs_mft_bitmap_find_free_rec(ntfs_volume *vol, ntfs_inode *base_ni)
+{
+	s64 rec;
+
+	if (ntfs_mft_bitmap_find_free_recs(vol, base_ni, &rec, 1) != 1)
+		return -1;
+	return rec;
+}
+
+/*
+ *		Get a free mft record for a base inode
+ *
+ *	The free records are taken from the list kept in the volume,
+ *	which is refilled from the mft bitmap when it gets empty, so
+ *	that the bitmap is not scanned for each new file.
+ *
+ *	Returns the free mft record, or -1 if there was an error
+ *		(ENOSPC if the initialized mft bitmap is full)
+ */
+
+static s64 ntfs_mft_get_free_rec(ntfs_volume *vol)
+{
+	s64 *recs;
+	s64 rec;
+	int count;
+	int i;
+
+	recs = vol->mft_free_recs;
+	if (!vol->mft_free_count) {
+		count = ntfs_mft_bitmap_find_free_recs(vol, (ntfs_inode*)NULL,
+				recs, MFT_FREE_RECS);
+		if (count <= 0)
+			return (-1);
+			/* the lowest record is to be used first */
+		for (i=0; i<count/2; i++) {
+			rec = recs[i];
+			recs[i] = recs[count - 1 - i];
+			recs[count - 1 - i] = rec;
+		}
+		vol->mft_free_count = count;
+	}
+	return (recs[--vol->mft_free_count]);
+}
+
+/*
+ *		Record a freed mft record into the list of free records
+ *
+ *	The list is kept in decreasing order. A record beyond the ones
+ *	collected from the bitmap is not inserted, it will be found when
+ *	scanning the bitmap again.
+ */
+
+static void ntfs_mft_put_free_rec(ntfs_volume *vol, s64 rec)
+{
+	s64 *recs;
+	int i;
+
+	recs = vol->mft_free_recs;
+	i = vol->mft_free_count;
+	if ((rec >= RESERVED_MFT_RECORDS)
+	    && (i < MFT_FREE_RECS)
+	    && (!i || (rec < recs[0]))) {
+		while ((i > 0) && (recs[i - 1] < rec))
+			i--;
+		if (!i || (recs[i - 1] != rec)) {
+			memmove(&recs[i + 1], &recs[i],
+				(vol->mft_free_count - i)*sizeof(s64));
+			recs[i] = rec;
+			vol->mft_free_count++;
+		}
+	}
+}
+
+/*
+ *		Remove a record allocated otherwise from the list
+ *	of free records
+ */
+
+static void ntfs_mft_drop_free_rec(ntfs_volume *vol, s64 rec)
+{
+	s64 *recs;
+	int i;
+
+	recs = vol->mft_free_recs;
+	i = 0;
+	while ((i < vol->mft_free_count) && (recs[i] != rec))
+		i++;
+	if (i < vol->mft_free_count) {
+		vol->mft_free_count--;
+		memmove(&recs[i], &recs[i + 1],
+			(vol->mft_free_count - i)*sizeof(s64));
+	}
+}
+
 static int ntfs_mft_attr_extend(ntfs_attr *na)
 {
 	int ret = STATUS_ERROR;
@@ -762,6 +1469,7 @@ static int ntfs_mft_bitmap_extend_allocation_i(ntfs_volume *vol)
 		return STATUS_ERROR;
 	}
 	mftbmp_na->rl = rl;
+	ntfs_attr_rl_changed(mftbmp_na);
 	ntfs_log_debug("Adding one run to mft bitmap.\n");
 	/* Find the last run in the new runlist. */
 	for (; rl[1].length; rl++)
@@ -845,6 +1553,7 @@ static int ntfs_mft_bitmap_extend_allocation_i(ntfs_volume *vol)
 	}
 ok:
 	mftbmp_na->allocated_size += vol->cluster_size;
+	vol->free_mft_records += vol->cluster_size << 3;
 	a->allocated_size = cpu_to_sle64(mftbmp_na->allocated_size);
 	/* Ensure the changes make it to disk. */
 	ntfs_inode_mark_dirty(ctx->ntfs_ino);
@@ -860,6 +1569,7 @@ restore_undo_alloc:
 				"mft bitmap attribute.%s\n", es);
 		ntfs_attr_put_search_ctx(ctx);
 		mftbmp_na->allocated_size += vol->cluster_size;
+		vol->free_mft_records += vol->cluster_size << 3;
 		/*
 		 * The only thing that is now wrong is ->allocated_size of the
 		 * base attribute extent which chkdsk should be able to fix.
@@ -879,11 +1589,8 @@ undo_alloc:
 	rl->lcn = rl[1].lcn;
 	rl->length = 0;
 	
-	/* FIXME: use an ntfs_cluster_free_* function */
-	if (ntfs_bitmap_clear_bit(vol->lcnbmp_na, lcn))
+	if (ntfs_cluster_free_basic(vol, lcn, 1))
 		ntfs_log_error("Failed to free cluster.%s\n", es);
-	else
-		vol->free_clusters++;
 	if (mp_rebuilt) {
 		if (ntfs_mapping_pairs_build(vol, (u8*)a +
 				le16_to_cpu(a->mapping_pairs_offset),
@@ -978,7 +1685,6 @@ static int ntfs_mft_bitmap_extend_initialized(ntfs_volume *vol)
 	ll = ntfs_attr_pwrite(mftbmp_na, old_initialized_size, 8, &ll);
 	if (ll == 8) {
 		ntfs_log_debug("Wrote eight initialized bytes to mft bitmap.\n");
-		vol->free_mft_records += (8 * 8); 
 		ret = 0;
 		goto out;
 	}
@@ -1114,6 +1820,7 @@ static int ntfs_mft_data_extend_allocation(ntfs_volume *vol)
 		goto out;
 	}
 	mft_na->rl = rl;
+	ntfs_attr_rl_changed(mft_na);
 	
 	/* Find the last run in the new runlist. */
 	for (; rl[1].length; rl++)
@@ -1235,6 +1942,7 @@ undo_alloc:
 	if (ntfs_rl_truncate(&mft_na->rl, old_last_vcn))
 		ntfs_log_error("Failed to truncate mft data attribute "
 				"runlist.%s\n", es);
+	ntfs_attr_rl_changed(mft_na);
 	if (mp_rebuilt) {
 		if (ntfs_mapping_pairs_build(vol, (u8*)a +
 				le16_to_cpu(a->mapping_pairs_offset),
@@ -1504,6 +2212,7 @@ found_free_rec:
 		ntfs_log_error("Failed to allocate bit in mft bitmap #2\n");
 		goto err_out;
 	}
+	ntfs_mft_drop_free_rec(vol, bit);
 	
 	ll = (bit + 1) << vol->mft_record_size_bits;
 	if (ll > mft_na->initialized_size)
@@ -1611,6 +2320,8 @@ undo_mftbmp_alloc:
 	err = errno;
 	if (ntfs_bitmap_clear_bit(mftbmp_na, bit))
 		ntfs_log_error("Failed to clear bit in mft bitmap.%s\n", es);
+	else
+		ntfs_mft_put_free_rec(vol, bit);
 	errno = err;
 err_out:
 	if (!errno)
@@ -1733,7 +2444,10 @@ ntfs_inode *ntfs_mft_record_alloc(ntfs_volume *vol, ntfs_inode *base_ni)
 	mft_na = vol->mft_na;
 	mftbmp_na = vol->mftbmp_na;
 retry:	
-	bit = ntfs_mft_bitmap_find_free_rec(vol, base_ni);
+	if (base_ni)
+		bit = ntfs_mft_bitmap_find_free_rec(vol, base_ni);
+	else
+		bit = ntfs_mft_get_free_rec(vol);
 	if (bit >= 0) {
 		ntfs_log_debug("found free record (#1) at %lld\n",
 				(long long)bit);
@@ -1809,6 +2523,7 @@ found_free_rec:
 		ntfs_log_error("Failed to allocate bit in mft bitmap.\n");
 		goto err_out;
 	}
+	ntfs_mft_drop_free_rec(vol, bit);
 	
 	/* The mft bitmap is now uptodate.  Deal with mft data attribute now. */
 	ll = (bit + 1) << vol->mft_record_size_bits;
@@ -1923,8 +2638,11 @@ found_free_rec:
 	ni->creation_time = ni->last_data_change_time =
 			ni->last_mft_change_time =
 			ni->last_access_time = ntfs_current_time();
-	/* Update the default mft allocation position if it was used. */
-	if (!base_ni)
+	/*
+	 * Update the default mft allocation position if it was used,
+	 * a freed record got from the free list may be behind it.
+	 */
+	if (!base_ni && (bit >= vol->mft_data_pos))
 		vol->mft_data_pos = bit + 1;
 	/* Return the opened, allocated inode of the allocated mft record. */
 	ntfs_log_debug("allocated %sinode 0x%llx.\n",
@@ -1938,6 +2656,8 @@ undo_mftbmp_alloc:
 	err = errno;
 	if (ntfs_bitmap_clear_bit(mftbmp_na, bit))
 		ntfs_log_error("Failed to clear bit in mft bitmap.%s\n", es);
+	else
+		ntfs_mft_put_free_rec(vol, bit);
 	errno = err;
 err_out:
 	if (!errno)
@@ -2008,6 +2728,7 @@ int ntfs_mft_record_free(ntfs_volume *vol, ntfs_inode *ni)
 	if (!ntfs_inode_close(ni)) {
 #endif
 		vol->free_mft_records++; 
+		ntfs_mft_put_free_rec(vol, mft_no);
 		return 0;
 	}
 	err = errno;
@@ -2049,3 +2770,435 @@ int ntfs_mft_usn_dec(MFT_RECORD *mrec)
 	return 0;
 }
 
+
+#ifdef NTFS_TEST
+
+#include <sys/time.h>
+
+#include "dir.h"
+#include "unistr.h"
+
+/*
+ *	The reads from the device are counted by interposing the device
+ *	operations, without the direct access to the file descriptor.
+ *	The scans of the mft bitmap for base records are
+ *	counted as the creations which find the list of free records empty.
+ */
+
+static struct ntfs_device_operations *test_mft_dev_ops;
+static struct ntfs_device_operations test_mft_ops;
+static s64 test_mft_reads;
+static s64 test_mft_scans;	/* scans of the mft bitmap */
+
+static s64 test_mft_read(struct ntfs_device *dev, void *buf, s64 count)
+{
+	test_mft_reads++;
+	return (test_mft_dev_ops->read(dev, buf, count));
+}
+
+static s64 test_mft_pread(struct ntfs_device *dev, void *buf, s64 count,
+			s64 offset)
+{
+	test_mft_reads++;
+	return (test_mft_dev_ops->pread(dev, buf, count, offset));
+}
+
+static s64 test_mft_preadv(struct ntfs_device *dev,
+			const struct ntfs_device_iovec *iov, int iovcnt)
+{
+	test_mft_reads++;
+	return (test_mft_dev_ops->preadv(dev, iov, iovcnt));
+}
+
+struct TEST_MFT_CHECK {
+	const ntfs_volume *vol;
+	const u8 *bitmap;
+	s64 bits;
+	s64 bad;
+} ;
+
+static int test_mft_check_rec(void *data, s64 mft_no, MFT_RECORD *m)
+{
+	struct TEST_MFT_CHECK *check;
+	BOOL in_use;
+	BOOL set;
+	int i;
+
+	check = (struct TEST_MFT_CHECK*)data;
+	if (mft_no >= RESERVED_MFT_RECORDS) {
+		in_use = m && ntfs_is_file_record(m->magic)
+				&& (m->flags & MFT_RECORD_IN_USE);
+		set = (mft_no < check->bits)
+			&& (check->bitmap[mft_no >> 3] & (1 << (mft_no & 7)));
+		if (in_use != set) {
+			if (check->bad++ < 10)
+				printf("record %lld is %s, bit is %s\n",
+					(long long)mft_no,
+					(in_use ? "in use" : "free"),
+					(set ? "set" : "clear"));
+		}
+		for (i=0; i<check->vol->mft_free_count; i++)
+			if ((check->vol->mft_free_recs[i] == mft_no)
+			    && (in_use || set)) {
+				if (check->bad++ < 10)
+					printf("record %lld is in the free"
+						" list\n", (long long)mft_no);
+			}
+	}
+	return (0);
+}
+
+/*
+ *		Check the mft bitmap against the in-use flags of the records
+ *	and the list of free records
+ *
+ *	Returns the count of differences
+ */
+
+static s64 test_mft_check(ntfs_volume *vol)
+{
+	struct TEST_MFT_CHECK check;
+	u8 *bitmap;
+	s64 size;
+
+	size = vol->mftbmp_na->initialized_size;
+	bitmap = (u8*)ntfs_malloc(size);
+	if (!bitmap
+	    || (ntfs_attr_pread(vol->mftbmp_na, 0, size, bitmap) != size)) {
+		free(bitmap);
+		return (1);
+	}
+	check.vol = vol;
+	check.bitmap = bitmap;
+	check.bits = size << 3;
+	check.bad = 0;
+	if (ntfs_mft_scan(vol, MFT_SCAN_ALL, 1, test_mft_check_rec, &check))
+		check.bad++;
+	free(bitmap);
+	return (check.bad);
+}
+
+/*
+ *		Create or delete the test files of a pass
+ *
+ *	Every @step-th file is processed, starting from the first one.
+ *
+ *	Returns the count of failures
+ */
+
+static int test_mft_files(ntfs_volume *vol, ntfs_inode **pdir_ni,
+			int mode, int count, int step, BOOL create,
+			BOOL scan)
+{
+	ntfs_inode *ni;
+	ntfschar *uname;
+	char name[32];
+	u64 inum;
+	int len;
+	int bad;
+	int i;
+
+	bad = 0;
+	for (i=0; (i<count) && *pdir_ni; i+=step) {
+		snprintf(name, sizeof(name), "%c%d", (mode ? 'l' : 's'), i);
+		uname = (ntfschar*)NULL;
+		len = ntfs_mbstoucs(name, &uname);
+		if (len <= 0) {
+			bad++;
+			continue;
+		}
+		if (create) {
+			if (scan)
+				vol->mft_free_count = 0;
+			if (!vol->mft_free_count)
+				test_mft_scans++;
+			ni = ntfs_create(*pdir_ni, const_cpu_to_le32(0),
+					uname, len, S_IFREG);
+			if (!ni || ntfs_inode_close(ni))
+				bad++;
+		} else {
+			inum = ntfs_inode_lookup_by_mbsname(*pdir_ni, name);
+			ni = (inum != (u64)-1
+				? ntfs_inode_open(vol, MREF(inum))
+				: (ntfs_inode*)NULL);
+			if (ni) {
+				inum = (*pdir_ni)->mft_no;
+				/* ntfs_delete() always closes ni and dir_ni */
+				if (ntfs_delete(vol, (char*)NULL, ni, *pdir_ni,
+						uname, len))
+					bad++;
+				*pdir_ni = ntfs_inode_open(vol, inum);
+			} else
+				bad++;
+		}
+		free(uname);
+	}
+	return (bad);
+}
+
+/*
+ *		Create many files in a directory
+ *
+ *	The files are created in a new directory, then a third of them
+ *	are deleted and created again. This is done first with the mft
+ *	bitmap scanned for each file, as before the list of free records
+ *	existed, then with the list. The mft bitmap is checked against
+ *	the in-use flags of the records after each pass. The files and
+ *	the directory are deleted in the end.
+ *
+ *	Returns 0 if the test passed
+ */
+
+static int test_mft_create(const char *name, int count)
+{
+	static const char dirname[] = "ntfs-test-mft";
+	ntfs_volume *vol;
+	ntfs_inode *root_ni;
+	ntfs_inode *dir_ni;
+	ntfschar *udirname;
+	clock_t start;
+	double secs;
+	s64 reads;
+	s64 bad;
+	int len;
+	int mode;
+
+	vol = ntfs_mount(name, 0);
+	if (!vol) {
+		printf("Could not mount %s\n", name);
+		return (1);
+	}
+	test_mft_dev_ops = vol->dev->d_ops;
+	test_mft_ops = *test_mft_dev_ops;
+	test_mft_ops.read = test_mft_read;
+	test_mft_ops.pread = test_mft_pread;
+	if (test_mft_ops.preadv)
+		test_mft_ops.preadv = test_mft_preadv;
+	test_mft_ops.fd = NULL;
+	vol->dev->d_ops = &test_mft_ops;
+	bad = 0;
+	udirname = (ntfschar*)NULL;
+	len = ntfs_mbstoucs(dirname, &udirname);
+	root_ni = ntfs_inode_open(vol, FILE_root);
+	dir_ni = (root_ni && (len > 0)
+			? ntfs_create(root_ni, const_cpu_to_le32(0),
+				udirname, len, S_IFDIR)
+			: (ntfs_inode*)NULL);
+	if (!dir_ni) {
+		printf("Could not create /%s\n", dirname);
+		bad++;
+	}
+	for (mode=0; (mode<2) && dir_ni; mode++) {
+		test_mft_reads = 0;
+		test_mft_scans = 0;
+		start = clock();
+		bad += test_mft_files(vol, &dir_ni, mode, count, 1,
+				TRUE, !mode);
+		secs = (double)(clock() - start)/CLOCKS_PER_SEC;
+		reads = test_mft_reads;
+		printf("%s : created %d files in %.3fs, %lld scans,"
+				" %lld reads\n",
+			(mode ? "free list  " : "bitmap scan"), count, secs,
+			(long long)test_mft_scans, (long long)reads);
+		bad += test_mft_files(vol, &dir_ni, mode, count, 3,
+				FALSE, FALSE);
+		test_mft_reads = 0;
+		test_mft_scans = 0;
+		start = clock();
+		bad += test_mft_files(vol, &dir_ni, mode, count, 3,
+				TRUE, !mode);
+		secs = (double)(clock() - start)/CLOCKS_PER_SEC;
+		reads = test_mft_reads;
+		printf("%s : recreated %d files in %.3fs, %lld scans,"
+				" %lld reads\n",
+			(mode ? "free list  " : "bitmap scan"),
+			(count + 2)/3, secs, (long long)test_mft_scans,
+			(long long)reads);
+		bad += test_mft_check(vol);
+		bad += test_mft_files(vol, &dir_ni, mode, count, 1,
+				FALSE, FALSE);
+	}
+	if (dir_ni) {
+		/* ntfs_delete() always closes dir_ni and root_ni */
+		if (ntfs_delete(vol, (char*)NULL, dir_ni, root_ni,
+				udirname, len))
+			bad++;
+		root_ni = (ntfs_inode*)NULL;
+	}
+	if (ntfs_inode_close(root_ni))
+		bad++;
+	bad += test_mft_check(vol);
+	free(udirname);
+	vol->dev->d_ops = test_mft_dev_ops;
+	if (ntfs_umount(vol, FALSE))
+		bad++;
+	printf("%s\n", (bad ? "** failed **" : "passed"));
+	return (bad != 0);
+}
+
+/*
+ *		Scanning the mft by threads
+ *
+ *	Each selection of records is scanned by 1, 2, 4... threads, and
+ *	the count of records and a checksum of their contents, which does
+ *	not depend on the order of the calls, must match the ones found
+ *	by a single thread. Stopping the scan is checked by returning a
+ *	value for a record of the first chunk.
+ */
+
+struct TEST_MFT_SCAN {
+	u32 size;		/* size of a record */
+	s64 stop;		/* record which stops the scan, or -1 */
+	s64 count;
+	u64 sum;
+} ;
+
+static int test_mft_scan_rec(void *data, s64 mft_no, MFT_RECORD *m)
+{
+	struct TEST_MFT_SCAN *ts;
+	const u8 *p;
+	u64 h;
+	u32 i;
+
+	ts = (struct TEST_MFT_SCAN*)data;
+	h = (u64)mft_no*0x9e3779b97f4a7c15ULL;
+	p = (const u8*)m;
+	for (i=0; i<ts->size; i++)
+		h = (h ^ p[i])*0x100000001b3ULL;
+	__atomic_fetch_add(&ts->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&ts->sum, h, __ATOMIC_RELAXED);
+	return (mft_no == ts->stop ? 12345 : 0);
+}
+
+static s64 test_mft_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, (struct timezone*)NULL);
+	return ((s64)tv.tv_sec*1000000 + tv.tv_usec);
+}
+
+/*
+ *		Check the scans of the mft by 1 to @max threads
+ *
+ *	Returns 0 if the test passed
+ */
+
+static int test_mft_scan(const char *name, int max, int repeat)
+{
+	static const int selections[] = {
+		MFT_SCAN_IN_USE, MFT_SCAN_DELETED, MFT_SCAN_OTHERS,
+		MFT_SCAN_IN_USE | MFT_SCAN_DELETED, MFT_SCAN_ALL
+	} ;
+	static const char *names[] = {
+		"in use", "deleted", "others", "in use+deleted", "all"
+	} ;
+	struct TEST_MFT_SCAN ref;
+	struct TEST_MFT_SCAN ts;
+	ntfs_volume *vol;
+	s64 ref_elapsed;
+	s64 elapsed;
+	s64 start;
+	s64 total;
+	BOOL failed;
+	int threads;
+	int bad;
+	int res;
+	int s;
+	int r;
+
+	vol = ntfs_mount(name, NTFS_MNT_RDONLY);
+	if (!vol) {
+		printf("Could not mount %s\n", name);
+		return (1);
+	}
+	total = vol->mft_na->initialized_size >> vol->mft_record_size_bits;
+	printf("%lld records of %d bytes\n", (long long)total,
+		(int)vol->mft_record_size);
+	bad = 0;
+	ref_elapsed = 1;
+	memset(&ref, 0, sizeof(ref));
+	for (s=0; s<(int)(sizeof(selections)/sizeof(int)); s++) {
+		for (threads=1; ; threads=min(2*threads, max)) {
+			memset(&ts, 0, sizeof(ts));
+			ts.size = vol->mft_record_size;
+			ts.stop = -1;
+			start = test_mft_now();
+			res = 0;
+			for (r=0; (r<repeat) && !res; r++)
+				res = ntfs_mft_scan(vol, selections[s],
+					threads, test_mft_scan_rec, &ts);
+			elapsed = max(test_mft_now() - start, 1);
+			if (threads == 1) {
+				ref = ts;
+				ref_elapsed = elapsed;
+			}
+			failed = res || (ts.count != ref.count)
+					|| (ts.sum != ref.sum);
+			if (failed)
+				bad++;
+			printf("%-14s %2d threads : %8lld records,"
+				" %7.1f MB/s, speedup %.2f  %s\n",
+				names[s], threads, (long long)ts.count/repeat,
+				(double)total*repeat*vol->mft_record_size
+					/elapsed,
+				(double)ref_elapsed/elapsed,
+				(failed ? "** failed **" : "ok"));
+			if (threads >= max)
+				break;
+		}
+	}
+		/* stop within the first chunk */
+	for (threads=1; ; threads=min(2*threads, max)) {
+		memset(&ts, 0, sizeof(ts));
+		ts.size = vol->mft_record_size;
+		ts.stop = min(total, MFT_SCAN_CHUNK)/2;
+		res = ntfs_mft_scan(vol, MFT_SCAN_ALL, threads,
+				test_mft_scan_rec, &ts);
+			/* only the chunks being processed may go on */
+		failed = (res != 12345)
+			|| (ts.count > (s64)threads*MFT_SCAN_CHUNK)
+			|| ((threads == 1) && (ts.count != ts.stop + 1));
+		if (failed)
+			bad++;
+		printf("stop at %-6lld %2d threads : %8lld records  %s\n",
+			(long long)ts.stop, threads, (long long)ts.count,
+			(failed ? "** failed **" : "ok"));
+		if (threads >= max)
+			break;
+	}
+	if (ntfs_umount(vol, FALSE))
+		bad++;
+	printf("%s\n", (bad ? "** failed **" : "passed"));
+	return (bad != 0);
+}
+
+/**
+ * test_mft_main - Mft record allocation test: Program start (main)
+ * @argc:
+ * @argv:
+ *
+ * "create image [count]" creates and deletes files on a volume,
+ * "scan image [threads [repeat]]" scans the mft by 1 to threads threads.
+ *
+ * Returns 0 if the test passed
+ */
+int test_mft_main(int argc, char *argv[])
+{
+	int res;
+
+	res = 1;
+	if ((argc >= 3) && (argc <= 4) && !strcmp(argv[1], "create"))
+		res = test_mft_create(argv[2],
+				(argc > 3 ? atoi(argv[3]) : 10000));
+	else if ((argc >= 3) && (argc <= 5) && !strcmp(argv[1], "scan"))
+		res = test_mft_scan(argv[2],
+			min(max(argc > 3 ? atoi(argv[3]) : 8, 1),
+				MFT_SCAN_THREADS_MAX),
+			max(argc > 4 ? atoi(argv[4]) : 10, 1));
+	else
+		printf("mft [create|scan] {args}\n");
+	return (res);
+}
+
+#endif
@@ -46,29 +46,21 @@ is_valid_record(u32 size, u16 usa_ofs, u16 usa_count)
 		usa_ofs + ((u32)usa_count * 2) <= NTFS_BLOCK_SIZE - 2;
 }
 
-/**
- * ntfs_mst_post_read_fixup - deprotect multi sector transfer protected data
- * @b:		pointer to the data to deprotect
- * @size:	size in bytes of @b
+/*
+ *		Deprotect a multi sector transfer protected record
  *
- * Perform the necessary post read multi sector transfer fixups and detect the
- * presence of incomplete multi sector transfers. - In that case, overwrite the
- * magic of the ntfs record header being processed with "BAAD" (in memory only!)
- * and abort processing.
+ *	All the sectors are checked with no branch before applying the
+ *	fixups, the faulty sector is only located when there is an error.
  *
- * Return 0 on success and -1 on error, with errno set to the error code. The
- * following error codes are defined:
- *	EINVAL	Invalid arguments or invalid NTFS record in buffer @b.
- *	EIO	Multi sector transfer error was detected. Magic of the NTFS
- *		record in @b will have been set to "BAAD".
+ *	Returns 0 if successful,
+ *		or the error code (see ntfs_mst_post_read_fixup_warn())
  */
-int ntfs_mst_post_read_fixup_warn(NTFS_RECORD *b, const u32 size,
-					BOOL warn)
+
+static int mst_deprotect(NTFS_RECORD *b, const u32 size, BOOL warn)
 {
-	u16 usa_ofs, usa_count, usn;
+	u16 usa_ofs, usa_count, usn, diff;
 	u16 *usa_pos, *data_pos;
-
-	ntfs_log_trace("Entering\n");
+	u16 i;
 
 	/* Setup the variables. */
 	usa_ofs = le16_to_cpu(b->usa_ofs);
@@ -84,7 +76,7 @@ int ntfs_mst_post_read_fixup_warn(NTFS_RECORD *b, const u32 size,
 					(long)size, (int)usa_ofs,
 					(unsigned int)usa_count);
 		}
-		return -1;
+		return (EINVAL);
 	}
 	/* Position of usn in update sequence array. */
 	usa_pos = (u16*)b + usa_ofs/sizeof(u16);
@@ -103,37 +95,101 @@ int ntfs_mst_post_read_fixup_warn(NTFS_RECORD *b, const u32 size,
 	/*
 	 * Check for incomplete multi sector transfer(s).
 	 */
-	while (--usa_count) {
-		if (*data_pos != usn) {
-			/*
-			 * Incomplete multi sector transfer detected! )-:
-			 * Set the magic to "BAAD" and return failure.
-			 * Note that magic_BAAD is already converted to le32.
-			 */
-			errno = EIO;
-			ntfs_log_perror("Incomplete multi-sector transfer: "
-				"magic: 0x%08x  size: %d  usa_ofs: %d  usa_count:"
-				" %d  data: %d  usn: %d", le32_to_cpu(*(le32 *)b), size,
-				usa_ofs, usa_count, *data_pos, usn);
-			b->magic = magic_BAAD;
-			return -1;
-		}
-		data_pos += NTFS_BLOCK_SIZE/sizeof(u16);
+	diff = 0;
+	for (i=1; i<usa_count; i++)
+		diff |= data_pos[(i - 1)*(NTFS_BLOCK_SIZE/sizeof(u16))] ^ usn;
+	if (diff) {
+		i = 1;
+		while (data_pos[(i - 1)*(NTFS_BLOCK_SIZE/sizeof(u16))] == usn)
+			i++;
+		/*
+		 * Incomplete multi sector transfer detected! )-:
+		 * Set the magic to "BAAD" and return failure.
+		 * Note that magic_BAAD is already converted to le32.
+		 */
+		errno = EIO;
+		ntfs_log_perror("Incomplete multi-sector transfer: "
+			"magic: 0x%08x  size: %d  usa_ofs: %d  usa_count:"
+			" %d  data: %d  usn: %d", le32_to_cpu(*(le32 *)b), size,
+			usa_ofs, usa_count - i,
+			data_pos[(i - 1)*(NTFS_BLOCK_SIZE/sizeof(u16))], usn);
+		b->magic = magic_BAAD;
+		return (EIO);
 	}
-	/* Re-setup the variables. */
-	usa_count = le16_to_cpu(b->usa_count);
-	data_pos = (u16*)b + NTFS_BLOCK_SIZE/sizeof(u16) - 1;
 	/* Fixup all sectors. */
-	while (--usa_count) {
+	for (i=1; i<usa_count; i++) {
 		/*
-		 * Increment position in usa and restore original data from
-		 * the usa into the data buffer.
+		 * Restore original data from the usa into the data buffer.
 		 */
-		*data_pos = *(++usa_pos);
-		/* Increment position in data as well. */
-		data_pos += NTFS_BLOCK_SIZE/sizeof(u16);
+		data_pos[(i - 1)*(NTFS_BLOCK_SIZE/sizeof(u16))] = usa_pos[i];
 	}
-	return 0;
+	return (0);
+}
+
+/**
+ * ntfs_mst_post_read_fixup - deprotect multi sector transfer protected data
+ * @b:		pointer to the data to deprotect
+ * @size:	size in bytes of @b
+ *
+ * Perform the necessary post read multi sector transfer fixups and detect the
+ * presence of incomplete multi sector transfers. - In that case, overwrite the
+ * magic of the ntfs record header being processed with "BAAD" (in memory only!)
+ * and abort processing.
+ *
+ * Return 0 on success and -1 on error, with errno set to the error code. The
+ * following error codes are defined:
+ *	EINVAL	Invalid arguments or invalid NTFS record in buffer @b.
+ *	EIO	Multi sector transfer error was detected. Magic of the NTFS
+ *		record in @b will have been set to "BAAD".
+ */
+int ntfs_mst_post_read_fixup_warn(NTFS_RECORD *b, const u32 size,
+					BOOL warn)
+{
+	ntfs_log_trace("Entering\n");
+
+	return (mst_deprotect(b, size, warn) ? -1 : 0);
+}
+
+/**
+ * ntfs_mst_post_read_fixup_records - deprotect a set of contiguous records
+ * @b:		buffer holding the records
+ * @size:	size in bytes of each record
+ * @count:	number of records in @b
+ * @warn:	TRUE if the invalid records are to be logged
+ * @errs:	array of @count error codes to fill in, or NULL
+ *
+ * Perform the post read multi sector transfer fixups on the @count records
+ * of @size bytes stored contiguously in @b, as ntfs_mst_post_read_fixup_warn()
+ * does for each of them.
+ *
+ * If @errs is not NULL, @errs[i] is set to 0 when record i was deprotected,
+ * otherwise to the error code (EINVAL or EIO, the magic of the record being
+ * set to "BAAD" in the latter case).
+ *
+ * Return the number of records which could not be deprotected, errno being
+ * set to the error code of the last of them.
+ */
+s64 ntfs_mst_post_read_fixup_records(void *b, const u32 size, s64 count,
+			BOOL warn, int *errs)
+{
+	u8 *rec;
+	s64 failed;
+	s64 r;
+	int err;
+
+	ntfs_log_trace("Entering\n");
+
+	failed = 0;
+	rec = (u8*)b;
+	for (r=0; r<count; r++) {
+		err = mst_deprotect((NTFS_RECORD*)rec, size, warn);
+		if (err)
+			failed++;
+		if (errs)
+			errs[r] = err;
+		rec += size;
+	}
+	return (failed);
 }
 
 /*
@@ -255,3 +311,319 @@ void ntfs_mst_post_write_fixup(NTFS_RECORD *b)
 	}
 }
 
+
+#ifdef NTFS_TEST
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#include <sys/time.h>
+
+#include "misc.h"
+
+/*
+ *		Deprotect a record the former way
+ *
+ *	This is the sector by sector check which mst_deprotect() replaced,
+ *	kept for checking that both give the same results and data.
+ *
+ *	Returns 0 if successful, or the error code
+ */
+
+static int test_mst_ref(NTFS_RECORD *b, const u32 size)
+{
+	u16 usa_ofs, usa_count, usn;
+	u16 *usa_pos, *data_pos;
+
+	usa_ofs = le16_to_cpu(b->usa_ofs);
+	usa_count = le16_to_cpu(b->usa_count);
+	if (!is_valid_record(size, usa_ofs, usa_count))
+		return (EINVAL);
+	usa_pos = (u16*)b + usa_ofs/sizeof(u16);
+	usn = *usa_pos;
+	data_pos = (u16*)b + NTFS_BLOCK_SIZE/sizeof(u16) - 1;
+	while (--usa_count) {
+		if (*data_pos != usn) {
+			b->magic = magic_BAAD;
+			return (EIO);
+		}
+		data_pos += NTFS_BLOCK_SIZE/sizeof(u16);
+	}
+	usa_count = le16_to_cpu(b->usa_count);
+	data_pos = (u16*)b + NTFS_BLOCK_SIZE/sizeof(u16) - 1;
+	while (--usa_count) {
+		*data_pos = *(++usa_pos);
+		data_pos += NTFS_BLOCK_SIZE/sizeof(u16);
+	}
+	return (0);
+}
+
+static u32 test_mst_random(u32 *seed)
+{
+	*seed = *seed*1103515245 + 12345;
+	return ((*seed >> 8) & 0xffffff);
+}
+
+static s64 test_mst_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, (struct timezone*)NULL);
+	return ((s64)tv.tv_sec*1000000 + tv.tv_usec);
+}
+
+/*
+ *		Build a buffer of protected records
+ *
+ *	When @damage is set, one record out of eight has a sector which
+ *	was not written, and one out of eight has a bad update sequence
+ *	array.
+ *
+ *	Returns the count of damaged records
+ */
+
+static s64 test_mst_build(u8 *buf, u32 size, s64 count, BOOL damage,
+			u32 *seed)
+{
+	NTFS_RECORD *b;
+	s64 damaged;
+	s64 r;
+	u32 i;
+
+	damaged = 0;
+	for (r=0; r<count; r++) {
+		b = (NTFS_RECORD*)&buf[r*size];
+		for (i=0; i<size; i++)
+			((u8*)b)[i] = test_mst_random(seed);
+		b->magic = magic_FILE;
+		b->usa_ofs = const_cpu_to_le16(0x30);
+		b->usa_count = cpu_to_le16(size/NTFS_BLOCK_SIZE + 1);
+		ntfs_mst_pre_write_fixup(b, size);
+		if (damage) {
+			switch (test_mst_random(seed) % 8) {
+			case 0 :
+				i = test_mst_random(seed)
+					% (size/NTFS_BLOCK_SIZE);
+				((u8*)b)[(i + 1)*NTFS_BLOCK_SIZE - 1] ^= 1;
+				damaged++;
+				break;
+			case 1 :
+				b->usa_count = cpu_to_le16(
+					le16_to_cpu(b->usa_count) + 1);
+				damaged++;
+				break;
+			default :
+				break;
+			}
+		}
+	}
+	return (damaged);
+}
+
+/*
+ *		Check the fixups against the former ones
+ *
+ *	The former code, the per-record fixup and the batched fixup must
+ *	give the same error codes and leave the same data.
+ *
+ *	Returns 0 if the test passed
+ */
+
+static int test_mst_check(u32 size, s64 count, u32 *seed)
+{
+	u8 *orig;
+	u8 *ref;
+	u8 *single;
+	u8 *batch;
+	int *refs;
+	int *errs;
+	s64 damaged;
+	s64 failed;
+	s64 r;
+	int bad;
+
+	bad = 1;
+	orig = (u8*)ntfs_malloc(size*count);
+	ref = (u8*)ntfs_malloc(size*count);
+	single = (u8*)ntfs_malloc(size*count);
+	batch = (u8*)ntfs_malloc(size*count);
+	refs = (int*)ntfs_malloc(count*sizeof(int));
+	errs = (int*)ntfs_malloc(count*sizeof(int));
+	if (orig && ref && single && batch && refs && errs) {
+		bad = 0;
+		damaged = test_mst_build(orig, size, count, TRUE, seed);
+		memcpy(ref, orig, size*count);
+		memcpy(single, orig, size*count);
+		memcpy(batch, orig, size*count);
+		for (r=0; r<count; r++) {
+			refs[r] = test_mst_ref((NTFS_RECORD*)&ref[r*size],
+						size);
+			if ((ntfs_mst_post_read_fixup_warn(
+					(NTFS_RECORD*)&single[r*size],
+					size, FALSE) ? errno : 0) != refs[r])
+				bad++;
+		}
+		failed = ntfs_mst_post_read_fixup_records(batch, size, count,
+					FALSE, errs);
+		for (r=0; r<count; r++)
+			if (errs[r] != refs[r])
+				bad++;
+		if ((failed != damaged)
+		    || memcmp(single, ref, size*count)
+		    || memcmp(batch, ref, size*count))
+			bad++;
+		printf("%lld records, %lld damaged : %s\n",
+			(long long)count, (long long)damaged,
+			(bad ? "** results differ **" : "same results and data"));
+	}
+	free(orig);
+	free(ref);
+	free(single);
+	free(batch);
+	free(refs);
+	free(errs);
+	return (bad);
+}
+
+/*
+ *		Time a way of deprotecting a buffer of records
+ *
+ *	The protected records are copied to the work buffer before each
+ *	fixup, and only the fixups are timed. @how is 1 for the former
+ *	code, 2 for one call per record and 3 for the batched call.
+ *
+ *	Returns the time in microseconds
+ */
+
+static s64 test_mst_time(u8 *work, const u8 *orig, u32 size, s64 count,
+			int loops, int how)
+{
+	s64 start;
+	s64 total;
+	s64 r;
+	int i;
+
+	total = 0;
+	for (i=0; i<loops; i++) {
+		memcpy(work, orig, size*count);
+		start = test_mst_now();
+		switch (how) {
+		case 1 :
+			for (r=0; r<count; r++)
+				test_mst_ref((NTFS_RECORD*)&work[r*size],
+						size);
+			break;
+		case 2 :
+			for (r=0; r<count; r++)
+				ntfs_mst_post_read_fixup_warn(
+					(NTFS_RECORD*)&work[r*size],
+					size, FALSE);
+			break;
+		default :
+			ntfs_mst_post_read_fixup_records(work, size, count,
+					FALSE, (int*)NULL);
+			break;
+		}
+		total += test_mst_now() - start;
+	}
+	return (total);
+}
+
+/*
+ *		Compare the speeds of deprotecting records
+ *
+ *	Buffers of 1KB (mft) and 4KB (index) records are deprotected
+ *	@loops times by the former code, by one call per record and by
+ *	the batched call. The best of three runs is kept.
+ *
+ *	Returns 0 if the test passed
+ */
+
+static int test_mst_speed(u32 kbytes, int loops)
+{
+	static const char *hows[] = {
+		"former", "per record", "batched"
+	} ;
+	static const u32 sizes[] = { 1024, 4096 } ;
+	u8 *orig;
+	u8 *work;
+	s64 count;
+	s64 t;
+	s64 u;
+	u32 size;
+	u32 seed;
+	u32 level;
+	int how;
+	int run;
+	int k;
+	int bad;
+
+	bad = 0;
+	seed = 1;
+	level = ntfs_log_clear_levels(NTFS_LOG_LEVEL_PERROR);
+	for (k=0; (k<2) && !bad; k++) {
+		size = sizes[k];
+		count = ((s64)kbytes << 10)/size;
+		if (count < 1)
+			count = 1;
+		bad += test_mst_check(size, count, &seed);
+		orig = (u8*)ntfs_malloc(size*count);
+		work = (u8*)ntfs_malloc(size*count);
+		if (!orig || !work) {
+			bad++;
+		} else {
+			test_mst_build(orig, size, count, FALSE, &seed);
+			printf("%lu-byte records, %lld per buffer, %d loops\n",
+				(unsigned long)size, (long long)count, loops);
+			for (how=1; how<=3; how++) {
+				t = 0;
+				for (run=0; run<3; run++) {
+					u = test_mst_time(work, orig, size,
+							count, loops, how);
+					if (!run || (u < t))
+						t = u;
+				}
+				printf("  %-10s : %.1fM records/s\n",
+					hows[how - 1],
+					(t > 0 ? (double)count*loops/t : 0.0));
+			}
+		}
+		free(orig);
+		free(work);
+	}
+	ntfs_log_set_levels(level & NTFS_LOG_LEVEL_PERROR);
+	printf("%s\n", (bad ? "** failed **" : "passed"));
+	return (bad != 0);
+}
+
+/**
+ * test_mst_main - Fixup test: Program start (main)
+ * @argc:
+ * @argv:
+ *
+ * "mst [kbytes [loops]]" checks the batched fixups against the former
+ * ones and compares their speeds, on buffers of @kbytes KB (256 by
+ * default) deprotected @loops times (2000 by default).
+ *
+ * Returns 0 if the test passed
+ */
+int test_mst_main(int argc, char *argv[])
+{
+	int res;
+
+	res = 1;
+	if (argc <= 3)
+		res = test_mst_speed(argc > 1 ? atoi(argv[1]) : 256,
+				argc > 2 ? atoi(argv[2]) : 2000);
+	else
+		printf("mst [kbytes [loops]]\n");
+	return (res);
+}
+
+#endif
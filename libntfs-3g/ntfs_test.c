@@ -0,0 +1,71 @@
+/**
+ * ntfs_test.c - Driver for the test harnesses of the library
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *	The harnesses are the NTFS_TEST parts of the library sources,
+ *	this program is built from the library sources compiled with
+ *	NTFS_TEST by "make ntfs-test", and it is not installed.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "types.h"
+#include "runlist.h"
+#include "device_io.h"
+#include "compress.h"
+#include "inode.h"
+#include "lcnalloc.h"
+#include "mft.h"
+#include "mst.h"
+#include "wof.h"
+
+int main(int argc, char *argv[])
+{
+	if ((argc > 1) && !strcmp(argv[1], "rl"))
+		return (test_rl_main(argc - 1, &argv[1]));
+	if ((argc > 1) && !strcmp(argv[1], "uefi"))
+		return (test_uefi_io_main(argc - 1, &argv[1]));
+#ifdef HAVE_NTFS_DEVICE_URING_IO_OPS
+	if ((argc > 1) && !strcmp(argv[1], "uring"))
+		return (test_uring_io_main(argc - 1, &argv[1]));
+#endif
+	if ((argc > 1) && !strcmp(argv[1], "compress"))
+		return (test_compress_main(argc - 1, &argv[1]));
+	if ((argc > 1) && !strcmp(argv[1], "lcn"))
+		return (test_lcn_main(argc - 1, &argv[1]));
+	if ((argc > 1) && !strcmp(argv[1], "mft"))
+		return (test_mft_main(argc - 1, &argv[1]));
+	if ((argc > 1) && !strcmp(argv[1], "mst"))
+		return (test_mst_main(argc - 1, &argv[1]));
+	if ((argc > 1) && !strcmp(argv[1], "wof"))
+		return (test_wof_main(argc - 1, &argv[1]));
+	if ((argc > 1) && !strcmp(argv[1], "inode"))
+		return (test_inode_main(argc - 1, &argv[1]));
+	printf("ntfs-test [rl|uefi|uring|compress|lcn|mft|mst|wof|inode] {args}\n");
+	return (1);
+}
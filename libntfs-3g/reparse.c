@@ -60,6 +60,7 @@
 #include "reparse.h"
 #include "xattrs.h"
 #include "ea.h"
+#include "wof.h"
 
 struct MOUNT_POINT_REPARSE_DATA {      /* reparse data for junctions */
 	le16	subst_name_offset;
@@ -1290,6 +1291,7 @@ int ntfs_remove_ntfs_reparse_data(ntfs_inode *ni)
 					res = -1;
 				} else {
 					/* now remove attribute */
+					ntfs_wof_invalidate(ni);
 					res = ntfs_attr_rm(na);
 					if (!res) {
 						ni->flags &=
@@ -138,6 +138,7 @@ runlist_element *ntfs_rl_extend(ntfs_attr *na, runlist_element *rl,
 			rl = (runlist_element*)NULL;
 		} else {
 			na->rl = newrl;
+			ntfs_attr_rl_changed(na);
 			rl = &newrl[irl];
 		}
 	} else {
@@ -1074,6 +1075,137 @@ LCN ntfs_rl_vcn_to_lcn(const runlist_element *rl, const VCN vcn)
 	return (LCN)LCN_ENOENT;
 }
 
+/**
+ * ntfs_rl_find_element - find the runlist element containing a vcn
+ * @rl:		runlist to search
+ * @count:	number of elements in @rl, including the terminator
+ * @vcn:	vcn to find, not lower than the vcn of the first element
+ *
+ * Search the runlist @rl by dichotomy for the element containing the
+ * virtual cluster number @vcn. This is meant for fragmented attributes,
+ * for which the caller keeps track of the number of elements, so that
+ * a lookup does not have to walk the runlist from its start.
+ *
+ * Return the index of the element containing @vcn, or the index of the
+ * terminator (@count - 1) if @vcn is beyond the end of the runlist.
+ */
+int ntfs_rl_find_element(const runlist_element *rl, int count, const VCN vcn)
+{
+	int low;
+	int high;
+	int mid;
+
+	/* Find the last element starting at or before vcn. */
+	low = 0;
+	high = count - 1;
+	while (low < high) {
+		mid = low + ((high - low + 1) >> 1);
+		if (rl[mid].vcn <= vcn)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	return (low);
+}
+
+/**
+ * ntfs_rl_to_iovec - map a buffer onto the runs of a runlist
+ * @vol:	ntfs volume the runlist belongs to
+ * @prl:	address of the run to begin with, updated on return
+ * @pofs:	address of the byte offset in this run, updated on return
+ * @count:	number of bytes to map
+ * @b:		buffer to map
+ * @zero:	if TRUE, zero the parts of @b which map to holes
+ * @iov:	device segments to fill
+ * @iovcnt:	address of the size of @iov, set to the number of segments
+ *		filled on return
+ *
+ * Build the device segments for transferring @count bytes of @b from or to
+ * the runs beginning at offset *@pofs into run *@prl, so that a single
+ * batched request can be submitted. Runs which are contiguous on the device
+ * are merged into a single segment. Holes have no segment, they are zeroed
+ * in place in @b if @zero is set, and just skipped otherwise.
+ *
+ * The mapping stops when @count bytes have been mapped, when @iov is full,
+ * or when a run is met which is neither allocated nor a hole (such as an
+ * unmapped run or the runlist terminator). *@prl and *@pofs are then set to
+ * where the mapping stopped, so that it can be resumed.
+ *
+ * Return the number of bytes of @b which were mapped, including holes.
+ * This function cannot fail.
+ */
+s64 ntfs_rl_to_iovec(const ntfs_volume *vol, const runlist_element **prl,
+		s64 *pofs, s64 count, void *b, BOOL zero,
+		struct ntfs_device_iovec *iov, int *iovcnt)
+{
+	const runlist_element *rl;
+	s64 mapped, ofs, len, pos;
+	int n;
+
+	rl = *prl;
+	ofs = *pofs;
+	n = 0;
+	mapped = 0;
+	while ((mapped < count) && rl->length) {
+		len = min(count - mapped, (rl->length <<
+				vol->cluster_size_bits) - ofs);
+		if (rl->lcn >= (LCN)0) {
+			pos = (rl->lcn << vol->cluster_size_bits) + ofs;
+			if (n && ((iov[n - 1].pos + iov[n - 1].count) == pos)
+			    && (((u8*)iov[n - 1].buf + iov[n - 1].count)
+					== ((u8*)b + mapped)))
+				iov[n - 1].count += len;
+			else {
+				if (n >= *iovcnt)
+					break;
+				iov[n].pos = pos;
+				iov[n].count = len;
+				iov[n].buf = (u8*)b + mapped;
+				n++;
+			}
+		} else {
+			if (rl->lcn != (LCN)LCN_HOLE)
+				break;
+			if (zero)
+				memset((u8*)b + mapped, 0, len);
+		}
+		mapped += len;
+		ofs += len;
+		if (ofs >= (rl->length << vol->cluster_size_bits)) {
+			rl++;
+			ofs = 0;
+		}
+	}
+	*prl = rl;
+	*pofs = ofs;
+	*iovcnt = n;
+	return (mapped);
+}
+
+/**
+ * ntfs_rl_iovec_done - get the progress of a partial batched transfer
+ * @iov:	device segments built by ntfs_rl_to_iovec()
+ * @iovcnt:	number of segments
+ * @b:		buffer which was mapped
+ * @done:	number of bytes actually transferred by the batch
+ *
+ * When a batched transfer is partial, return the number of bytes of @b,
+ * including holes, which are located before the first byte which could
+ * not be transferred.
+ */
+s64 ntfs_rl_iovec_done(const struct ntfs_device_iovec *iov, int iovcnt,
+		const void *b, s64 done)
+{
+	int i;
+
+	for (i=0; (i < iovcnt) && (done >= iov[i].count); i++)
+		done -= iov[i].count;
+	if (i >= iovcnt)
+		return ((const u8*)iov[iovcnt - 1].buf + iov[iovcnt - 1].count
+				- (const u8*)b);
+	return ((const u8*)iov[i].buf + done - (const u8*)b);
+}
+
 /**
  * ntfs_rl_pread - gather read from disk
  * @vol:	ntfs volume to read from
@@ -1084,7 +1216,8 @@ LCN ntfs_rl_vcn_to_lcn(const runlist_element *rl, const VCN vcn)
  *
  * This function will read @count bytes from the volume @vol to the data buffer
  * @b gathering the data as specified by the runlist @rl. The read begins at
- * offset @pos into the runlist @rl.
+ * offset @pos into the runlist @rl. The runs are read by batched requests,
+ * so that reading over many runs only needs a few system calls.
  *
  * On success, return the number of successfully read bytes. If this number is
  * lower than @count this means that the read reached end of file or that an
@@ -1101,7 +1234,9 @@ LCN ntfs_rl_vcn_to_lcn(const runlist_element *rl, const VCN vcn)
 s64 ntfs_rl_pread(const ntfs_volume *vol, const runlist_element *rl,
 		const s64 pos, s64 count, void *b)
 {
-	s64 bytes_read, to_read, ofs, total;
+	struct ntfs_device_iovec iov[RL_IOV_BATCH];
+	s64 bytes_read, mapped, queued, ofs, total;
+	int i, n;
 	int err = EIO;
 
 	if (!vol || !rl || pos < 0 || count < 0) {
@@ -1119,41 +1254,33 @@ s64 ntfs_rl_pread(const ntfs_volume *vol, const runlist_element *rl,
 		ofs += (rl->length << vol->cluster_size_bits);
 	/* Offset in the run at which to begin reading. */
 	ofs = pos - ofs;
-	for (total = 0LL; count; rl++, ofs = 0) {
-		if (!rl->length)
+	for (total = 0LL; count; ) {
+		/* Map as many runs as possible, zeroing holes. */
+		n = RL_IOV_BATCH;
+		mapped = ntfs_rl_to_iovec(vol, &rl, &ofs, count, b, TRUE,
+				iov, &n);
+		if (!mapped)
 			goto rl_err_out;
-		if (rl->lcn < (LCN)0) {
-			if (rl->lcn != (LCN)LCN_HOLE)
+		if (n) {
+			for (queued = 0, i = 0; i < n; i++)
+				queued += iov[i].count;
+			do {
+				bytes_read = ntfs_preadv(vol->dev, iov, n);
+				/* If the syscall was interrupted, try again. */
+			} while (bytes_read == (s64)-1 && errno == EINTR);
+			if (bytes_read != queued) {
+				if (bytes_read > 0)
+					total += ntfs_rl_iovec_done(iov, n, b,
+							bytes_read);
+				else if (bytes_read == (s64)-1)
+					err = errno;
 				goto rl_err_out;
-			/* It is a hole. Just fill buffer @b with zeroes. */
-			to_read = min(count, (rl->length <<
-					vol->cluster_size_bits) - ofs);
-			memset(b, 0, to_read);
-			/* Update counters and proceed with next run. */
-			total += to_read;
-			count -= to_read;
-			b = (u8*)b + to_read;
-			continue;
-		}
-		/* It is a real lcn, read it from the volume. */
-		to_read = min(count, (rl->length << vol->cluster_size_bits) -
-				ofs);
-retry:
-		bytes_read = ntfs_pread(vol->dev, (rl->lcn <<
-				vol->cluster_size_bits) + ofs, to_read, b);
-		/* If everything ok, update progress counters and continue. */
-		if (bytes_read > 0) {
-			total += bytes_read;
-			count -= bytes_read;
-			b = (u8*)b + bytes_read;
-			continue;
+			}
 		}
-		/* If the syscall was interrupted, try again. */
-		if (bytes_read == (s64)-1 && errno == EINTR)
-			goto retry;
-		if (bytes_read == (s64)-1)
-			err = errno;
-		goto rl_err_out;
+		/* Update progress counters and proceed with next runs. */
+		total += mapped;
+		count -= mapped;
+		b = (u8*)b + mapped;
 	}
 	/* Finally, return the number of bytes read. */
 	return total;
@@ -1177,6 +1304,7 @@ rl_err_out:
  * scattering the data as specified by the runlist @rl. The write begins at
  * offset @pos into the runlist @rl. If a run is sparse then the related buffer
  * data is ignored which means that the caller must ensure they are consistent.
+ * The runs are written by batched requests.
  *
  * On success, return the number of successfully written bytes. If this number
  * is lower than @count this means that the write has been interrupted in
@@ -1190,7 +1318,9 @@ rl_err_out:
 s64 ntfs_rl_pwrite(const ntfs_volume *vol, const runlist_element *rl,
 		s64 ofs, const s64 pos, s64 count, void *b)
 {
-	s64 written, to_write, total = 0;
+	struct ntfs_device_iovec iov[RL_IOV_BATCH];
+	s64 written, mapped, queued, total = 0;
+	int i, n;
 	int err = EIO;
 
 	if (!vol || !rl || pos < 0 || count < 0) {
@@ -1210,45 +1340,33 @@ s64 ntfs_rl_pwrite(const ntfs_volume *vol, const runlist_element *rl,
 	}
 	/* Offset in the run at which to begin writing. */
 	ofs = pos - ofs;
-	for (total = 0LL; count; rl++, ofs = 0) {
-		if (!rl->length)
+	for (total = 0LL; count; ) {
+		/* Map as many runs as possible, skipping holes. */
+		n = RL_IOV_BATCH;
+		mapped = ntfs_rl_to_iovec(vol, &rl, &ofs, count, b, FALSE,
+				iov, &n);
+		if (!mapped)
 			goto rl_err_out;
-		if (rl->lcn < (LCN)0) {
-
-			if (rl->lcn != (LCN)LCN_HOLE)
+		if (n && !NVolReadOnly(vol)) {
+			for (queued = 0, i = 0; i < n; i++)
+				queued += iov[i].count;
+			do {
+				written = ntfs_pwritev(vol->dev, iov, n);
+				/* If the syscall was interrupted, try again. */
+			} while (written == (s64)-1 && errno == EINTR);
+			if (written != queued) {
+				if (written > 0)
+					total += ntfs_rl_iovec_done(iov, n, b,
+							written);
+				else if (written == (s64)-1)
+					err = errno;
 				goto rl_err_out;
-			
-			to_write = min(count, (rl->length <<
-					       vol->cluster_size_bits) - ofs);
-			
-			total += to_write;
-			count -= to_write;
-			b = (u8*)b + to_write;
-			continue;
-		}
-		/* It is a real lcn, write it to the volume. */
-		to_write = min(count, (rl->length << vol->cluster_size_bits) -
-				ofs);
-retry:
-		if (!NVolReadOnly(vol))
-			written = ntfs_pwrite(vol->dev, (rl->lcn <<
-					vol->cluster_size_bits) + ofs,
-					to_write, b);
-		else
-			written = to_write;
-		/* If everything ok, update progress counters and continue. */
-		if (written > 0) {
-			total += written;
-			count -= written;
-			b = (u8*)b + written;
-			continue;
+			}
 		}
-		/* If the syscall was interrupted, try again. */
-		if (written == (s64)-1 && errno == EINTR)
-			goto retry;
-		if (written == (s64)-1)
-			err = errno;
-		goto rl_err_out;
+		/* Update progress counters and proceed with next runs. */
+		total += mapped;
+		count -= mapped;
+		b = (u8*)b + mapped;
 	}
 out:
 	return total;
@@ -1757,6 +1875,9 @@ s64 ntfs_rl_get_compressed_size(ntfs_volume *vol, runlist *rl)
 
 
 #ifdef NTFS_TEST
+
+#include <time.h>
+
 /**
  * test_rl_helper
  */
@@ -2155,6 +2276,100 @@ out:
 	free(attr3);
 }
 
+/**
+ * test_rl_lookup - Runlist test: Compare vcn lookup methods
+ * @count:	number of runs in the synthetic runlist
+ *
+ * Build a runlist of @count runs of varying lengths, then time the
+ * conversion of random and sequential vcns by walking the runlist and by
+ * searching it with ntfs_rl_find_element(), the latter being tried
+ * first on the element found for the previous vcn, as done for
+ * attributes.
+ *
+ * Returns:
+ */
+static void test_rl_lookup(int count)
+{
+	runlist_element *rl;
+	VCN *vcns;
+	VCN vcn;
+	LCN lcn;
+	LCN sum[3];
+	clock_t start;
+	double secs[3];
+	int lookups;
+	int hint;
+	int i;
+	int j;
+
+	if (count < 1)
+		count = 100000;
+	lookups = 1000000;
+	rl = ntfs_malloc((count + 1) * sizeof(runlist_element));
+	vcns = ntfs_malloc(lookups * sizeof(VCN));
+	if (!rl || !vcns) {
+		free(rl);
+		free(vcns);
+		return;
+	}
+	srandom(1);
+	vcn = 0;
+	for (i = 0; i < count; i++) {
+		MKRL(rl + i, vcn, 2*vcn + (i & 7), 1 + (random() & 15));
+		vcn += rl[i].length;
+	}
+	MKRL(rl + count, vcn, LCN_ENOENT, 0);
+
+	printf("%d runs, %lld clusters, %d lookups\n", count,
+		(long long)vcn, lookups);
+	for (j = 0; j < 2; j++) {
+		for (i = 0; i < lookups; i++)
+			vcns[i] = (j ? (VCN)i % rl[count].vcn
+				: (VCN)random() % rl[count].vcn);
+		start = clock();
+		sum[0] = 0;
+		for (i = 0; i < lookups / 100; i++)
+			sum[0] += ntfs_rl_vcn_to_lcn(rl, vcns[i]);
+		secs[0] = (double)(clock() - start) * 100 / CLOCKS_PER_SEC;
+		start = clock();
+		sum[1] = 0;
+		for (i = 0; i < lookups / 100; i++) {
+			hint = ntfs_rl_find_element(rl, count + 1, vcns[i]);
+			sum[1] += rl[hint].lcn + vcns[i] - rl[hint].vcn;
+		}
+		secs[1] = (double)(clock() - start) * 100 / CLOCKS_PER_SEC;
+		start = clock();
+		sum[2] = 0;
+		hint = 0;
+		for (i = 0; i < lookups; i++) {
+			vcn = vcns[i];
+			if ((vcn < rl[hint].vcn) || (vcn >= rl[hint + 1].vcn)) {
+				if ((vcn >= rl[hint + 1].vcn)
+				    && (vcn < rl[hint + 2].vcn))
+					hint++;
+				else
+					hint = ntfs_rl_find_element(rl,
+							count + 1, vcn);
+			}
+			lcn = rl[hint].lcn + vcn - rl[hint].vcn;
+			if (i < lookups / 100)
+				sum[2] += lcn;
+		}
+		secs[2] = (double)(clock() - start) / CLOCKS_PER_SEC;
+		printf("%s lookups :\n", (j ? "sequential" : "random"));
+		printf("    linear  %12.0f per second\n",
+			(secs[0] > 0 ? lookups / secs[0] : 0));
+		printf("    search  %12.0f per second\n",
+			(secs[1] > 0 ? lookups / secs[1] : 0));
+		printf("    hinted  %12.0f per second\n",
+			(secs[2] > 0 ? lookups / secs[2] : 0));
+		if ((sum[0] != sum[1]) || (sum[0] != sum[2]))
+			printf("    ** lookup results differ **\n");
+	}
+	free(vcns);
+	free(rl);
+}
+
 /**
  * test_rl_main - Runlist test: Program start (main)
  * @argc:
@@ -2169,8 +2384,9 @@ int test_rl_main(int argc, char *argv[])
 	if      ((argc == 2) && (strcmp(argv[1], "zero") == 0)) test_rl_zero();
 	else if ((argc == 3) && (strcmp(argv[1], "frag") == 0)) test_rl_frag(argv[2]);
 	else if ((argc == 4) && (strcmp(argv[1], "pure") == 0)) test_rl_pure(argv[2], argv[3]);
+	else if ((argc <= 3) && (argc > 1) && (strcmp(argv[1], "lookup") == 0)) test_rl_lookup(argc == 3 ? atoi(argv[2]) : 0);
 	else
-		printf("rl [zero|frag|pure] {args}\n");
+		printf("rl [zero|frag|pure|lookup] {args}\n");
 
 	return 0;
 }
@@ -1584,6 +1584,12 @@ static void resize_cache(struct SECURITY_CONTEXT *scx,
  *	returns the updated or created cache entry,
  *	or NULL if not possible (typically if there is no
  *		security id associated)
+ *
+ *	When the volume is shared by threads, the permission caches and
+ *	the indexes of $Secure are protected by the NTFS_LOCK_SECURITY
+ *	lock, held by the functions which may be called by threads which
+ *	do not change the volume (ntfs_get_owner_mode(), ntfs_allowed_access(),
+ *	ntfs_allowed_as_owner(), ntfs_get_posix_acl(), ntfs_get_ntfs_acl()).
  */
 
 #if POSIXACLS
@@ -2199,6 +2205,7 @@ int ntfs_get_posix_acl(struct SECURITY_CONTEXT *scx, ntfs_inode *ni,
 	BOOL isdir;
 	size_t outsize;
 
+	ntfs_volume_lock(scx->vol, NTFS_LOCK_SECURITY);
 	outsize = 0;	/* default to error */
 	if (!scx->mapping[MAPUSERS])
 		errno = ENOTSUP;
@@ -2303,6 +2310,7 @@ int ntfs_get_posix_acl(struct SECURITY_CONTEXT *scx, ntfs_inode *ni,
 		} else
 			outsize = 0;
 	}
+	ntfs_volume_unlock(scx->vol, NTFS_LOCK_SECURITY);
 	return (outsize ? (int)outsize : -errno);
 }
 
@@ -2437,6 +2445,7 @@ int ntfs_get_ntfs_acl(struct SECURITY_CONTEXT *scx, ntfs_inode *ni,
 	char *securattr;
 	size_t outsize;
 
+	ntfs_volume_lock(scx->vol, NTFS_LOCK_SECURITY);
 	outsize = 0;	/* default to no data and no error */
 	securattr = getsecurityattr(scx->vol, ni);
 	if (securattr) {
@@ -2446,6 +2455,7 @@ int ntfs_get_ntfs_acl(struct SECURITY_CONTEXT *scx, ntfs_inode *ni,
 		}
 		free(securattr);
 	}
+	ntfs_volume_unlock(scx->vol, NTFS_LOCK_SECURITY);
 	return (outsize ? (int)outsize : -errno);
 }
 
@@ -2468,6 +2478,7 @@ int ntfs_get_owner_mode(struct SECURITY_CONTEXT *scx,
 	struct POSIX_SECURITY *pxdesc;
 #endif
 
+	ntfs_volume_lock(scx->vol, NTFS_LOCK_SECURITY);
 	if (!scx->mapping[MAPUSERS])
 		perm = 07777;
 	else {
@@ -2560,6 +2571,7 @@ int ntfs_get_owner_mode(struct SECURITY_CONTEXT *scx,
 			}
 		}
 	}
+	ntfs_volume_unlock(scx->vol, NTFS_LOCK_SECURITY);
 	return (perm);
 }
 
@@ -3033,6 +3045,7 @@ BOOL ntfs_allowed_as_owner(struct SECURITY_CONTEXT *scx, ntfs_inode *ni)
 	BOOL gotowner;
 	int allowed;
 
+	ntfs_volume_lock(scx->vol, NTFS_LOCK_SECURITY);
 	processuid = scx->uid;
 /* TODO : use CAP_FOWNER process capability */
 	/*
@@ -3076,6 +3089,7 @@ BOOL ntfs_allowed_as_owner(struct SECURITY_CONTEXT *scx, ntfs_inode *ni)
 			errno = EPERM;
 		}
 	}
+	ntfs_volume_unlock(scx->vol, NTFS_LOCK_SECURITY);
 	return (allowed);
 }
 
@@ -3464,6 +3478,7 @@ int ntfs_allowed_access(struct SECURITY_CONTEXT *scx,
 	int allow;
 	struct stat stbuf;
 
+	ntfs_volume_lock(scx->vol, NTFS_LOCK_SECURITY);
 	/*
 	 * Always allow for root unless execution is requested.
 	 * (was checked by fuse until kernel 2.6.29)
@@ -3526,6 +3541,7 @@ int ntfs_allowed_access(struct SECURITY_CONTEXT *scx,
 		} else
 			allow = 0;
 	}
+	ntfs_volume_unlock(scx->vol, NTFS_LOCK_SECURITY);
 	return (allow);
 }
 
@@ -27,7 +27,489 @@
 #include "logging.h"
 #include "compat.h"
 #include "unistr.h"
+#ifdef NTFS_TEST
+#include "uefi_io_host.h"
+#else
 #include "uefi_support.h"
+#endif
+
+/*
+ * Firmware DiskIo calls have a high fixed cost, so small reads (MFT
+ * records, index blocks, bitmap chunks) are served from a few cached
+ * disk areas, each one filled by a single DiskIo call. The fill size
+ * starts at UEFI_IO_MIN_WINDOW and doubles up to the size of an area
+ * while reads are sequential.
+ *
+ * When DiskIo2 is available, up to UEFI_IO_REQUESTS reads are submitted
+ * asynchronously, each with its own token and event: all the segments
+ * of a vectored read are queued before waiting for the first one, and
+ * sequential reads prefetch the next window into the cache, which is
+ * only waited for when its data is needed.
+ */
+#define UEFI_IO_SEGMENTS	8	/* number of cached disk areas */
+#define UEFI_IO_MIN_CACHE	65536	/* smallest cache worth setting up */
+#define UEFI_IO_MIN_WINDOW	4096	/* initial fill size */
+#define UEFI_IO_REQUESTS	16	/* max outstanding DiskIo2 reads */
+
+struct UEFI_IO_SEGMENT {
+	s64 Start;		/* device offset of the data */
+	s64 Len;		/* 0 if the area is unused */
+	UINT32 Used;		/* clock value of the last use */
+	int Request;		/* pending DiskIo2 read, or -1 */
+	UINT8 *Data;
+};
+
+struct UEFI_IO_CACHE {
+	UINT8 *Buffer;
+	s64 SegmentSize;	/* multiple of the media block size */
+	s64 MinWindow;
+	s64 Window;		/* current fill size */
+	s64 Next;		/* offset following the last read */
+	s64 Ahead;		/* offset following the last fill */
+	UINT32 Clock;
+	UINT64 Hits;
+	UINT64 Fills;
+	UINT64 Prefetches;
+	UINT64 Direct;
+	struct UEFI_IO_SEGMENT Segment[UEFI_IO_SEGMENTS];
+};
+
+struct UEFI_IO_QUEUE {
+	EFI_DISK_IO2_TOKEN Token[UEFI_IO_REQUESTS];
+	BOOL Busy[UEFI_IO_REQUESTS];
+};
+
+/*
+ *		Read from the disk through DiskIo2 when available
+ */
+static EFI_STATUS ntfs_device_uefi_io_read_disk(EFI_FS* FileSystem,
+		void *buf, s64 count, s64 offset)
+{
+	EFI_BLOCK_IO_MEDIA* Media = FileSystem->BlockIo->Media;
+
+	if (FileSystem->DiskIo2 != NULL)
+		return FileSystem->DiskIo2->ReadDiskEx(FileSystem->DiskIo2,
+			Media->MediaId, offset, &(FileSystem->DiskIo2Token),
+			count, buf);
+	return FileSystem->DiskIo->ReadDisk(FileSystem->DiskIo,
+			Media->MediaId, offset, (UINTN)count, buf);
+}
+
+/*
+ *		Set up the DiskIo2 request queue of a device
+ *
+ *	Without DiskIo2, or if the events cannot be created, there is
+ *	no queue and all the reads are synchronous.
+ */
+static void ntfs_device_uefi_io_queue_init(EFI_FS* FileSystem)
+{
+	struct UEFI_IO_QUEUE *Queue;
+	EFI_STATUS Status;
+	int i;
+
+	FileSystem->DiskQueue = NULL;
+	if (FileSystem->DiskIo2 == NULL)
+		return;
+	Queue = (struct UEFI_IO_QUEUE*)calloc(1, sizeof(*Queue));
+	if (!Queue)
+		return;
+	for (i = 0; i < UEFI_IO_REQUESTS; i++) {
+		Status = gBS->CreateEvent(0, TPL_CALLBACK, NULL, NULL,
+				&Queue->Token[i].Event);
+		if (EFI_ERROR(Status)) {
+			while (--i >= 0)
+				gBS->CloseEvent(Queue->Token[i].Event);
+			free(Queue);
+			return;
+		}
+	}
+	FileSystem->DiskQueue = Queue;
+}
+
+/*
+ *		Submit an asynchronous DiskIo2 read
+ *
+ *	Returns the request slot, or -1 if the queue is full or the read
+ *	could not be submitted, the caller then has to read synchronously.
+ */
+static int ntfs_device_uefi_io_submit(EFI_FS* FileSystem, void *buf,
+		s64 count, s64 offset)
+{
+	struct UEFI_IO_QUEUE *Queue =
+			(struct UEFI_IO_QUEUE*)FileSystem->DiskQueue;
+	EFI_STATUS Status;
+	int slot;
+
+	for (slot = 0; slot < UEFI_IO_REQUESTS && Queue->Busy[slot]; slot++)
+		;
+	if (slot == UEFI_IO_REQUESTS)
+		return -1;
+	Queue->Token[slot].TransactionStatus = EFI_SUCCESS;
+	Status = FileSystem->DiskIo2->ReadDiskEx(FileSystem->DiskIo2,
+			FileSystem->BlockIo->Media->MediaId, offset,
+			&Queue->Token[slot], count, buf);
+	if (EFI_ERROR(Status)) {
+		ntfs_log_debug("Could not queue read at address %08llx: %r\n",
+				(long long)offset, Status);
+		return -1;
+	}
+	Queue->Busy[slot] = TRUE;
+	return slot;
+}
+
+/*
+ *		Wait for the completion of an asynchronous DiskIo2 read
+ *
+ *	Returns the status of the read
+ */
+static EFI_STATUS ntfs_device_uefi_io_wait(EFI_FS* FileSystem, int slot)
+{
+	struct UEFI_IO_QUEUE *Queue =
+			(struct UEFI_IO_QUEUE*)FileSystem->DiskQueue;
+	EFI_STATUS Status;
+
+	FS_ASSERT(Queue->Busy[slot]);
+	do {
+		Status = gBS->CheckEvent(Queue->Token[slot].Event);
+	} while (Status == EFI_NOT_READY);
+	Queue->Busy[slot] = FALSE;
+	if (EFI_ERROR(Status))
+		return Status;
+	return Queue->Token[slot].TransactionStatus;
+}
+
+/*
+ *		Free the DiskIo2 request queue of a device
+ *
+ *	The pending reads are waited for, as they use buffers which are
+ *	about to be freed.
+ */
+static void ntfs_device_uefi_io_queue_free(EFI_FS* FileSystem)
+{
+	struct UEFI_IO_QUEUE *Queue =
+			(struct UEFI_IO_QUEUE*)FileSystem->DiskQueue;
+	int i;
+
+	if (Queue) {
+		for (i = 0; i < UEFI_IO_REQUESTS; i++) {
+			if (Queue->Busy[i])
+				ntfs_device_uefi_io_wait(FileSystem, i);
+			gBS->CloseEvent(Queue->Token[i].Event);
+		}
+		free(Queue);
+		FileSystem->DiskQueue = NULL;
+	}
+}
+
+/*
+ *		Set up the read cache of a device
+ *
+ *	The cache gets as much memory as the pool can provide, up to
+ *	DISK_CACHE_SIZE. Failing to set it up is not an error, the
+ *	device is then accessed directly.
+ */
+static void ntfs_device_uefi_io_cache_init(EFI_FS* FileSystem)
+{
+	struct UEFI_IO_CACHE *Cache;
+	UINT32 BlockSize = FileSystem->BlockIo->Media->BlockSize;
+	s64 Size = (s64)DISK_CACHE_SIZE << 10;
+	s64 SegmentSize;
+	int i;
+
+	FileSystem->DiskCache = NULL;
+	if (Size < UEFI_IO_MIN_CACHE || BlockSize == 0)
+		return;
+	Cache = (struct UEFI_IO_CACHE*)calloc(1, sizeof(*Cache));
+	if (!Cache)
+		return;
+	while (Size >= UEFI_IO_MIN_CACHE
+	    && !(Cache->Buffer = (UINT8*)malloc(Size)))
+		Size >>= 1;
+	SegmentSize = (Size / UEFI_IO_SEGMENTS / BlockSize) * BlockSize;
+	if (!Cache->Buffer || !SegmentSize) {
+		free(Cache->Buffer);
+		free(Cache);
+		return;
+	}
+	Cache->SegmentSize = SegmentSize;
+	Cache->MinWindow = ((UEFI_IO_MIN_WINDOW + BlockSize - 1)
+				/ BlockSize) * BlockSize;
+	if (Cache->MinWindow > SegmentSize)
+		Cache->MinWindow = SegmentSize;
+	Cache->Window = Cache->MinWindow;
+	Cache->Next = -1;
+	Cache->Ahead = -1;
+	for (i = 0; i < UEFI_IO_SEGMENTS; i++) {
+		Cache->Segment[i].Data = &Cache->Buffer[i * SegmentSize];
+		Cache->Segment[i].Request = -1;
+	}
+	FileSystem->DiskCache = Cache;
+	ntfs_log_debug("DiskIo cache: %d areas of %lld bytes\n",
+			UEFI_IO_SEGMENTS, (long long)SegmentSize);
+}
+
+/*
+ *		Free the read cache of a device
+ */
+static void ntfs_device_uefi_io_cache_free(EFI_FS* FileSystem)
+{
+	struct UEFI_IO_CACHE *Cache =
+			(struct UEFI_IO_CACHE*)FileSystem->DiskCache;
+
+	if (Cache) {
+		ntfs_log_debug("DiskIo cache: %lld hits, %lld fills, "
+			"%lld prefetches, %lld direct reads\n",
+			(long long)Cache->Hits, (long long)Cache->Fills,
+			(long long)Cache->Prefetches, (long long)Cache->Direct);
+		free(Cache->Buffer);
+		free(Cache);
+		FileSystem->DiskCache = NULL;
+	}
+}
+
+/*
+ *		Wait for the pending read of a cached area
+ *
+ *	If the read failed, the area is dropped.
+ */
+static void ntfs_device_uefi_io_cache_settle(EFI_FS* FileSystem,
+		struct UEFI_IO_SEGMENT *Segment)
+{
+	if (Segment->Request >= 0) {
+		if (EFI_ERROR(ntfs_device_uefi_io_wait(FileSystem,
+				Segment->Request)))
+			Segment->Len = 0;
+		Segment->Request = -1;
+	}
+}
+
+/*
+ *		Find the cached area containing a device position
+ *
+ *	Returns the area, or NULL if the position is not cached
+ */
+static struct UEFI_IO_SEGMENT *ntfs_device_uefi_io_cache_find(
+		struct UEFI_IO_CACHE *Cache, s64 pos)
+{
+	struct UEFI_IO_SEGMENT *Segment;
+	int i;
+
+	for (i = 0; i < UEFI_IO_SEGMENTS; i++) {
+		Segment = &Cache->Segment[i];
+		if (Segment->Len && pos >= Segment->Start
+		    && pos < Segment->Start + Segment->Len)
+			return Segment;
+	}
+	return NULL;
+}
+
+/*
+ *		Get the least recently used cached area for reuse
+ *
+ *	Areas with a pending read are only reused if all of them have
+ *	one, after waiting for it, or not at all if noWait is set.
+ *
+ *	Returns the area, or NULL if none could be reused
+ */
+static struct UEFI_IO_SEGMENT *ntfs_device_uefi_io_cache_victim(
+		EFI_FS* FileSystem, BOOL noWait)
+{
+	struct UEFI_IO_CACHE *Cache =
+			(struct UEFI_IO_CACHE*)FileSystem->DiskCache;
+	struct UEFI_IO_SEGMENT *Segment = NULL;
+	int i;
+
+	for (i = 0; i < UEFI_IO_SEGMENTS; i++)
+		if (Cache->Segment[i].Request < 0
+		    && (!Segment || Cache->Segment[i].Used < Segment->Used))
+			Segment = &Cache->Segment[i];
+	if (!Segment && !noWait) {
+		Segment = &Cache->Segment[0];
+		for (i = 1; i < UEFI_IO_SEGMENTS; i++)
+			if (Cache->Segment[i].Used < Segment->Used)
+				Segment = &Cache->Segment[i];
+		ntfs_device_uefi_io_cache_settle(FileSystem, Segment);
+	}
+	if (Segment)
+		Segment->Len = 0;
+	return Segment;
+}
+
+/*
+ *		Prefetch the window following the last fill
+ *
+ *	The read is queued into a free cached area, nothing is done if
+ *	the queue or all the areas are busy.
+ */
+static void ntfs_device_uefi_io_cache_prefetch(EFI_FS* FileSystem)
+{
+	struct UEFI_IO_CACHE *Cache =
+			(struct UEFI_IO_CACHE*)FileSystem->DiskCache;
+	struct UEFI_IO_SEGMENT *Segment;
+	EFI_BLOCK_IO_MEDIA* Media = FileSystem->BlockIo->Media;
+	s64 volume_size, start, len;
+	int slot;
+
+	volume_size = (s64)Media->BlockSize * (Media->LastBlock + 1);
+	start = Cache->Ahead;
+	if (start < 0 || start >= volume_size)
+		return;
+	/* Already cached, as when reading a file again */
+	Segment = ntfs_device_uefi_io_cache_find(Cache, start);
+	if (Segment) {
+		Cache->Ahead = Segment->Start + Segment->Len;
+		return;
+	}
+	Segment = ntfs_device_uefi_io_cache_victim(FileSystem, TRUE);
+	if (!Segment)
+		return;
+	Cache->Window <<= 1;
+	if (Cache->Window > Cache->SegmentSize)
+		Cache->Window = Cache->SegmentSize;
+	len = Cache->Window;
+	if (start + len > volume_size)
+		len = volume_size - start;
+	slot = ntfs_device_uefi_io_submit(FileSystem, Segment->Data,
+				len, start);
+	if (slot < 0)
+		return;
+	Segment->Start = start;
+	Segment->Len = len;
+	Segment->Request = slot;
+	Segment->Used = ++Cache->Clock;
+	Cache->Ahead = start + len;
+	Cache->Prefetches++;
+}
+
+/*
+ *		Fill a cached area with the data at a device position
+ *
+ *	The area starts at the block containing the position and is at
+ *	least the current window. On a sequential read, the window is
+ *	doubled first.
+ *
+ *	Returns the area, or NULL on error
+ */
+static struct UEFI_IO_SEGMENT *ntfs_device_uefi_io_cache_fill(
+		EFI_FS* FileSystem, s64 pos, s64 count, BOOL sequential)
+{
+	struct UEFI_IO_CACHE *Cache =
+			(struct UEFI_IO_CACHE*)FileSystem->DiskCache;
+	struct UEFI_IO_SEGMENT *Segment;
+	EFI_BLOCK_IO_MEDIA* Media = FileSystem->BlockIo->Media;
+	EFI_STATUS Status;
+	s64 volume_size, start, len;
+
+	volume_size = (s64)Media->BlockSize * (Media->LastBlock + 1);
+	if (pos >= volume_size) {
+		errno = EIO;
+		return NULL;
+	}
+	if (sequential) {
+		Cache->Window <<= 1;
+		if (Cache->Window > Cache->SegmentSize)
+			Cache->Window = Cache->SegmentSize;
+	} else
+		Cache->Window = Cache->MinWindow;
+	start = (pos / Media->BlockSize) * Media->BlockSize;
+	len = ((pos + count - start + Media->BlockSize - 1)
+				/ Media->BlockSize) * Media->BlockSize;
+	if (len < Cache->Window)
+		len = Cache->Window;
+	if (len > Cache->SegmentSize)
+		len = Cache->SegmentSize;
+	if (start + len > volume_size)
+		len = volume_size - start;
+
+	Segment = ntfs_device_uefi_io_cache_victim(FileSystem, FALSE);
+	Status = ntfs_device_uefi_io_read_disk(FileSystem, Segment->Data,
+				len, start);
+	if (EFI_ERROR(Status)) {
+		ntfs_log_perror("Failed to read data at address %08llx\n", start);
+		errno = EIO;
+		return NULL;
+	}
+	Segment->Start = start;
+	Segment->Len = len;
+	Cache->Ahead = start + len;
+	Cache->Fills++;
+	return Segment;
+}
+
+/*
+ *		Read from the device through the read cache
+ *
+ *	Returns the count of bytes read, or -1 on error
+ */
+static s64 ntfs_device_uefi_io_cache_read(EFI_FS* FileSystem, void *buf,
+		s64 count, s64 offset)
+{
+	struct UEFI_IO_CACHE *Cache =
+			(struct UEFI_IO_CACHE*)FileSystem->DiskCache;
+	struct UEFI_IO_SEGMENT *Segment;
+	BOOL sequential;
+	s64 done, pos, n;
+
+	sequential = (offset == Cache->Next);
+	done = 0;
+	while (done < count) {
+		pos = offset + done;
+		Segment = ntfs_device_uefi_io_cache_find(Cache, pos);
+		if (Segment)
+			ntfs_device_uefi_io_cache_settle(FileSystem, Segment);
+		if (Segment && Segment->Len)
+			Cache->Hits++;
+		else {
+			Segment = ntfs_device_uefi_io_cache_fill(FileSystem,
+					pos, count - done, sequential);
+			if (!Segment)
+				return -1;
+		}
+		n = Segment->Start + Segment->Len - pos;
+		if (n > count - done)
+			n = count - done;
+		CopyMem((UINT8*)buf + done, &Segment->Data[pos - Segment->Start],
+				(UINTN)n);
+		Segment->Used = ++Cache->Clock;
+		done += n;
+	}
+	Cache->Next = offset + count;
+	/* Keep a window ahead of sequential reads */
+	if (sequential && FileSystem->DiskQueue && Cache->Ahead >= Cache->Next
+	    && Cache->Ahead - Cache->Next < Cache->Window)
+		ntfs_device_uefi_io_cache_prefetch(FileSystem);
+	return count;
+}
+
+/*
+ *		Update the cached areas overlapped by a write
+ *
+ *	If the write failed, the areas are dropped, as the state of the
+ *	device is unknown.
+ */
+static void ntfs_device_uefi_io_cache_write(EFI_FS* FileSystem,
+		const void *buf, s64 count, s64 offset, BOOL failed)
+{
+	struct UEFI_IO_CACHE *Cache =
+			(struct UEFI_IO_CACHE*)FileSystem->DiskCache;
+	struct UEFI_IO_SEGMENT *Segment;
+	s64 start, end;
+	int i;
+
+	for (i = 0; i < UEFI_IO_SEGMENTS; i++) {
+		Segment = &Cache->Segment[i];
+		start = MAX(offset, Segment->Start);
+		end = MIN(offset + count, Segment->Start + Segment->Len);
+		if (Segment->Len && start < end)
+			ntfs_device_uefi_io_cache_settle(FileSystem, Segment);
+		if (Segment->Len && start < end && failed)
+			Segment->Len = 0;
+		else if (Segment->Len && start < end)
+			CopyMem(&Segment->Data[start - Segment->Start],
+				(const UINT8*)buf + (start - offset),
+				(UINTN)(end - start));
+	}
+}
 
 /**
  * ntfs_device_uefi_io_open: For UEFI drivers, there isn't much to
@@ -71,6 +553,8 @@ static int ntfs_device_uefi_io_open(struct ntfs_device *dev, int flags)
 	dev->d_private = FileSystem;
 	if (FileSystem->BlockIo->Media->ReadOnly || (flags & O_RDWR) != O_RDWR)
 		NDevSetReadOnly(dev);
+	ntfs_device_uefi_io_queue_init(FileSystem);
+	ntfs_device_uefi_io_cache_init(FileSystem);
 	NDevSetOpen(dev);
 
 	return 0;
@@ -116,6 +600,8 @@ static int ntfs_device_uefi_io_close(struct ntfs_device *dev)
 			return -1;
 		}
 
+	ntfs_device_uefi_io_queue_free((EFI_FS*)dev->d_private);
+	ntfs_device_uefi_io_cache_free((EFI_FS*)dev->d_private);
 	NDevClearOpen(dev);
 
 	return 0;
@@ -164,27 +650,36 @@ static s64 ntfs_device_uefi_io_seek(struct ntfs_device* dev, s64 offset,
 
 /**
  * ntfs_device_uefi_io_pread - Perform a positioned read from the device
+ *
+ * Reads smaller than a cached area go through the read cache, larger ones
+ * go directly to the device.
  */
 static s64 ntfs_device_uefi_io_pread(struct ntfs_device *dev, void *buf,
 		s64 count, s64 offset)
 {
 	EFI_STATUS Status;
 	EFI_FS* FileSystem = (EFI_FS*)dev->d_private;
-	EFI_BLOCK_IO_MEDIA* Media;
+	struct UEFI_IO_CACHE* Cache;
 
 	FS_ASSERT(FileSystem != NULL);
 	FS_ASSERT(count >= 0);
 	FS_ASSERT(offset >= 0);
 
-	Media = FileSystem->BlockIo->Media;
+	Cache = (struct UEFI_IO_CACHE*)FileSystem->DiskCache;
+	if (Cache && count > 0 && count <= Cache->SegmentSize) {
+		if (ntfs_device_uefi_io_cache_read(FileSystem, buf, count,
+				offset) < 0)
+			return -1;
+		FileSystem->Offset += count;
+		return count;
+	}
+	if (Cache) {
+		Cache->Direct++;
+		Cache->Next = offset + count;
+	}
 
 	/* Prefer DiskIo2 when available */
-	if (FileSystem->DiskIo2 != NULL)
-		Status = FileSystem->DiskIo2->ReadDiskEx(FileSystem->DiskIo2, Media->MediaId,
-			offset, &(FileSystem->DiskIo2Token), count, buf);
-	else
-		Status = FileSystem->DiskIo->ReadDisk(FileSystem->DiskIo, Media->MediaId,
-			offset, (UINTN)count, buf);
+	Status = ntfs_device_uefi_io_read_disk(FileSystem, buf, count, offset);
 
 	if (EFI_ERROR(Status)) {
 		ntfs_log_perror("Failed to read data at address %08llx\n", offset);
@@ -196,6 +691,77 @@ static s64 ntfs_device_uefi_io_pread(struct ntfs_device *dev, void *buf,
 	return count;
 }
 
+/**
+ * ntfs_device_uefi_io_preadv - Perform a vectored read from the device
+ *
+ * With DiskIo2, the segments are queued before waiting for the first one,
+ * so that the device can process them while the previous ones complete.
+ * Segments which fit in the cache, or which cannot be queued, are read
+ * synchronously once the segments queued before them have completed.
+ *
+ * Returns the count of bytes read up to the first failed segment, or -1
+ * if the first one failed.
+ */
+static s64 ntfs_device_uefi_io_preadv(struct ntfs_device *dev,
+		const struct ntfs_device_iovec *iov, int iovcnt)
+{
+	EFI_FS* FileSystem = (EFI_FS*)dev->d_private;
+	struct UEFI_IO_CACHE* Cache;
+	int slot[UEFI_IO_REQUESTS];
+	int first, next;
+	BOOL failed;
+	s64 total, res;
+
+	FS_ASSERT(FileSystem != NULL);
+
+	Cache = (struct UEFI_IO_CACHE*)FileSystem->DiskCache;
+	total = 0;
+	failed = FALSE;
+	first = next = 0;
+	while (first < iovcnt) {
+		/* Queue as many of the following segments as possible */
+		while (!failed && FileSystem->DiskQueue && next < iovcnt
+		    && next - first < UEFI_IO_REQUESTS
+		    && (!Cache || iov[next].count > Cache->SegmentSize)) {
+			slot[next % UEFI_IO_REQUESTS] =
+				ntfs_device_uefi_io_submit(FileSystem,
+					iov[next].buf, iov[next].count,
+					iov[next].pos);
+			if (slot[next % UEFI_IO_REQUESTS] < 0)
+				break;
+			if (Cache) {
+				Cache->Direct++;
+				Cache->Next = iov[next].pos + iov[next].count;
+			}
+			next++;
+		}
+		if (next > first) {
+			/* Consume the oldest queued segment */
+			if (EFI_ERROR(ntfs_device_uefi_io_wait(FileSystem,
+					slot[first % UEFI_IO_REQUESTS])) && !failed) {
+				ntfs_log_perror("Failed to read data at address "
+					"%08llx\n", (long long)iov[first].pos);
+				errno = EIO;
+				failed = TRUE;
+			}
+			if (!failed)
+				total += iov[first].count;
+		} else {
+			if (failed)
+				break;
+			res = ntfs_device_uefi_io_pread(dev, iov[first].buf,
+					iov[first].count, iov[first].pos);
+			if (res != iov[first].count)
+				failed = TRUE;
+			else
+				total += res;
+			next++;
+		}
+		first++;
+	}
+	return (failed && !total ? -1 : total);
+}
+
 /**
  * ntfs_device_uefi_io_pwrite - Perform a positioned write to the device
  */
@@ -226,6 +792,10 @@ static s64 ntfs_device_uefi_io_pwrite(struct ntfs_device *dev, const void *buf,
 		Status = FileSystem->DiskIo->WriteDisk(FileSystem->DiskIo, Media->MediaId,
 			offset, (UINTN)count, (VOID*)buf);
 
+	if (FileSystem->DiskCache)
+		ntfs_device_uefi_io_cache_write(FileSystem, buf, count, offset,
+				EFI_ERROR(Status));
+
 	if (EFI_ERROR(Status)) {
 		ntfs_log_perror("Failed to write data at address %08llx\n", offset);
 		errno = EIO;
@@ -310,4 +880,370 @@ struct ntfs_device_operations ntfs_device_uefi_io_ops = {
 	.sync		= ntfs_device_uefi_io_sync,
 	.stat		= ntfs_device_uefi_io_stat,
 	.ioctl		= ntfs_device_uefi_io_ioctl,
+	.preadv		= ntfs_device_uefi_io_preadv,
 };
+
+#ifdef NTFS_TEST
+
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "device_io.h"
+#include "volume.h"
+#include "inode.h"
+#include "attrib.h"
+#include "dir.h"
+
+/*
+ *		Host harness for the DiskIo read cache
+ *
+ *	The disk is an image file read through DiskIo and DiskIo2 stubs,
+ *	which count the calls and charge each of them a fixed latency, as
+ *	firmware does. An asynchronous DiskIo2 read completes when the
+ *	latency has elapsed after it was queued, so that queued reads
+ *	overlap.
+ *
+ *	The volume is mounted read-only and all the files are read, with
+ *	and without the cache, and with and without DiskIo2, then in the
+ *	default configuration of the driver, with and without the device
+ *	block cache. The data read must be the same in all the
+ *	configurations.
+ */
+
+struct TEST_DISK {
+	EFI_BLOCK_IO_MEDIA Media;
+	EFI_BLOCK_IO_PROTOCOL BlockIo;
+	EFI_DISK_IO_PROTOCOL DiskIo;
+	EFI_DISK_IO2_PROTOCOL DiskIo2;
+	EFI_BOOT_SERVICES BootServices;
+	EFI_FS FileSystem;
+	int fd;
+	long latency;		/* microseconds per call */
+	u64 calls;
+	u64 queued;		/* asynchronous DiskIo2 reads */
+	u64 bytes;
+} ;
+
+struct TEST_EVENT {
+	s64 due;		/* completion time of the read */
+} ;
+
+struct TEST_WALK {
+	MFT_REF *mrefs;
+	unsigned int *types;
+	int count;
+	int size;
+} ;
+
+static struct TEST_DISK test_disk;
+
+static s64 test_uefi_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, (struct timezone*)NULL);
+	return ((s64)tv.tv_sec*1000000 + tv.tv_usec);
+}
+
+static EFI_STATUS test_uefi_read(UINT64 Offset, UINTN BufferSize,
+			VOID *Buffer)
+{
+	test_disk.calls++;
+	test_disk.bytes += BufferSize;
+	if (pread(test_disk.fd, Buffer, BufferSize, Offset)
+			!= (ssize_t)BufferSize)
+		return (EFI_DEVICE_ERROR);
+	return (EFI_SUCCESS);
+}
+
+static EFI_STATUS test_uefi_read_disk(EFI_DISK_IO_PROTOCOL *This
+				__attribute__((unused)),
+			UINT32 MediaId __attribute__((unused)),
+			UINT64 Offset, UINTN BufferSize, VOID *Buffer)
+{
+	if (test_disk.latency)
+		usleep(test_disk.latency);
+	return (test_uefi_read(Offset, BufferSize, Buffer));
+}
+
+static EFI_STATUS test_uefi_write_disk(EFI_DISK_IO_PROTOCOL *This
+				__attribute__((unused)),
+			UINT32 MediaId __attribute__((unused)),
+			UINT64 Offset __attribute__((unused)),
+			UINTN BufferSize __attribute__((unused)),
+			VOID *Buffer __attribute__((unused)))
+{
+	return (EFI_DEVICE_ERROR);
+}
+
+static EFI_STATUS test_uefi_read_disk_ex(EFI_DISK_IO2_PROTOCOL *This
+				__attribute__((unused)),
+			UINT32 MediaId __attribute__((unused)),
+			UINT64 Offset, EFI_DISK_IO2_TOKEN *Token,
+			UINT64 BufferSize, VOID *Buffer)
+{
+	EFI_STATUS Status;
+
+	if (!Token->Event)
+		return (test_uefi_read_disk(&test_disk.DiskIo, 0,
+					Offset, BufferSize, Buffer));
+	test_disk.queued++;
+	Status = test_uefi_read(Offset, BufferSize, Buffer);
+	((struct TEST_EVENT*)Token->Event)->due = test_uefi_now()
+						+ test_disk.latency;
+	Token->TransactionStatus = Status;
+	return (EFI_SUCCESS);
+}
+
+static EFI_STATUS test_uefi_write_disk_ex(EFI_DISK_IO2_PROTOCOL *This
+				__attribute__((unused)),
+			UINT32 MediaId __attribute__((unused)),
+			UINT64 Offset __attribute__((unused)),
+			EFI_DISK_IO2_TOKEN *Token __attribute__((unused)),
+			UINT64 BufferSize __attribute__((unused)),
+			VOID *Buffer __attribute__((unused)))
+{
+	return (EFI_DEVICE_ERROR);
+}
+
+static EFI_STATUS test_uefi_flush(EFI_BLOCK_IO_PROTOCOL *This
+				__attribute__((unused)))
+{
+	return (EFI_SUCCESS);
+}
+
+static EFI_STATUS test_uefi_create_event(UINT32 Type __attribute__((unused)),
+			UINTN NotifyTpl __attribute__((unused)),
+			VOID *NotifyFunction __attribute__((unused)),
+			VOID *NotifyContext __attribute__((unused)),
+			EFI_EVENT *Event)
+{
+	*Event = calloc(1, sizeof(struct TEST_EVENT));
+	return (*Event ? EFI_SUCCESS : EFI_DEVICE_ERROR);
+}
+
+static EFI_STATUS test_uefi_check_event(EFI_EVENT Event)
+{
+	if (test_uefi_now() < ((struct TEST_EVENT*)Event)->due)
+		return (EFI_NOT_READY);
+	return (EFI_SUCCESS);
+}
+
+static EFI_STATUS test_uefi_close_event(EFI_EVENT Event)
+{
+	free(Event);
+	return (EFI_SUCCESS);
+}
+
+static int test_uefi_filldir(void *dirent, const ntfschar *name,
+			const int name_len, const int name_type,
+			const s64 pos __attribute__((unused)),
+			const MFT_REF mref, const unsigned dt_type)
+{
+	struct TEST_WALK *walk = (struct TEST_WALK*)dirent;
+
+	if ((name_type == FILE_NAME_DOS)
+	    || (MREF(mref) < FILE_first_user)
+	    || ((name_len <= 2) && (name[0] == const_cpu_to_le16('.'))
+		&& ((name_len == 1) || (name[1] == const_cpu_to_le16('.')))))
+		return (0);
+	if (walk->count == walk->size) {
+		walk->size += 64;
+		walk->mrefs = (MFT_REF*)realloc(walk->mrefs,
+					walk->size*sizeof(MFT_REF));
+		walk->types = (unsigned int*)realloc(walk->types,
+					walk->size*sizeof(unsigned int));
+		if (!walk->mrefs || !walk->types)
+			return (-1);
+	}
+	walk->mrefs[walk->count] = mref;
+	walk->types[walk->count] = dt_type;
+	walk->count++;
+	return (0);
+}
+
+/*
+ *		Read all the files in a directory tree
+ *
+ *	Returns a checksum of the data read, which is expected to be
+ *	the same in all configurations
+ */
+
+static u64 test_uefi_walk(ntfs_volume *vol, MFT_REF dir_mref, char *buf)
+{
+	struct TEST_WALK walk;
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	s64 pos;
+	s64 got;
+	u64 sum;
+	int i;
+	int j;
+
+	sum = 0;
+	walk.mrefs = (MFT_REF*)NULL;
+	walk.types = (unsigned int*)NULL;
+	walk.count = walk.size = 0;
+	ni = ntfs_inode_open(vol, dir_mref);
+	if (ni) {
+		pos = 0;
+		ntfs_readdir(ni, &pos, &walk, test_uefi_filldir);
+		ntfs_inode_close(ni);
+	}
+	for (i=0; i<walk.count; i++) {
+		if (walk.types[i] == NTFS_DT_DIR)
+			sum += test_uefi_walk(vol, walk.mrefs[i], buf);
+		else {
+			ni = ntfs_inode_open(vol, walk.mrefs[i]);
+			if (!ni)
+				continue;
+			na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+			if (na) {
+				pos = 0;
+				while ((got = ntfs_attr_pread(na, pos,
+						65536, buf)) > 0) {
+					for (j=0; j<got; j++)
+						sum = sum*31 + (u8)buf[j];
+					pos += got;
+				}
+				ntfs_attr_close(na);
+			}
+			ntfs_inode_close(ni);
+		}
+	}
+	free(walk.mrefs);
+	free(walk.types);
+	return (sum);
+}
+
+/*
+ *		Mount and read a volume in a configuration of the device
+ *
+ *	@cache is the size of the DiskIo read cache, @dcache the size of
+ *	the device block cache and @readahead the read-ahead window, all
+ *	in KB, as in the options of the driver.
+ *
+ *	Returns the checksum of the data, or zero if the volume could
+ *	not be mounted
+ */
+
+static u64 test_uefi_pass(const char *name, int cache, int dcache,
+			int readahead, BOOL diskio2)
+{
+	struct ntfs_device *dev;
+	struct UEFI_IO_CACHE *disk_cache;
+	ntfs_volume *vol;
+	char *buf;
+	u64 prefetches;
+	u64 sum;
+	s64 start;
+
+	test_disk_cache_size = cache;
+	test_disk.FileSystem.DiskIo2 = (diskio2 ? &test_disk.DiskIo2
+				: (EFI_DISK_IO2_PROTOCOL*)NULL);
+	test_disk.calls = 0;
+	test_disk.queued = 0;
+	test_disk.bytes = 0;
+	buf = (char*)malloc(65536);
+	dev = ntfs_device_alloc(name, 0, &ntfs_device_uefi_io_ops, NULL);
+	if (!buf || !dev) {
+		free(buf);
+		return (0);
+	}
+	start = test_uefi_now();
+	vol = ntfs_device_mount(dev, NTFS_MNT_RDONLY);
+	if (!vol) {
+		printf("** could not mount %s **\n", name);
+		ntfs_device_free(dev);
+		free(buf);
+		return (0);
+	}
+	if (dcache)
+		ntfs_device_cache_init(vol->dev, (s64)dcache << 10,
+				DCACHE_BLOCK_SIZE, 0);
+	if (readahead)
+		ntfs_set_readahead(vol, (s64)readahead << 10);
+	sum = test_uefi_walk(vol, FILE_root, buf);
+	/* the queued reads which are not prefetches come from preadv */
+	disk_cache = (struct UEFI_IO_CACHE*)test_disk.FileSystem.DiskCache;
+	prefetches = (disk_cache ? disk_cache->Prefetches : 0);
+	ntfs_umount(vol, FALSE);
+	printf("cache %5dK  dcache %5dK  ahead %5dK  %-7s  %6lld calls"
+		"  %6lld prefetches  %6lld batched  %6.1f MB  %5lld ms"
+		"  sum %016llx\n",
+		cache, dcache, readahead, (diskio2 ? "DiskIo2" : "DiskIo"),
+		(long long)test_disk.calls, (long long)prefetches,
+		(long long)(test_disk.queued - prefetches),
+		test_disk.bytes/1048576.0,
+		(long long)(test_uefi_now() - start)/1000,
+		(unsigned long long)sum);
+	free(buf);
+	return (sum);
+}
+
+/**
+ * test_uefi_io_main - DiskIo read cache test: Program start (main)
+ * @argc:
+ * @argv:	image file, and optional latency of a DiskIo call in us
+ *
+ * Returns:	0 if all the configurations read the same data
+ */
+int test_uefi_io_main(int argc, char *argv[])
+{
+	EFI_FS *fs;
+	struct stat st;
+	CHAR16 *path;
+	u64 sum;
+	int ret;
+
+	if ((argc < 2) || (argc > 3)) {
+		printf("uefi image [latency_us]\n");
+		return (1);
+	}
+	test_disk.fd = open(argv[1], O_RDONLY);
+	if ((test_disk.fd < 0) || fstat(test_disk.fd, &st)) {
+		printf("** could not open %s **\n", argv[1]);
+		return (1);
+	}
+	test_disk.latency = (argc == 3 ? atol(argv[2]) : 100);
+	test_disk.Media.BlockSize = 512;
+	test_disk.Media.LastBlock = st.st_size/512 - 1;
+	test_disk.Media.ReadOnly = TRUE;
+	test_disk.BlockIo.Media = &test_disk.Media;
+	test_disk.BlockIo.FlushBlocks = test_uefi_flush;
+	test_disk.DiskIo.ReadDisk = test_uefi_read_disk;
+	test_disk.DiskIo.WriteDisk = test_uefi_write_disk;
+	test_disk.DiskIo2.ReadDiskEx = test_uefi_read_disk_ex;
+	test_disk.DiskIo2.WriteDiskEx = test_uefi_write_disk_ex;
+	test_disk.BootServices.CreateEvent = test_uefi_create_event;
+	test_disk.BootServices.CheckEvent = test_uefi_check_event;
+	test_disk.BootServices.CloseEvent = test_uefi_close_event;
+	gBS = &test_disk.BootServices;
+	path = (CHAR16*)NULL;
+	if (ntfs_mbstoucs(argv[1], &path) < 0)
+		return (1);
+	fs = &test_disk.FileSystem;
+	fs->DevicePathString = path;
+	fs->BlockIo = &test_disk.BlockIo;
+	fs->DiskIo = &test_disk.DiskIo;
+	fs->ForwardLink = (LIST_ENTRY*)&FsListHead;
+	fs->BackLink = (LIST_ENTRY*)&FsListHead;
+	FsListHead.ForwardLink = (LIST_ENTRY*)fs;
+	FsListHead.BackLink = (LIST_ENTRY*)fs;
+
+	sum = test_uefi_pass(argv[1], 0, 0, 0, FALSE);
+	ret = (sum ? 0 : 1);
+	if ((test_uefi_pass(argv[1], 4096, 0, 0, FALSE) != sum)
+	    || (test_uefi_pass(argv[1], 0, 0, 0, TRUE) != sum)
+	    || (test_uefi_pass(argv[1], 4096, 0, 0, TRUE) != sum)
+	    || (test_uefi_pass(argv[1], 4096, 0, 1024, TRUE) != sum)
+	    || (test_uefi_pass(argv[1], 4096, 1024, 1024, TRUE) != sum)) {
+		printf("** data differ **\n");
+		ret = 1;
+	}
+	free(path);
+	close(test_disk.fd);
+	return (ret);
+}
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ * uefi_io_host.h - Host definitions for testing the UEFI disk io functions
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *	The subset of the UEFI types and boot services used by uefi_io.c,
+ *	defined for building it on the host with NTFS_TEST, so that its
+ *	read cache can be exercised by test_uefi_io_main() against a
+ *	file-backed DiskIo, without firmware.
+ */
+
+#ifndef _NTFS_UEFI_IO_HOST_H
+#define _NTFS_UEFI_IO_HOST_H
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+typedef u8 UINT8;
+typedef u32 UINT32;
+typedef u64 UINT64;
+typedef s64 INT64;
+typedef size_t UINTN;
+typedef void VOID;
+typedef ntfschar CHAR16;
+typedef UINTN EFI_STATUS;
+typedef void *EFI_EVENT;
+
+#define EFI_SUCCESS		0
+#define EFI_NOT_READY		6
+#define EFI_DEVICE_ERROR	7
+#define EFI_ERROR(Status)	((Status) != EFI_SUCCESS)
+#define TPL_CALLBACK		8
+
+typedef struct _LIST_ENTRY {
+	struct _LIST_ENTRY *ForwardLink;
+	struct _LIST_ENTRY *BackLink;
+} LIST_ENTRY;
+
+typedef struct {
+	UINT32 MediaId;
+	BOOL ReadOnly;
+	UINT32 BlockSize;
+	UINT64 LastBlock;
+} EFI_BLOCK_IO_MEDIA;
+
+typedef struct _EFI_BLOCK_IO_PROTOCOL {
+	EFI_BLOCK_IO_MEDIA *Media;
+	EFI_STATUS (*FlushBlocks)(struct _EFI_BLOCK_IO_PROTOCOL *This);
+} EFI_BLOCK_IO_PROTOCOL;
+
+typedef struct _EFI_DISK_IO_PROTOCOL {
+	EFI_STATUS (*ReadDisk)(struct _EFI_DISK_IO_PROTOCOL *This,
+			UINT32 MediaId, UINT64 Offset, UINTN BufferSize,
+			VOID *Buffer);
+	EFI_STATUS (*WriteDisk)(struct _EFI_DISK_IO_PROTOCOL *This,
+			UINT32 MediaId, UINT64 Offset, UINTN BufferSize,
+			VOID *Buffer);
+} EFI_DISK_IO_PROTOCOL;
+
+typedef struct {
+	EFI_EVENT Event;
+	EFI_STATUS TransactionStatus;
+} EFI_DISK_IO2_TOKEN;
+
+typedef struct _EFI_DISK_IO2_PROTOCOL {
+	EFI_STATUS (*ReadDiskEx)(struct _EFI_DISK_IO2_PROTOCOL *This,
+			UINT32 MediaId, UINT64 Offset,
+			EFI_DISK_IO2_TOKEN *Token, UINT64 BufferSize,
+			VOID *Buffer);
+	EFI_STATUS (*WriteDiskEx)(struct _EFI_DISK_IO2_PROTOCOL *This,
+			UINT32 MediaId, UINT64 Offset,
+			EFI_DISK_IO2_TOKEN *Token, UINT64 BufferSize,
+			VOID *Buffer);
+} EFI_DISK_IO2_PROTOCOL;
+
+typedef struct {
+	EFI_STATUS (*CreateEvent)(UINT32 Type, UINTN NotifyTpl,
+			VOID *NotifyFunction, VOID *NotifyContext,
+			EFI_EVENT *Event);
+	EFI_STATUS (*CheckEvent)(EFI_EVENT Event);
+	EFI_STATUS (*CloseEvent)(EFI_EVENT Event);
+} EFI_BOOT_SERVICES;
+
+/* The members of the driver's EFI_FS which are used by uefi_io.c */
+typedef struct _EFI_FS {
+	LIST_ENTRY *ForwardLink;
+	LIST_ENTRY *BackLink;
+	EFI_BLOCK_IO_PROTOCOL *BlockIo;
+	EFI_DISK_IO_PROTOCOL *DiskIo;
+	EFI_DISK_IO2_PROTOCOL *DiskIo2;
+	EFI_DISK_IO2_TOKEN DiskIo2Token;
+	VOID *DiskCache;
+	VOID *DiskQueue;
+	CHAR16 *DevicePathString;
+	INT64 Offset;
+} EFI_FS;
+
+/* Defined by the test harness at the end of uefi_io.c */
+static EFI_BOOT_SERVICES *gBS;
+static EFI_FS FsListHead;
+static int test_disk_cache_size;
+
+#define DISK_CACHE_SIZE		test_disk_cache_size
+#define CopyMem(d, s, n)	memcpy(d, s, n)
+#define FS_ASSERT(a)		do { if (!(a)) abort(); } while (0)
+#ifndef MIN
+#define MIN(x, y)		((x) < (y) ? (x) : (y))
+#endif
+#ifndef MAX
+#define MAX(x, y)		((x) > (y) ? (x) : (y))
+#endif
+
+static inline int StrCmp(const CHAR16 *s1, const CHAR16 *s2)
+{
+	while (*s1 && (*s1 == *s2)) {
+		s1++;
+		s2++;
+	}
+	return (*s1 - *s2);
+}
+
+#endif /* _NTFS_UEFI_IO_HOST_H */
@@ -50,6 +50,9 @@
 #ifdef HAVE_SYS_IOCTL_H
 #include <sys/ioctl.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 #ifdef HAVE_LINUX_FD_H
 #include <linux/fd.h>
 #endif
@@ -66,6 +69,11 @@
 
 #define DEV_FD(dev)	(*(int *)dev->d_private)
 
+#if defined(HAVE_SYS_UIO_H) && defined(HAVE_PREADV) && defined(HAVE_PWRITEV)
+#define UNIX_IO_VECTORED 1
+#define UNIX_IOV_MAX 64	/* Max segments in a vectored system call */
+#endif
+
 /* Define to nothing if not present on this system. */
 #ifndef O_EXCL
 #	define O_EXCL 0
@@ -375,6 +383,151 @@ static int ntfs_device_unix_io_ioctl(struct ntfs_device *dev,
 	return ioctl(DEV_FD(dev), request, argp);
 }
 
+/**
+ * ntfs_device_unix_io_fd - Get the file descriptor of the device
+ * @dev:
+ *
+ * Returns the file descriptor the device was opened on.
+ */
+static int ntfs_device_unix_io_fd(struct ntfs_device *dev)
+{
+	return DEV_FD(dev);
+}
+
+#ifdef UNIX_IO_VECTORED
+
+/*
+ *		Transfer a vector of buffers at a device position
+ *
+ *	The system call is repeated on partial transfers, until all is
+ *	transferred, or the end of device or an error is met.
+ *
+ *	Returns the number of bytes transferred, or -1 if none
+ */
+
+static s64 ntfs_unix_io_vector(int fd, struct iovec *vec, int cnt, s64 pos,
+		BOOL write)
+{
+	s64 total;
+	s64 ret;
+
+	total = 0;
+	while (cnt) {
+		if (write)
+			ret = pwritev(fd, vec, cnt, pos + total);
+		else
+			ret = preadv(fd, vec, cnt, pos + total);
+		if (ret <= 0) {
+			if ((ret < 0) && (errno == EINTR))
+				continue;
+			if ((ret < 0) && !total)
+				return (-1);
+			break;
+		}
+		total += ret;
+			/* skip the completed buffers */
+		while (cnt && (ret >= (s64)vec->iov_len)) {
+			ret -= vec->iov_len;
+			vec++;
+			cnt--;
+		}
+		if (cnt) {
+			vec->iov_base = (char*)vec->iov_base + ret;
+			vec->iov_len -= ret;
+		}
+	}
+	return (total);
+}
+
+/*
+ *		Transfer a batch of segments
+ *
+ *	Segments which are consecutive on the device are grouped into
+ *	a single vectored system call.
+ *
+ *	Returns the number of bytes transferred until the first incomplete
+ *	segment, or -1 if none (with errno set)
+ */
+
+static s64 ntfs_unix_io_batch(struct ntfs_device *dev,
+		const struct ntfs_device_iovec *iov, int iovcnt, BOOL write)
+{
+	struct iovec vec[UNIX_IOV_MAX];
+	s64 total;
+	s64 size;
+	s64 ret;
+	int cnt;
+	int i;
+	int j;
+
+	total = 0;
+	for (i=0; i<iovcnt; i=j) {
+		size = 0;
+		for (j=i; (j < iovcnt) && ((j - i) < UNIX_IOV_MAX)
+		    && (iov[j].pos == (iov[i].pos + size)); j++) {
+			if (!iov[j].buf || (iov[j].count < 0)) {
+				errno = EINVAL;
+				return (total ? total : -1);
+			}
+			vec[j - i].iov_base = iov[j].buf;
+			vec[j - i].iov_len = iov[j].count;
+			size += iov[j].count;
+		}
+		cnt = j - i;
+		if (iov[i].pos < 0) {
+			errno = EINVAL;
+			return (total ? total : -1);
+		}
+		ret = ntfs_unix_io_vector(DEV_FD(dev), vec, cnt, iov[i].pos,
+				write);
+		if (ret < 0)
+			return (total ? total : -1);
+		total += ret;
+		if (ret < size)
+			break;
+	}
+	return (total);
+}
+
+/**
+ * ntfs_device_unix_io_preadv - Perform a batch of positioned reads
+ * @dev:
+ * @iov:
+ * @iovcnt:
+ *
+ * Description...
+ *
+ * Returns:
+ */
+static s64 ntfs_device_unix_io_preadv(struct ntfs_device *dev,
+		const struct ntfs_device_iovec *iov, int iovcnt)
+{
+	return (ntfs_unix_io_batch(dev, iov, iovcnt, FALSE));
+}
+
+/**
+ * ntfs_device_unix_io_pwritev - Perform a batch of positioned writes
+ * @dev:
+ * @iov:
+ * @iovcnt:
+ *
+ * Description...
+ *
+ * Returns:
+ */
+static s64 ntfs_device_unix_io_pwritev(struct ntfs_device *dev,
+		const struct ntfs_device_iovec *iov, int iovcnt)
+{
+	if (NDevReadOnly(dev)) {
+		errno = EROFS;
+		return -1;
+	}
+	NDevSetDirty(dev);
+	return (ntfs_unix_io_batch(dev, iov, iovcnt, TRUE));
+}
+
+#endif /* UNIX_IO_VECTORED */
+
 /**
  * Device operations for working with unix style devices and files.
  */
@@ -389,4 +542,9 @@ struct ntfs_device_operations ntfs_device_unix_io_ops = {
 	.sync		= ntfs_device_unix_io_sync,
 	.stat		= ntfs_device_unix_io_stat,
 	.ioctl		= ntfs_device_unix_io_ioctl,
+#ifdef UNIX_IO_VECTORED
+	.preadv		= ntfs_device_unix_io_preadv,
+	.pwritev	= ntfs_device_unix_io_pwritev,
+#endif
+	.fd		= ntfs_device_unix_io_fd,
 };
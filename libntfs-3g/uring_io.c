@@ -0,0 +1,1095 @@
+/**
+ * uring_io.c - Linux io_uring disk io functions.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	These device operations are the same as the unix ones, except that
+ *	large positioned reads and writes, and batches of them, are split
+ *	into chunks which are all queued together to an io_uring, so that
+ *	the device has many requests to process concurrently.
+ *
+ *	The ring is directly set up by system calls, so that there is no
+ *	dependency on liburing. When the kernel does not support io_uring
+ *	(or it is disabled), the device falls back to the unix operations,
+ *	and so it does when the ring fails, after the requests in flight
+ *	have completed.
+ *
+ *	When the volume is shared by threads, the ring is used by one
+ *	thread at a time, and the requests of the other threads meanwhile
+ *	are processed by plain system calls rather than waiting.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#ifdef ENABLE_VOLUME_LOCKS
+#include <pthread.h>
+#endif
+
+#include "types.h"
+#include "device.h"
+#include "device_io.h"
+#include "logging.h"
+#include "misc.h"
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+
+#define URING_ENTRIES 64	/* Max number of queued requests */
+#define URING_CHUNK 262144	/* Max size of a queued request */
+
+#ifdef NTFS_TEST
+
+	/* the failures which the harness may simulate */
+enum {
+	TEST_URING_NONE,	/* no failure */
+	TEST_URING_SETUP,	/* io_uring is not supported */
+	TEST_URING_ENTER,	/* the next wait for completions fails */
+	TEST_URING_FAILED	/* the wait has failed */
+} ;
+
+static int test_uring_fail = TEST_URING_NONE;
+
+#endif
+
+/*
+ *		Private data of an io_uring device
+ *
+ *	The file descriptor has to be the first field, so that the unix
+ *	device operations can be used for everything which does not
+ *	go through the ring.
+ */
+
+struct URING_DEVICE {
+	int fd;			/* Device file, as for unix_io */
+	int ring_fd;		/* io_uring or -1 if no more usable */
+	unsigned int entries;	/* Max number of requests in ring */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	s64 pos[URING_ENTRIES];		/* Device position of chunks */
+	s64 done[URING_ENTRIES];	/* Bytes transferred, or -errno */
+	struct iovec iov[URING_ENTRIES];	/* Memory buffers of chunks */
+#ifdef ENABLE_VOLUME_LOCKS
+	pthread_mutex_t mutex;		/* Owner of the ring and chunks */
+#endif
+} ;
+
+#define URING(dev) ((struct URING_DEVICE*)(dev)->d_private)
+
+/*
+ *		Unmap the rings and close the io_uring
+ *
+ *	Afterwards, all requests are processed by plain system calls.
+ */
+
+static void ntfs_uring_teardown(struct URING_DEVICE *ring)
+{
+	if (ring->sqes && (ring->sqes != MAP_FAILED))
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && (ring->cq_ring != MAP_FAILED))
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring && (ring->sq_ring != MAP_FAILED))
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	ring->sqes = (struct io_uring_sqe*)NULL;
+	ring->cq_ring = ring->sq_ring = (void*)NULL;
+	if (ring->ring_fd >= 0)
+		close(ring->ring_fd);
+	ring->ring_fd = -1;
+}
+
+/*
+ *		Create an io_uring and map its rings
+ *
+ *	Returns zero if successful
+ *		-1 if io_uring cannot be used, with errno set
+ */
+
+static int ntfs_uring_setup(struct URING_DEVICE *ring)
+{
+	struct io_uring_params p;
+	int err;
+
+#ifdef NTFS_TEST
+	if (test_uring_fail == TEST_URING_SETUP) {
+		ring->ring_fd = -1;
+		errno = ENOSYS;
+		return (-1);
+	}
+#endif
+	memset(&p, 0, sizeof(p));
+	ring->ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ring->ring_fd < 0)
+		return (-1);
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries*sizeof(u32);
+	ring->cq_ring_size = p.cq_off.cqes
+			+ p.cq_entries*sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+	ring->sq_ring = mmap((void*)NULL, ring->sq_ring_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->ring_fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = mmap((void*)NULL, ring->cq_ring_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->ring_fd, IORING_OFF_CQ_RING);
+	ring->sqes = (struct io_uring_sqe*)mmap((void*)NULL, ring->sqes_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->ring_fd, IORING_OFF_SQES);
+	if ((ring->sq_ring == MAP_FAILED)
+	    || (ring->cq_ring == MAP_FAILED)
+	    || (ring->sqes == MAP_FAILED)) {
+		err = errno;
+		ntfs_uring_teardown(ring);
+		errno = err;
+		return (-1);
+	}
+	ring->sq_head = (unsigned int*)((char*)ring->sq_ring
+					+ p.sq_off.head);
+	ring->sq_tail = (unsigned int*)((char*)ring->sq_ring
+					+ p.sq_off.tail);
+	ring->sq_mask = (unsigned int*)((char*)ring->sq_ring
+					+ p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int*)((char*)ring->sq_ring
+					+ p.sq_off.array);
+	ring->cq_head = (unsigned int*)((char*)ring->cq_ring
+					+ p.cq_off.head);
+	ring->cq_tail = (unsigned int*)((char*)ring->cq_ring
+					+ p.cq_off.tail);
+	ring->cq_mask = (unsigned int*)((char*)ring->cq_ring
+					+ p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ring
+					+ p.cq_off.cqes);
+	ring->entries = (p.sq_entries < URING_ENTRIES
+				? p.sq_entries : URING_ENTRIES);
+	return (0);
+}
+
+/*
+ *		Enter the ring to submit requests and wait for completions
+ *
+ *	The harness may simulate a failure of the wait which follows
+ *	a submission, so that the requests are still in flight.
+ */
+
+static int ntfs_uring_enter(struct URING_DEVICE *ring, int submit, int wait)
+{
+#ifdef NTFS_TEST
+	if (test_uring_fail == TEST_URING_ENTER) {
+		if (submit)
+			return (syscall(__NR_io_uring_enter, ring->ring_fd,
+					submit, 0, 0, (void*)NULL, 0));
+		test_uring_fail = TEST_URING_FAILED;
+		errno = EIO;
+		return (-1);
+	}
+#endif
+	return (syscall(__NR_io_uring_enter, ring->ring_fd, submit, wait,
+			IORING_ENTER_GETEVENTS, (void*)NULL, 0));
+}
+
+/*
+ *		Queue the prepared chunks and wait for their completion
+ *
+ *	The result of each chunk is stored into ring->done[]
+ *
+ *	If the ring fails after some chunks were submitted, their
+ *	completion is still waited for, as a chunk redone by a system
+ *	call could otherwise be overwritten by the late completion of
+ *	the queued one.
+ *
+ *	Returns zero if successful
+ *		-1 if the ring failed, but no chunk is in flight : the
+ *		   completed chunks have their result in ring->done[],
+ *		   and the other ones are to be redone
+ *		-2 if some chunks may still be in flight
+ */
+
+static int ntfs_uring_run(struct URING_DEVICE *ring, int n, int opcode)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned int tail;
+	unsigned int head;
+	unsigned int idx;
+	BOOL failed;
+	int submitted;
+	int completed;
+	int err;
+	int ret;
+	int i;
+
+	tail = *ring->sq_tail;
+	for (i=0; i<n; i++) {
+		idx = (tail + i) & *ring->sq_mask;
+		sqe = &ring->sqes[idx];
+		memset(sqe, 0, sizeof(struct io_uring_sqe));
+		sqe->opcode = opcode;
+		sqe->fd = ring->fd;
+		sqe->addr = (unsigned long)&ring->iov[i];
+		sqe->len = 1;
+		sqe->off = ring->pos[i];
+		sqe->user_data = i;
+		ring->sq_array[idx] = idx;
+	}
+	__atomic_store_n(ring->sq_tail, tail + n, __ATOMIC_RELEASE);
+
+	submitted = 0;
+	completed = 0;
+	failed = FALSE;
+	err = 0;
+	head = *ring->cq_head;
+	while (failed ? completed < submitted : completed < n) {
+			/*
+			 * submit what is left, and wait for all, or
+			 * after a failure, only wait for the submitted ones
+			 */
+		if (failed)
+			ret = ntfs_uring_enter(ring, 0, submitted - completed);
+		else
+			ret = ntfs_uring_enter(ring, n - submitted,
+					n - completed);
+		if (ret >= 0) {
+			if (!failed)
+				submitted += ret;
+		} else
+			if ((errno != EINTR)
+			    && (errno != EAGAIN)
+			    && (errno != EBUSY)) {
+				if (failed) {
+					errno = err;
+					return (-2);
+				}
+				failed = TRUE;
+				err = errno;
+			}
+		while (head != __atomic_load_n(ring->cq_tail,
+						__ATOMIC_ACQUIRE)) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			if (cqe->user_data < (u64)n)
+				ring->done[cqe->user_data] = cqe->res;
+			head++;
+			completed++;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	if (failed) {
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ *		Complete a chunk by plain system calls
+ *
+ *	This is used for short transfers, errors reported by the
+ *	ring (to get a proper errno), and when there is no ring.
+ *
+ *	Returns the number of bytes transferred, or -1 if none
+ */
+
+static s64 ntfs_uring_finish(struct URING_DEVICE *ring, int i, BOOL write)
+{
+	char *buf;
+	s64 count;
+	s64 done;
+	s64 ret;
+
+	buf = (char*)ring->iov[i].iov_base;
+	count = ring->iov[i].iov_len;
+	done = (ring->done[i] > 0 ? ring->done[i] : 0);
+	ret = 1;
+	while ((done < count) && (ret > 0)) {
+		if (write)
+			ret = pwrite(ring->fd, &buf[done], count - done,
+					ring->pos[i] + done);
+		else
+			ret = pread(ring->fd, &buf[done], count - done,
+					ring->pos[i] + done);
+		if (ret > 0)
+			done += ret;
+		else
+			if ((ret < 0) && (errno == EINTR))
+				ret = 1;
+	}
+	return ((done || (ret >= 0)) ? done : -1);
+}
+
+#ifdef ENABLE_VOLUME_LOCKS
+
+/*
+ *		Transfer a batch of segments by plain system calls
+ *
+ *	This is used when another thread is using the ring.
+ *
+ *	Returns the number of bytes transferred until the first incomplete
+ *	segment, or -1 if none (with errno set).
+ */
+
+static s64 ntfs_uring_sync_transfer(struct URING_DEVICE *ring,
+			const struct ntfs_device_iovec *iov, int iovcnt,
+			BOOL write)
+{
+	s64 total;
+	s64 done;
+	s64 ret;
+	int s;
+
+	total = 0;
+	for (s=0; s<iovcnt; s++) {
+		if (!iov[s].buf || (iov[s].count < 0) || (iov[s].pos < 0)) {
+			errno = EINVAL;
+			return (total ? total : -1);
+		}
+		done = 0;
+		ret = 1;
+		while ((done < iov[s].count) && (ret > 0)) {
+			if (write)
+				ret = pwrite(ring->fd,
+					(const char*)iov[s].buf + done,
+					iov[s].count - done, iov[s].pos + done);
+			else
+				ret = pread(ring->fd,
+					(char*)iov[s].buf + done,
+					iov[s].count - done, iov[s].pos + done);
+			if (ret > 0)
+				done += ret;
+			else
+				if ((ret < 0) && (errno == EINTR))
+					ret = 1;
+		}
+		if ((ret < 0) && !done)
+			return (total ? total : -1);
+		total += done;
+		if (done < iov[s].count)
+			break;
+	}
+	return (total);
+}
+
+#endif /* ENABLE_VOLUME_LOCKS */
+
+/*
+ *		Transfer a batch of segments through the ring
+ *
+ *	The segments are split into chunks of at most URING_CHUNK bytes,
+ *	and up to ring->entries chunks are queued at once.
+ *
+ *	Returns the number of bytes transferred until the first incomplete
+ *	segment, or -1 if none (with errno set).
+ */
+
+static s64 ntfs_uring_ring_transfer(struct ntfs_device *dev,
+			const struct ntfs_device_iovec *iov, int iovcnt,
+			BOOL write)
+{
+	struct URING_DEVICE *ring;
+	s64 total;
+	s64 done;
+	s64 ofs;
+	s64 len;
+	int ret;
+	int n;
+	int i;
+	int s;
+
+	ring = URING(dev);
+	total = 0;
+	s = 0;
+	ofs = 0;
+	while (s < iovcnt) {
+			/* prepare a ring full of chunks */
+		n = 0;
+		while ((s < iovcnt) && (n < (int)ring->entries)) {
+			if (!iov[s].buf || (iov[s].count < 0)
+			    || (iov[s].pos < 0)) {
+				errno = EINVAL;
+				return (total ? total : -1);
+			}
+			len = iov[s].count - ofs;
+			if (len > URING_CHUNK)
+				len = URING_CHUNK;
+			if (len > 0) {
+				ring->pos[n] = iov[s].pos + ofs;
+				ring->iov[n].iov_base = (char*)iov[s].buf + ofs;
+				ring->iov[n].iov_len = len;
+				ring->done[n] = 0;
+				n++;
+				ofs += len;
+			}
+			if (ofs >= iov[s].count) {
+				s++;
+				ofs = 0;
+			}
+		}
+		ret = 0;
+		if (ring->ring_fd >= 0)
+			ret = ntfs_uring_run(ring, n,
+				write ? IORING_OP_WRITEV : IORING_OP_READV);
+		if (ret) {
+			ntfs_log_perror("io_uring failed on %s, using "
+				"synchronous I/O", dev->d_name);
+			ntfs_uring_teardown(ring);
+				/* chunks still in flight cannot be redone */
+			if (ret < -1) {
+				errno = EIO;
+				return (total ? total : -1);
+			}
+		}
+			/* account in order, stopping at first incomplete */
+		for (i=0; i<n; i++) {
+			done = ring->done[i];
+			if (done != (s64)ring->iov[i].iov_len) {
+				done = ntfs_uring_finish(ring, i, write);
+				if (done < 0)
+					return (total ? total : -1);
+			}
+			total += done;
+			if (done < (s64)ring->iov[i].iov_len)
+				return (total);
+		}
+	}
+	return (total);
+}
+
+/*
+ *		Transfer a batch of segments, through the ring if it is free
+ */
+
+static s64 ntfs_uring_transfer(struct ntfs_device *dev,
+			const struct ntfs_device_iovec *iov, int iovcnt,
+			BOOL write)
+{
+#ifdef ENABLE_VOLUME_LOCKS
+	struct URING_DEVICE *ring;
+	s64 total;
+
+	ring = URING(dev);
+	if (pthread_mutex_trylock(&ring->mutex))
+		return (ntfs_uring_sync_transfer(ring, iov, iovcnt, write));
+	total = ntfs_uring_ring_transfer(dev, iov, iovcnt, write);
+	pthread_mutex_unlock(&ring->mutex);
+	return (total);
+#else
+	return (ntfs_uring_ring_transfer(dev, iov, iovcnt, write));
+#endif
+}
+
+/*
+ *		Open the device and set up the io_uring
+ *
+ *	The device is opened by the unix operations. If io_uring
+ *	cannot be used, the unix operations are kept for the device.
+ */
+
+static int ntfs_device_uring_io_open(struct ntfs_device *dev, int flags)
+{
+	struct URING_DEVICE *ring;
+	int err;
+
+	if (ntfs_device_unix_io_ops.open(dev, flags))
+		return (-1);
+	ring = (struct URING_DEVICE*)ntfs_malloc(sizeof(struct URING_DEVICE));
+	if (!ring) {
+		err = errno;
+		ntfs_device_unix_io_ops.close(dev);
+		errno = err;
+		return (-1);
+	}
+	memset(ring, 0, sizeof(struct URING_DEVICE));
+	ring->fd = *(int*)dev->d_private;
+	if (ntfs_uring_setup(ring)) {
+		ntfs_log_debug("io_uring is not available (%s), using unix "
+				"I/O for %s\n", strerror(errno), dev->d_name);
+		free(ring);
+		dev->d_ops = &ntfs_device_unix_io_ops;
+	} else {
+#ifdef ENABLE_VOLUME_LOCKS
+		pthread_mutex_init(&ring->mutex, (pthread_mutexattr_t*)NULL);
+#endif
+		free(dev->d_private);
+		dev->d_private = ring;
+	}
+	return (0);
+}
+
+/*
+ *		Close the io_uring and the device
+ */
+
+static int ntfs_device_uring_io_close(struct ntfs_device *dev)
+{
+	if (NDevOpen(dev)) {
+		ntfs_uring_teardown(URING(dev));
+#ifdef ENABLE_VOLUME_LOCKS
+		pthread_mutex_destroy(&URING(dev)->mutex);
+#endif
+	}
+	return (ntfs_device_unix_io_ops.close(dev));
+}
+
+static s64 ntfs_device_uring_io_seek(struct ntfs_device *dev, s64 offset,
+		int whence)
+{
+	return (ntfs_device_unix_io_ops.seek(dev, offset, whence));
+}
+
+static s64 ntfs_device_uring_io_read(struct ntfs_device *dev, void *buf,
+		s64 count)
+{
+	return (ntfs_device_unix_io_ops.read(dev, buf, count));
+}
+
+static s64 ntfs_device_uring_io_write(struct ntfs_device *dev,
+		const void *buf, s64 count)
+{
+	return (ntfs_device_unix_io_ops.write(dev, buf, count));
+}
+
+/*
+ *		Positioned read
+ *
+ *	Small reads are done by a single system call, as queuing them
+ *	to the ring brings no concurrency.
+ */
+
+static s64 ntfs_device_uring_io_pread(struct ntfs_device *dev, void *buf,
+		s64 count, s64 offset)
+{
+	struct ntfs_device_iovec iov;
+
+	if (count <= URING_CHUNK)
+		return (pread(URING(dev)->fd, buf, count, offset));
+	iov.pos = offset;
+	iov.count = count;
+	iov.buf = buf;
+	return (ntfs_uring_transfer(dev, &iov, 1, FALSE));
+}
+
+/*
+ *		Positioned write
+ */
+
+static s64 ntfs_device_uring_io_pwrite(struct ntfs_device *dev,
+		const void *buf, s64 count, s64 offset)
+{
+	struct ntfs_device_iovec iov;
+
+	if (NDevReadOnly(dev)) {
+		errno = EROFS;
+		return (-1);
+	}
+	NDevSetDirty(dev);
+	if (count <= URING_CHUNK)
+		return (pwrite(URING(dev)->fd, buf, count, offset));
+	iov.pos = offset;
+	iov.count = count;
+	iov.buf = (void*)buf;
+	return (ntfs_uring_transfer(dev, &iov, 1, TRUE));
+}
+
+static int ntfs_device_uring_io_sync(struct ntfs_device *dev)
+{
+	return (ntfs_device_unix_io_ops.sync(dev));
+}
+
+static int ntfs_device_uring_io_stat(struct ntfs_device *dev,
+		struct stat *buf)
+{
+	return (ntfs_device_unix_io_ops.stat(dev, buf));
+}
+
+static int ntfs_device_uring_io_ioctl(struct ntfs_device *dev,
+		unsigned long request, void *argp)
+{
+	return (ntfs_device_unix_io_ops.ioctl(dev, request, argp));
+}
+
+/*
+ *		Get the file descriptor of the device
+ *
+ *	The ring is not involved in reading through the descriptor,
+ *	so the data may be spliced as with the unix operations.
+ */
+
+static int ntfs_device_uring_io_fd(struct ntfs_device *dev)
+{
+	return (URING(dev)->fd);
+}
+
+/*
+ *		Batched positioned read
+ */
+
+static s64 ntfs_device_uring_io_preadv(struct ntfs_device *dev,
+		const struct ntfs_device_iovec *iov, int iovcnt)
+{
+	return (ntfs_uring_transfer(dev, iov, iovcnt, FALSE));
+}
+
+/*
+ *		Batched positioned write
+ */
+
+static s64 ntfs_device_uring_io_pwritev(struct ntfs_device *dev,
+		const struct ntfs_device_iovec *iov, int iovcnt)
+{
+	if (NDevReadOnly(dev)) {
+		errno = EROFS;
+		return (-1);
+	}
+	NDevSetDirty(dev);
+	return (ntfs_uring_transfer(dev, iov, iovcnt, TRUE));
+}
+
+/**
+ * Device operations for working with devices and files through io_uring.
+ */
+struct ntfs_device_operations ntfs_device_uring_io_ops = {
+	.open		= ntfs_device_uring_io_open,
+	.close		= ntfs_device_uring_io_close,
+	.seek		= ntfs_device_uring_io_seek,
+	.read		= ntfs_device_uring_io_read,
+	.write		= ntfs_device_uring_io_write,
+	.pread		= ntfs_device_uring_io_pread,
+	.pwrite		= ntfs_device_uring_io_pwrite,
+	.sync		= ntfs_device_uring_io_sync,
+	.stat		= ntfs_device_uring_io_stat,
+	.ioctl		= ntfs_device_uring_io_ioctl,
+	.preadv		= ntfs_device_uring_io_preadv,
+	.pwritev	= ntfs_device_uring_io_pwritev,
+	.fd		= ntfs_device_uring_io_fd,
+};
+
+#ifdef NTFS_TEST
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#include <sys/time.h>
+
+#include "volume.h"
+#include "inode.h"
+#include "attrib.h"
+#include "dir.h"
+
+#define TEST_URING_BATCHES 100		/* batches per mode */
+#define TEST_URING_SEGMENTS 200		/* max segments in a batch */
+#define TEST_URING_SEGSIZE 600000	/* max size of a segment */
+#define TEST_URING_FILE 4194304		/* size of files on the volume */
+#define TEST_URING_EXTEND 524288	/* step for fragmenting files */
+
+enum { TEST_URING_RING, TEST_URING_ABORT, TEST_URING_NORING } ;
+
+static const char *test_uring_modes[] = {
+	"ring", "failed wait", "no ring"
+} ;
+
+static u32 test_uring_random(u32 *seed)
+{
+	*seed = *seed*1103515245 + 12345;
+	return ((*seed >> 8) & 0xffffff);
+}
+
+static void test_uring_fill(u8 *buf, s64 size, u32 *seed)
+{
+	s64 i;
+
+	for (i=0; i<size; i++)
+		buf[i] = test_uring_random(seed);
+}
+
+static s64 test_uring_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, (struct timezone*)NULL);
+	return ((s64)tv.tv_sec*1000000 + tv.tv_usec);
+}
+
+/*
+ *		Check whether a device uses the operations expected in a mode
+ */
+
+static BOOL test_uring_used(struct ntfs_device *dev, int mode)
+{
+	return ((dev->d_ops == &ntfs_device_uring_io_ops)
+			== (mode != TEST_URING_NORING));
+}
+
+/*
+ *		Check batched transfers on a plain file
+ *
+ *	Batches of random segments are read and written by the io_uring
+ *	operations, and checked against a copy of the file in memory.
+ *	Some segments are bigger than a chunk, and some batches have more
+ *	chunks than the ring has entries. In the end, the whole file is
+ *	read by the io_uring operations, then by the unix ones.
+ *
+ *	Returns 0 if the test passed
+ */
+
+static int test_uring_device(const char *name, u8 *ref, u8 *buf, s64 size,
+			int mode, u32 *seed)
+{
+	struct ntfs_device_iovec iov[TEST_URING_SEGMENTS];
+	struct ntfs_device *dev;
+	s64 start;
+	s64 slot;
+	s64 queued;
+	s64 done;
+	s64 transferred;
+	BOOL write;
+	int bad;
+	int fd;
+	int b;
+	int n;
+	int i;
+
+	bad = 0;
+	test_uring_fill(ref, size, seed);
+	fd = open(name, O_WRONLY);
+	if ((fd < 0) || (pwrite(fd, ref, size, 0) != size))
+		bad++;
+	if ((fd >= 0) && close(fd))
+		bad++;
+	dev = ntfs_device_alloc(name, 0, &ntfs_device_uring_io_ops, NULL);
+	if (mode == TEST_URING_NORING)
+		test_uring_fail = TEST_URING_SETUP;
+	if (!dev || dev->d_ops->open(dev, O_RDWR)) {
+		printf("Could not open %s\n", name);
+		if (dev)
+			ntfs_device_free(dev);
+		test_uring_fail = TEST_URING_NONE;
+		return (1);
+	}
+	test_uring_fail = (mode == TEST_URING_ABORT
+				? TEST_URING_ENTER : TEST_URING_NONE);
+	if (!test_uring_used(dev, mode))
+		bad++;
+	transferred = 0;
+	start = test_uring_now();
+	for (b=0; (b<TEST_URING_BATCHES) && !bad; b++) {
+		write = (b & 1) != 0;
+		n = ((b % 10) >= 8 ? TEST_URING_SEGMENTS
+				: (int)(test_uring_random(seed) % 64) + 1);
+		slot = size/n;
+		queued = 0;
+		for (i=0; i<n; i++) {
+			iov[i].count = test_uring_random(seed)
+				% min(slot, TEST_URING_SEGSIZE) + 1;
+			iov[i].pos = i*slot + test_uring_random(seed)
+				% (slot - iov[i].count + 1);
+			iov[i].buf = &buf[queued];
+			queued += iov[i].count;
+		}
+		if (write) {
+			test_uring_fill(buf, queued, seed);
+			done = dev->d_ops->pwritev(dev, iov, n);
+			for (i=0; (i<n) && (done == queued); i++)
+				memcpy(&ref[iov[i].pos], iov[i].buf,
+					iov[i].count);
+		} else {
+			memset(buf, 0, queued);
+			done = dev->d_ops->preadv(dev, iov, n);
+			for (i=0; (i<n) && (done == queued); i++)
+				if (memcmp(iov[i].buf, &ref[iov[i].pos],
+						iov[i].count))
+					bad++;
+		}
+		if (done != queued)
+			bad++;
+		transferred += queued;
+	}
+	memset(buf, 0, size);
+	if (!bad && ((dev->d_ops->pread(dev, buf, size, 0) != size)
+			|| memcmp(buf, ref, size)))
+		bad++;
+	if ((mode == TEST_URING_ABORT)
+	    && (test_uring_fail != TEST_URING_FAILED))
+		bad++;
+	test_uring_fail = TEST_URING_NONE;
+	if (dev->d_ops->close(dev))
+		bad++;
+	ntfs_device_free(dev);
+	dev = ntfs_device_alloc(name, 0, &ntfs_device_unix_io_ops, NULL);
+	memset(buf, 0, size);
+	if (!dev || dev->d_ops->open(dev, O_RDONLY)
+	    || (dev->d_ops->pread(dev, buf, size, 0) != size)
+	    || memcmp(buf, ref, size)
+	    || dev->d_ops->close(dev))
+		bad++;
+	if (dev)
+		ntfs_device_free(dev);
+	printf("%-11s device : %d batches, %lld MB in %lld ms  %s\n",
+		test_uring_modes[mode], b, (long long)(transferred >> 20),
+		(long long)(test_uring_now() - start)/1000,
+		(bad ? "** failed **" : "ok"));
+	return (bad != 0);
+}
+
+/*
+ *		Check the files written and read on a volume
+ *
+ *	Two files are first written by turns from their end to their
+ *	beginning, so that they are fragmented, then rewritten in full
+ *	and read back on the volume mounted with io_uring. After unmounting, they are read again with the volume
+ *	mounted with the unix operations, then deleted.
+ *
+ *	Returns 0 if the test passed
+ */
+
+static int test_uring_volume(const char *image, u8 *ref, u8 *buf, int mode,
+			u32 *seed)
+{
+	static const char *fnames[] = {
+		"ntfs-test-uring-a", "ntfs-test-uring-b"
+	} ;
+	ntfs_volume *vol;
+	ntfs_inode *dir_ni;
+	ntfs_inode *ni[2];
+	ntfs_attr *na[2];
+	runlist_element *rl;
+	ntfschar *uname;
+	s64 pos;
+	int runs;
+	int bad;
+	int len;
+	int f;
+
+	if (mode == TEST_URING_NORING)
+		test_uring_fail = TEST_URING_SETUP;
+	vol = ntfs_mount(image, NTFS_MNT_IO_URING);
+	test_uring_fail = TEST_URING_NONE;
+	if (!vol) {
+		printf("Could not mount %s\n", image);
+		return (1);
+	}
+	bad = (test_uring_used(vol->dev, mode) ? 0 : 1);
+	test_uring_fill(ref, 2*TEST_URING_FILE, seed);
+	test_uring_fill(buf, TEST_URING_EXTEND, seed);
+	for (f=0; f<2; f++) {
+		ni[f] = (ntfs_inode*)NULL;
+		na[f] = (ntfs_attr*)NULL;
+		uname = (ntfschar*)NULL;
+		len = ntfs_mbstoucs(fnames[f], &uname);
+		dir_ni = ntfs_inode_open(vol, FILE_root);
+		if ((len > 0) && dir_ni)
+			ni[f] = ntfs_create(dir_ni, const_cpu_to_le32(0),
+					uname, len, S_IFREG);
+		if (ni[f])
+			na[f] = ntfs_attr_open(ni[f], AT_DATA, AT_UNNAMED, 0);
+		if (!na[f])
+			bad++;
+		if (dir_ni && ntfs_inode_close(dir_ni))
+			bad++;
+		free(uname);
+	}
+	for (pos=TEST_URING_FILE - TEST_URING_EXTEND; (pos>=0) && !bad;
+			pos-=TEST_URING_EXTEND)
+		for (f=0; f<2; f++)
+			if (ntfs_attr_pwrite(na[f], pos, TEST_URING_EXTEND,
+					buf) != TEST_URING_EXTEND)
+				bad++;
+	if (mode == TEST_URING_ABORT)
+		test_uring_fail = TEST_URING_ENTER;
+	runs = 0;
+	for (f=0; (f<2) && !bad; f++) {
+		if (ntfs_attr_pwrite(na[f], 0, TEST_URING_FILE,
+				&ref[f*TEST_URING_FILE]) != TEST_URING_FILE)
+			bad++;
+		memset(buf, 0, TEST_URING_FILE);
+		if ((ntfs_attr_pread(na[f], 0, TEST_URING_FILE, buf)
+				!= TEST_URING_FILE)
+		    || memcmp(buf, &ref[f*TEST_URING_FILE], TEST_URING_FILE))
+			bad++;
+		if (!ntfs_attr_map_whole_runlist(na[f]))
+			for (rl=na[f]->rl; rl->length; rl++)
+				runs++;
+	}
+	if ((mode == TEST_URING_ABORT)
+	    && (test_uring_fail != TEST_URING_FAILED))
+		bad++;
+	test_uring_fail = TEST_URING_NONE;
+	for (f=0; f<2; f++) {
+		if (na[f])
+			ntfs_attr_close(na[f]);
+		if (ni[f] && ntfs_inode_close(ni[f]))
+			bad++;
+	}
+	if (ntfs_umount(vol, FALSE))
+		bad++;
+		/* read the files again and delete them */
+	vol = ntfs_mount(image, 0);
+	if (!vol || (vol->dev->d_ops != &ntfs_device_unix_io_ops))
+		bad++;
+	for (f=0; (f<2) && vol; f++) {
+		ni[f] = ntfs_pathname_to_inode(vol, (ntfs_inode*)NULL,
+					fnames[f]);
+		na[f] = (ni[f]
+			? ntfs_attr_open(ni[f], AT_DATA, AT_UNNAMED, 0)
+			: (ntfs_attr*)NULL);
+		memset(buf, 0, TEST_URING_FILE);
+		if (!na[f]
+		    || (ntfs_attr_pread(na[f], 0, TEST_URING_FILE, buf)
+				!= TEST_URING_FILE)
+		    || memcmp(buf, &ref[f*TEST_URING_FILE], TEST_URING_FILE))
+			bad++;
+		if (na[f])
+			ntfs_attr_close(na[f]);
+		uname = (ntfschar*)NULL;
+		len = ntfs_mbstoucs(fnames[f], &uname);
+		dir_ni = ntfs_inode_open(vol, FILE_root);
+			/* ntfs_delete() always closes ni and dir_ni */
+		if (!ni[f] || !dir_ni || (len <= 0)
+		    || ntfs_delete(vol, (char*)NULL, ni[f], dir_ni,
+				uname, len)) {
+			bad++;
+			if (dir_ni)
+				ntfs_inode_close(dir_ni);
+		}
+		free(uname);
+	}
+	if (vol && ntfs_umount(vol, FALSE))
+		bad++;
+	printf("%-11s volume : 2 files of %d MB in %d runs  %s\n",
+		test_uring_modes[mode], TEST_URING_FILE >> 20, runs,
+		(bad ? "** failed **" : "ok"));
+	return (bad != 0);
+}
+
+/**
+ * test_uring_io_main - io_uring test: Program start (main)
+ * @argc:
+ * @argv:	image file, and optional size of the scratch file in MB
+ *
+ * The batched transfers are checked on a scratch file created beside
+ * the image, then files are written and read on the volume. This is
+ * done with the ring, with the ring failing while requests are in
+ * flight, and as if io_uring was not supported.
+ *
+ * Returns:	0 if the test passed
+ */
+
+int test_uring_io_main(int argc, char *argv[])
+{
+	struct ntfs_device *dev;
+	char *scratch;
+	u8 *ref;
+	u8 *buf;
+	s64 size;
+	u32 seed;
+	int first;
+	int bad;
+	int fd;
+	int mode;
+
+	if ((argc < 2) || (argc > 3)) {
+		printf("uring image [megabytes]\n");
+		return (1);
+	}
+	size = (s64)(argc > 2 ? atoi(argv[2]) : 16) << 20;
+	if (size < 2*TEST_URING_FILE)
+		size = 2*TEST_URING_FILE;
+	scratch = (char*)ntfs_malloc(strlen(argv[1]) + 7);
+	ref = (u8*)ntfs_malloc(size);
+	buf = (u8*)ntfs_malloc(size);
+	if (!scratch || !ref || !buf) {
+		free(scratch);
+		free(ref);
+		free(buf);
+		return (1);
+	}
+	sprintf(scratch, "%s.uring", argv[1]);
+	fd = open(scratch, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if ((fd < 0) || close(fd)) {
+		printf("Could not create %s\n", scratch);
+		free(scratch);
+		free(ref);
+		free(buf);
+		return (1);
+	}
+		/* only check the fallback if io_uring is not supported */
+	first = TEST_URING_RING;
+	dev = ntfs_device_alloc(scratch, 0, &ntfs_device_uring_io_ops, NULL);
+	if (dev && !dev->d_ops->open(dev, O_RDONLY)) {
+		if (dev->d_ops != &ntfs_device_uring_io_ops) {
+			printf("io_uring is not supported here\n");
+			first = TEST_URING_NORING;
+		}
+		dev->d_ops->close(dev);
+	}
+	if (dev)
+		ntfs_device_free(dev);
+	seed = 1;
+	bad = 0;
+	for (mode=first; mode<=TEST_URING_NORING; mode++) {
+		bad += test_uring_device(scratch, ref, buf, size, mode, &seed);
+		bad += test_uring_volume(argv[1], ref, buf, mode, &seed);
+	}
+	unlink(scratch);
+	free(scratch);
+	free(ref);
+	free(buf);
+	printf("%s\n", (bad ? "** failed **" : "passed"));
+	return (bad != 0);
+}
+
+#endif /* NTFS_TEST */
+
+#endif /* HAVE_LINUX_IO_URING_H */
@@ -57,6 +57,9 @@
 #if defined(__sun) && defined (__SVR4)
 #include <sys/mnttab.h>
 #endif
+#ifdef ENABLE_VOLUME_LOCKS
+#include <pthread.h>
+#endif
 
 #include "param.h"
 #include "compat.h"
@@ -68,6 +71,8 @@
 #include "debug.h"
 #include "inode.h"
 #include "runlist.h"
+#include "lcnalloc.h"
+#include "compress.h"
 #include "logfile.h"
 #include "dir.h"
 #include "logging.h"
@@ -76,6 +81,14 @@
 #include "misc.h"
 #include "security.h"
 
+#ifdef ENABLE_VOLUME_LOCKS
+
+struct VOLUME_LOCKS {
+	pthread_mutex_t mutex[NTFS_LOCK_COUNT];
+} ;
+
+#endif /* ENABLE_VOLUME_LOCKS */
+
 const char *ntfs_home = 
 "News, support and information:  https://github.com/tuxera/ntfs-3g/\n";
 
@@ -161,6 +174,24 @@ static void ntfs_error_set(int *err)
 		*err = errno;
 }
 
+/*
+ *		Free the locks of a volume shared by threads
+ */
+
+static void ntfs_volume_free_locks(ntfs_volume *v)
+{
+#ifdef ENABLE_VOLUME_LOCKS
+	int i;
+
+	if (v->locks) {
+		for (i=0; i<NTFS_LOCK_COUNT; i++)
+			pthread_mutex_destroy(&v->locks->mutex[i]);
+		free(v->locks);
+		v->locks = (struct VOLUME_LOCKS*)NULL;
+	}
+#endif
+}
+
 /**
  * __ntfs_volume_release - Destroy an NTFS volume object
  * @v:
@@ -204,6 +235,8 @@ static int __ntfs_volume_release(ntfs_volume *v)
 	if (v->dev) {
 		struct ntfs_device *dev = v->dev;
 
+		if (ntfs_device_cache_flush(dev))
+			ntfs_error_set(&err);
 		if (dev->d_ops->sync(dev))
 			ntfs_error_set(&err);
 		if (dev->d_ops->close(dev))
@@ -211,6 +244,9 @@ static int __ntfs_volume_release(ntfs_volume *v)
 	}
 
 	ntfs_free_lru_caches(v);
+	ntfs_free_extents_release(v);
+	ntfs_compress_release(v);
+	ntfs_volume_free_locks(v);
 	free(v->vol_name);
 	free(v->upcase);
 	if (v->locase) free(v->locase);
@@ -373,6 +409,7 @@ mft_has_no_attr_list:
 			goto error_exit;
 		}
 		vol->mft_na->rl = nrl;
+		ntfs_attr_rl_changed(vol->mft_na);
 
 		/* Get the lowest vcn for the next extent. */
 		highest_vcn = sle64_to_cpu(a->highest_vcn);
@@ -1389,6 +1426,123 @@ int ntfs_set_ignore_case(ntfs_volume *vol)
 	return (res);
 }
 
+/*
+ *		Set the max read-ahead window for sequential reads
+ *
+ *	The size is in bytes, zero disables the read-ahead.
+ *	Not set in ntfs_mount() to avoid changing the memory usage
+ *	of existing tools.
+ */
+
+int ntfs_set_readahead(ntfs_volume *vol, s64 size)
+{
+	int res;
+
+	res = -1;
+	if (vol && (size >= 0) && (size <= READAHEAD_MAX_SIZE)) {
+		vol->readahead_size = size;
+		res = 0;
+	}
+	if (res) {
+		errno = EINVAL;
+		ntfs_log_error("Failed to set the read-ahead size\n");
+	}
+	return (res);
+}
+
+/*
+ *		Prepare a volume for being shared by threads
+ *
+ *	The threads which change the volume (creating, writing, renaming
+ *	or deleting files, setting attributes...) must still run alone,
+ *	for instance by holding a readers-writer lock exclusive, but the
+ *	threads which only read may then run concurrently. The caches
+ *	are always protected by their own locks, and the shared state
+ *	of the volume by the locks in vol->locks (see ntfs_volume_lock()).
+ *	Moreover the open inodes are shared, so that the threads opening
+ *	the same inode get the same ntfs_inode, and each of them has a
+ *	lock which the threads use to serialize their requests on the
+ *	inode (see ntfs_inode_open() and ntfs_inode_lock()).
+ *
+ *	The runlist of $MFT is fully mapped here, so that reading the
+ *	mft records never has to change it.
+ *
+ *	Returns 0 if successful, or -1 with errno set
+ */
+
+int ntfs_volume_set_threaded(ntfs_volume *vol)
+{
+	int res;
+#ifdef ENABLE_VOLUME_LOCKS
+	struct VOLUME_LOCKS *locks;
+	pthread_mutexattr_t attr;
+	int i;
+#endif
+
+	res = -1;
+	if (!vol || !vol->mft_na) {
+		errno = EINVAL;
+	} else {
+#ifdef ENABLE_VOLUME_LOCKS
+		if (vol->locks)
+			res = 0;
+		else
+			if (!ntfs_attr_map_whole_runlist(vol->mft_na)) {
+				locks = (struct VOLUME_LOCKS*)ntfs_malloc(
+					sizeof(struct VOLUME_LOCKS));
+				if (locks) {
+					pthread_mutexattr_init(&attr);
+					pthread_mutexattr_settype(&attr,
+						PTHREAD_MUTEX_RECURSIVE);
+					for (i=0; i<NTFS_LOCK_COUNT; i++)
+						pthread_mutex_init(
+							&locks->mutex[i],
+							&attr);
+					pthread_mutexattr_destroy(&attr);
+					vol->locks = locks;
+					res = 0;
+				}
+			}
+#else
+		errno = EOPNOTSUPP;
+#endif
+	}
+	if (res)
+		ntfs_log_perror("Failed to share the volume between threads");
+	return (res);
+}
+
+/*
+ *		Take a lock of a volume shared by threads
+ *
+ *	The locks are recursive. When several locks are needed, they
+ *	have to be taken in the order of ntfs_volume_lock_id, after the
+ *	inode locks and before the cache locks.
+ *	Nothing is done when the volume is not shared.
+ */
+
+void ntfs_volume_lock(ntfs_volume *vol __attribute__((unused)),
+			ntfs_volume_lock_id id __attribute__((unused)))
+{
+#ifdef ENABLE_VOLUME_LOCKS
+	if (vol->locks)
+		pthread_mutex_lock(&vol->locks->mutex[id]);
+#endif
+}
+
+/*
+ *		Release a lock taken by ntfs_volume_lock()
+ */
+
+void ntfs_volume_unlock(ntfs_volume *vol __attribute__((unused)),
+			ntfs_volume_lock_id id __attribute__((unused)))
+{
+#ifdef ENABLE_VOLUME_LOCKS
+	if (vol->locks)
+		pthread_mutex_unlock(&vol->locks->mutex[id]);
+#endif
+}
+
 /**
  * ntfs_mount - open ntfs volume
  * @name:	name of device/file to open
@@ -1402,6 +1556,10 @@ int ntfs_set_ignore_case(ntfs_volume *vol)
  * is implemented:
  *	NTFS_MNT_RDONLY	- mount volume read-only
  *
+ * When @flags contains NTFS_MNT_IO_URING and io_uring is supported, the
+ * device is accessed through io_uring instead of the default device
+ * operations.
+ *
  * The function opens the device or file @name and verifies that it contains a
  * valid bootsector. Then, it allocates an ntfs_volume structure and initializes
  * some of the values inside the structure from the information stored in the
@@ -1418,11 +1576,17 @@ ntfs_volume *ntfs_mount(const char *name __attribute__((unused)),
 		ntfs_mount_flags flags __attribute__((unused)))
 {
 #ifndef NO_NTFS_DEVICE_DEFAULT_IO_OPS
+	struct ntfs_device_operations *dops;
 	struct ntfs_device *dev;
 	ntfs_volume *vol;
 
+	dops = &ntfs_device_default_io_ops;
+#ifdef HAVE_NTFS_DEVICE_URING_IO_OPS
+	if (flags & NTFS_MNT_IO_URING)
+		dops = &ntfs_device_uring_io_ops;
+#endif
 	/* Allocate an ntfs_device structure. */
-	dev = ntfs_device_alloc(name, 0, &ntfs_device_default_io_ops, NULL);
+	dev = ntfs_device_alloc(name, 0, dops, NULL);
 	if (!dev)
 		return NULL;
 	/* Call ntfs_device_mount() to do the actual mount. */
@@ -0,0 +1,2939 @@
+/**
+ * wof.c - Files compressed by the Windows Overlay Filter
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Windows 10 can compress files with algorithms which are not
+ *	supported by the NTFS compression ("CompactOS" or "compact /exe").
+ *	Such a file is a reparse point with tag IO_REPARSE_TAG_WOF, its
+ *	unnamed data stream is sparse and has the size of the uncompressed
+ *	data, and the compressed data is stored in the named data stream
+ *	"WofCompressedData".
+ *
+ *	The data is compressed by chunks (4K, 8K or 16K for XPRESS, 32K
+ *	for LZX) which are independent from each other. The compressed
+ *	stream begins with a table of the end offsets of all the chunks
+ *	but the last one, and each chunk is stored uncompressed when it
+ *	could not be made smaller.
+ *
+ *	The reads of the unnamed data stream are redirected here by
+ *	ntfs_attr_pread(). The chunk tables are kept in an LRU cache, the
+ *	chunks which are partially read are kept in the cache of
+ *	decompressed blocks, and the chunks of a big read are decompressed
+ *	in parallel by the compression threads.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "param.h"
+#include "types.h"
+#include "layout.h"
+#include "attrib.h"
+#include "inode.h"
+#include "volume.h"
+#include "reparse.h"
+#include "compress.h"
+#include "cache.h"
+#include "wof.h"
+#include "logging.h"
+#include "misc.h"
+
+struct WOF_REPARSE_DATA {		/* reparse data of a WOF file */
+	le32 version;			/* WOF_CURRENT_VERSION */
+	le32 provider;			/* WOF_PROVIDER_FILE */
+	le32 file_version;		/* FILE_PROVIDER_CURRENT_VERSION */
+	le32 algorithm;			/* WOF_XPRESS4K ... */
+} ;
+
+#define WOF_CURRENT_VERSION 1
+#define WOF_PROVIDER_FILE 2
+#define FILE_PROVIDER_CURRENT_VERSION 1
+
+enum {
+	WOF_XPRESS4K = 0,
+	WOF_LZX = 1,
+	WOF_XPRESS8K = 2,
+	WOF_XPRESS16K = 3
+} ;
+
+#define WOF_BATCH_SIZE 1048576	/* uncompressed data decompressed at once */
+#define WOF_TABLE_CACHE_MAX 1048576 /* biggest chunk table kept in cache */
+
+static ntfschar WOF_STREAM[] = { const_cpu_to_le16('W'),
+			const_cpu_to_le16('o'), const_cpu_to_le16('f'),
+			const_cpu_to_le16('C'), const_cpu_to_le16('o'),
+			const_cpu_to_le16('m'), const_cpu_to_le16('p'),
+			const_cpu_to_le16('r'), const_cpu_to_le16('e'),
+			const_cpu_to_le16('s'), const_cpu_to_le16('s'),
+			const_cpu_to_le16('e'), const_cpu_to_le16('d'),
+			const_cpu_to_le16('D'), const_cpu_to_le16('a'),
+			const_cpu_to_le16('t'), const_cpu_to_le16('a') } ;
+
+/*
+ *		Bit stream
+ *
+ *	Both XPRESS and LZX store the bits in 16-bit little endian words,
+ *	the most significant bit first. Some byte fields (XPRESS match
+ *	lengths, LZX uncompressed blocks) are inserted between words,
+ *	so a word is only fetched when the bits needed for the next field
+ *	are not all in the buffer, which makes the byte fields located
+ *	as the Windows compressor put them. Reading beyond the end of the
+ *	input gets zeroes, the size of the output ends the decompression.
+ */
+
+struct WOF_BITS {
+	const u8 *next;		/* next word to fetch */
+	const u8 *end;		/* end of input */
+	u32 buf;		/* bits, left aligned */
+	int left;		/* count of bits in buf */
+} ;
+
+static inline void wof_bits_ensure(struct WOF_BITS *bs, int n)
+{
+	if (bs->left < n) {
+		if ((bs->end - bs->next) >= 2) {
+			bs->buf |= (u32)(bs->next[0] | (bs->next[1] << 8))
+					<< (16 - bs->left);
+			bs->next += 2;
+		}
+		bs->left += 16;
+	}
+}
+
+/*
+ *	Get n bits (at most 16) which have been fetched
+ */
+
+static inline u32 wof_bits_pop(struct WOF_BITS *bs, int n)
+{
+	u32 v;
+
+	v = (n ? bs->buf >> (32 - n) : 0);
+	bs->buf <<= n;
+	bs->left -= n;
+	return (v);
+}
+
+static inline u32 wof_bits_read(struct WOF_BITS *bs, int n)
+{
+	wof_bits_ensure(bs, n);
+	return (wof_bits_pop(bs, n));
+}
+
+/*
+ *		Decoding table of a canonical Huffman code
+ *
+ *	The first bits of a codeword index a main table, the entries of
+ *	which are (symbol << 8) + length. For codewords longer than the
+ *	main index, the entry is WOF_SUBTABLE plus the location of a
+ *	subtable indexed by the next bits. A null entry denotes an
+ *	unused codeword, which is allowed by incomplete codes.
+ *
+ *	Returns 0 if successful, -1 if the code is over-subscribed
+ */
+
+#define WOF_TABLEBITS 11
+#define WOF_SUBTABLE 0x80000000
+#define WOF_BADSYM 0xffff
+#define WOF_MAXSYMS 512
+
+#define WOF_TABLE_SIZE(bits, syms, maxlen) ((1 << (bits)) \
+		+ ((maxlen) > (bits) ? (syms) << ((maxlen) - (bits)) : 0))
+
+static int wof_make_table(u32 *table, int bits, const u8 *lens,
+			int nsyms, int maxlen)
+{
+	u16 count[17];
+	u16 offs[17];
+	u16 sorted[WOF_MAXSYMS];
+	u32 code;
+	u32 entry;
+	u32 first;
+	u32 n;
+	u32 next_sub;
+	int left;
+	int len;
+	int sym;
+	int i;
+	int k;
+
+	memset(count, 0, sizeof(count));
+	for (sym=0; sym<nsyms; sym++)
+		count[lens[sym]]++;
+	left = 1;
+	for (len=1; len<=maxlen; len++) {
+		left = (left << 1) - count[len];
+		if (left < 0)
+			return (-1);
+	}
+	offs[1] = 0;
+	for (len=1; len<maxlen; len++)
+		offs[len + 1] = offs[len] + count[len];
+	for (sym=0; sym<nsyms; sym++)
+		if (lens[sym])
+			sorted[offs[lens[sym]]++] = sym;
+	memset(table, 0, sizeof(u32) << bits);
+	next_sub = 1 << bits;
+	code = 0;
+	i = 0;
+	for (len=1; len<=maxlen; len++) {
+		for (k=0; k<count[len]; k++) {
+			sym = sorted[i++];
+			entry = ((u32)sym << 8) | len;
+			if (len <= bits) {
+				first = code << (bits - len);
+				n = 1 << (bits - len);
+			} else {
+				first = code >> (len - bits);
+				if (!table[first]) {
+					table[first] = WOF_SUBTABLE | next_sub;
+					memset(&table[next_sub], 0,
+						sizeof(u32) << (maxlen - bits));
+					next_sub += 1 << (maxlen - bits);
+				}
+				first = (table[first] & ~WOF_SUBTABLE)
+					+ ((code & ((1 << (len - bits)) - 1))
+						<< (maxlen - len));
+				n = 1 << (maxlen - len);
+			}
+			while (n--)
+				table[first++] = entry;
+			code++;
+		}
+		code <<= 1;
+	}
+	return (0);
+}
+
+static inline unsigned int wof_decode(struct WOF_BITS *bs,
+			const u32 *table, int bits, int maxlen)
+{
+	u32 entry;
+
+	wof_bits_ensure(bs, maxlen);
+	entry = table[bs->buf >> (32 - bits)];
+	if (entry & WOF_SUBTABLE)
+		entry = table[(entry & ~WOF_SUBTABLE)
+			+ ((bs->buf >> (32 - maxlen))
+				& ((1 << (maxlen - bits)) - 1))];
+	if (!entry)
+		return (WOF_BADSYM);
+	bs->buf <<= entry & 0xff;
+	bs->left -= entry & 0xff;
+	return (entry >> 8);
+}
+
+/*
+ *		Copy a match
+ *
+ *	The copy is done by 8-byte chunks when the source is far enough
+ *	and there is room for writing a few bytes beyond the match.
+ */
+
+static inline void wof_copy_match(u8 *p, u32 offset, u32 length,
+			const u8 *end)
+{
+	const u8 *src;
+	u8 *q;
+
+	src = p - offset;
+	q = p + length;
+	if ((offset >= 8) && ((end - q) >= 8)) {
+		do {
+			memcpy(p, src, 8);
+			p += 8;
+			src += 8;
+		} while (p < q);
+	} else
+		if (offset == 1)
+			memset(p, *src, length);
+		else
+			while (p < q)
+				*p++ = *src++;
+}
+
+/*
+ *		XPRESS Huffman decompression ([MS-XCA] 2.2)
+ *
+ *	A chunk begins with the 512 codeword lengths of the literals and
+ *	match headers, as 4-bit fields, followed by the bit stream.
+ */
+
+#define XPRESS_SYMBOLS 512
+#define XPRESS_MAX_CODEWORD_LEN 15
+#define XPRESS_MIN_MATCH_LEN 3
+
+struct WOF_XPRESS {
+	u32 table[WOF_TABLE_SIZE(WOF_TABLEBITS, XPRESS_SYMBOLS,
+				XPRESS_MAX_CODEWORD_LEN)];
+	u8 lens[XPRESS_SYMBOLS];
+} ;
+
+static int wof_xpress_decompress(struct WOF_XPRESS *d, const u8 *in,
+			u32 insz, u8 *out, u32 outsz)
+{
+	struct WOF_BITS bs;
+	u8 *p;
+	u8 *end;
+	unsigned int sym;
+	u32 length;
+	u32 offset;
+	int obits;
+	int i;
+
+	if (insz < (XPRESS_SYMBOLS / 2))
+		return (-1);
+	for (i=0; i<(XPRESS_SYMBOLS / 2); i++) {
+		d->lens[2*i] = in[i] & 15;
+		d->lens[2*i + 1] = in[i] >> 4;
+	}
+	if (wof_make_table(d->table, WOF_TABLEBITS, d->lens,
+				XPRESS_SYMBOLS, XPRESS_MAX_CODEWORD_LEN))
+		return (-1);
+	bs.next = &in[XPRESS_SYMBOLS / 2];
+	bs.end = &in[insz];
+	bs.buf = 0;
+	bs.left = 0;
+	p = out;
+	end = &out[outsz];
+	while (p < end) {
+		sym = wof_decode(&bs, d->table, WOF_TABLEBITS,
+				XPRESS_MAX_CODEWORD_LEN);
+		if (sym < 256) {
+			*p++ = sym;
+			continue;
+		}
+		if (sym == WOF_BADSYM)
+			return (-1);
+		length = sym & 15;
+		obits = (sym >> 4) & 15;
+		wof_bits_ensure(&bs, 16);
+		offset = ((u32)1 << obits) | wof_bits_pop(&bs, obits);
+		if (length == 15) {
+			if (bs.next >= bs.end)
+				return (-1);
+			length += *bs.next++;
+			if (length == (15 + 255)) {
+				if ((bs.end - bs.next) < 2)
+					return (-1);
+				length = bs.next[0] | (bs.next[1] << 8);
+				bs.next += 2;
+			}
+		}
+		length += XPRESS_MIN_MATCH_LEN;
+		if ((offset > (u32)(p - out)) || (length > (u32)(end - p)))
+			return (-1);
+		wof_copy_match(p, offset, length, end);
+		p += length;
+	}
+	return (0);
+}
+
+/*
+ *		LZX decompression
+ *
+ *	This is the variant used in WIM files : the window is the 32K
+ *	chunk, there is no header, the block size is either the default
+ *	one (one bit) or explicit (one bit and 16 bits), and the
+ *	translation of x86 calls is always applied.
+ */
+
+#define LZX_NUM_CHARS 256
+#define LZX_NUM_OFFSET_SLOTS 30
+#define LZX_NUM_LEN_HEADERS 8
+#define LZX_MAINCODE_SYMBOLS (LZX_NUM_CHARS \
+			+ LZX_NUM_OFFSET_SLOTS*LZX_NUM_LEN_HEADERS)
+#define LZX_LENCODE_SYMBOLS 249
+#define LZX_PRECODE_SYMBOLS 20
+#define LZX_ALIGNEDCODE_SYMBOLS 8
+#define LZX_MAX_CODEWORD_LEN 16
+#define LZX_MAX_PRE_CODEWORD_LEN 15
+#define LZX_MAX_ALIGNED_CODEWORD_LEN 7
+#define LZX_ALIGNED_BITS 3
+#define LZX_LENS_OVERRUN 50	/* longest run beyond a set of lengths */
+#define LZX_MIN_MATCH_LEN 2
+#define LZX_NUM_RECENT_OFFSETS 3
+#define LZX_OFFSET_ADJUSTMENT 2
+#define LZX_DEFAULT_BLOCK_SIZE 32768
+#define LZX_E8_FILE_SIZE 12000000
+
+enum {
+	LZX_BLOCKTYPE_VERBATIM = 1,
+	LZX_BLOCKTYPE_ALIGNED = 2,
+	LZX_BLOCKTYPE_UNCOMPRESSED = 3
+} ;
+
+static const u32 lzx_offset_slot_base[LZX_NUM_OFFSET_SLOTS] = {
+	0, 1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192,
+	256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096, 6144,
+	8192, 12288, 16384, 24576
+} ;
+
+static const u8 lzx_extra_offset_bits[LZX_NUM_OFFSET_SLOTS] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+} ;
+
+struct WOF_LZX {
+	u32 maintable[WOF_TABLE_SIZE(WOF_TABLEBITS, LZX_MAINCODE_SYMBOLS,
+				LZX_MAX_CODEWORD_LEN)];
+	u32 lentable[WOF_TABLE_SIZE(WOF_TABLEBITS, LZX_LENCODE_SYMBOLS,
+				LZX_MAX_CODEWORD_LEN)];
+	u32 pretable[WOF_TABLE_SIZE(WOF_TABLEBITS, LZX_PRECODE_SYMBOLS,
+				LZX_MAX_PRE_CODEWORD_LEN)];
+	u32 alignedtable[1 << LZX_MAX_ALIGNED_CODEWORD_LEN];
+	u8 mainlens[LZX_MAINCODE_SYMBOLS + LZX_LENS_OVERRUN];
+	u8 lenlens[LZX_LENCODE_SYMBOLS + LZX_LENS_OVERRUN];
+	u8 prelens[LZX_PRECODE_SYMBOLS];
+	u8 alignedlens[LZX_ALIGNEDCODE_SYMBOLS];
+} ;
+
+/*
+ *	Read a set of codeword lengths, as differences from the
+ *	previous ones, through a precode. As runs may go beyond the end,
+ *	the arrays have some extra room.
+ */
+
+static int wof_lzx_read_lens(struct WOF_LZX *d, struct WOF_BITS *bs,
+			u8 *lens, int count)
+{
+	u8 *p;
+	u8 *end;
+	unsigned int presym;
+	int run;
+	int len;
+	int i;
+
+	for (i=0; i<LZX_PRECODE_SYMBOLS; i++)
+		d->prelens[i] = wof_bits_read(bs, 4);
+	if (wof_make_table(d->pretable, WOF_TABLEBITS, d->prelens,
+			LZX_PRECODE_SYMBOLS, LZX_MAX_PRE_CODEWORD_LEN))
+		return (-1);
+	p = lens;
+	end = &lens[count];
+	do {
+		presym = wof_decode(bs, d->pretable, WOF_TABLEBITS,
+				LZX_MAX_PRE_CODEWORD_LEN);
+		if (presym < 17) {
+			len = *p - presym;
+			if (len < 0)
+				len += 17;
+			*p++ = len;
+		} else {
+			switch (presym) {
+			case 17 :
+				run = 4 + wof_bits_read(bs, 4);
+				len = 0;
+				break;
+			case 18 :
+				run = 20 + wof_bits_read(bs, 5);
+				len = 0;
+				break;
+			case 19 :
+				run = 4 + wof_bits_read(bs, 1);
+				presym = wof_decode(bs, d->pretable,
+					WOF_TABLEBITS,
+					LZX_MAX_PRE_CODEWORD_LEN);
+				if (presym > 17)
+					return (-1);
+				len = *p - presym;
+				if (len < 0)
+					len += 17;
+				break;
+			default :
+				return (-1);
+			}
+			memset(p, len, run);
+			p += run;
+		}
+	} while (p < end);
+	return (0);
+}
+
+/*
+ *	Undo the translation of the targets of x86 calls
+ */
+
+static void wof_lzx_undo_e8(u8 *data, u32 size)
+{
+	u8 *p;
+	u8 *tail;
+	s32 pos;
+	s32 abs_offset;
+	s32 rel_offset;
+
+	if (size > 10) {
+		tail = &data[size - 10];
+		for (p=data; p<tail; p++) {
+			if (*p == 0xe8) {
+				pos = p - data;
+				abs_offset = (s32)(p[1] | (p[2] << 8)
+					| (p[3] << 16) | ((u32)p[4] << 24));
+				rel_offset = abs_offset;
+				if (abs_offset >= 0) {
+					if (abs_offset < LZX_E8_FILE_SIZE)
+						rel_offset = abs_offset - pos;
+				} else
+					if (abs_offset >= -pos)
+						rel_offset = abs_offset
+							+ LZX_E8_FILE_SIZE;
+				if (rel_offset != abs_offset) {
+					p[1] = rel_offset;
+					p[2] = rel_offset >> 8;
+					p[3] = rel_offset >> 16;
+					p[4] = rel_offset >> 24;
+				}
+				p += 4;
+			}
+		}
+	}
+}
+
+/*
+ *	Decompress a verbatim or aligned block
+ *
+ *	A match may go beyond the end of the block, the next block then
+ *	begins after the match.
+ */
+
+static int wof_lzx_block(struct WOF_LZX *d, struct WOF_BITS *bs,
+			u8 *out, u8 **pp, u8 *bend, u8 *end,
+			u32 *recent, BOOL aligned)
+{
+	u8 *p;
+	unsigned int sym;
+	u32 length;
+	u32 offset;
+	int slot;
+	int nbits;
+
+	p = *pp;
+	while (p < bend) {
+		sym = wof_decode(bs, d->maintable, WOF_TABLEBITS,
+				LZX_MAX_CODEWORD_LEN);
+		if (sym < LZX_NUM_CHARS) {
+			*p++ = sym;
+			continue;
+		}
+		if (sym == WOF_BADSYM)
+			return (-1);
+		sym -= LZX_NUM_CHARS;
+		length = sym % LZX_NUM_LEN_HEADERS;
+		slot = sym / LZX_NUM_LEN_HEADERS;
+		if (length == (LZX_NUM_LEN_HEADERS - 1)) {
+			sym = wof_decode(bs, d->lentable, WOF_TABLEBITS,
+					LZX_MAX_CODEWORD_LEN);
+			if (sym == WOF_BADSYM)
+				return (-1);
+			length += sym;
+		}
+		length += LZX_MIN_MATCH_LEN;
+		if (slot < LZX_NUM_RECENT_OFFSETS) {
+			offset = recent[slot];
+			recent[slot] = recent[0];
+			recent[0] = offset;
+		} else {
+			nbits = lzx_extra_offset_bits[slot];
+			offset = lzx_offset_slot_base[slot]
+					- LZX_OFFSET_ADJUSTMENT;
+			if (aligned && (nbits >= LZX_ALIGNED_BITS)) {
+				offset += wof_bits_read(bs,
+					nbits - LZX_ALIGNED_BITS)
+						<< LZX_ALIGNED_BITS;
+				sym = wof_decode(bs, d->alignedtable,
+					LZX_MAX_ALIGNED_CODEWORD_LEN,
+					LZX_MAX_ALIGNED_CODEWORD_LEN);
+				if (sym == WOF_BADSYM)
+					return (-1);
+				offset += sym;
+			} else
+				offset += wof_bits_read(bs, nbits);
+			recent[2] = recent[1];
+			recent[1] = recent[0];
+			recent[0] = offset;
+		}
+		if ((offset > (u32)(p - out)) || (length > (u32)(end - p)))
+			return (-1);
+		wof_copy_match(p, offset, length, end);
+		p += length;
+	}
+	*pp = p;
+	return (0);
+}
+
+static int wof_lzx_decompress(struct WOF_LZX *d, const u8 *in,
+			u32 insz, u8 *out, u32 outsz)
+{
+	struct WOF_BITS bs;
+	u32 recent[LZX_NUM_RECENT_OFFSETS];
+	u8 *p;
+	u8 *bend;
+	u8 *end;
+	u32 bsize;
+	int btype;
+	int i;
+	int err;
+
+	memset(d->mainlens, 0, LZX_MAINCODE_SYMBOLS);
+	memset(d->lenlens, 0, LZX_LENCODE_SYMBOLS);
+	for (i=0; i<LZX_NUM_RECENT_OFFSETS; i++)
+		recent[i] = 1;
+	bs.next = in;
+	bs.end = &in[insz];
+	bs.buf = 0;
+	bs.left = 0;
+	p = out;
+	bend = out;
+	end = &out[outsz];
+	err = 0;
+	while (!err && (p < end)) {
+		btype = wof_bits_read(&bs, 3);
+		if (wof_bits_read(&bs, 1))
+			bsize = LZX_DEFAULT_BLOCK_SIZE;
+		else
+			bsize = wof_bits_read(&bs, 16);
+		if (!bsize || (bsize > (u32)(end - bend)))
+			return (-1);
+		bend += bsize;
+		switch (btype) {
+		case LZX_BLOCKTYPE_ALIGNED :
+			for (i=0; i<LZX_ALIGNEDCODE_SYMBOLS; i++)
+				d->alignedlens[i] = wof_bits_read(&bs, 3);
+			/* short codewords, no subtable is needed */
+			if (wof_make_table(d->alignedtable,
+					LZX_MAX_ALIGNED_CODEWORD_LEN,
+					d->alignedlens,
+					LZX_ALIGNEDCODE_SYMBOLS,
+					LZX_MAX_ALIGNED_CODEWORD_LEN))
+				return (-1);
+			/* fall through */
+		case LZX_BLOCKTYPE_VERBATIM :
+			if (wof_lzx_read_lens(d, &bs, d->mainlens,
+					LZX_NUM_CHARS)
+			    || wof_lzx_read_lens(d, &bs,
+					&d->mainlens[LZX_NUM_CHARS],
+					LZX_MAINCODE_SYMBOLS - LZX_NUM_CHARS)
+			    || wof_lzx_read_lens(d, &bs, d->lenlens,
+					LZX_LENCODE_SYMBOLS)
+			    || wof_make_table(d->maintable, WOF_TABLEBITS,
+					d->mainlens, LZX_MAINCODE_SYMBOLS,
+					LZX_MAX_CODEWORD_LEN)
+			    || wof_make_table(d->lentable, WOF_TABLEBITS,
+					d->lenlens, LZX_LENCODE_SYMBOLS,
+					LZX_MAX_CODEWORD_LEN))
+				return (-1);
+			err = wof_lzx_block(d, &bs, out, &p, bend, end,
+				recent, btype == LZX_BLOCKTYPE_ALIGNED);
+			break;
+		case LZX_BLOCKTYPE_UNCOMPRESSED :
+			/*
+			 * The block is aligned to a 16-bit boundary, the
+			 * next word being skipped if already aligned.
+			 */
+			if (p != (bend - bsize))
+				return (-1);
+			wof_bits_ensure(&bs, 1);
+			bs.buf = 0;
+			bs.left = 0;
+			if ((bs.end - bs.next) < (s64)(12 + bsize))
+				return (-1);
+			for (i=0; i<LZX_NUM_RECENT_OFFSETS; i++) {
+				recent[i] = bs.next[0] | (bs.next[1] << 8)
+					| (bs.next[2] << 16)
+					| ((u32)bs.next[3] << 24);
+				if (!recent[i])
+					return (-1);
+				bs.next += 4;
+			}
+			memcpy(p, bs.next, bsize);
+			bs.next += bsize;
+			p += bsize;
+			if ((bsize & 1) && (bs.next < bs.end))
+				bs.next++;
+			break;
+		default :
+			return (-1);
+		}
+	}
+	if (!err)
+		wof_lzx_undo_e8(out, outsz);
+	return (err);
+}
+
+/*
+ *		Decompression of a batch of chunks
+ *
+ *	The chunks are independent, so they may be decompressed in
+ *	parallel, each one with its own decoding tables.
+ */
+
+struct WOF_CHUNK {
+	const u8 *in;
+	u8 *out;
+	u32 insz;
+	u32 outsz;
+	BOOL bad;
+} ;
+
+struct WOF_JOB {
+	struct WOF_CHUNK *chunks;
+	int format;
+} ;
+
+static void wof_decompress_chunk(void *arg, int i)
+{
+	struct WOF_JOB *job;
+	struct WOF_CHUNK *chunk;
+	void *d;
+	int err;
+
+	job = (struct WOF_JOB*)arg;
+	chunk = &job->chunks[i];
+	err = -1;
+	if (chunk->insz == chunk->outsz) {
+			/* stored uncompressed */
+		memcpy(chunk->out, chunk->in, chunk->outsz);
+		err = 0;
+	} else
+		if (chunk->insz < chunk->outsz) {
+			if (job->format == WOF_LZX) {
+				d = ntfs_malloc(sizeof(struct WOF_LZX));
+				if (d)
+					err = wof_lzx_decompress(
+						(struct WOF_LZX*)d, chunk->in,
+						chunk->insz, chunk->out,
+						chunk->outsz);
+			} else {
+				d = ntfs_malloc(sizeof(struct WOF_XPRESS));
+				if (d)
+					err = wof_xpress_decompress(
+						(struct WOF_XPRESS*)d,
+						chunk->in, chunk->insz,
+						chunk->out, chunk->outsz);
+			}
+			free(d);
+		}
+	chunk->bad = (err != 0);
+}
+
+/*
+ *		Description of an open compressed stream
+ */
+
+struct WOF_STREAM {
+	ntfs_attr *cna;		/* the compressed stream */
+	u8 *table;		/* chunk table, NULL if not loaded */
+	BOOL owned;		/* table to be freed after use */
+	BOOL cached;		/* table to be copied from the cache */
+	s64 size;		/* uncompressed size */
+	s64 nchunks;
+	s64 table_size;		/* size of chunk table on disk */
+	int format;
+	int chunk_bits;
+	int entry_size;
+} ;
+
+#if CACHE_WOF_SIZE
+
+static int wof_compare(const struct CACHED_GENERIC *cached,
+			const struct CACHED_GENERIC *item)
+{
+	return (((const struct CACHED_WOF*)cached)->mref
+			!= ((const struct CACHED_WOF*)item)->mref);
+}
+
+int ntfs_wof_hash(const struct CACHED_GENERIC *item)
+{
+	return (MREF(((const struct CACHED_WOF*)item)->mref)
+					% (2*CACHE_WOF_SIZE));
+}
+
+#endif /* CACHE_WOF_SIZE */
+
+#if CACHE_CBLOCK_SIZE
+
+/*
+ *	The decompressed chunks share the cache of decompressed blocks
+ *	of compressed files, the unnamed data of a WOF file is never
+ *	compressed by NTFS.
+ */
+
+static int wof_chunk_compare(const struct CACHED_GENERIC *cached,
+			const struct CACHED_GENERIC *item)
+{
+	const struct CACHED_CBLOCK *c = (const struct CACHED_CBLOCK*)cached;
+	const struct CACHED_CBLOCK *i = (const struct CACHED_CBLOCK*)item;
+
+	return ((c->mref != i->mref) || (c->index != i->index));
+}
+
+static int wof_chunk_inode_compare(const struct CACHED_GENERIC *cached,
+			const struct CACHED_GENERIC *item)
+{
+	return (((const struct CACHED_CBLOCK*)cached)->mref
+			!= ((const struct CACHED_CBLOCK*)item)->mref);
+}
+
+#endif /* CACHE_CBLOCK_SIZE */
+
+static u64 wof_mref(ntfs_inode *ni)
+{
+	return (MK_MREF(ni->mft_no, le16_to_cpu(ni->mrec->sequence_number)));
+}
+
+/*
+ *		Get the compression format from the reparse data
+ *
+ *	Returns the format, or -1 if the file is not compressed by WOF,
+ *		or -2 if it is, but not in a supported way
+ */
+
+static int wof_format(ntfs_inode *ni)
+{
+	REPARSE_POINT *reparse;
+	const struct WOF_REPARSE_DATA *data;
+	int format;
+
+	format = -1;
+	reparse = ntfs_get_reparse_point(ni);
+	if (reparse) {
+		if (reparse->reparse_tag == IO_REPARSE_TAG_WOF) {
+			format = -2;
+			data = (const struct WOF_REPARSE_DATA*)
+					reparse->reparse_data;
+			if ((le16_to_cpu(reparse->reparse_data_length)
+				>= sizeof(struct WOF_REPARSE_DATA))
+			    && (data->version
+				== const_cpu_to_le32(WOF_CURRENT_VERSION))
+			    && (data->provider
+				== const_cpu_to_le32(WOF_PROVIDER_FILE))
+			    && (data->file_version == const_cpu_to_le32(
+					FILE_PROVIDER_CURRENT_VERSION))
+			    && (le32_to_cpu(data->algorithm)
+					<= WOF_XPRESS16K))
+				format = le32_to_cpu(data->algorithm);
+		}
+		free(reparse);
+	}
+	return (format);
+}
+
+/*
+ *		Copy entries of a chunk table kept in the cache
+ *
+ *	When the volume is shared by threads, the cached table may be
+ *	dropped by another thread while the file is read, so only the
+ *	entries needed are copied, while holding the cache lock.
+ *
+ *	Returns TRUE if the entries were found
+ */
+
+static BOOL wof_cached_entries(struct WOF_STREAM *ws, s64 offs, s64 size,
+			u8 *buf)
+{
+	BOOL found;
+#if CACHE_WOF_SIZE
+	struct CACHE_HEADER *cache;
+	struct CACHED_WOF item;
+	struct CACHED_WOF *cached;
+
+	found = FALSE;
+	cache = ws->cna->ni->vol->wof_cache;
+	if (ws->cached && cache) {
+		item.mref = wof_mref(ws->cna->ni);
+		ntfs_lock_cache(cache);
+		cached = (struct CACHED_WOF*)ntfs_fetch_cache(cache,
+				GENERIC(&item), wof_compare);
+		if (cached && cached->table
+		    && (cached->tablesize == (size_t)ws->table_size)) {
+			memcpy(buf, &cached->table[offs], size);
+			found = TRUE;
+		}
+		ntfs_unlock_cache(cache);
+	}
+#else
+	found = FALSE;
+#endif
+	return (found);
+}
+
+/*
+ *		Get the offsets of chunks in the compressed stream
+ *
+ *	offs[k] is set to the offset of chunk first+k for k from 0 to n,
+ *	the last one being the end of the previous chunk.
+ *	The offsets are relative to the beginning of the stream.
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+static int wof_chunk_offsets(struct WOF_STREAM *ws, s64 first, int n,
+			s64 *offs)
+{
+	const u8 *table;
+	u8 *buf;
+	s64 base;
+	s64 e1;
+	s64 data_end;
+	s64 size;
+	s64 e;
+	int k;
+	int err;
+
+	err = 0;
+	buf = (u8*)NULL;
+	data_end = ws->cna->data_size - ws->table_size;
+		/* the entry e is the end of chunk e, needed from first-1 */
+	base = 0;
+	e1 = first + n - 1;
+	if (e1 > (ws->nchunks - 2))
+		e1 = ws->nchunks - 2;
+	table = ws->table;
+	if (!table) {
+			/* only read the needed entries */
+		base = (first ? first - 1 : 0);
+		if (e1 >= base) {
+			size = (e1 - base + 1)*ws->entry_size;
+			buf = (u8*)ntfs_malloc(size);
+			if (!buf)
+				return (-1);
+			if (!wof_cached_entries(ws, base*ws->entry_size,
+						size, buf)
+			    && (ntfs_attr_pread(ws->cna, base*ws->entry_size,
+						size, buf) != size)) {
+				free(buf);
+				errno = EIO;
+				return (-1);
+			}
+			table = buf;
+		}
+	}
+	for (k=0; (k<=n) && !err; k++) {
+		e = first + k - 1;
+		if (e < 0)
+			offs[k] = 0;
+		else
+			if (e >= (ws->nchunks - 1))
+				offs[k] = data_end;
+			else
+				if (ws->entry_size == 8)
+					offs[k] = le64_to_cpup((const le64*)
+						&table[(e - base)*8]);
+				else
+					offs[k] = le32_to_cpup((const le32*)
+						&table[(e - base)*4]);
+		if ((offs[k] > data_end) || (k && (offs[k] < offs[k - 1])))
+			err = -1;
+	}
+	for (k=0; k<=n; k++)
+		offs[k] += ws->table_size;
+	free(buf);
+	if (err) {
+		ntfs_log_error("Bad chunk table in WOF file %lld\n",
+				(long long)ws->cna->ni->mft_no);
+		errno = EIO;
+	}
+	return (err);
+}
+
+/*
+ *		Open the compressed stream of a file
+ *
+ *	The format and the chunk table are got from the cache if possible,
+ *	and the chunk table is loaded if it is not too big. When the
+ *	volume is shared by threads, the cached table is not used
+ *	directly, its entries are copied when needed.
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+static int wof_open(ntfs_attr *na, struct WOF_STREAM *ws)
+{
+	ntfs_inode *ni;
+#if CACHE_WOF_SIZE
+	struct CACHED_WOF item;
+	struct CACHED_WOF *cached;
+#endif
+
+	ni = na->ni;
+	ws->table = (u8*)NULL;
+	ws->owned = FALSE;
+	ws->cached = FALSE;
+	ws->size = na->data_size;
+	ws->format = -1;
+#if CACHE_WOF_SIZE
+	cached = (struct CACHED_WOF*)NULL;
+	if (ni->vol->wof_cache) {
+		item.mref = wof_mref(ni);
+		ntfs_lock_cache(ni->vol->wof_cache);
+		cached = (struct CACHED_WOF*)ntfs_fetch_cache(
+				ni->vol->wof_cache, GENERIC(&item), wof_compare);
+		if (cached) {
+			ws->format = cached->format;
+				/* do not keep the table of a shared volume */
+			if (ni->vol->locks) {
+				ws->cached = TRUE;
+				cached = (struct CACHED_WOF*)NULL;
+			}
+		}
+		ntfs_unlock_cache(ni->vol->wof_cache);
+	}
+#endif
+	if (ws->format < 0)
+		ws->format = wof_format(ni);
+	switch (ws->format) {
+	case WOF_XPRESS4K :
+		ws->chunk_bits = 12;
+		break;
+	case WOF_XPRESS8K :
+		ws->chunk_bits = 13;
+		break;
+	case WOF_XPRESS16K :
+		ws->chunk_bits = 14;
+		break;
+	case WOF_LZX :
+		ws->chunk_bits = 15;
+		break;
+	default :
+		errno = EOPNOTSUPP;
+		ntfs_log_error("Unsupported WOF compression in inode %lld\n",
+				(long long)ni->mft_no);
+		return (-1);
+	}
+	ws->cna = ntfs_attr_open(ni, AT_DATA, WOF_STREAM,
+			sizeof(WOF_STREAM)/sizeof(ntfschar));
+	if (!ws->cna) {
+		ntfs_log_perror("Could not open the WOF stream of inode %lld",
+				(long long)ni->mft_no);
+		return (-1);
+	}
+	ws->nchunks = (ws->size + (1LL << ws->chunk_bits) - 1)
+				>> ws->chunk_bits;
+	ws->entry_size = (ws->size > 0xffffffffLL ? 8 : 4);
+	ws->table_size = (ws->nchunks ? ws->nchunks - 1 : 0)
+				* ws->entry_size;
+	if (ws->table_size > ws->cna->data_size) {
+		ntfs_log_error("Bad chunk table in WOF file %lld\n",
+				(long long)ni->mft_no);
+		errno = EIO;
+		goto err_out;
+	}
+#if CACHE_WOF_SIZE
+	if (cached && ws->table_size
+	    && (cached->tablesize == (size_t)ws->table_size))
+		ws->table = cached->table;
+#endif
+	if (!ws->table && !ws->cached && ws->table_size
+	    && (ws->table_size <= WOF_TABLE_CACHE_MAX)) {
+		ws->table = (u8*)ntfs_malloc(ws->table_size);
+		if (!ws->table)
+			goto err_out;
+		ws->owned = TRUE;
+		if (ntfs_attr_pread(ws->cna, 0, ws->table_size, ws->table)
+						!= ws->table_size) {
+			errno = EIO;
+			goto err_out;
+		}
+	}
+#if CACHE_WOF_SIZE
+	if (ni->vol->wof_cache && !cached && !ws->cached) {
+		item.table = (ws->owned ? ws->table : (u8*)NULL);
+		item.tablesize = (ws->owned ? ws->table_size : 0);
+		item.format = ws->format;
+		ntfs_lock_cache(ni->vol->wof_cache);
+		cached = (struct CACHED_WOF*)ntfs_enter_cache(
+				ni->vol->wof_cache, GENERIC(&item), wof_compare);
+		if (cached && ws->owned && !ni->vol->locks) {
+			free(ws->table);
+			ws->table = cached->table;
+			ws->owned = FALSE;
+		}
+		ntfs_unlock_cache(ni->vol->wof_cache);
+	}
+#endif
+	return (0);
+err_out :
+	if (ws->owned)
+		free(ws->table);
+	ntfs_attr_close(ws->cna);
+	return (-1);
+}
+
+static void wof_close(struct WOF_STREAM *ws)
+{
+	if (ws->owned)
+		free(ws->table);
+	ntfs_attr_close(ws->cna);
+}
+
+/*
+ *		Check whether a chunk is only partially read
+ */
+
+static BOOL wof_partial(struct WOF_STREAM *ws, s64 chunk,
+			s64 pos, s64 count)
+{
+	s64 start;
+	s64 end;
+
+	start = chunk << ws->chunk_bits;
+	end = min(start + (1LL << ws->chunk_bits), ws->size);
+	return ((start < pos) || (end > (pos + count)));
+}
+
+#if CACHE_CBLOCK_SIZE
+
+/*
+ *		Get the part of a chunk which is read from the cache
+ *
+ *	Returns TRUE if found
+ */
+
+static BOOL wof_cached_chunk(struct WOF_STREAM *ws, s64 chunk,
+			s64 pos, s64 count, u8 *b)
+{
+	struct CACHE_HEADER *cache;
+	struct CACHED_CBLOCK item;
+	struct CACHED_CBLOCK *cached;
+	s64 start;
+	s64 end;
+	BOOL found;
+
+	found = FALSE;
+	cache = ws->cna->ni->vol->cblock_cache;
+	if (cache) {
+		item.mref = wof_mref(ws->cna->ni);
+		item.index = chunk;
+		ntfs_lock_cache(cache);
+		cached = (struct CACHED_CBLOCK*)ntfs_fetch_cache(cache,
+				GENERIC(&item), wof_chunk_compare);
+		start = max(chunk << ws->chunk_bits, pos);
+		end = min((chunk + 1) << ws->chunk_bits, pos + count);
+		if (cached && ((s64)cached->datasize
+				>= (end - (chunk << ws->chunk_bits)))) {
+			memcpy(&b[start - pos], cached->data
+				+ (start - (chunk << ws->chunk_bits)),
+				end - start);
+			found = TRUE;
+		}
+		ntfs_unlock_cache(cache);
+	}
+	return (found);
+}
+
+#endif /* CACHE_CBLOCK_SIZE */
+
+/*
+ *		Read decompressed data from a batch of chunks
+ *
+ *	The chunks partially read are got from the cache if possible,
+ *	otherwise they are decompressed into a buffer and cached, the
+ *	other ones are directly decompressed into the user buffer.
+ *
+ *	Returns the count of bytes read, or -1 if there was an error
+ */
+
+static s64 wof_read_batch(struct WOF_STREAM *ws, s64 pos, s64 count,
+			u8 *b)
+{
+	struct WOF_JOB job;
+	struct WOF_CHUNK *chunk;
+	s64 *offs;
+	u8 *cbuf;
+	u8 *partial[2];
+	s64 first;
+	s64 last;
+	s64 start;
+	s64 end;
+	s64 csize;
+	s64 res;
+	int n;
+	int k;
+	int bad;
+#if CACHE_CBLOCK_SIZE
+	struct CACHED_CBLOCK item;
+	BOOL tail;
+#endif
+
+	first = pos >> ws->chunk_bits;
+	last = (pos + count - 1) >> ws->chunk_bits;
+#if CACHE_CBLOCK_SIZE
+		/* only the first and last chunks may be partial */
+	if (wof_partial(ws, first, pos, count)
+	    && wof_cached_chunk(ws, first, pos, count, b))
+		first++;
+	tail = (first <= last) && (last > (pos >> ws->chunk_bits))
+			&& wof_partial(ws, last, pos, count)
+			&& wof_cached_chunk(ws, last, pos, count, b);
+	if (tail)
+		last--;
+	if (first > last)
+		return (count);
+#endif
+	n = last - first + 1;
+	offs = (s64*)ntfs_malloc((n + 1)*sizeof(s64));
+	job.chunks = (struct WOF_CHUNK*)ntfs_malloc(
+				n*sizeof(struct WOF_CHUNK));
+	partial[0] = partial[1] = (u8*)NULL;
+	cbuf = (u8*)NULL;
+	res = -1;
+	if (!offs || !job.chunks
+	    || wof_chunk_offsets(ws, first, n, offs))
+		goto out;
+	csize = offs[n] - offs[0];
+	if (csize > ((s64)n << ws->chunk_bits)) {
+		ntfs_log_error("Bad chunk table in WOF file %lld\n",
+				(long long)ws->cna->ni->mft_no);
+		errno = EIO;
+		goto out;
+	}
+	cbuf = (u8*)ntfs_malloc(csize ? csize : 1);
+	if (!cbuf)
+		goto out;
+	if (ntfs_attr_pread(ws->cna, offs[0], csize, cbuf) != csize) {
+		errno = EIO;
+		goto out;
+	}
+	job.format = ws->format;
+	for (k=0; k<n; k++) {
+		chunk = &job.chunks[k];
+		start = (first + k) << ws->chunk_bits;
+		chunk->in = &cbuf[offs[k] - offs[0]];
+		chunk->insz = offs[k + 1] - offs[k];
+		chunk->outsz = min(1LL << ws->chunk_bits, ws->size - start);
+		chunk->bad = FALSE;
+		if (wof_partial(ws, first + k, pos, count)) {
+			chunk->out = (u8*)ntfs_malloc(chunk->outsz);
+			partial[k ? 1 : 0] = chunk->out;
+			if (!chunk->out)
+				goto out;
+		} else
+			chunk->out = &b[start - pos];
+	}
+	ntfs_compress_dispatch(ws->cna->ni->vol, wof_decompress_chunk,
+				&job, n);
+		/* collect the chunks in order, up to the first bad one */
+	bad = -1;
+	for (k=0; (k<n) && (bad < 0); k++) {
+		chunk = &job.chunks[k];
+		if (chunk->bad) {
+			bad = k;
+		} else
+			if (chunk->out != &b[((first + k) << ws->chunk_bits)
+						- pos]) {
+				start = max((first + k) << ws->chunk_bits, pos);
+				end = min(((first + k) << ws->chunk_bits)
+					+ chunk->outsz, pos + count);
+				memcpy(&b[start - pos], chunk->out
+					+ (start - ((first + k)
+						<< ws->chunk_bits)),
+					end - start);
+#if CACHE_CBLOCK_SIZE
+				if (ws->cna->ni->vol->cblock_cache) {
+					item.mref = wof_mref(ws->cna->ni);
+					item.index = first + k;
+					item.data = chunk->out;
+					item.datasize = chunk->outsz;
+					item.cbused = 0;
+					ntfs_enter_cache(
+						ws->cna->ni->vol->cblock_cache,
+						GENERIC(&item),
+						wof_chunk_compare);
+				}
+#endif
+			}
+	}
+	if (bad >= 0) {
+		ntfs_log_error("Bad compressed chunk %lld in WOF file %lld\n",
+				(long long)(first + bad),
+				(long long)ws->cna->ni->mft_no);
+			/* return what could be decompressed before */
+		res = max((first + bad) << ws->chunk_bits, pos) - pos;
+		if (!res) {
+			res = -1;
+			errno = EIO;
+		}
+	} else
+		res = count;
+out :
+	free(partial[0]);
+	free(partial[1]);
+	free(cbuf);
+	free(job.chunks);
+	free(offs);
+	return (res);
+}
+
+/**
+ * ntfs_wof_compressed - check whether reads are to be decompressed
+ * @na:		attribute to be read
+ *
+ * Only the unnamed data stream of a reparse point with the WOF tag
+ * is redirected, whatever the provider of the compressed data.
+ */
+
+BOOL ntfs_wof_compressed(ntfs_attr *na)
+{
+	ntfs_inode *ni;
+#if CACHE_WOF_SIZE
+	struct CACHED_WOF item;
+#endif
+	BOOL res;
+
+	res = FALSE;
+	ni = na->ni;
+	if ((ni->flags & FILE_ATTR_REPARSE_POINT)
+	    && (na->type == AT_DATA)
+	    && !na->name_len
+	    && !test_nino_flag(ni, NoWof)) {
+#if CACHE_WOF_SIZE
+		item.mref = wof_mref(ni);
+		if (ni->vol->wof_cache
+		    && ntfs_fetch_cache(ni->vol->wof_cache, GENERIC(&item),
+					wof_compare))
+			res = TRUE;
+		else
+#endif
+		{
+			res = (wof_format(ni) != -1);
+			if (!res)
+				set_nino_flag(ni, NoWof);
+		}
+	}
+	return (res);
+}
+
+/**
+ * ntfs_wof_pread - read from a file compressed by WOF
+ * @na:		unnamed data attribute of the file
+ * @pos:	byte position in the uncompressed data
+ * @count:	number of bytes to read
+ * @b:		output data buffer
+ *
+ * NOTE:  You probably want to be using attrib.c::ntfs_attr_pread() instead.
+ *
+ * Reads are done by batches of chunks, the chunks of a batch being
+ * read with a single request and decompressed in parallel when there
+ * are compression threads.
+ *
+ * Return the number of bytes read, or -1 on error and nothing was
+ * read, with errno set appropriately.
+ */
+
+s64 ntfs_wof_pread(ntfs_attr *na, s64 pos, s64 count, void *b)
+{
+	struct WOF_STREAM ws;
+	s64 total;
+	s64 batch;
+	s64 got;
+
+	if (pos >= na->data_size)
+		return (0);
+	if (count > (na->data_size - pos))
+		count = na->data_size - pos;
+	if (!count)
+		return (0);
+	if (wof_open(na, &ws))
+		return (-1);
+	total = 0;
+	got = 0;
+	while ((count > 0) && (got >= 0)) {
+			/* end the batch on a chunk boundary */
+		batch = WOF_BATCH_SIZE - (pos & ((1 << ws.chunk_bits) - 1));
+		if (batch > count)
+			batch = count;
+		got = wof_read_batch(&ws, pos, batch, (u8*)b + total);
+		if (got > 0) {
+			total += got;
+			pos += got;
+			count -= got;
+			if (got < batch)
+				got = -1;
+		}
+	}
+	wof_close(&ws);
+	return (total || (got >= 0) ? total : -1);
+}
+
+/**
+ * ntfs_wof_invalidate - forget the cached data of a WOF file
+ * @ni:		inode being changed
+ *
+ * To be called before changing the data streams or the reparse data
+ * of a reparse point.
+ */
+
+void ntfs_wof_invalidate(ntfs_inode *ni)
+{
+#if CACHE_WOF_SIZE
+	struct CACHED_WOF item;
+#endif
+#if CACHE_CBLOCK_SIZE
+	struct CACHED_CBLOCK citem;
+#endif
+
+	if (ni->flags & FILE_ATTR_REPARSE_POINT) {
+		clear_nino_flag(ni, NoWof);
+#if CACHE_WOF_SIZE
+		if (ni->vol->wof_cache
+		    && ni->vol->wof_cache->most_recent_entry) {
+			item.mref = wof_mref(ni);
+			ntfs_invalidate_cache(ni->vol->wof_cache,
+					GENERIC(&item), wof_compare, 0);
+		}
+#endif
+#if CACHE_CBLOCK_SIZE
+		if (ni->vol->cblock_cache
+		    && ni->vol->cblock_cache->most_recent_entry) {
+			citem.mref = wof_mref(ni);
+			ntfs_invalidate_cache(ni->vol->cblock_cache,
+					GENERIC(&citem),
+					wof_chunk_inode_compare, CACHE_NOHASH);
+		}
+#endif
+	}
+}
+
+#ifdef NTFS_TEST
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+
+#include "dir.h"
+
+/*
+ *	There is no reference compressor available to the test, so the
+ *	streams are either assembled by hand from the specifications, or
+ *	produced by the minimal compressors below, which follow the
+ *	specifications, use all the features of both formats (long
+ *	matches, recent offsets, aligned and uncompressed blocks, runs of
+ *	codeword lengths, translation of x86 calls) and lay the words and
+ *	byte fields out the way the decoder fetches them.
+ */
+
+static u32 test_wof_random(u32 *seed)
+{
+	*seed = *seed*1103515245 + 12345;
+	return ((*seed >> 8) & 0xffffff);
+}
+
+/*
+ *		Fill a buffer with test data
+ *
+ *	The kinds of data are text, a mix of random bytes and long
+ *	repeated sequences, long runs, x86 code with calls, and random
+ *	bytes, which cannot be compressed.
+ */
+
+enum { TEST_WOF_TEXT, TEST_WOF_MIX, TEST_WOF_RUNS, TEST_WOF_X86,
+		TEST_WOF_RANDOM, TEST_WOF_KINDS } ;
+
+static void test_wof_fill(u8 *buf, u32 size, int kind, u32 *seed)
+{
+	static const char *words[] = {
+		"\tif (", "ni", "->", "vol", "na", "return (", ");\n",
+		" = ", "0", "NULL", "}\n", "\t\t", "le32_to_cpu(",
+		"wof_read_batch", "(", ", ", "chunk", " + ", "s64 ",
+		"while (", ") {\n", "errno = ", "EIO", "/* ", " */\n",
+		"the ", "compressed ", "stream ", "is ", "not ", "found",
+	} ;
+	u32 pos;
+	u32 len;
+	u32 offs;
+	u32 i;
+	s32 rel;
+
+	pos = 0;
+	while (pos < size) {
+		switch (kind) {
+		case TEST_WOF_TEXT :
+			i = test_wof_random(seed)
+				% (sizeof(words)/sizeof(words[0]));
+			len = strlen(words[i]);
+			if (len > (size - pos))
+				len = size - pos;
+			memcpy(&buf[pos], words[i], len);
+			break;
+		case TEST_WOF_MIX :
+			len = test_wof_random(seed) % 600 + 1;
+			if (len > (size - pos))
+				len = size - pos;
+			if ((pos > 0) && (test_wof_random(seed) & 1)) {
+				offs = test_wof_random(seed) % pos + 1;
+				for (i=0; i<len; i++)
+					buf[pos + i] = buf[pos + i - offs];
+			} else
+				for (i=0; i<len; i++)
+					buf[pos + i] = test_wof_random(seed)
+							% 16;
+			break;
+		case TEST_WOF_RUNS :
+			len = test_wof_random(seed) % 2000 + 50;
+			if (len > (size - pos))
+				len = size - pos;
+			memset(&buf[pos], test_wof_random(seed) & 3, len);
+			break;
+		case TEST_WOF_X86 :
+				/* a call to a near target, or a few opcodes */
+			if (test_wof_random(seed) & 1) {
+				rel = (s32)(test_wof_random(seed) % 4096) - 2048;
+				if (!(test_wof_random(seed) % 8))
+					rel = (s32)(test_wof_random(seed)
+							<< 8);
+				len = 5;
+				if (len > (size - pos))
+					len = size - pos;
+				buf[pos] = 0xe8;
+				for (i=1; i<len; i++)
+					buf[pos + i] = rel >> (8*(i - 1));
+			} else {
+				len = test_wof_random(seed) % 8 + 1;
+				if (len > (size - pos))
+					len = size - pos;
+				for (i=0; i<len; i++)
+					buf[pos + i] = 0x40
+						+ test_wof_random(seed) % 8;
+			}
+			break;
+		default :
+			len = size - pos;
+			for (i=0; i<len; i++)
+				buf[pos + i] = test_wof_random(seed);
+			break;
+		}
+		pos += len;
+	}
+}
+
+/*
+ *		Bit stream writer
+ *
+ *	A word is reserved at the current output position when the
+ *	decoder would fetch it, that is when the bits of the next field
+ *	are not all in the words already reserved, so that the byte
+ *	fields written in between are where the decoder reads them.
+ */
+
+struct TEST_WOF_OUT {
+	u8 *buf;
+	u32 room;
+	u32 pos;		/* next byte to write */
+	u32 words[2];		/* reserved words not fully used */
+	int nwords;
+	int used;		/* bits used in words[0] */
+	BOOL full;
+} ;
+
+static void test_wof_out_init(struct TEST_WOF_OUT *os, u8 *buf,
+			u32 pos, u32 room)
+{
+	os->buf = buf;
+	os->room = room;
+	os->pos = pos;
+	os->nwords = 0;
+	os->used = 0;
+	os->full = (pos > room);
+}
+
+static void test_wof_ensure(struct TEST_WOF_OUT *os, int n)
+{
+	if (((os->nwords << 4) - os->used) < n) {
+		if ((os->pos + 2) <= os->room) {
+			os->buf[os->pos] = 0;
+			os->buf[os->pos + 1] = 0;
+		} else
+			os->full = TRUE;
+		os->words[os->nwords++] = os->pos;
+		os->pos += 2;
+	}
+}
+
+static void test_wof_put(struct TEST_WOF_OUT *os, u32 v, int n)
+{
+	u32 at;
+	int bit;
+
+	while (n-- > 0) {
+		bit = 15 - os->used;
+		at = os->words[0] + (bit >> 3);
+		if (((v >> n) & 1) && (at < os->room))
+			os->buf[at] |= 1 << (bit & 7);
+		if (++os->used == 16) {
+			os->words[0] = os->words[1];
+			os->nwords--;
+			os->used = 0;
+		}
+	}
+}
+
+static void test_wof_bits(struct TEST_WOF_OUT *os, u32 v, int n)
+{
+	test_wof_ensure(os, n);
+	test_wof_put(os, v, n);
+}
+
+static void test_wof_code(struct TEST_WOF_OUT *os, const u16 *codes,
+			const u8 *lens, int sym, int maxlen)
+{
+	test_wof_ensure(os, maxlen);
+	test_wof_put(os, codes[sym], lens[sym]);
+}
+
+static void test_wof_byte(struct TEST_WOF_OUT *os, u8 b)
+{
+	if (os->pos < os->room)
+		os->buf[os->pos] = b;
+	else
+		os->full = TRUE;
+	os->pos++;
+}
+
+	/* the unused bits are dropped, the next word too if none */
+static void test_wof_align(struct TEST_WOF_OUT *os)
+{
+	test_wof_ensure(os, 1);
+	os->nwords = 0;
+	os->used = 0;
+}
+
+/*
+ *		Build the codeword lengths of a Huffman code
+ *
+ *	The frequencies are halved until no codeword is longer than
+ *	maxlen. A single used symbol gets a one-bit codeword.
+ */
+
+static void test_wof_lens(const u32 *freqs, int nsyms, int maxlen, u8 *lens)
+{
+	u32 f[WOF_MAXSYMS];
+	u32 w[2*WOF_MAXSYMS];
+	int parent[2*WOF_MAXSYMS];
+	int sym[WOF_MAXSYMS];
+	int n;
+	int nodes;
+	int live;
+	int a;
+	int b;
+	int i;
+	int depth;
+	int deepest;
+
+	memcpy(f, freqs, nsyms*sizeof(u32));
+	do {
+		memset(lens, 0, nsyms);
+		n = 0;
+		for (i=0; i<nsyms; i++)
+			if (f[i]) {
+				sym[n] = i;
+				w[n++] = f[i];
+			}
+		if (n == 1)
+			lens[sym[0]] = 1;
+		deepest = 0;
+		if (n > 1) {
+			for (i=0; i<2*n; i++)
+				parent[i] = -1;
+			nodes = n;
+			for (live=n; live>1; live--) {
+				a = b = -1;
+				for (i=0; i<nodes; i++)
+					if (parent[i] < 0) {
+						if ((a < 0) || (w[i] < w[a])) {
+							b = a;
+							a = i;
+						} else
+							if ((b < 0) || (w[i] < w[b]))
+								b = i;
+					}
+				w[nodes] = w[a] + w[b];
+				parent[a] = parent[b] = nodes++;
+			}
+			for (i=0; i<n; i++) {
+				depth = 0;
+				for (a=i; parent[a]>=0; a=parent[a])
+					depth++;
+				lens[sym[i]] = depth;
+				if (depth > deepest)
+					deepest = depth;
+			}
+		}
+		for (i=0; i<nsyms; i++)
+			if (f[i])
+				f[i] = (f[i] >> 1) | 1;
+	} while (deepest > maxlen);
+}
+
+/*
+ *	Assign the canonical codewords, the way wof_make_table() does
+ */
+
+static void test_wof_codes(const u8 *lens, int nsyms, u16 *codes)
+{
+	u16 count[17];
+	u16 next[17];
+	u16 code;
+	int len;
+	int sym;
+
+	memset(count, 0, sizeof(count));
+	for (sym=0; sym<nsyms; sym++)
+		count[lens[sym]]++;
+	count[0] = 0;
+	code = 0;
+	for (len=1; len<=16; len++) {
+		code = (code + count[len - 1]) << 1;
+		next[len] = code;
+	}
+	for (sym=0; sym<nsyms; sym++)
+		if (lens[sym])
+			codes[sym] = next[lens[sym]]++;
+}
+
+/*
+ *		Parse data into literals and matches
+ *
+ *	The three most recent offsets are tried first, then a few
+ *	previous positions with the same first bytes.
+ *
+ *	Returns the count of tokens
+ */
+
+struct TEST_WOF_TOKEN {
+	u32 length;		/* 0 for a literal */
+	u32 offset;
+} ;
+
+#define TEST_WOF_HASH(p) ((((p)[0] << 8) ^ ((p)[1] << 4) ^ (p)[2]) & 4095)
+
+static int test_wof_parse(const u8 *data, u32 size, u32 maxoffs,
+			u32 maxlen, struct TEST_WOF_TOKEN *tokens)
+{
+	s32 head[4096];
+	s32 *prev;
+	u32 recent[3];
+	u32 pos;
+	u32 best;
+	u32 bestoffs;
+	u32 len;
+	u32 offs;
+	u32 i;
+	s32 cand;
+	int tries;
+	int n;
+
+	prev = (s32*)ntfs_malloc((size ? size : 1)*sizeof(s32));
+	if (!prev)
+		return (-1);
+	for (i=0; i<4096; i++)
+		head[i] = -1;
+	recent[0] = recent[1] = recent[2] = 1;
+	n = 0;
+	pos = 0;
+	while (pos < size) {
+		best = 0;
+		bestoffs = 0;
+		for (i=0; (i<=3) && ((pos + 3) <= size); i++) {
+			if (i < 3)
+				offs = recent[i];
+			else
+				offs = 0;
+			cand = head[TEST_WOF_HASH(&data[pos])];
+			for (tries=0; tries<(i < 3 ? 1 : 24); tries++) {
+				if (i == 3) {
+					if ((cand < 0)
+					    || ((pos - cand) > maxoffs))
+						break;
+					offs = pos - cand;
+					cand = prev[cand];
+				}
+				if (offs > pos)
+					break;
+				for (len=0; (len<maxlen)
+					&& ((pos + len) < size)
+					&& (data[pos + len]
+						== data[pos + len - offs]); len++)
+					;
+				if ((len >= 3) && (len > best)) {
+					best = len;
+					bestoffs = offs;
+				}
+			}
+		}
+		if (!best)
+			best = 1;
+		else {
+			if (bestoffs == recent[1]) {
+				recent[1] = recent[0];
+				recent[0] = bestoffs;
+			} else
+				if (bestoffs != recent[0]) {
+					recent[2] = recent[1];
+					recent[1] = recent[0];
+					recent[0] = bestoffs;
+				}
+		}
+		tokens[n].length = (bestoffs ? best : 0);
+		tokens[n].offset = bestoffs;
+		n++;
+		for (i=0; i<best; i++, pos++)
+			if ((pos + 3) <= size) {
+				prev[pos] = head[TEST_WOF_HASH(&data[pos])];
+				head[TEST_WOF_HASH(&data[pos])] = pos;
+			}
+	}
+	free(prev);
+	return (n);
+}
+
+
+/*
+ *		Compress a chunk in XPRESS Huffman format
+ *
+ *	Returns the compressed size, or 0 if there was no room
+ */
+
+static u32 test_wof_xpress(const u8 *data, u32 size, u8 *out, u32 room)
+{
+	struct TEST_WOF_OUT os;
+	struct TEST_WOF_TOKEN *tokens;
+	u32 freqs[XPRESS_SYMBOLS];
+	u8 lens[XPRESS_SYMBOLS];
+	u16 codes[XPRESS_SYMBOLS];
+	u32 pos;
+	u32 length;
+	u32 offset;
+	u32 res;
+	int obits;
+	int pass;
+	int sym;
+	int n;
+	int t;
+	int i;
+
+	tokens = (struct TEST_WOF_TOKEN*)ntfs_malloc((size ? size : 1)
+				*sizeof(struct TEST_WOF_TOKEN));
+	n = (tokens ? test_wof_parse(data, size, 65535, size, tokens) : -1);
+	if ((n < 0) || (room < (XPRESS_SYMBOLS / 2))) {
+		free(tokens);
+		return (0);
+	}
+	memset(freqs, 0, sizeof(freqs));
+	obits = 0;
+	offset = 0;
+	for (pass=0; pass<2; pass++) {
+		if (pass) {
+			test_wof_lens(freqs, XPRESS_SYMBOLS,
+					XPRESS_MAX_CODEWORD_LEN, lens);
+			test_wof_codes(lens, XPRESS_SYMBOLS, codes);
+			for (i=0; i<(XPRESS_SYMBOLS / 2); i++)
+				out[i] = lens[2*i] | (lens[2*i + 1] << 4);
+			test_wof_out_init(&os, out, XPRESS_SYMBOLS / 2, room);
+		}
+		pos = 0;
+		for (t=0; t<n; t++) {
+			length = tokens[t].length;
+			if (!length) {
+				sym = data[pos++];
+			} else {
+				offset = tokens[t].offset;
+				for (obits=0; (offset >> obits) > 1; obits++)
+					;
+				sym = 256 + (obits << 4) + (length
+					- XPRESS_MIN_MATCH_LEN < 15
+					? length - XPRESS_MIN_MATCH_LEN : 15);
+				pos += length;
+			}
+			if (!pass) {
+				freqs[sym]++;
+				continue;
+			}
+			test_wof_code(&os, codes, lens, sym,
+					XPRESS_MAX_CODEWORD_LEN);
+			if (length) {
+				test_wof_ensure(&os, 16);
+				test_wof_put(&os, offset - (1 << obits), obits);
+				length -= XPRESS_MIN_MATCH_LEN;
+				if ((length >= 15) && (length < (15 + 255)))
+					test_wof_byte(&os, length - 15);
+				if (length >= (15 + 255)) {
+					test_wof_byte(&os, 255);
+					test_wof_byte(&os, length & 255);
+					test_wof_byte(&os, length >> 8);
+				}
+			}
+		}
+	}
+	res = (os.full ? 0 : os.pos);
+	free(tokens);
+	return (res);
+}
+
+/*
+ *		Translate the targets of x86 calls, before LZX compression
+ */
+
+static void test_wof_lzx_e8(u8 *data, u32 size)
+{
+	u8 *p;
+	u8 *tail;
+	s32 pos;
+	s32 abs_offset;
+	s32 rel_offset;
+
+	if (size > 10) {
+		tail = &data[size - 10];
+		for (p=data; p<tail; p++) {
+			if (*p == 0xe8) {
+				pos = p - data;
+				rel_offset = (s32)(p[1] | (p[2] << 8)
+					| (p[3] << 16) | ((u32)p[4] << 24));
+				if ((rel_offset >= -pos)
+				    && (rel_offset < LZX_E8_FILE_SIZE)) {
+					if (rel_offset < (LZX_E8_FILE_SIZE - pos))
+						abs_offset = rel_offset + pos;
+					else
+						abs_offset = rel_offset
+							- LZX_E8_FILE_SIZE;
+					p[1] = abs_offset;
+					p[2] = abs_offset >> 8;
+					p[3] = abs_offset >> 16;
+					p[4] = abs_offset >> 24;
+				}
+				p += 4;
+			}
+		}
+	}
+}
+
+/*
+ *	Write a set of codeword lengths through a precode, as
+ *	differences from the previous ones, with runs when possible
+ */
+
+static void test_wof_lzx_lens(struct TEST_WOF_OUT *os, const u8 *prev,
+			const u8 *lens, int count)
+{
+	u8 syms[LZX_MAINCODE_SYMBOLS];
+	u8 extras[LZX_MAINCODE_SYMBOLS];
+	u8 deltas[LZX_MAINCODE_SYMBOLS];
+	u32 freqs[LZX_PRECODE_SYMBOLS];
+	u8 prelens[LZX_PRECODE_SYMBOLS];
+	u16 precodes[LZX_PRECODE_SYMBOLS];
+	int run;
+	int n;
+	int i;
+	int k;
+
+	memset(freqs, 0, sizeof(freqs));
+	n = 0;
+	for (i=0; i<count; i+=run) {
+		for (run=1; ((i + run) < count) && (lens[i + run] == lens[i]);
+				run++)
+			;
+		if (!lens[i] && (run >= 20)) {
+			run = min(run, 51);
+			syms[n] = 18;
+			extras[n] = run - 20;
+		} else
+			if (!lens[i] && (run >= 4)) {
+				run = min(run, 19);
+				syms[n] = 17;
+				extras[n] = run - 4;
+			} else
+				if (run >= 4) {
+					run = min(run, 5);
+					syms[n] = 19;
+					extras[n] = run - 4;
+					deltas[n] = (prev[i] + 17 - lens[i]) % 17;
+					freqs[deltas[n]]++;
+				} else {
+					run = 1;
+					syms[n] = (prev[i] + 17 - lens[i]) % 17;
+				}
+		freqs[syms[n++]]++;
+	}
+	test_wof_lens(freqs, LZX_PRECODE_SYMBOLS, LZX_MAX_PRE_CODEWORD_LEN,
+			prelens);
+	test_wof_codes(prelens, LZX_PRECODE_SYMBOLS, precodes);
+	for (i=0; i<LZX_PRECODE_SYMBOLS; i++)
+		test_wof_bits(os, prelens[i], 4);
+	for (k=0; k<n; k++) {
+		test_wof_code(os, precodes, prelens, syms[k],
+				LZX_MAX_PRE_CODEWORD_LEN);
+		switch (syms[k]) {
+		case 17 :
+			test_wof_bits(os, extras[k], 4);
+			break;
+		case 18 :
+			test_wof_bits(os, extras[k], 5);
+			break;
+		case 19 :
+			test_wof_bits(os, extras[k], 1);
+			test_wof_code(os, precodes, prelens, deltas[k],
+					LZX_MAX_PRE_CODEWORD_LEN);
+			break;
+		default :
+			break;
+		}
+	}
+}
+
+/*
+ *		Compress a chunk in LZX format
+ *
+ *	The blocks are of random types and sizes, an uncompressed block
+ *	only being inserted where the previous block ends, and ending
+ *	between two matches.
+ *
+ *	Returns the compressed size, or 0 if there was no room
+ */
+
+struct TEST_WOF_LZXSYM {
+	u16 main;
+	s16 len;		/* length symbol, -1 if none */
+	u32 extra;		/* extra offset bits */
+	u8 slot;
+} ;
+
+static u32 test_wof_lzx(const u8 *data, u32 size, u8 *out, u32 room,
+			u32 *seed)
+{
+	struct TEST_WOF_OUT os;
+	struct TEST_WOF_TOKEN *tokens;
+	struct TEST_WOF_LZXSYM *syms;
+	struct TEST_WOF_LZXSYM *sym;
+	u8 *work;
+	u32 mainfreqs[LZX_MAINCODE_SYMBOLS];
+	u32 lenfreqs[LZX_LENCODE_SYMBOLS];
+	u32 alignedfreqs[LZX_ALIGNEDCODE_SYMBOLS];
+	u8 mainlens[LZX_MAINCODE_SYMBOLS];
+	u8 prevmain[LZX_MAINCODE_SYMBOLS];
+	u8 lenlens[LZX_LENCODE_SYMBOLS];
+	u8 prevlen[LZX_LENCODE_SYMBOLS];
+	u8 alignedlens[LZX_ALIGNEDCODE_SYMBOLS];
+	u16 maincodes[LZX_MAINCODE_SYMBOLS];
+	u16 lencodes[LZX_LENCODE_SYMBOLS];
+	u16 alignedcodes[LZX_ALIGNEDCODE_SYMBOLS];
+	u32 recent[LZX_NUM_RECENT_OFFSETS];
+	u32 pos;
+	u32 bend;
+	u32 bsize;
+	u32 length;
+	u32 offset;
+	u32 res;
+	int btype;
+	int nbits;
+	int slot;
+	int n;
+	int t;
+	int k;
+	int i;
+	BOOL aligned;
+
+	res = 0;
+	work = (u8*)ntfs_malloc(size ? size : 1);
+	tokens = (struct TEST_WOF_TOKEN*)ntfs_malloc((size ? size : 1)
+				*sizeof(struct TEST_WOF_TOKEN));
+	syms = (struct TEST_WOF_LZXSYM*)ntfs_malloc((size ? size : 1)
+				*sizeof(struct TEST_WOF_LZXSYM));
+	if (!work || !tokens || !syms)
+		goto out;
+	memcpy(work, data, size);
+	test_wof_lzx_e8(work, size);
+	n = test_wof_parse(work, size,
+			lzx_offset_slot_base[LZX_NUM_OFFSET_SLOTS - 1]
+			+ (1 << lzx_extra_offset_bits[LZX_NUM_OFFSET_SLOTS - 1])
+			- 1 - LZX_OFFSET_ADJUSTMENT,
+			LZX_MIN_MATCH_LEN + LZX_NUM_LEN_HEADERS - 1
+			+ LZX_LENCODE_SYMBOLS - 1, tokens);
+	if (n < 0)
+		goto out;
+	memset(prevmain, 0, sizeof(prevmain));
+	memset(prevlen, 0, sizeof(prevlen));
+	for (i=0; i<LZX_NUM_RECENT_OFFSETS; i++)
+		recent[i] = 1;
+	test_wof_out_init(&os, out, 0, room);
+	pos = 0;
+	bend = 0;
+	t = 0;
+	while (pos < size) {
+		btype = test_wof_random(seed) % 8;
+		if (!btype && (pos == bend))
+			btype = LZX_BLOCKTYPE_UNCOMPRESSED;
+		else
+			btype = (btype < 4 ? LZX_BLOCKTYPE_VERBATIM
+					: LZX_BLOCKTYPE_ALIGNED);
+		if (btype == LZX_BLOCKTYPE_UNCOMPRESSED) {
+			k = test_wof_random(seed) % 64 + 1;
+			for (bsize=0; k-- && (t<n); t++)
+				bsize += (tokens[t].length
+						? tokens[t].length : 1);
+		} else
+			if (((size - bend) >= LZX_DEFAULT_BLOCK_SIZE)
+			    && (test_wof_random(seed) & 1))
+				bsize = LZX_DEFAULT_BLOCK_SIZE;
+			else
+				if (test_wof_random(seed) % 4)
+					bsize = size - bend;
+				else
+					bsize = test_wof_random(seed)
+						% (size - bend) + 1;
+		test_wof_bits(&os, btype, 3);
+		if ((bsize == LZX_DEFAULT_BLOCK_SIZE)
+		    && (test_wof_random(seed) & 1))
+			test_wof_bits(&os, 1, 1);
+		else {
+			test_wof_bits(&os, 0, 1);
+			test_wof_bits(&os, bsize, 16);
+		}
+		bend += bsize;
+		if (btype == LZX_BLOCKTYPE_UNCOMPRESSED) {
+			test_wof_align(&os);
+			for (i=0; i<LZX_NUM_RECENT_OFFSETS; i++)
+				for (k=0; k<4; k++)
+					test_wof_byte(&os, recent[i] >> (8*k));
+			for ( ; pos<bend; pos++)
+				test_wof_byte(&os, work[pos]);
+			if (bsize & 1)
+				test_wof_byte(&os, 0);
+			continue;
+		}
+		aligned = (btype == LZX_BLOCKTYPE_ALIGNED);
+			/* get the symbols of the matches beginning here */
+		memset(mainfreqs, 0, sizeof(mainfreqs));
+		memset(lenfreqs, 0, sizeof(lenfreqs));
+		memset(alignedfreqs, 0, sizeof(alignedfreqs));
+		for (k=0; (t<n) && (pos<bend); t++) {
+			sym = &syms[k++];
+			length = tokens[t].length;
+			sym->len = -1;
+			sym->extra = 0;
+			sym->slot = 0;
+			if (!length) {
+				sym->main = work[pos++];
+				mainfreqs[sym->main]++;
+				continue;
+			}
+			offset = tokens[t].offset;
+			if (offset == recent[0])
+				slot = 0;
+			else
+				if (offset == recent[1]) {
+					slot = 1;
+					recent[1] = recent[0];
+					recent[0] = offset;
+				} else
+					if (offset == recent[2]) {
+						slot = 2;
+						recent[2] = recent[0];
+						recent[0] = offset;
+					} else {
+						for (slot=LZX_NUM_OFFSET_SLOTS - 1;
+						    lzx_offset_slot_base[slot]
+							> (offset
+							+ LZX_OFFSET_ADJUSTMENT);
+						    slot--)
+							;
+						sym->extra = offset
+							+ LZX_OFFSET_ADJUSTMENT
+							- lzx_offset_slot_base[slot];
+						recent[2] = recent[1];
+						recent[1] = recent[0];
+						recent[0] = offset;
+						if (aligned
+						    && (lzx_extra_offset_bits[slot]
+							>= LZX_ALIGNED_BITS))
+							alignedfreqs[sym->extra
+								& 7]++;
+					}
+			sym->slot = slot;
+			length -= LZX_MIN_MATCH_LEN;
+			sym->main = LZX_NUM_CHARS + slot*LZX_NUM_LEN_HEADERS
+				+ min(length, LZX_NUM_LEN_HEADERS - 1);
+			if (length >= (LZX_NUM_LEN_HEADERS - 1)) {
+				sym->len = length - (LZX_NUM_LEN_HEADERS - 1);
+				lenfreqs[sym->len]++;
+			}
+			mainfreqs[sym->main]++;
+			pos += tokens[t].length;
+		}
+		test_wof_lens(mainfreqs, LZX_MAINCODE_SYMBOLS,
+				LZX_MAX_CODEWORD_LEN, mainlens);
+		test_wof_lens(lenfreqs, LZX_LENCODE_SYMBOLS,
+				LZX_MAX_CODEWORD_LEN, lenlens);
+		test_wof_codes(mainlens, LZX_MAINCODE_SYMBOLS, maincodes);
+		test_wof_codes(lenlens, LZX_LENCODE_SYMBOLS, lencodes);
+		if (aligned) {
+			test_wof_lens(alignedfreqs, LZX_ALIGNEDCODE_SYMBOLS,
+				LZX_MAX_ALIGNED_CODEWORD_LEN, alignedlens);
+			test_wof_codes(alignedlens, LZX_ALIGNEDCODE_SYMBOLS,
+				alignedcodes);
+			for (i=0; i<LZX_ALIGNEDCODE_SYMBOLS; i++)
+				test_wof_bits(&os, alignedlens[i], 3);
+		}
+		test_wof_lzx_lens(&os, prevmain, mainlens, LZX_NUM_CHARS);
+		test_wof_lzx_lens(&os, &prevmain[LZX_NUM_CHARS],
+				&mainlens[LZX_NUM_CHARS],
+				LZX_MAINCODE_SYMBOLS - LZX_NUM_CHARS);
+		test_wof_lzx_lens(&os, prevlen, lenlens, LZX_LENCODE_SYMBOLS);
+		memcpy(prevmain, mainlens, sizeof(prevmain));
+		memcpy(prevlen, lenlens, sizeof(prevlen));
+		for (i=0; i<k; i++) {
+			sym = &syms[i];
+			test_wof_code(&os, maincodes, mainlens, sym->main,
+					LZX_MAX_CODEWORD_LEN);
+			if (sym->len >= 0)
+				test_wof_code(&os, lencodes, lenlens, sym->len,
+						LZX_MAX_CODEWORD_LEN);
+			if ((sym->main < LZX_NUM_CHARS)
+			    || (sym->slot < LZX_NUM_RECENT_OFFSETS))
+				continue;
+			nbits = lzx_extra_offset_bits[sym->slot];
+			if (aligned && (nbits >= LZX_ALIGNED_BITS)) {
+				test_wof_bits(&os, sym->extra >> LZX_ALIGNED_BITS,
+						nbits - LZX_ALIGNED_BITS);
+				test_wof_code(&os, alignedcodes, alignedlens,
+						sym->extra & 7,
+						LZX_MAX_ALIGNED_CODEWORD_LEN);
+			} else
+				test_wof_bits(&os, sym->extra, nbits);
+		}
+	}
+	res = (os.full ? 0 : os.pos);
+out :
+	free(syms);
+	free(tokens);
+	free(work);
+	return (res);
+}
+
+static const char *test_wof_formats[] = {
+	"XPRESS4K", "LZX", "XPRESS8K", "XPRESS16K"
+} ;
+
+static int test_wof_chunk_bits(int format)
+{
+	static const int bits[] = { 12, 15, 13, 14 } ;
+
+	return (bits[format]);
+}
+
+static u32 test_wof_compress(int format, const u8 *data, u32 size,
+			u8 *out, u32 room, u32 *seed)
+{
+	if (format == WOF_LZX)
+		return (test_wof_lzx(data, size, out, room, seed));
+	return (test_wof_xpress(data, size, out, room));
+}
+
+static int test_wof_decompress(int format, const u8 *in, u32 insz,
+			u8 *out, u32 outsz)
+{
+	void *d;
+	int err;
+
+	err = -1;
+	if (format == WOF_LZX) {
+		d = ntfs_malloc(sizeof(struct WOF_LZX));
+		if (d)
+			err = wof_lzx_decompress((struct WOF_LZX*)d,
+					in, insz, out, outsz);
+	} else {
+		d = ntfs_malloc(sizeof(struct WOF_XPRESS));
+		if (d)
+			err = wof_xpress_decompress((struct WOF_XPRESS*)d,
+					in, insz, out, outsz);
+	}
+	free(d);
+	return (err);
+}
+
+/*
+ *		Decompress streams assembled by hand
+ *
+ *	In the XPRESS streams, the codeword of a literal is the literal
+ *	itself, or the literal plus 0x80 when a match symbol has a
+ *	one-bit codeword. The LZX streams are uncompressed blocks, the
+ *	second one with an odd size and a translated x86 call.
+ *	The expected data is completed up to its size by repeating
+ *	its last byte.
+ */
+
+struct TEST_WOF_VECTOR {
+	const char *what;
+	int format;
+	int sym1;		/* XPRESS symbol with a one-bit codeword */
+	const char *in;		/* stream, after the XPRESS lengths */
+	u32 insz;
+	const char *data;
+	u32 datasz;
+	u32 size;
+} ;
+
+#define TEST_WOF_BYTES(s) s, sizeof(s) - 1
+
+static const struct TEST_WOF_VECTOR test_wof_vectors[] = {
+	{ "XPRESS literals", WOF_XPRESS4K, -1,
+		TEST_WOF_BYTES("OW Fetts"), TEST_WOF_BYTES("WOF test"), 8 },
+	{ "XPRESS match", WOF_XPRESS8K, 256 + (1 << 4) + 3,
+		TEST_WOF_BYTES("\xe2\xe1\x40\xe3"),
+		TEST_WOF_BYTES("abcabcabc"), 9 },
+	{ "XPRESS match length byte", WOF_XPRESS16K, 256 + 15,
+		TEST_WOF_BYTES("\x00\xe1\x00\x00\x16"),
+		TEST_WOF_BYTES("a"), 41 },
+	{ "XPRESS match length word", WOF_XPRESS4K, 256 + 15,
+		TEST_WOF_BYTES("\x00\xe1\x00\x00\xff\x2c\x01"),
+		TEST_WOF_BYTES("a"), 304 },
+	{ "LZX uncompressed block", WOF_LZX, -1,
+		TEST_WOF_BYTES("\x01\x60\x00\x00" "\x01\x00\x00\x00"
+			"\x01\x00\x00\x00" "\x01\x00\x00\x00"
+			"0123456789abcdef"),
+		TEST_WOF_BYTES("0123456789abcdef"), 16 },
+	{ "LZX x86 call, odd block", WOF_LZX, -1,
+		TEST_WOF_BYTES("\x00\x60\x00\xf0" "\x01\x00\x00\x00"
+			"\x01\x00\x00\x00" "\x01\x00\x00\x00"
+			"xy\xe8\x20\x00\x00\x00" "ABCDEFGH" "\x00"
+			"\x00\x60\x00\x10" "\x01\x00\x00\x00"
+			"\x01\x00\x00\x00" "\x01\x00\x00\x00" "Z"),
+		TEST_WOF_BYTES("xy\xe8\x1e\x00\x00\x00" "ABCDEFGHZ"), 16 },
+} ;
+
+static int test_wof_known(void)
+{
+	const struct TEST_WOF_VECTOR *v;
+	u8 *in;
+	u8 *data;
+	u8 *out;
+	u32 insz;
+	u32 i;
+	int bad;
+
+	bad = 0;
+	for (i=0; i<(sizeof(test_wof_vectors)/sizeof(test_wof_vectors[0]));
+				i++) {
+		v = &test_wof_vectors[i];
+		insz = v->insz;
+		if (v->format != WOF_LZX)
+			insz += XPRESS_SYMBOLS / 2;
+		in = (u8*)ntfs_malloc(insz);
+		data = (u8*)ntfs_malloc(v->size);
+		out = (u8*)ntfs_malloc(v->size);
+		if (!in || !data || !out) {
+			bad++;
+		} else {
+			memcpy(data, v->data, v->datasz);
+			memset(&data[v->datasz], v->data[v->datasz - 1],
+					v->size - v->datasz);
+			if (v->format == WOF_LZX)
+				memcpy(in, v->in, v->insz);
+			else {
+				memset(in, 0, XPRESS_SYMBOLS / 2);
+					/* literals 0-255, or 0-127, 8 bits */
+				memset(in, 0x88, (v->sym1 < 0 ? 128 : 64));
+				if (v->sym1 >= 0)
+					in[v->sym1 >> 1] |= 1 << (4*(v->sym1 & 1));
+				memcpy(&in[XPRESS_SYMBOLS / 2], v->in, v->insz);
+			}
+			if (test_wof_decompress(v->format, in, insz,
+						out, v->size)
+			    || memcmp(out, data, v->size)) {
+				printf("%-28s ** failed **\n", v->what);
+				bad++;
+			} else
+				printf("%-28s ok\n", v->what);
+		}
+		free(in);
+		free(data);
+		free(out);
+	}
+	return (bad);
+}
+
+/*
+ *		Decompress random chunks and damaged copies of them
+ *
+ *	Chunks of all the formats and kinds of data, some of them
+ *	shorter as the last chunk of a file, must decompress to the
+ *	original data. Damaged copies (flipped bits, truncation,
+ *	overwritten bytes, random codeword lengths or block headers)
+ *	may be accepted or rejected, but the buffers given to the
+ *	decoders have no spare room, so that a memory checker catches
+ *	overflows.
+ *
+ *	Returns 0 if the test passed
+ */
+
+static int test_wof_fuzz(int count, u32 seed)
+{
+	static const int formats[] = {
+		WOF_XPRESS4K, WOF_XPRESS8K, WOF_XPRESS16K, WOF_LZX
+	} ;
+	u8 *data;
+	u8 *cbuf;
+	u8 *in;
+	u8 *out;
+	u32 room;
+	u32 size;
+	u32 csize;
+	u32 insz;
+	u32 pos;
+	int format;
+	int kind;
+	int mutation;
+	int n;
+	int i;
+	int errors;
+	int stored;
+	int accepted;
+	int rejected;
+
+	room = 2*LZX_DEFAULT_BLOCK_SIZE + 4096;
+	data = (u8*)ntfs_malloc(LZX_DEFAULT_BLOCK_SIZE);
+	cbuf = (u8*)ntfs_malloc(room);
+	if (!data || !cbuf) {
+		free(data);
+		free(cbuf);
+		return (1);
+	}
+	errors = test_wof_known();
+	stored = 0;
+	accepted = 0;
+	rejected = 0;
+	for (i=0; i<count; i++) {
+		format = formats[i & 3];
+		size = 1 << test_wof_chunk_bits(format);
+		if (!(test_wof_random(&seed) % 4))
+			size = test_wof_random(&seed) % size + 1;
+		kind = test_wof_random(&seed) % TEST_WOF_KINDS;
+		test_wof_fill(data, size, kind, &seed);
+		csize = test_wof_compress(format, data, size, cbuf, room,
+					&seed);
+		in = (u8*)ntfs_malloc(csize ? csize : 1);
+		out = (u8*)ntfs_malloc(size);
+		if (!csize || !in || !out) {
+			printf("Could not compress chunk %d\n", i);
+			free(in);
+			free(out);
+			errors++;
+			continue;
+		}
+		if (csize >= size)
+			stored++;
+		memcpy(in, cbuf, csize);
+		if (test_wof_decompress(format, in, csize, out, size)
+		    || memcmp(out, data, size)) {
+			if (errors < 10)
+				printf("%s chunk %d of %s (%lu bytes)"
+					" not decompressed correctly\n",
+					test_wof_formats[format], i,
+					(kind == TEST_WOF_TEXT ? "text"
+					: kind == TEST_WOF_MIX ? "mixed data"
+					: kind == TEST_WOF_RUNS ? "runs"
+					: kind == TEST_WOF_X86 ? "x86 code"
+					: "random bytes"),
+					(unsigned long)size);
+			errors++;
+		}
+		free(in);
+		for (mutation=0; mutation<4; mutation++) {
+			insz = (mutation == 1
+				? test_wof_random(&seed) % csize : csize);
+			in = (u8*)ntfs_malloc(insz ? insz : 1);
+			if (!in) {
+				errors++;
+				break;
+			}
+			memcpy(in, cbuf, insz);
+			switch (mutation) {
+			case 0 :
+				n = test_wof_random(&seed) % 8 + 1;
+				while (n--) {
+					pos = test_wof_random(&seed) % insz;
+					in[pos] ^= 1 << (test_wof_random(&seed)
+								& 7);
+				}
+				break;
+			case 1 :
+				break;
+			case 2 :
+				pos = test_wof_random(&seed) % insz;
+				n = test_wof_random(&seed) % 64 + 1;
+				while (n-- && (pos < insz))
+					in[pos++] = test_wof_random(&seed);
+				break;
+			default :
+					/* codeword lengths or block header */
+				n = test_wof_random(&seed) % 16 + 1;
+				while (n--) {
+					pos = test_wof_random(&seed)
+						% (format == WOF_LZX ? 4
+							: XPRESS_SYMBOLS / 2);
+					if (pos < insz)
+						in[pos] = test_wof_random(&seed);
+				}
+				break;
+			}
+			if (test_wof_decompress(format, in, insz, out, size))
+				rejected++;
+			else
+				accepted++;
+			free(in);
+		}
+		free(out);
+	}
+	printf("%d chunks decompressed, %d of them not compressible\n",
+			count, stored);
+	printf("%d damaged chunks accepted, %d rejected\n",
+			accepted, rejected);
+	printf("%s\n", (errors ? "** failed **" : "passed"));
+	free(data);
+	free(cbuf);
+	return (errors != 0);
+}
+
+/*
+ *		Build the compressed stream of a file
+ *
+ *	Returns the stream, or NULL if there was an error
+ */
+
+static u8 *test_wof_stream(int format, const u8 *data, u32 size,
+			u32 *psize, u32 *seed)
+{
+	u8 *stream;
+	u8 *cbuf;
+	u32 chunk;
+	u32 nchunks;
+	u32 tsize;
+	u32 room;
+	u32 pos;
+	u32 csize;
+	u32 outsz;
+	u32 k;
+
+	chunk = 1 << test_wof_chunk_bits(format);
+	nchunks = (size + chunk - 1)/chunk;
+	tsize = (nchunks ? nchunks - 1 : 0)*4;
+	room = 2*chunk + 4096;
+	stream = (u8*)ntfs_malloc(tsize + size + 1);
+	cbuf = (u8*)ntfs_malloc(room);
+	if (!stream || !cbuf) {
+		free(stream);
+		free(cbuf);
+		return ((u8*)NULL);
+	}
+	pos = tsize;
+	for (k=0; k<nchunks; k++) {
+		outsz = min(chunk, size - k*chunk);
+		csize = test_wof_compress(format, &data[k*chunk], outsz,
+					cbuf, room, seed);
+		if (!csize || (csize >= outsz)) {
+			memcpy(&stream[pos], &data[k*chunk], outsz);
+			csize = outsz;
+		} else
+			memcpy(&stream[pos], cbuf, csize);
+		pos += csize;
+		if ((k + 1) < nchunks)
+			*(le32*)&stream[4*k] = cpu_to_le32(pos - tsize);
+	}
+	free(cbuf);
+	*psize = pos;
+	return (stream);
+}
+
+/*
+ *		Create a file compressed by WOF
+ *
+ *	The unnamed data stream is left sparse, with the size of the
+ *	uncompressed data.
+ *
+ *	Returns 0 if successful, the inode being returned anyway
+ */
+
+static int test_wof_create(ntfs_inode *dir_ni, ntfschar *uname, int len,
+			int algorithm, const u8 *stream, u32 ssize, s64 size,
+			ntfs_inode **pni)
+{
+	char value[sizeof(REPARSE_POINT) + sizeof(struct WOF_REPARSE_DATA)];
+	REPARSE_POINT *reparse;
+	struct WOF_REPARSE_DATA *data;
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	BOOL ok;
+
+	ok = FALSE;
+	ni = ntfs_create(dir_ni, const_cpu_to_le32(0), uname, len, S_IFREG);
+	na = (ntfs_attr*)NULL;
+	if (ni && !ntfs_attr_add(ni, AT_DATA, WOF_STREAM,
+			sizeof(WOF_STREAM)/sizeof(ntfschar), (u8*)NULL, 0))
+		na = ntfs_attr_open(ni, AT_DATA, WOF_STREAM,
+				sizeof(WOF_STREAM)/sizeof(ntfschar));
+	if (na) {
+		ok = (ntfs_attr_pwrite(na, 0, ssize, stream) == ssize);
+		ntfs_attr_close(na);
+		na = (ntfs_attr*)NULL;
+	}
+	if (ok) {
+		na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+		ok = na && !ntfs_attr_truncate(na, size);
+		if (na)
+			ntfs_attr_close(na);
+	}
+	if (ok) {
+		reparse = (REPARSE_POINT*)value;
+		reparse->reparse_tag = IO_REPARSE_TAG_WOF;
+		reparse->reparse_data_length = cpu_to_le16(
+					sizeof(struct WOF_REPARSE_DATA));
+		reparse->reserved = const_cpu_to_le16(0);
+		data = (struct WOF_REPARSE_DATA*)reparse->reparse_data;
+		data->version = const_cpu_to_le32(WOF_CURRENT_VERSION);
+		data->provider = const_cpu_to_le32(WOF_PROVIDER_FILE);
+		data->file_version = const_cpu_to_le32(
+					FILE_PROVIDER_CURRENT_VERSION);
+		data->algorithm = cpu_to_le32(algorithm);
+		ok = !ntfs_set_ntfs_reparse_data(ni, value, sizeof(value), 0);
+	}
+	*pni = ni;
+	return (ok ? 0 : -1);
+}
+
+/*
+ *		Check a read from a WOF file
+ *
+ *	@expect is the count of bytes expected, or -1 for an error
+ */
+
+static int test_wof_check(ntfs_attr *na, const u8 *data, s64 pos,
+			s64 count, s64 expect)
+{
+	u8 *buf;
+	s64 got;
+	int bad;
+
+	buf = (u8*)ntfs_malloc(count ? count : 1);
+	if (!buf)
+		return (1);
+	got = ntfs_attr_pread(na, pos, count, buf);
+	bad = (got != expect)
+		|| ((got > 0) && memcmp(buf, &data[pos], got));
+	if (bad)
+		printf("    %lld bytes read at %lld : got %lld, expected %lld\n",
+			(long long)count, (long long)pos, (long long)got,
+			(long long)expect);
+	free(buf);
+	return (bad);
+}
+
+/*
+ *	Read through the chunk table on disk, as for files too big for
+ *	their chunk table to be loaded
+ */
+
+static int test_wof_untabled(ntfs_attr *na, const u8 *data, s64 size,
+			u32 *seed)
+{
+	struct WOF_STREAM ws;
+	u8 *buf;
+	s64 pos;
+	s64 count;
+	int bad;
+	int i;
+
+	if (!size)
+		return (0);
+	bad = 1;
+	buf = (u8*)ntfs_malloc(size);
+	if (buf && !wof_open(na, &ws)) {
+		if (ws.owned)
+			free(ws.table);
+		ws.table = (u8*)NULL;
+		ws.owned = FALSE;
+		bad = 0;
+		for (i=0; i<8; i++) {
+			pos = (i ? test_wof_random(seed) % size : 0);
+			count = (i ? test_wof_random(seed) % (size - pos) + 1
+					: size);
+			if ((wof_read_batch(&ws, pos, count, buf) != count)
+			    || memcmp(buf, &data[pos], count))
+				bad++;
+		}
+		wof_close(&ws);
+	}
+	if (bad)
+		printf("    reads through the chunk table on disk failed\n");
+	free(buf);
+	return (bad);
+}
+
+enum { TEST_WOF_EMPTY, TEST_WOF_SMALL, TEST_WOF_ONE, TEST_WOF_EXACT,
+	TEST_WOF_PARTIAL, TEST_WOF_DECREASING, TEST_WOF_BEYOND,
+	TEST_WOF_OVERSIZE, TEST_WOF_BADCHUNK, TEST_WOF_SHORT,
+	TEST_WOF_ALGORITHM, TEST_WOF_CASES } ;
+
+/*
+ *		Check the reads from the file of a test case
+ *
+ *	Returns the count of bad reads
+ */
+
+static int test_wof_reads(ntfs_attr *na, const u8 *data, u32 size,
+			u32 chunk, int c, u32 *seed)
+{
+	struct CACHE_HEADER *cache;
+	u32 pos;
+	u32 count;
+	int bad;
+	int i;
+
+	bad = 0;
+	switch (c) {
+	case TEST_WOF_DECREASING :
+	case TEST_WOF_BEYOND :
+		bad += test_wof_check(na, data, 0, 2*chunk, 2*chunk);
+		bad += test_wof_check(na, data, 0, size, -1);
+		break;
+	case TEST_WOF_OVERSIZE :
+		bad += test_wof_check(na, data, 0, size, -1);
+		bad += test_wof_check(na, data, chunk, chunk, -1);
+		bad += test_wof_check(na, data, 2*chunk, size - 2*chunk,
+				size - 2*chunk);
+		break;
+	case TEST_WOF_BADCHUNK :
+		bad += test_wof_check(na, data, 0, size, 2*chunk);
+		bad += test_wof_check(na, data, 2*chunk + 10, 100, -1);
+		bad += test_wof_check(na, data, 3*chunk, size - 3*chunk,
+				size - 3*chunk);
+		break;
+	case TEST_WOF_SHORT :
+	case TEST_WOF_ALGORITHM :
+		bad += test_wof_check(na, data, 0, size, -1);
+		break;
+	default :
+		bad += test_wof_check(na, data, 0, size + 10, size);
+		bad += test_wof_check(na, data, size, 10, 0);
+		for (i=0; i<20; i++) {
+			pos = test_wof_random(seed) % (size + 1);
+			count = test_wof_random(seed) % (2*chunk) + 1;
+			bad += test_wof_check(na, data, pos, count,
+					min(count, size - pos));
+		}
+		cache = na->ni->vol->cblock_cache;
+		na->ni->vol->cblock_cache = (struct CACHE_HEADER*)NULL;
+		bad += test_wof_untabled(na, data, size, seed);
+		na->ni->vol->cblock_cache = cache;
+		break;
+	}
+	return (bad);
+}
+
+/*
+ *		Check the chunk tables of files created on a volume
+ *
+ *	For each format, files of various sizes are created in the root
+ *	directory, read in full, by random ranges and through the chunk
+ *	table on disk, then deleted. Files of five chunks and a half,
+ *	the first two not compressible, are then damaged in various ways,
+ *	and the reads must fail where the damage is, returning the data
+ *	before a bad chunk.
+ *
+ *	Returns 0 if the test passed
+ */
+
+static int test_wof_read(const char *name)
+{
+	static const char *cases[] = {
+		"empty file", "1000 bytes", "one chunk", "three chunks",
+		"five chunks and a half", "decreasing offsets",
+		"offset beyond the end", "chunk bigger than a chunk",
+		"bad chunk", "table beyond the end", "unsupported algorithm"
+	} ;
+	static const char fname[] = "ntfs-test-wof";
+	ntfs_volume *vol;
+	ntfs_inode *root_ni;
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	ntfschar *uname;
+	u8 *data;
+	u8 *stream;
+	u32 ssize;
+	u32 tsize;
+	u32 chunk;
+	u32 size;
+	u32 seed;
+	u32 pos;
+	u32 k;
+	int format;
+	int algorithm;
+	int bad;
+	int failed;
+	int c;
+	int len;
+
+	vol = ntfs_mount(name, 0);
+	data = (u8*)ntfs_malloc(6*LZX_DEFAULT_BLOCK_SIZE);
+	if (!vol || !data) {
+		printf("Could not mount %s\n", name);
+		free(data);
+		return (1);
+	}
+	uname = (ntfschar*)NULL;
+	len = ntfs_mbstoucs(fname, &uname);
+	seed = 1;
+	failed = (len <= 0);
+	for (format=0; (format<=WOF_XPRESS16K) && !failed; format++) {
+		chunk = 1 << test_wof_chunk_bits(format);
+		for (c=0; (c<TEST_WOF_CASES) && !failed; c++) {
+			switch (c) {
+			case TEST_WOF_EMPTY :
+				size = 0;
+				break;
+			case TEST_WOF_SMALL :
+				size = 1000;
+				break;
+			case TEST_WOF_ONE :
+				size = chunk;
+				break;
+			case TEST_WOF_EXACT :
+				size = 3*chunk;
+				break;
+			default :
+				size = 5*chunk + chunk/2;
+				break;
+			}
+			for (k=0; k<size; k+=chunk)
+				test_wof_fill(&data[k], min(chunk, size - k),
+					(c < TEST_WOF_PARTIAL ? TEST_WOF_TEXT
+					: k < 2*chunk ? TEST_WOF_RANDOM
+					: k & chunk ? TEST_WOF_X86
+					: TEST_WOF_TEXT), &seed);
+			stream = test_wof_stream(format, data, size, &ssize,
+						&seed);
+			if (!stream) {
+				failed++;
+				break;
+			}
+			tsize = (size ? (size - 1)/chunk : 0)*4;
+			algorithm = format;
+			switch (c) {
+			case TEST_WOF_DECREASING :
+				memcpy(&k, &stream[8], 4);
+				memcpy(&stream[8], &stream[12], 4);
+				memcpy(&stream[12], &k, 4);
+				break;
+			case TEST_WOF_BEYOND :
+				*(le32*)&stream[16] = cpu_to_le32(ssize
+							- tsize + 1);
+				break;
+			case TEST_WOF_OVERSIZE :
+				*(le32*)&stream[0] = const_cpu_to_le32(0);
+				break;
+			case TEST_WOF_BADCHUNK :
+				pos = tsize + le32_to_cpup((le32*)&stream[4]);
+				if (format == WOF_LZX)
+					stream[pos + 1] &= 0x1f;
+				else
+					memset(&stream[pos], 0,
+						XPRESS_SYMBOLS / 2);
+				break;
+			case TEST_WOF_SHORT :
+				ssize = tsize - 1;
+				break;
+			case TEST_WOF_ALGORITHM :
+				algorithm = WOF_XPRESS16K + 1;
+				break;
+			default :
+				break;
+			}
+			bad = 0;
+			ni = (ntfs_inode*)NULL;
+			na = (ntfs_attr*)NULL;
+			root_ni = ntfs_inode_open(vol, FILE_root);
+			if (!root_ni
+			    || test_wof_create(root_ni, uname, len,
+					algorithm, stream, ssize, size, &ni)
+			    || !(na = ntfs_attr_open(ni, AT_DATA,
+					AT_UNNAMED, 0))) {
+				printf("Could not create the WOF file /%s\n",
+					fname);
+				bad++;
+			} else
+				bad += test_wof_reads(na, data, size, chunk, c,
+						&seed);
+			printf("%-9s %-28s %s\n", test_wof_formats[format],
+				cases[c], (bad ? "** failed **" : "ok"));
+			failed += bad;
+			if (na)
+				ntfs_attr_close(na);
+			if (ni) {
+				/* ntfs_delete() always closes ni and root_ni */
+				if (ntfs_delete(vol, (char*)NULL, ni, root_ni,
+						uname, len))
+					failed++;
+			} else
+				if (root_ni && ntfs_inode_close(root_ni))
+					failed++;
+			free(stream);
+		}
+	}
+	free(uname);
+	free(data);
+	if (ntfs_umount(vol, FALSE))
+		failed++;
+	printf("%s\n", (failed ? "** failed **" : "passed"));
+	return (failed != 0);
+}
+
+/**
+ * test_wof_main - WOF test: Program start (main)
+ * @argc:
+ * @argv:
+ *
+ * "fuzz [count [seed]]" decompresses streams assembled by hand, then
+ * random chunks of all the formats and damaged copies of them,
+ * "read image" checks the chunk tables of files created on a volume.
+ *
+ * Returns 0 if the test passed
+ */
+int test_wof_main(int argc, char *argv[])
+{
+	int res;
+
+	res = 1;
+	if ((argc >= 2) && (argc <= 4) && !strcmp(argv[1], "fuzz"))
+		res = test_wof_fuzz(argc > 2 ? atoi(argv[2]) : 4000,
+				argc > 3 ? strtoul(argv[3], (char**)NULL, 0)
+					: 1);
+	else if ((argc == 3) && !strcmp(argv[1], "read"))
+		res = test_wof_read(argv[2]);
+	else
+		printf("wof [fuzz|read] {args}\n");
+	return (res);
+}
+
+#endif
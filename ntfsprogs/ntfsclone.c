@@ -1785,6 +1785,7 @@ static void walk_runs(struct ntfs_walk_cluster *walk)
 					AT_DATA, NULL, 0);
 			if (na) {
 				na->rl = rl;
+				ntfs_attr_rl_changed(na);
 				rl = (runlist_element*)NULL;
 				if (!ntfs_attr_map_whole_runlist(na)) {
 					copy_wipe_mft(walk->image,na->rl);
@@ -1801,6 +1802,7 @@ static void walk_runs(struct ntfs_walk_cluster *walk)
 					AT_INDEX_ALLOCATION, NTFS_INDEX_I30, 4);
 			if (na) {
 				na->rl = rl;
+				ntfs_attr_rl_changed(na);
 				rl = (runlist_element*)NULL;
 				if (!ntfs_attr_map_whole_runlist(na)) {
 					copy_wipe_i30(walk->image,na->rl);
@@ -660,6 +660,7 @@ static int assign_runlist(struct ALLOC_CONTEXT *alctx)
 	if (na->rl)
 		free(na->rl);
 	na->rl = alctx->rl;
+	ntfs_attr_rl_changed(na);
 			/* Allocate the clusters */
 	for (k=0; ((k + 1) < alctx->rl_count) && !err; k++) {
 		if (ntfs_bitmap_set_run(alctx->vol->lcnbmp_na,
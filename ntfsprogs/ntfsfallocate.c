@@ -478,6 +478,7 @@ static void ntfs_restore_rl(ntfs_attr *na, runlist_element *oldrl)
 	}
 	free(na->rl);
 	na->rl = oldrl;
+	ntfs_attr_rl_changed(na);
 	if (ntfs_attr_update_mapping_pairs(na, 0)) {
 		ntfs_log_error("Failed to restore the original runlist\n");
 	}
@@ -575,6 +576,7 @@ static int ntfs_merge_allocation(ntfs_attr *na, runlist_element *rl,
 			err = -1;
 		} else {
 			na->rl = rl;
+			ntfs_attr_rl_changed(na);
 				/* Update the runlist */
 			if (ntfs_attr_update_mapping_pairs(na, 0)) {
 				ntfs_log_error(
@@ -1284,6 +1284,7 @@ static int replace_runlist(ntfs_attr *na, const runlist_element *reprl,
 		/* deallocate the old runlist and replace */
 		free(na->rl);
 		na->rl = newrl;
+		ntfs_attr_rl_changed(na);
 		r = 0;
 	}
 	return (r);
@@ -2560,6 +2561,7 @@ static void truncate_bitmap_data_attr(ntfs_resize_t *resize)
 			/* switch to the new bitmap runlist */
 		free(lcnbmp_na->rl);
 		lcnbmp_na->rl = rl;
+		ntfs_attr_rl_changed(lcnbmp_na);
 	}
 }
 
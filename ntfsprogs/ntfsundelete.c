@@ -1330,6 +1330,7 @@ static int get_data(struct ufile *file, ntfs_volume *vol)
  * read_record - Read an MFT record into memory
  * @vol:     An ntfs volume obtained from ntfs_mount
  * @record:  The record number to read
+ * @mrec:    The record already read, or NULL to read it from the volume
  *
  * Read the specified MFT record and gather as much information about it as
  * possible.
@@ -1337,7 +1338,8 @@ static int get_data(struct ufile *file, ntfs_volume *vol)
  * Return:  Pointer  A ufile object containing the results
  *	    NULL     Error
  */
-static struct ufile * read_record(ntfs_volume *vol, long long record)
+static struct ufile * read_record(ntfs_volume *vol, long long record,
+				const MFT_RECORD *mrec)
 {
 	ATTR_RECORD *attr10, *attr20, *attr90;
 	struct ufile *file;
@@ -1364,23 +1366,27 @@ static struct ufile * read_record(ntfs_volume *vol, long long record)
 		return NULL;
 	}
 
-	mft = ntfs_attr_open(vol->mft_ni, AT_DATA, AT_UNNAMED, 0);
-	if (!mft) {
-		ntfs_log_perror("ERROR: Couldn't open $MFT/$DATA");
-		free_file(file);
-		return NULL;
-	}
+	if (mrec) {
+		memcpy(file->mft, mrec, vol->mft_record_size);
+	} else {
+		mft = ntfs_attr_open(vol->mft_ni, AT_DATA, AT_UNNAMED, 0);
+		if (!mft) {
+			ntfs_log_perror("ERROR: Couldn't open $MFT/$DATA");
+			free_file(file);
+			return NULL;
+		}
+
+		if (ntfs_attr_mst_pread(mft, vol->mft_record_size * record, 1, vol->mft_record_size, file->mft) < 1) {
+			ntfs_log_error("ERROR: Couldn't read MFT Record %lld.\n", record);
+			ntfs_attr_close(mft);
+			free_file(file);
+			return NULL;
+		}
 
-	if (ntfs_attr_mst_pread(mft, vol->mft_record_size * record, 1, vol->mft_record_size, file->mft) < 1) {
-		ntfs_log_error("ERROR: Couldn't read MFT Record %lld.\n", record);
 		ntfs_attr_close(mft);
-		free_file(file);
-		return NULL;
+		mft = NULL;
 	}
 
-	ntfs_attr_close(mft);
-	mft = NULL;
-
 	/* disable errors logging, while examining suspicious records */
 	log_levels = ntfs_log_clear_levels(NTFS_LOG_LEVEL_PERROR);
 	attr10 = find_first_attribute(AT_STANDARD_INFORMATION,	file->mft);
@@ -1983,7 +1989,7 @@ static int undelete_file(ntfs_volume *vol, long long inode)
 		return 0;
 
 	/* try to get record */
-	file = read_record(vol, inode);
+	file = read_record(vol, inode, NULL);
 	if (!file || !file->mft) {
 		ntfs_log_error("Can't read info from mft record %lld.\n", inode);
 		return 0;
@@ -2202,6 +2208,81 @@ free:
 	return result;
 }
 
+/*
+ * Context of scan_disk() passed to scan_record()
+ */
+struct scan_context {
+	ntfs_volume *vol;
+	regex_t *re;
+	const u8 *bitmap;	/* $MFT/$BITMAP */
+	long long bmpsize;
+	int results;
+} ;
+
+/**
+ * scan_record - Examine an MFT record for scan_disk()
+ * @data:    The scan context
+ * @mft_no:  The MFT record number
+ * @mrec:    The MFT record
+ *
+ * Only the records which are marked free in the MFT bitmap are examined.
+ * Records which may be recovered are listed or undeleted, according to the
+ * command line options.
+ *
+ * Return:  0  Always, so that the scan goes on
+ */
+static int scan_record(void *data, s64 mft_no, MFT_RECORD *mrec)
+{
+	struct scan_context *ctx = (struct scan_context*)data;
+	struct ufile *file;
+	int percent;
+
+	if (((mft_no >> 3) >= ctx->bmpsize)
+	    || (ctx->bitmap[mft_no >> 3] & (1 << (mft_no & 7))))
+		return 0;
+
+	file = read_record(ctx->vol, mft_no, mrec);
+	if (!file) {
+		ntfs_log_error("Couldn't read MFT Record %lld.\n",
+				(long long)mft_no);
+		return 0;
+	}
+
+	if ((opts.since > 0) && (file->date <= opts.since))
+		goto skip;
+	if (opts.match && !name_match(ctx->re, file))
+		goto skip;
+	if (opts.size_begin && (opts.size_begin > file->max_size))
+		goto skip;
+	if (opts.size_end && (opts.size_end < file->max_size))
+		goto skip;
+
+	percent = calc_percentage(file, ctx->vol);
+	if ((opts.percent == -1) || (percent >= opts.percent)) {
+		if (opts.verbose)
+			dump_record(file);
+		else
+			list_record(file);
+
+		/* Was -u specified with no inode
+		   so undelete file by regex */
+		if (opts.mode == MODE_UNDELETE) {
+			if  (!undelete_file(ctx->vol, file->inode))
+				ntfs_log_verbose("ERROR: Failed to undelete "
+					  "inode %lli\n!",
+					  file->inode);
+			ntfs_log_info("\n");
+		}
+	}
+	if (((opts.percent == -1) && (percent > 0)) ||
+	    ((opts.percent > 0)  && (percent >= opts.percent))) {
+		ctx->results++;
+	}
+skip:
+	free_file(file);
+	return 0;
+}
+
 /**
  * scan_disk - Search an NTFS volume for files that could be undeleted
  * @vol:  An ntfs volume obtained from ntfs_mount
@@ -2209,6 +2290,9 @@ free:
  * Read through all the MFT entries looking for deleted files.  For each one
  * determine how much of the data lies in unused disk space.
  *
+ * The MFT is read in large chunks by ntfs_mft_scan(), and the records are
+ * examined in order in this thread, as recovering files is not thread-safe.
+ *
  * The list can be filtered by name, size and date, using command line options.
  *
  * Return:  -1  Error, something went wrong
@@ -2216,17 +2300,11 @@ free:
  */
 static int scan_disk(ntfs_volume *vol)
 {
-	s64 nr_mft_records;
-	const int BUFSIZE = 8192;
-	char *buffer = NULL;
+	struct scan_context ctx;
+	u8 *bitmap = NULL;
 	int results = 0;
 	ntfs_attr *attr;
-	long long size;
 	long long bmpsize;
-	long long i;
-	int j, k, b;
-	int percent;
-	struct ufile *file;
 	regex_t re;
 
 	if (!vol)
@@ -2240,12 +2318,18 @@ static int scan_disk(ntfs_volume *vol)
 	NVolSetNoFixupWarn(vol);
 	bmpsize = attr->initialized_size;
 
-	buffer = malloc(BUFSIZE);
-	if (!buffer) {
+	bitmap = malloc(bmpsize ? bmpsize : 1);
+	if (!bitmap) {
 		ntfs_log_error("ERROR: Couldn't allocate memory in scan_disk()\n");
 		results = -1;
 		goto out;
 	}
+	bmpsize = ntfs_attr_pread(attr, 0, bmpsize, bitmap);
+	if (bmpsize < 0) {
+		ntfs_log_perror("ERROR: Couldn't read $MFT/$BITMAP");
+		results = -1;
+		goto out;
+	}
 
 	if (opts.match) {
 		int flags = REG_NOSUB;
@@ -2262,73 +2346,23 @@ static int scan_disk(ntfs_volume *vol)
 #endif
 	}
 
-	nr_mft_records = vol->mft_na->initialized_size >>
-			vol->mft_record_size_bits;
+	ctx.vol = vol;
+	ctx.re = &re;
+	ctx.bitmap = bitmap;
+	ctx.bmpsize = bmpsize;
+	ctx.results = 0;
 
 	ntfs_log_quiet("Inode    Flags  %%age     Date    Time       Size  Filename\n");
 	ntfs_log_quiet("-----------------------------------------------------------------------\n");
-	for (i = 0; i < bmpsize; i += BUFSIZE) {
-		long long read_count = min((bmpsize - i), BUFSIZE);
-		size = ntfs_attr_pread(attr, i, read_count, buffer);
-		if (size < 0)
-			break;
-
-		for (j = 0; j < size; j++) {
-			b = buffer[j];
-			for (k = 0; k < 8; k++, b>>=1) {
-				if (((i+j)*8+k) >= nr_mft_records)
-					goto done;
-				if (b & 1)
-					continue;
-				file = read_record(vol, (i+j)*8+k);
-				if (!file) {
-					ntfs_log_error("Couldn't read MFT Record %lld.\n",
-							(long long)(i+j)*8+k);
-					continue;
-				}
-
-				if ((opts.since > 0) && (file->date <= opts.since))
-					goto skip;
-				if (opts.match && !name_match(&re, file))
-					goto skip;
-				if (opts.size_begin && (opts.size_begin > file->max_size))
-					goto skip;
-				if (opts.size_end && (opts.size_end < file->max_size))
-					goto skip;
-
-				percent = calc_percentage(file, vol);
-				if ((opts.percent == -1) || (percent >= opts.percent)) {
-					if (opts.verbose)
-						dump_record(file);
-					else
-						list_record(file);
-
-					/* Was -u specified with no inode
-					   so undelete file by regex */
-					if (opts.mode == MODE_UNDELETE) {
-						if  (!undelete_file(vol, file->inode))
-							ntfs_log_verbose("ERROR: Failed to undelete "
-								  "inode %lli\n!",
-								  file->inode);
-						ntfs_log_info("\n");
-					}
-				}
-				if (((opts.percent == -1) && (percent > 0)) ||
-				    ((opts.percent > 0)  && (percent >= opts.percent))) {
-					results++;
-				}
-skip:
-				free_file(file);
-			}
-		}
-	}
-done:
+	if (ntfs_mft_scan(vol, MFT_SCAN_ALL, 1, scan_record, &ctx))
+		ntfs_log_perror("ERROR: Couldn't scan the MFT");
+	results = ctx.results;
 	ntfs_log_quiet("\nFiles with potentially recoverable content: %d\n",
 		results);
 out:
 	if (opts.match)
 		regfree(&re);
-	free(buffer);
+	free(bitmap);
 	NVolClearNoFixupWarn(vol);
 	if (attr)
 		ntfs_attr_close(attr);
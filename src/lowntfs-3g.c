@@ -95,6 +95,9 @@
 #include "attrib.h"
 #include "inode.h"
 #include "volume.h"
+#include "mft.h"
+#include "compress.h"
+#include "cache.h"
 #include "dir.h"
 #include "unistr.h"
 #include "layout.h"
@@ -113,6 +116,11 @@
 
 #include "ntfs-3g_common.h"
 
+#ifdef FUSE_INTERNAL
+#include <pthread.h>
+#include "fuse_kernel.h"
+#endif /* FUSE_INTERNAL */
+
 /*
  *	The following permission checking modes are governed by
  *	the LPERMSCONFIG value in param.h
@@ -133,9 +141,11 @@
 #define ATTR_TIMEOUT (ctx->ro ? TIMEOUT_RO : 0.0)
 #define ENTRY_TIMEOUT (ctx->ro ? TIMEOUT_RO : 0.0)
 #else
+	/* timeout of entries and attributes kept by the kernel */
+#define CACHE_TIMEOUT (ctx->cache_timeout ? (double)ctx->cache_timeout : 10.0)
 #if defined(__sun) && defined (__SVR4)
-#define ATTR_TIMEOUT (ctx->ro ? TIMEOUT_RO : 10.0)
-#define ENTRY_TIMEOUT (ctx->ro ? TIMEOUT_RO : 10.0)
+#define ATTR_TIMEOUT (ctx->ro ? TIMEOUT_RO : CACHE_TIMEOUT)
+#define ENTRY_TIMEOUT (ctx->ro ? TIMEOUT_RO : CACHE_TIMEOUT)
 #else /* defined(__sun) && defined (__SVR4) */
 	/*
 	 * FUSE cacheing is only usable with basic permissions
@@ -145,17 +155,28 @@
 #warning "Fuse cacheing is only usable with basic permissions checked by kernel"
 #endif
 #if KERNELACLS
-#define ATTR_TIMEOUT (ctx->ro ? TIMEOUT_RO : 10.0)
-#define ENTRY_TIMEOUT (ctx->ro ? TIMEOUT_RO : 10.0)
+#define ATTR_TIMEOUT (ctx->ro ? TIMEOUT_RO : CACHE_TIMEOUT)
+#define ENTRY_TIMEOUT (ctx->ro ? TIMEOUT_RO : CACHE_TIMEOUT)
 #else /* KERNELACLS */
 #define ATTR_TIMEOUT (ctx->ro ? TIMEOUT_RO : \
-	(ctx->vol->secure_flags & (1 << SECURITY_DEFAULT) ? 10.0 : 0.0))
+	(ctx->vol->secure_flags & (1 << SECURITY_DEFAULT) ? CACHE_TIMEOUT : 0.0))
 #define ENTRY_TIMEOUT (ctx->ro ? TIMEOUT_RO : \
-	(ctx->vol->secure_flags & (1 << SECURITY_DEFAULT) ? 10.0 : 0.0))
+	(ctx->vol->secure_flags & (1 << SECURITY_DEFAULT) ? CACHE_TIMEOUT : 0.0))
 #endif /* KERNELACLS */
 #endif /* defined(__sun) && defined (__SVR4) */
 #endif /* !CACHEING */
+	/* the kernel can be notified of changes with fuse >= 2.8 */
+#if CACHEING && (defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28))
+#define NOTIFYING 1
+#else
+#define NOTIFYING 0
+#endif
+#if NOTIFYING && !defined(FUSE_INTERNAL)
+#include <pthread.h>
+#endif
 #define GHOSTLTH 40 /* max length of a ghost file name - see ghostformat */
+#define PREFETCH_AHEAD 64 /* mft records prefetched ahead of lookups */
+#define SPLICE_EXTENTS 16 /* max device extents of a spliced read */
 
 		/* sometimes the kernel cannot check access */
 #define ntfs_real_allowed_access(scx, ni, type) ntfs_allowed_access(scx, ni, type)
@@ -208,9 +229,31 @@ typedef struct fill_context {
 	off_t off;
 	fuse_req_t req;
 	fuse_ino_t ino;
+	struct SECURITY_CONTEXT *security;
 	BOOL filled;
+	BOOL plus;
 } ntfs_fuse_fill_context_t;
 
+		/* entries of the latest directory listed */
+struct prefetch_entry {
+	MFT_REF mref;
+	int pos;		/* position in the listing */
+} ;
+
+struct prefetch_list {
+	fuse_ino_t ino;		/* directory listed, 0 if none */
+	MFT_REF *mrefs;		/* entries in listing order */
+	struct prefetch_entry *sorted; /* entries by mft record, NULL if
+					  the listing is being built */
+	int count;
+	int allocated;
+	int start;		/* entries prefetched, in listing order */
+	int end;
+	int istart;		/* entries prefetched, in mft record order */
+	int iend;
+	int last;		/* latest entry looked up, in mft record order */
+} ;
+
 struct open_file {
 	struct open_file *next;
 	struct open_file *previous;
@@ -243,6 +286,7 @@ const char *EXEC_NAME = "lowntfs-3g";
 
 static ntfs_fuse_context_t *ctx;
 static u32 ntfs_sequence;
+static struct prefetch_list prefetch;
 static const char ghostformat[] = ".ghost-ntfs-3g-%020llu";
 
 static const char *usage_msg = 
@@ -323,14 +367,227 @@ static void ntfs_fuse_update_times(ntfs_inode *ni, ntfs_time_update_flags mask)
 	ntfs_inode_update_times(ni, mask);
 }
 
-static s64 ntfs_get_nr_free_mft_records(ntfs_volume *vol)
+#ifdef FUSE_INTERNAL
+
+/*
+ *		Locking for multithreaded mounts
+ *
+ *	With the option threads=n, the requests are processed by n
+ *	threads, and the volume is shared by them (see
+ *	ntfs_volume_set_threaded()), so that libntfs-3g protects its
+ *	caches and its list of open inodes. The requests which do not
+ *	change the volume hold the volume lock shared, so that they may
+ *	run concurrently, and the other ones hold it exclusive, so that
+ *	the mft records and clusters allocators, the indexes and the
+ *	runlists are only changed while no other request is running.
+ *	Writers are preferred when the system allows it, so that a
+ *	stream of reads cannot starve them.
+ *
+ *	The requests holding the volume lock shared lock the inodes
+ *	they use (see ntfs_inode_lock()), so that the requests on
+ *	different inodes run in parallel. When listing a directory with
+ *	the attributes of its entries, the directory is locked first.
+ *	ntfs_fuse_read() releases the inode lock while reading the plain
+ *	data of a file, as the runlist is then private to the request,
+ *	and the device cache, the read-ahead and io_uring have their own
+ *	locks.
+ *
+ *	Updating the access time of an inode may have to update its
+ *	directory entries, so this is not done while the volume lock is
+ *	shared : the inodes are recorded, and their times are updated
+ *	with the volume lock exclusive by the next request, or when the
+ *	current shared requests are over.
+ */
+
+static pthread_rwlock_t ntfs_fuse_volume_lock
+#ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+	= PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+#else
+	= PTHREAD_RWLOCK_INITIALIZER;
+#endif
+static pthread_mutex_t ntfs_fuse_prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+	pthread_mutex_t lock;
+	MFT_REF *mrefs;		/* inodes waiting for their access time */
+	int count;
+	int allocated;
+} atimes = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+} ;
+
+#define prefetch_lock() pthread_mutex_lock(&ntfs_fuse_prefetch_lock)
+#define prefetch_unlock() pthread_mutex_unlock(&ntfs_fuse_prefetch_lock)
+
+/*
+ *		Record an inode whose access time is to be updated
+ *
+ *	The inode must be locked by the caller. An update which would
+ *	not be done according to the atime options is not recorded.
+ */
+
+static void ntfs_fuse_defer_atime(ntfs_inode *ni)
+{
+	MFT_REF mref;
+	MFT_REF *newmrefs;
+	int newcount;
+	int i;
+
+	if ((ctx->atime != ATIME_DISABLED)
+	    && ((ctx->atime != ATIME_RELATIVE)
+		|| (sle64_to_cpu(ni->last_access_time)
+			< sle64_to_cpu(ni->last_data_change_time))
+		|| (sle64_to_cpu(ni->last_access_time)
+			< sle64_to_cpu(ni->last_mft_change_time)))) {
+		mref = MK_MREF(ni->mft_no,
+				le16_to_cpu(ni->mrec->sequence_number));
+		pthread_mutex_lock(&atimes.lock);
+		for (i=0; (i<atimes.count) && (atimes.mrefs[i] != mref); i++)
+			{ }
+		if (i >= atimes.count) {
+			if (atimes.count >= atimes.allocated) {
+				newcount = (atimes.allocated
+						? 2*atimes.allocated : 64);
+				newmrefs = (MFT_REF*)realloc(atimes.mrefs,
+						newcount*sizeof(MFT_REF));
+				if (newmrefs) {
+					atimes.mrefs = newmrefs;
+					atimes.allocated = newcount;
+				}
+			}
+				/* the access time is lost if no memory */
+			if (atimes.count < atimes.allocated)
+				atimes.mrefs[atimes.count++] = mref;
+		}
+		pthread_mutex_unlock(&atimes.lock);
+	}
+}
+
+/*
+ *		Update the access times which were deferred
+ *
+ *	The volume lock must be held exclusive.
+ */
+
+static void ntfs_fuse_flush_atimes(void)
+{
+	ntfs_inode *ni;
+	int i;
+
+	pthread_mutex_lock(&atimes.lock);
+	for (i=0; i<atimes.count; i++) {
+			/* the inode may have been deleted meanwhile */
+		ni = ntfs_inode_open(ctx->vol, atimes.mrefs[i]);
+		if (ni) {
+			ntfs_fuse_update_times(ni, NTFS_UPDATE_ATIME);
+			if (ntfs_inode_close(ni))
+				ntfs_log_perror("Failed to update the access"
+					" time of inode %lld",
+					(long long)MREF(atimes.mrefs[i]));
+		}
+	}
+	atimes.count = 0;
+	pthread_mutex_unlock(&atimes.lock);
+}
+
+static void ntfs_fuse_lock(void *userdata __attribute__((unused)),
+			int opcode, int unlock)
+{
+	BOOL shared;
+	BOOL pending;
+
+	if (ctx->threads > 1) {
+		switch (opcode) {
+		case FUSE_LOOKUP :
+		case FUSE_FORGET :
+		case FUSE_GETATTR :
+		case FUSE_READLINK :
+		case FUSE_READ :
+		case FUSE_STATFS :
+		case FUSE_GETXATTR :
+		case FUSE_LISTXATTR :
+		case FUSE_OPENDIR :
+		case FUSE_READDIR :
+		case FUSE_READDIRPLUS :
+		case FUSE_RELEASEDIR :
+		case FUSE_ACCESS :
+		case FUSE_BMAP :
+			shared = TRUE;
+			break;
+		default :
+			shared = FALSE;
+			break;
+		}
+		if (unlock) {
+			pthread_rwlock_unlock(&ntfs_fuse_volume_lock);
+			if (shared) {
+				pthread_mutex_lock(&atimes.lock);
+				pending = (atimes.count != 0);
+				pthread_mutex_unlock(&atimes.lock);
+				if (pending) {
+					pthread_rwlock_wrlock(
+						&ntfs_fuse_volume_lock);
+					ntfs_fuse_flush_atimes();
+					pthread_rwlock_unlock(
+						&ntfs_fuse_volume_lock);
+				}
+			}
+		} else {
+			if (shared)
+				pthread_rwlock_rdlock(&ntfs_fuse_volume_lock);
+			else {
+				pthread_rwlock_wrlock(&ntfs_fuse_volume_lock);
+				ntfs_fuse_flush_atimes();
+			}
+		}
+	}
+}
+
+#else /* FUSE_INTERNAL */
+
+#define prefetch_lock() do { } while (0)
+#define prefetch_unlock() do { } while (0)
+
+#endif /* FUSE_INTERNAL */
+
+/*
+ *		Update the access time of an inode after reading it
+ */
+
+static void ntfs_fuse_update_atime(ntfs_inode *ni)
 {
-	ntfs_attr *na = vol->mftbmp_na;
-	s64 nr_free = ntfs_attr_get_free_bits(na);
+#ifdef FUSE_INTERNAL
+	if (ctx->threads > 1)
+		ntfs_fuse_defer_atime(ni);
+	else
+#endif /* FUSE_INTERNAL */
+		ntfs_fuse_update_times(ni, NTFS_UPDATE_ATIME);
+}
 
-	if (nr_free >= 0)
-		nr_free += (na->allocated_size - na->data_size) << 3;
-	return nr_free;
+/*
+ *		Open an inode for a request holding the volume lock shared,
+ *	and lock it
+ */
+
+static ntfs_inode *ntfs_fuse_open_locked(MFT_REF mref)
+{
+	ntfs_inode *ni;
+
+	ni = ntfs_inode_open(ctx->vol, mref);
+	if (ni)
+		ntfs_inode_lock(ni);
+	return (ni);
+}
+
+/*
+ *		Unlock and close an inode opened by ntfs_fuse_open_locked()
+ */
+
+static int ntfs_fuse_close_locked(ntfs_inode *ni)
+{
+	if (ni)
+		ntfs_inode_unlock(ni);
+	return (ntfs_inode_close(ni));
 }
 
 /*
@@ -637,6 +894,27 @@ static void ntfs_init(void *userdata __attribute__((unused)),
 			>= SAFE_CAPACITY_FOR_BIG_WRITES))
 		conn->want |= FUSE_CAP_BIG_WRITES;
 #endif
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+		/*
+		 * With a writeback cache, the kernel is in charge of the
+		 * file sizes and mtimes of the files being written to, it
+		 * sets them when flushing, before the files are released.
+		 */
+	if (ctx->writeback_cache
+	    && !ctx->ro
+	    && (conn->capable & FUSE_CAP_WRITEBACK_CACHE))
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+	else
+		ctx->writeback_cache = FALSE;
+#endif
+#ifdef FUSE_CAP_READDIRPLUS
+		/*
+		 * The attributes returned along with the directory entries
+		 * are useless if the kernel cannot keep them.
+		 */
+	if (ctx->readdirplus && (ENTRY_TIMEOUT > 0.0))
+		conn->want |= FUSE_CAP_READDIRPLUS;
+#endif
 #ifdef FUSE_CAP_IOCTL_DIR
 	conn->want |= FUSE_CAP_IOCTL_DIR;
 #endif /* defined(FUSE_CAP_IOCTL_DIR) */
@@ -721,6 +999,92 @@ static int wsl_getstat(ntfs_inode *ni, const REPARSE_POINT *reparse,
 	return (res);
 }
 
+/*
+ *		Define attributes for a WOF compressed file
+ *		(internal plugin)
+ *
+ *	The size is the size of the uncompressed data
+ */
+
+static int wof_getstat(ntfs_inode *ni,
+			const REPARSE_POINT *reparse __attribute__((unused)),
+			struct stat *stbuf)
+{
+	ntfs_attr *na;
+	int res;
+
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (na) {
+		stbuf->st_size = na->data_size;
+		stbuf->st_blocks = (ni->allocated_size + 511) >> 9;
+		stbuf->st_mode = S_IFREG;
+		ntfs_attr_close(na);
+		res = 0;
+	} else
+		res = -errno;
+	return (res);
+}
+
+/*
+ *		Open a WOF compressed file, only for reading
+ */
+
+static int wof_open(ntfs_inode *ni __attribute__((unused)),
+			const REPARSE_POINT *reparse __attribute__((unused)),
+			struct fuse_file_info *fi)
+{
+	int res;
+
+	res = 0;
+	if (fi->flags & (O_WRONLY | O_RDWR))
+		res = -EOPNOTSUPP;
+	return (res);
+}
+
+/*
+ *		Read from a WOF compressed file
+ *
+ *	The data is decompressed by ntfs_attr_pread()
+ */
+
+static int wof_read(ntfs_inode *ni,
+			const REPARSE_POINT *reparse __attribute__((unused)),
+			char *buf, size_t size, off_t offset,
+			struct fuse_file_info *fi __attribute__((unused)))
+{
+	ntfs_attr *na;
+	s64 total;
+	s64 ret;
+	int res;
+
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (!na)
+		return (-errno);
+	if (offset >= na->data_size)
+		size = 0;
+	else
+		if ((s64)(offset + size) > na->data_size)
+			size = na->data_size - offset;
+	total = 0;
+	res = 0;
+	while (size > 0) {
+		ret = ntfs_attr_pread(na, offset, size, buf);
+		if (ret <= 0) {
+			if (!total)
+				res = (ret < 0 ? -errno : -EIO);
+			break;
+		}
+		size -= ret;
+		offset += ret;
+		buf += ret;
+		total += ret;
+	}
+	if (!res)
+		res = total;
+	ntfs_attr_close(na);
+	return (res);
+}
+
 /*
  *		Apply permission masks to st_mode returned by reparse handler
  */
@@ -744,6 +1108,46 @@ static void apply_umask(struct stat *stbuf)
 
 #endif /* DISABLE_PLUGINS */
 
+static void ntfs_fuse_stat_times(struct stat *stbuf, ntfs_time atime,
+			ntfs_time ctime, ntfs_time mtime)
+{
+#ifdef HAVE_STRUCT_STAT_ST_ATIMESPEC
+	stbuf->st_atimespec = ntfs2timespec(atime);
+	stbuf->st_ctimespec = ntfs2timespec(ctime);
+	stbuf->st_mtimespec = ntfs2timespec(mtime);
+#elif defined(HAVE_STRUCT_STAT_ST_ATIM)
+	stbuf->st_atim = ntfs2timespec(atime);
+	stbuf->st_ctim = ntfs2timespec(ctime);
+	stbuf->st_mtim = ntfs2timespec(mtime);
+#elif defined(HAVE_STRUCT_STAT_ST_ATIMENSEC)
+	{
+	struct timespec ts;
+
+	ts = ntfs2timespec(atime);
+	stbuf->st_atime = ts.tv_sec;
+	stbuf->st_atimensec = ts.tv_nsec;
+	ts = ntfs2timespec(ctime);
+	stbuf->st_ctime = ts.tv_sec;
+	stbuf->st_ctimensec = ts.tv_nsec;
+	ts = ntfs2timespec(mtime);
+	stbuf->st_mtime = ts.tv_sec;
+	stbuf->st_mtimensec = ts.tv_nsec;
+	}
+#else
+#warning "No known way to set nanoseconds in struct stat !"
+	{
+	struct timespec ts;
+
+	ts = ntfs2timespec(atime);
+	stbuf->st_atime = ts.tv_sec;
+	ts = ntfs2timespec(ctime);
+	stbuf->st_ctime = ts.tv_sec;
+	ts = ntfs2timespec(mtime);
+	stbuf->st_mtime = ts.tv_sec;
+	}
+#endif
+}
+
 static int ntfs_fuse_getstat(struct SECURITY_CONTEXT *scx,
 				ntfs_inode *ni, struct stat *stbuf)
 {
@@ -901,82 +1305,536 @@ static int ntfs_fuse_getstat(struct SECURITY_CONTEXT *scx,
 					char *target = NULL;
 					int len;
 
-					/* st_size should be set to length of
-					 * symlink target as multibyte string */
-					len = ntfs_ucstombs(
-							intx_file->target,
-							(na->data_size -
-							    offsetof(INTX_FILE,
-								     target)) /
-							       sizeof(ntfschar),
-							     &target, 0);
-					if (len < 0) {
-						res = -errno;
-						free(intx_file);
-						ntfs_attr_close(na);
-						goto exit;
-					}
-					free(target);
-					stbuf->st_mode = S_IFLNK;
-					stbuf->st_size = len;
-				}
-				free(intx_file);
+					/* st_size should be set to length of
+					 * symlink target as multibyte string */
+					len = ntfs_ucstombs(
+							intx_file->target,
+							(na->data_size -
+							    offsetof(INTX_FILE,
+								     target)) /
+							       sizeof(ntfschar),
+							     &target, 0);
+					if (len < 0) {
+						res = -errno;
+						free(intx_file);
+						ntfs_attr_close(na);
+						goto exit;
+					}
+					free(target);
+					stbuf->st_mode = S_IFLNK;
+					stbuf->st_size = len;
+				}
+				free(intx_file);
+			}
+			ntfs_attr_close(na);
+		}
+		stbuf->st_mode |= (0777 & ~ctx->fmask);
+	}
+#ifndef DISABLE_PLUGINS
+ok:
+#endif /* DISABLE_PLUGINS */
+	if (withusermapping) {
+		if (ntfs_get_owner_mode(scx,ni,stbuf) < 0)
+			set_fuse_error(&res);
+	} else {
+		stbuf->st_uid = ctx->uid;
+		stbuf->st_gid = ctx->gid;
+	}
+	if (S_ISLNK(stbuf->st_mode))
+		stbuf->st_mode |= 0777;
+nodata :
+	stbuf->st_ino = ni->mft_no;
+	ntfs_fuse_stat_times(stbuf, ni->last_access_time,
+			ni->last_mft_change_time, ni->last_data_change_time);
+exit:
+	return (res);
+}
+
+static __inline__ BOOL ntfs_fuse_fillstat(struct SECURITY_CONTEXT *scx,
+			struct fuse_entry_param *pentry, u64 iref)
+{
+	ntfs_inode *ni;
+	BOOL ok = FALSE;
+
+	pentry->ino = MREF(iref);
+	ni = ntfs_fuse_open_locked(pentry->ino);
+	if (ni) {
+		if (!ntfs_fuse_getstat(scx, ni, &pentry->attr)) {
+			pentry->generation = 1;
+			pentry->attr_timeout = ATTR_TIMEOUT;
+			pentry->entry_timeout = ENTRY_TIMEOUT;
+			ok = TRUE;
+		}
+		if (ntfs_fuse_close_locked(ni))
+		       ok = FALSE;
+	}
+	return (ok);
+}
+
+#ifdef FUSE_CAP_READDIRPLUS
+
+/*
+ *		Get the attributes of a directory entry for readdirplus
+ *
+ *	When the inode is not in the cache and the entry is a plain file
+ *	and there is no user mapping, the attributes are taken from the
+ *	FILE_NAME attribute recorded in the index, so that the mft record
+ *	of the file does not have to be read for the lookup. This copy is
+ *	not always up to date (Windows only updates it lazily, and only
+ *	for the name used for opening the file, and hard links other than
+ *	the DOS name are not counted), so the attributes are not to be
+ *	kept and the kernel gets the actual ones by getattr().
+ *	Otherwise the entry is left for the kernel to look up, so that
+ *	the mft records are prefetched by batches as for a plain readdir.
+ *
+ *	Returns TRUE if the attributes could be got
+ */
+
+static BOOL ntfs_fuse_entry_stat(ntfs_fuse_fill_context_t *fill_ctx,
+			struct fuse_entry_param *pentry,
+			const FILE_NAME_ATTR *fn, u64 iref)
+{
+	struct stat *stbuf;
+	ntfs_inode *ni;
+	BOOL ok;
+
+	ni = ntfs_inode_open_cached(ctx->vol, iref);
+	if (ni) {
+			/* the directory being listed is locked first */
+		ntfs_inode_lock(ni);
+		ok = !ntfs_fuse_getstat(fill_ctx->security, ni,
+					&pentry->attr);
+		if (ntfs_fuse_close_locked(ni))
+			ok = FALSE;
+		if (ok) {
+			pentry->ino = MREF(iref);
+			pentry->generation = 1;
+			pentry->attr_timeout = ATTR_TIMEOUT;
+			pentry->entry_timeout = ENTRY_TIMEOUT;
+		}
+	} else if (fn
+	    && !fill_ctx->security->mapping[MAPUSERS]
+	    && !ctx->posix_nlink
+	    && !(fn->file_attributes
+		& (FILE_ATTR_I30_INDEX_PRESENT | FILE_ATTR_REPARSE_POINT
+		    | FILE_ATTR_SYSTEM | FILE_ATTR_ENCRYPTED))) {
+		stbuf = &pentry->attr;
+		memset(stbuf, 0, sizeof(struct stat));
+		stbuf->st_ino = MREF(iref);
+		stbuf->st_mode = S_IFREG | (0777 & ~ctx->fmask);
+			/* a separate DOS name is counted as a link */
+		stbuf->st_nlink = (fn->file_name_type == FILE_NAME_WIN32
+					? 2 : 1);
+		stbuf->st_size = sle64_to_cpu(fn->data_size);
+		stbuf->st_blocks = (sle64_to_cpu(fn->allocated_size)
+					+ 511) >> 9;
+		stbuf->st_uid = ctx->uid;
+		stbuf->st_gid = ctx->gid;
+		ntfs_fuse_stat_times(stbuf, fn->last_access_time,
+			fn->last_mft_change_time, fn->last_data_change_time);
+		pentry->ino = MREF(iref);
+		pentry->generation = 1;
+			/* the index copy may be stale, getattr() is needed */
+		pentry->attr_timeout = 0.0;
+		pentry->entry_timeout = ENTRY_TIMEOUT;
+		ok = TRUE;
+	} else
+		ok = FALSE;
+	return (ok);
+}
+
+#endif /* FUSE_CAP_READDIRPLUS */
+
+#if NOTIFYING
+
+/*
+ *		Notification of changes to the kernel
+ *
+ *	When the kernel keeps entries and attributes for some time,
+ *	it has to be told about the changes it cannot infer from its
+ *	own requests : the DOS name deleted along with the long name,
+ *	the ghost names deleted when closing, the times updated when
+ *	closing, and the system xattrs which change the file attributes.
+ *
+ *	The attributes of an inode are invalidated before replying, so
+ *	that they cannot be used after the reply. Invalidating an entry
+ *	requires the kernel to lock the parent directory, which the
+ *	caller of the request may hold, so entries are queued and
+ *	invalidated by a separate thread.
+ */
+
+struct notify_entry {
+	struct notify_entry *next;
+	fuse_ino_t parent;
+	char name[1];
+} ;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	struct notify_entry *first;
+	struct notify_entry *last;
+	BOOL active;
+	BOOL stop;
+} notify = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+} ;
+
+/*
+ *		Invalidate the attributes of an inode kept by the kernel
+ */
+
+static void ntfs_fuse_notify_inode(fuse_ino_t ino)
+{
+	if (notify.active)
+		fuse_lowlevel_notify_inval_inode(ctx->fc, ino, -1, 0);
+}
+
+/*
+ *		Queue the invalidation of an entry kept by the kernel
+ */
+
+static void ntfs_fuse_notify_entry(fuse_ino_t parent, const char *name)
+{
+	struct notify_entry *item;
+
+	if (notify.active) {
+		item = (struct notify_entry*)ntfs_malloc(
+				sizeof(struct notify_entry) + strlen(name));
+		if (item) {
+			item->next = (struct notify_entry*)NULL;
+			item->parent = parent;
+			strcpy(item->name, name);
+			pthread_mutex_lock(&notify.lock);
+			if (notify.last)
+				notify.last->next = item;
+			else
+				notify.first = item;
+			notify.last = item;
+			pthread_cond_signal(&notify.cond);
+			pthread_mutex_unlock(&notify.lock);
+		}
+	}
+}
+
+/*
+ *		Queue the invalidation of the other names of a file
+ *	in a directory
+ *
+ *	When unlinking a name in the Win32 or DOS namespace, ntfs_delete()
+ *	also deletes its counterpart in the other namespace, which the
+ *	kernel is not aware of.
+ */
+
+static void ntfs_fuse_notify_other_names(ntfs_inode *ni, fuse_ino_t parent,
+			const char *name)
+{
+	ntfs_attr_search_ctx *actx;
+	FILE_NAME_ATTR *fn;
+	char *other;
+
+	if (notify.active) {
+		actx = ntfs_attr_get_search_ctx(ni, NULL);
+		if (actx) {
+			while (!ntfs_attr_lookup(AT_FILE_NAME, AT_UNNAMED, 0,
+					CASE_SENSITIVE, 0, NULL, 0, actx)) {
+				fn = (FILE_NAME_ATTR*)((u8*)actx->attr +
+				    le16_to_cpu(actx->attr->value_offset));
+				if ((MREF_LE(fn->parent_directory)
+						== INODE(parent))
+				    && ((fn->file_name_type == FILE_NAME_WIN32)
+					|| (fn->file_name_type
+						== FILE_NAME_DOS))) {
+					other = (char*)NULL;
+					if ((ntfs_ucstombs((const ntfschar*)
+						((const u8*)fn + offsetof(
+						    FILE_NAME_ATTR, file_name)),
+						fn->file_name_length,
+						&other, 0) > 0)
+					    && strcmp(other, name))
+						ntfs_fuse_notify_entry(parent,
+								other);
+					free(other);
+				}
+			}
+			ntfs_attr_put_search_ctx(actx);
+		}
+	}
+}
+
+/*
+ *		Queue the invalidation of the DOS name of a file before
+ *	it is changed or removed through an extended attribute
+ */
+
+static void ntfs_fuse_notify_dos_name(ntfs_inode *ni, ntfs_inode *dir_ni)
+{
+	char dosname[64];
+	int len;
+
+	if (notify.active) {
+		len = ntfs_get_ntfs_dos_name(ni, dir_ni, dosname,
+						sizeof(dosname) - 1);
+		if (len > 0) {
+			dosname[len] = 0;
+			ntfs_fuse_notify_entry((dir_ni->mft_no == FILE_root
+					? FUSE_ROOT_ID : dir_ni->mft_no),
+					dosname);
+		}
+	}
+}
+
+static void *ntfs_fuse_notify_thread(void *arg __attribute__((unused)))
+{
+	struct notify_entry *item;
+	BOOL stop;
+
+	pthread_mutex_lock(&notify.lock);
+	while (notify.first || !notify.stop) {
+		item = notify.first;
+		if (item) {
+			notify.first = item->next;
+			if (!notify.first)
+				notify.last = (struct notify_entry*)NULL;
+			stop = notify.stop;
+			pthread_mutex_unlock(&notify.lock);
+			if (!stop)
+				fuse_lowlevel_notify_inval_entry(ctx->fc,
+					item->parent, item->name,
+					strlen(item->name));
+			free(item);
+			pthread_mutex_lock(&notify.lock);
+		} else
+			pthread_cond_wait(&notify.cond, &notify.lock);
+	}
+	pthread_mutex_unlock(&notify.lock);
+	return ((void*)NULL);
+}
+
+/*
+ *		Start notifying when the kernel keeps entries or attributes
+ *	of a writable volume
+ *
+ *	This has to be done after daemonizing, and signals are left
+ *	to the main thread.
+ */
+
+static void ntfs_fuse_notify_start(void)
+{
+	sigset_t oldset;
+	sigset_t newset;
+
+	if (!ctx->ro && ((ATTR_TIMEOUT > 0.0) || (ENTRY_TIMEOUT > 0.0))) {
+		sigfillset(&newset);
+		pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+		if (!pthread_create(&notify.thread, (pthread_attr_t*)NULL,
+				ntfs_fuse_notify_thread, (void*)NULL))
+			notify.active = TRUE;
+		else
+			ntfs_log_error("Could not start the notification "
+					"thread, not notifying changes\n");
+		pthread_sigmask(SIG_SETMASK, &oldset, (sigset_t*)NULL);
+	}
+}
+
+/*
+ *		Stop notifying, dropping the pending notifications
+ */
+
+static void ntfs_fuse_notify_end(void)
+{
+	if (notify.active) {
+		notify.active = FALSE;
+		pthread_mutex_lock(&notify.lock);
+		notify.stop = TRUE;
+		pthread_cond_signal(&notify.cond);
+		pthread_mutex_unlock(&notify.lock);
+		pthread_join(notify.thread, (void**)NULL);
+	}
+}
+
+#else /* NOTIFYING */
+
+#define ntfs_fuse_notify_inode(ino) do { } while (0)
+#define ntfs_fuse_notify_entry(parent, name) do { } while (0)
+#define ntfs_fuse_notify_other_names(ni, parent, name) do { } while (0)
+#define ntfs_fuse_notify_dos_name(ni, dir_ni) do { } while (0)
+#define ntfs_fuse_notify_start() do { } while (0)
+#define ntfs_fuse_notify_end() do { } while (0)
+
+#endif /* NOTIFYING */
+
+/*
+ *		Prefetching of mft records for lookups following a listing
+ *
+ *	When a directory is listed, the entries are recorded, and when
+ *	an entry is then looked up (as ls -l, find or du do for all the
+ *	entries), the mft records of the next entries are prefetched by
+ *	a few large reads, rather than read one by one when each entry
+ *	is looked up. The next entries are taken in listing order, or in
+ *	mft record order when the lookups are seen to follow it.
+ *	Only the latest directory listed is remembered.
+ *
+ *	On a multithreaded mount, the list is protected by a mutex,
+ *	which is not held while prefetching.
+ */
+
+static void prefetch_clear(void)
+{
+	free(prefetch.mrefs);
+	free(prefetch.sorted);
+	prefetch.mrefs = (MFT_REF*)NULL;
+	prefetch.sorted = (struct prefetch_entry*)NULL;
+	prefetch.ino = 0;
+	prefetch.count = 0;
+	prefetch.allocated = 0;
+	prefetch.start = prefetch.end = 0;
+	prefetch.istart = prefetch.iend = 0;
+	prefetch.last = -1;
+}
+
+static void prefetch_begin(fuse_ino_t ino)
+{
+	prefetch_lock();
+	prefetch_clear();
+	prefetch.ino = ino;
+	prefetch_unlock();
+}
+
+static void prefetch_add(fuse_ino_t ino, MFT_REF mref)
+{
+	MFT_REF *newmrefs;
+	int newcount;
+
+	prefetch_lock();
+		/* another directory may have been listed meanwhile */
+	if ((prefetch.ino == ino) && !prefetch.sorted) {
+		if (prefetch.count >= prefetch.allocated) {
+			newcount = (prefetch.allocated
+					? 2*prefetch.allocated : 64);
+			newmrefs = (MFT_REF*)realloc(prefetch.mrefs,
+					newcount*sizeof(MFT_REF));
+			if (newmrefs) {
+				prefetch.mrefs = newmrefs;
+				prefetch.allocated = newcount;
 			}
-			ntfs_attr_close(na);
 		}
-		stbuf->st_mode |= (0777 & ~ctx->fmask);
-	}
-#ifndef DISABLE_PLUGINS
-ok:
-#endif /* DISABLE_PLUGINS */
-	if (withusermapping) {
-		if (ntfs_get_owner_mode(scx,ni,stbuf) < 0)
-			set_fuse_error(&res);
-	} else {
-		stbuf->st_uid = ctx->uid;
-		stbuf->st_gid = ctx->gid;
+		if (prefetch.count < prefetch.allocated)
+			prefetch.mrefs[prefetch.count++] = mref;
+		else
+			prefetch_clear();
 	}
-	if (S_ISLNK(stbuf->st_mode))
-		stbuf->st_mode |= 0777;
-nodata :
-	stbuf->st_ino = ni->mft_no;
-#ifdef HAVE_STRUCT_STAT_ST_ATIMESPEC
-	stbuf->st_atimespec = ntfs2timespec(ni->last_access_time);
-	stbuf->st_ctimespec = ntfs2timespec(ni->last_mft_change_time);
-	stbuf->st_mtimespec = ntfs2timespec(ni->last_data_change_time);
-#elif defined(HAVE_STRUCT_STAT_ST_ATIM)
-	stbuf->st_atim = ntfs2timespec(ni->last_access_time);
-	stbuf->st_ctim = ntfs2timespec(ni->last_mft_change_time);
-	stbuf->st_mtim = ntfs2timespec(ni->last_data_change_time);
-#elif defined(HAVE_STRUCT_STAT_ST_ATIMENSEC)
-	{
-	struct timespec ts;
+	prefetch_unlock();
+}
 
-	ts = ntfs2timespec(ni->last_access_time);
-	stbuf->st_atime = ts.tv_sec;
-	stbuf->st_atimensec = ts.tv_nsec;
-	ts = ntfs2timespec(ni->last_mft_change_time);
-	stbuf->st_ctime = ts.tv_sec;
-	stbuf->st_ctimensec = ts.tv_nsec;
-	ts = ntfs2timespec(ni->last_data_change_time);
-	stbuf->st_mtime = ts.tv_sec;
-	stbuf->st_mtimensec = ts.tv_nsec;
+static int prefetch_compare(const void *p1, const void *p2)
+{
+	u64 r1 = MREF(((const struct prefetch_entry*)p1)->mref);
+	u64 r2 = MREF(((const struct prefetch_entry*)p2)->mref);
+
+	return (r1 < r2 ? -1 : (r1 > r2 ? 1 : 0));
+}
+
+static void prefetch_end(fuse_ino_t ino)
+{
+	int i;
+
+	prefetch_lock();
+		/* the list may have been ended by a concurrent listing */
+	if ((prefetch.ino == ino) && !prefetch.sorted) {
+		if (prefetch.count) {
+			prefetch.sorted = (struct prefetch_entry*)ntfs_malloc(
+				prefetch.count*sizeof(struct prefetch_entry));
+			if (prefetch.sorted) {
+				for (i=0; i<prefetch.count; i++) {
+					prefetch.sorted[i].mref
+						= prefetch.mrefs[i];
+					prefetch.sorted[i].pos = i;
+				}
+				qsort(prefetch.sorted, prefetch.count,
+					sizeof(struct prefetch_entry),
+					prefetch_compare);
+			} else
+				prefetch_clear();
+		} else
+			prefetch_clear();
 	}
-#else
-#warning "No known way to set nanoseconds in struct stat !"
-	{
-	struct timespec ts;
+	prefetch_unlock();
+}
 
-	ts = ntfs2timespec(ni->last_access_time);
-	stbuf->st_atime = ts.tv_sec;
-	ts = ntfs2timespec(ni->last_mft_change_time);
-	stbuf->st_ctime = ts.tv_sec;
-	ts = ntfs2timespec(ni->last_data_change_time);
-	stbuf->st_mtime = ts.tv_sec;
+static void prefetch_lookup(fuse_ino_t parent, MFT_REF iref)
+{
+	struct prefetch_entry wanted;
+	const struct prefetch_entry *found;
+	MFT_REF mrefs[PREFETCH_AHEAD];
+	int ipos;
+	int pos;
+	int count;
+	int i;
+
+	count = 0;
+	prefetch_lock();
+	if ((parent == prefetch.ino) && prefetch.sorted) {
+		wanted.mref = iref;
+		found = (const struct prefetch_entry*)bsearch(&wanted,
+			prefetch.sorted, prefetch.count,
+			sizeof(struct prefetch_entry), prefetch_compare);
+		if (found) {
+			pos = found->pos;
+			ipos = found - prefetch.sorted;
+			if (((pos < prefetch.start) || (pos >= prefetch.end))
+			    && ((ipos < prefetch.istart)
+				|| (ipos >= prefetch.iend))) {
+				if (ipos == (prefetch.last + 1)) {
+					/*
+					 * Entries looked up in mft record
+					 * order (as find does for big
+					 * directories), prefetch in the
+					 * same order
+					 */
+					count = prefetch.count - ipos;
+					if (count > PREFETCH_AHEAD)
+						count = PREFETCH_AHEAD;
+					for (i=0; i<count; i++)
+						mrefs[i] = prefetch.sorted
+							[ipos + i].mref;
+					prefetch.istart = ipos;
+					prefetch.iend = ipos + count;
+				} else {
+					/* entries looked up in listing order */
+					count = prefetch.count - pos;
+					if (count > PREFETCH_AHEAD)
+						count = PREFETCH_AHEAD;
+					memcpy(mrefs, &prefetch.mrefs[pos],
+						count*sizeof(MFT_REF));
+					prefetch.start = pos;
+					prefetch.end = pos + count;
+				}
+			}
+			prefetch.last = ipos;
+		}
 	}
-#endif
-exit:
-	return (res);
+	prefetch_unlock();
+	if (count > 0)
+		ntfs_mft_prefetch(ctx->vol, mrefs, count);
+}
+
+/*
+ *		Prefetching for an access to an entry which was not
+ *	looked up, as for the attributes and xattrs got after a readdirplus
+ */
+
+static void prefetch_access(fuse_ino_t ino)
+{
+	fuse_ino_t parent;
+
+	prefetch_lock();
+	parent = prefetch.ino;
+	prefetch_unlock();
+	if (parent)
+		prefetch_lookup(parent, INODE(ino));
 }
 
 static void ntfs_fuse_getattr(fuse_req_t req, fuse_ino_t ino,
@@ -987,13 +1845,14 @@ static void ntfs_fuse_getattr(fuse_req_t req, fuse_ino_t ino,
 	struct stat stbuf;
 	struct SECURITY_CONTEXT security;
 
-	ni = ntfs_inode_open(ctx->vol, INODE(ino));
+	prefetch_access(ino);
+	ni = ntfs_fuse_open_locked(INODE(ino));
 	if (!ni)
 		res = -errno;
 	else {
 		ntfs_fuse_fill_security_context(req, &security);
 		res = ntfs_fuse_getstat(&security, ni, &stbuf);
-		if (ntfs_inode_close(ni))
+		if (ntfs_fuse_close_locked(ni))
 			set_fuse_error(&res);
 	}
 	if (!res)
@@ -1002,28 +1861,6 @@ static void ntfs_fuse_getattr(fuse_req_t req, fuse_ino_t ino,
 		fuse_reply_err(req, -res);
 }
 
-static __inline__ BOOL ntfs_fuse_fillstat(struct SECURITY_CONTEXT *scx,
-			struct fuse_entry_param *pentry, u64 iref)
-{
-	ntfs_inode *ni;
-	BOOL ok = FALSE;
-
-	pentry->ino = MREF(iref);
-	ni = ntfs_inode_open(ctx->vol, pentry->ino);
-	if (ni) {
-		if (!ntfs_fuse_getstat(scx, ni, &pentry->attr)) {
-			pentry->generation = 1;
-			pentry->attr_timeout = ATTR_TIMEOUT;
-			pentry->entry_timeout = ENTRY_TIMEOUT;
-			ok = TRUE;
-		}
-		if (ntfs_inode_close(ni))
-		       ok = FALSE;
-	}
-	return (ok);
-}
-
-
 static void ntfs_fuse_lookup(fuse_req_t req, fuse_ino_t parent,
 			const char *name)
 {
@@ -1034,7 +1871,7 @@ static void ntfs_fuse_lookup(fuse_req_t req, fuse_ino_t parent,
 	BOOL ok = FALSE;
 
 	if (strlen(name) < 256) {
-		dir_ni = ntfs_inode_open(ctx->vol, INODE(parent));
+		dir_ni = ntfs_fuse_open_locked(INODE(parent));
 		if (dir_ni) {
 #if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
 			/*
@@ -1042,7 +1879,7 @@ static void ntfs_fuse_lookup(fuse_req_t req, fuse_ino_t parent,
 			 */
 			if (ntfs_fuse_fill_security_context(req, &security)
 			    && !ntfs_allowed_access(&security,dir_ni,S_IEXEC)) {
-				ntfs_inode_close(dir_ni);
+				ntfs_fuse_close_locked(dir_ni);
 				errno = EACCES;
 			} else {
 #else
@@ -1054,8 +1891,9 @@ static void ntfs_fuse_lookup(fuse_req_t req, fuse_ino_t parent,
 				if (MREF(iref) <= 1) {
 					iref = (u64)-1;
 					errno = ENOENT;
-				}
-				ok = !ntfs_inode_close(dir_ni)
+				} else
+					prefetch_lookup(parent, iref);
+				ok = !ntfs_fuse_close_locked(dir_ni)
 					&& (iref != (u64)-1)
 					&& ntfs_fuse_fillstat(
 						&security,&entry,iref);
@@ -1123,7 +1961,7 @@ static void ntfs_fuse_readlink(fuse_req_t req, fuse_ino_t ino)
 	int res = 0;
 
 	/* Get inode. */
-	ni = ntfs_inode_open(ctx->vol, INODE(ino));
+	ni = ntfs_fuse_open_locked(INODE(ino));
 	if (!ni) {
 		res = -errno;
 		goto exit;
@@ -1216,7 +2054,7 @@ exit:
 		free(intx_file);
 	if (na)
 		ntfs_attr_close(na);
-	if (ntfs_inode_close(ni))
+	if (ntfs_fuse_close_locked(ni))
 		set_fuse_error(&res);
 
 	if (res < 0)
@@ -1226,11 +2064,31 @@ exit:
 	free(buf);
 }
 
-static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
+/*
+ *		Add an entry to a readdir buffer, with its attributes
+ *	when doing a readdirplus
+ */
+
+static size_t ntfs_fuse_add_entry(ntfs_fuse_fill_context_t *fill_ctx,
+			char *buf, size_t bufsize, const char *name,
+			const struct fuse_entry_param *entry, off_t off)
+{
+#ifdef FUSE_CAP_READDIRPLUS
+	if (fill_ctx->plus)
+		return (fuse_add_direntry_plus(fill_ctx->req, buf, bufsize,
+				name, entry, off));
+#endif /* FUSE_CAP_READDIRPLUS */
+	return (fuse_add_direntry(fill_ctx->req, buf, bufsize,
+				name, &entry->attr, off));
+}
+
+static int ntfs_fuse_filler_fn(ntfs_fuse_fill_context_t *fill_ctx,
 		const ntfschar *name, const int name_len, const int name_type,
 		const s64 pos __attribute__((unused)), const MFT_REF mref,
-		const unsigned dt_type __attribute__((unused)))
+		const unsigned dt_type __attribute__((unused)),
+		const FILE_NAME_ATTR *fn __attribute__((unused)))
 {
+	struct fuse_entry_param entry;
 	char *filename = NULL;
 	int ret = 0;
 	int filenamelen = -1;
@@ -1253,6 +2111,7 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 		ntfs_inode *ni;
 #endif /* DISABLE_PLUGINS */
 		 
+		prefetch_add(fill_ctx->ino, mref);
 		switch (dt_type) {
 		case NTFS_DT_DIR :
 			st.st_mode = S_IFDIR | (0777 & ~ctx->dmask); 
@@ -1276,7 +2135,7 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 			st.st_mode = S_IFLNK | 0777; /* default */
 #ifndef DISABLE_PLUGINS
 			/* get emulated type from plugin if available */
-			ni = ntfs_inode_open(ctx->vol, mref);
+			ni = ntfs_fuse_open_locked(mref);
 			if (ni && (ni->flags & FILE_ATTR_REPARSE_POINT)) {
 				const plugin_operations_t *ops;
 				REPARSE_POINT *reparse;
@@ -1289,7 +2148,7 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 					st.st_mode = S_IFLNK;
 			}
 			if (ni)
-				ntfs_inode_close(ni);
+				ntfs_fuse_close_locked(ni);
 #endif /* DISABLE_PLUGINS */
 			break;
 		default : /* unexpected types shown as plain files */
@@ -1329,12 +2188,25 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 			ntfs_log_debug("   after: '%s'\n", filename);
 		}
 #endif /* defined(__APPLE__) || defined(__DARWIN__), ... */
+
+		memset(&entry, 0, sizeof(entry));
+		entry.attr = st;
+#ifdef FUSE_CAP_READDIRPLUS
+			/* "." and ".." are not looked up by the kernel */
+		if (fill_ctx->plus
+		    && strcmp(filename, ".") && strcmp(filename, "..")
+		    && !ntfs_fuse_entry_stat(fill_ctx, &entry, fn, mref)) {
+				/* no attributes, the kernel will look up */
+			memset(&entry, 0, sizeof(entry));
+			entry.attr = st;
+		}
+#endif /* FUSE_CAP_READDIRPLUS */
 	
 		current = fill_ctx->last;
-		sz = fuse_add_direntry(fill_ctx->req,
+		sz = ntfs_fuse_add_entry(fill_ctx,
 				&current->buf[current->off],
 				current->bufsize - current->off,
-				filename, &st, current->off + fill_ctx->off);
+				filename, &entry, current->off + fill_ctx->off);
 		if (!sz || ((current->off + sz) > current->bufsize)) {
 			newone = (ntfs_fuse_fill_item_t*)ntfs_malloc
 				(sizeof(ntfs_fuse_fill_item_t)
@@ -1347,10 +2219,10 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 				fill_ctx->last = newone;
 				fill_ctx->off += current->off;
 				current = newone;
-				sz = fuse_add_direntry(fill_ctx->req,
+				sz = ntfs_fuse_add_entry(fill_ctx,
 					current->buf,
 					current->bufsize - current->off,
-					filename, &st, fill_ctx->off);
+					filename, &entry, fill_ctx->off);
 				if (!sz) {
 					errno = EIO;
 					ntfs_log_error("Could not add a"
@@ -1373,6 +2245,14 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 	return ret;
 }
 
+static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
+		const ntfschar *name, const int name_len, const int name_type,
+		const s64 pos, const MFT_REF mref, const unsigned dt_type)
+{
+	return (ntfs_fuse_filler_fn(fill_ctx, name, name_len, name_type,
+			pos, mref, dt_type, (const FILE_NAME_ATTR*)NULL));
+}
+
 static void ntfs_fuse_opendir(fuse_req_t req, fuse_ino_t ino,
 			 struct fuse_file_info *fi)
 {
@@ -1382,7 +2262,7 @@ static void ntfs_fuse_opendir(fuse_req_t req, fuse_ino_t ino,
 	ntfs_fuse_fill_context_t *fill;
 	struct SECURITY_CONTEXT security;
 
-	ni = ntfs_inode_open(ctx->vol, INODE(ino));
+	ni = ntfs_fuse_open_locked(INODE(ino));
 	if (ni) {
 		if (ntfs_fuse_fill_security_context(req, &security)) {
 			if (fi->flags & O_WRONLY)
@@ -1406,7 +2286,7 @@ static void ntfs_fuse_opendir(fuse_req_t req, fuse_ino_t ino,
 			res = -EOPNOTSUPP;
 #endif /* DISABLE_PLUGINS */
 		}
-		if (ntfs_inode_close(ni))
+		if (ntfs_fuse_close_locked(ni))
 			set_fuse_error(&res);
 		if (!res) {
 			fill = (ntfs_fuse_fill_context_t*)
@@ -1417,6 +2297,7 @@ static void ntfs_fuse_opendir(fuse_req_t req, fuse_ino_t ino,
 				fill->first = fill->last
 					= (ntfs_fuse_fill_item_t*)NULL;
 				fill->filled = FALSE;
+				fill->plus = FALSE;
 				fill->ino = ino;
 				fill->off = 0;
 #ifndef DISABLE_PLUGINS
@@ -1461,7 +2342,7 @@ static void ntfs_fuse_releasedir(fuse_req_t req,
 			const plugin_operations_t *ops;
 			REPARSE_POINT *reparse;
 
-			ni = ntfs_inode_open(ctx->vol, INODE(ino));
+			ni = ntfs_fuse_open_locked(INODE(ino));
 			if (ni) {
 				if (ni->flags & FILE_ATTR_REPARSE_POINT) {
 					memcpy(&ufi, fi, sizeof(ufi));
@@ -1469,7 +2350,7 @@ static void ntfs_fuse_releasedir(fuse_req_t req,
 					res = CALL_REPARSE_PLUGIN(ni, release,
 								 &ufi);
 				}
-				if (ntfs_inode_close(ni) && !res)
+				if (ntfs_fuse_close_locked(ni) && !res)
 					res = -errno;
 			} else
 				res = -errno;
@@ -1481,13 +2362,14 @@ static void ntfs_fuse_releasedir(fuse_req_t req,
 	fuse_reply_err(req, -res);
 }
 
-static void ntfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
-			off_t off __attribute__((unused)),
-			struct fuse_file_info *fi __attribute__((unused)))
+static void ntfs_fuse_readdir_common(fuse_req_t req, fuse_ino_t ino,
+			size_t size, off_t off, struct fuse_file_info *fi,
+			BOOL plus)
 {
 #ifndef DISABLE_PLUGINS
 	struct fuse_file_info ufi;
 #endif /* DISABLE_PLUGINS */
+	struct SECURITY_CONTEXT security;
 	ntfs_fuse_fill_item_t *first;
 	ntfs_fuse_fill_item_t *current;
 	ntfs_fuse_fill_context_t *fill;
@@ -1497,7 +2379,7 @@ static void ntfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 
 	fill = (ntfs_fuse_fill_context_t*)(long)fi->fh;
 	if (fill && (fill->ino == ino)) {
-		if (fill->filled && !off) {
+		if (fill->filled && (!off || (fill->plus != plus))) {
 			/* Rewinding : make sure to clear existing results */   
 			current = fill->first;
 			while (current) {
@@ -1520,7 +2402,11 @@ static void ntfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 				fill->first = first;
 				fill->last = first;
 				fill->off = 0;
-				ni = ntfs_inode_open(ctx->vol,INODE(ino));
+				fill->plus = plus;
+				ntfs_fuse_fill_security_context(req,
+						&security);
+				fill->security = &security;
+				ni = ntfs_fuse_open_locked(INODE(ino));
 				if (!ni)
 					err = -errno;
 				else {
@@ -1540,15 +2426,18 @@ static void ntfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 						err = -EOPNOTSUPP;
 #endif /* DISABLE_PLUGINS */
 					} else {
-						if (ntfs_readdir(ni, &pos, fill,
-							(ntfs_filldir_t)
-							ntfs_fuse_filler))
+						prefetch_begin(ino);
+						if (ntfs_readdir_fn(ni, &pos, fill,
+							(ntfs_filldir_fn_t)
+							ntfs_fuse_filler_fn))
 							err = -errno;
+						prefetch_end(ino);
 					}
 					fill->filled = TRUE;
-					ntfs_fuse_update_times(ni,
-						NTFS_UPDATE_ATIME);
-					if (ntfs_inode_close(ni))
+					fill->security =
+						(struct SECURITY_CONTEXT*)NULL;
+					ntfs_fuse_update_atime(ni);
+					if (ntfs_fuse_close_locked(ni))
 						set_fuse_error(&err);
 				}
 				if (!err) {
@@ -1598,6 +2487,22 @@ static void ntfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 		fuse_reply_err(req, -err);
 }
 
+static void ntfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			off_t off, struct fuse_file_info *fi)
+{
+	ntfs_fuse_readdir_common(req, ino, size, off, fi, FALSE);
+}
+
+#ifdef FUSE_CAP_READDIRPLUS
+
+static void ntfs_fuse_readdirplus(fuse_req_t req, fuse_ino_t ino,
+			size_t size, off_t off, struct fuse_file_info *fi)
+{
+	ntfs_fuse_readdir_common(req, ino, size, off, fi, TRUE);
+}
+
+#endif /* FUSE_CAP_READDIRPLUS */
+
 static void ntfs_fuse_open(fuse_req_t req, fuse_ino_t ino,
 		      struct fuse_file_info *fi)
 {
@@ -1663,7 +2568,7 @@ static void ntfs_fuse_open(fuse_req_t req, fuse_ino_t ino,
 				state |= CLOSE_ENCRYPTED;
 #endif /* HAVE_SETXATTR */
 		/* mark a future need to update the mtime */
-			if (ctx->dmtime)
+			if (ctx->dmtime && !ctx->writeback_cache)
 				state |= CLOSE_DMTIME;
 			/* deny opening metadata files for writing */
 			if (ino < FILE_first_user)
@@ -1698,6 +2603,79 @@ close:
 		fuse_reply_open(req, fi);
 }
 
+#ifdef FUSE_INTERNAL
+
+/*
+ *		Reply to a read by splicing the data from the device
+ *
+ *	The data is passed to the kernel without being copied to a
+ *	buffer. This is only possible for plain data fully allocated
+ *	and initialized, and stored in a few extents of a device which
+ *	can be read directly.
+ *
+ *	Returns TRUE if the read has been replied to, and FALSE if
+ *		the data has to be read into a buffer
+ */
+
+static BOOL ntfs_fuse_splice_read(fuse_req_t req, ntfs_attr *na,
+			off_t offset, size_t size)
+{
+	struct ntfs_device_iovec iov[SPLICE_EXTENTS];
+	struct fuse_buf bufs[SPLICE_EXTENTS];
+	BOOL replied;
+	int fd;
+	int n;
+	int i;
+
+	replied = FALSE;
+	fd = ntfs_device_fd(ctx->vol->dev);
+	if (fd >= 0) {
+		n = ntfs_attr_map_extents(na, offset, size,
+					iov, SPLICE_EXTENTS);
+		if (n >= 0) {
+			for (i=0; i<n; i++) {
+				bufs[i].size = iov[i].count;
+				bufs[i].mem = (void*)NULL;
+				bufs[i].fd = fd;
+				bufs[i].pos = iov[i].pos;
+			}
+			fuse_reply_data(req, bufs, n);
+			replied = TRUE;
+		}
+	}
+	return (replied);
+}
+
+/*
+ *		Release the inode lock for reading the data of a file
+ *
+ *	On a multithreaded mount, this is done for the plain data of a
+ *	non-resident stream, after its runlist has been fully mapped,
+ *	so that reading it only uses the attribute private to the
+ *	request, the read-ahead buffer being locked separately.
+ *
+ *	Returns TRUE if the lock was released
+ */
+
+static BOOL ntfs_fuse_unlock_data(ntfs_attr *na)
+{
+	BOOL unlocked;
+
+	unlocked = FALSE;
+	if ((ctx->threads > 1)
+	    && NAttrNonResident(na)
+	    && !(na->data_flags & ATTR_COMPRESSION_MASK)
+	    && !NAttrEncrypted(na)
+	    && !(na->ni->flags & FILE_ATTR_REPARSE_POINT)
+	    && !ntfs_attr_map_whole_runlist(na)) {
+		ntfs_inode_unlock(na->ni);
+		unlocked = TRUE;
+	}
+	return (unlocked);
+}
+
+#endif /* FUSE_INTERNAL */
+
 static void ntfs_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 			off_t offset,
 			struct fuse_file_info *fi __attribute__((unused)))
@@ -1708,18 +2686,17 @@ static void ntfs_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 	char *buf = (char*)NULL;
 	s64 total = 0;
 	s64 max_read;
+#ifdef FUSE_INTERNAL
+	BOOL unlocked;
+	BOOL spliced = FALSE;
+#endif /* FUSE_INTERNAL */
 
 	if (!size) {
 		res = 0;
 		goto exit;
 	}
-	buf = (char*)ntfs_malloc(size);
-	if (!buf) {
-		res = -errno;
-		goto exit;
-	}
 
-	ni = ntfs_inode_open(ctx->vol, INODE(ino));
+	ni = ntfs_fuse_open_locked(INODE(ino));
 	if (!ni) {
 		res = -errno;
 		goto exit;
@@ -1730,6 +2707,11 @@ static void ntfs_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 		REPARSE_POINT *reparse;
 		struct open_file *of;
 
+		buf = (char*)ntfs_malloc(size);
+		if (!buf) {
+			res = -errno;
+			goto exit;
+		}
 		of = (struct open_file*)(long)fi->fh;
 		res = CALL_REPARSE_PLUGIN(ni, read, buf, size, offset, &of->fi);
 		if (res >= 0) {
@@ -1760,7 +2742,21 @@ static void ntfs_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 			goto ok;
 		size = max_read - offset;
 	}
-	while (size > 0) {
+	res = 0;
+#ifdef FUSE_INTERNAL
+	unlocked = ntfs_fuse_unlock_data(na);
+	if (ctx->splice && ntfs_fuse_splice_read(req, na, offset, size)) {
+		spliced = TRUE;
+		total = size;
+		size = 0;
+	}
+#endif /* FUSE_INTERNAL */
+	if (size > 0) {
+		buf = (char*)ntfs_malloc(size);
+		if (!buf)
+			res = -errno;
+	}
+	while (!res && (size > 0)) {
 		s64 ret = ntfs_attr_pread(na, offset, size, buf + total);
 		if (ret != (s64)size)
 			ntfs_log_perror("ntfs_attr_pread error reading inode %lld at "
@@ -1768,23 +2764,34 @@ static void ntfs_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 				(long long)offset, (long long)size, (long long)ret);
 		if (ret <= 0 || ret > (s64)size) {
 			res = (ret < 0) ? -errno : -EIO;
-			goto exit;
+			break;
 		}
 		size -= ret;
 		offset += ret;
 		total += ret;
 	}
+#ifdef FUSE_INTERNAL
+	if (unlocked)
+		ntfs_inode_lock(ni);
+#endif /* FUSE_INTERNAL */
+	if (res)
+		goto exit;
 ok:
 	res = total;
 #ifndef DISABLE_PLUGINS
 stamps :
 #endif /* DISABLE_PLUGINS */
-	ntfs_fuse_update_times(ni, NTFS_UPDATE_ATIME);
+	ntfs_fuse_update_atime(ni);
 exit:
 	if (na)
 		ntfs_attr_close(na);
-	if (ntfs_inode_close(ni))
+	if (ntfs_fuse_close_locked(ni))
 		set_fuse_error(&res);
+#ifdef FUSE_INTERNAL
+	if (spliced)
+		; /* already replied */
+	else
+#endif /* FUSE_INTERNAL */
 	if (res < 0)
 		fuse_reply_err(req, -res);
 	else
@@ -1842,6 +2849,7 @@ static void ntfs_fuse_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
 stamps :
 #endif /* DISABLE_PLUGINS */
 	if ((res > 0)
+	    && !ctx->writeback_cache
 	    && (!ctx->dmtime
 		|| (sle64_to_cpu(ntfs_current_time())
 		     - sle64_to_cpu(ni->last_data_change_time)) > ctx->dmtime))
@@ -2311,7 +3319,7 @@ static void ntfs_fuse_access(fuse_req_t req, fuse_ino_t ino, int mask)
 		else
 			res = -EOPNOTSUPP;
 	} else {
-		ni = ntfs_inode_open(ctx->vol, INODE(ino));
+		ni = ntfs_fuse_open_locked(INODE(ino));
 		if (!ni) {
 			res = -errno;
 		} else {
@@ -2324,7 +3332,7 @@ static void ntfs_fuse_access(fuse_req_t req, fuse_ino_t ino, int mask)
 						ni, mode))
 					res = -errno;
 			}
-			if (ntfs_inode_close(ni))
+			if (ntfs_fuse_close_locked(ni))
 				set_fuse_error(&res);
 		}
 	}
@@ -2490,7 +3498,7 @@ static int ntfs_fuse_create(fuse_req_t req, fuse_ino_t parent, const char *name,
 			    && (ni->flags & FILE_ATTR_ENCRYPTED))
 				state |= CLOSE_ENCRYPTED;
 #endif /* HAVE_SETXATTR */
-			if (fi && ctx->dmtime)
+			if (fi && ctx->dmtime && !ctx->writeback_cache)
 				state |= CLOSE_DMTIME;
 			ntfs_inode_update_mbsname(dir_ni, name, ni->mft_no);
 			NInoSetDirty(ni);
@@ -2864,10 +3872,12 @@ static int ntfs_fuse_rm(fuse_req_t req, fuse_ino_t parent, const char *name,
 #else /* DISABLE_PLUGINS */
 		res = -EOPNOTSUPP;
 #endif /* DISABLE_PLUGINS */
-	} else
+	} else {
+		ntfs_fuse_notify_other_names(ni, parent, name);
 		if (ntfs_delete(ctx->vol, (char*)NULL, ni, dir_ni,
 					 uname, uname_len))
 			res = -errno;
+	}
 		/* ntfs_delete() always closes ni and dir_ni */
 	ni = dir_ni = NULL;
 exit:
@@ -3123,6 +4133,8 @@ stamps :
 #endif /* DISABLE_PLUGINS */
 	if (of->state & CLOSE_DMTIME)
 		ntfs_inode_update_times(ni,NTFS_UPDATE_MCTIME);
+		/* the times or the size may have changed */
+	ntfs_fuse_notify_inode(ino);
 exit:
 	if (na)
 		ntfs_attr_close(na);
@@ -3133,7 +4145,8 @@ out:
 	if (of) {
 		if (of->state & CLOSE_GHOST) {
 			sprintf(ghostname,ghostformat,of->ghost);
-			ntfs_fuse_rm(req, of->parent, ghostname, RM_ANY);
+			if (!ntfs_fuse_rm(req, of->parent, ghostname, RM_ANY))
+				ntfs_fuse_notify_entry(of->parent, ghostname);
 		}
 			/* remove from open files list */
 		if (of->next)
@@ -3253,7 +4266,7 @@ static void ntfs_fuse_bmap(fuse_req_t req, fuse_ino_t ino, size_t blocksize,
 		goto done;
 	}
 
-	ni = ntfs_inode_open(ctx->vol, INODE(ino));
+	ni = ntfs_fuse_open_locked(INODE(ino));
 	if (!ni) {
 		ret = -errno;
 		goto done;
@@ -3282,7 +4295,7 @@ static void ntfs_fuse_bmap(fuse_req_t req, fuse_ino_t ino, size_t blocksize,
 close_attr:
 	ntfs_attr_close(na);
 close_inode:
-	if (ntfs_inode_close(ni))
+	if (ntfs_fuse_close_locked(ni))
 		set_fuse_error(&ret);
 done :
 	if (ret < 0)
@@ -3473,7 +4486,7 @@ static void ntfs_fuse_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 #if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
 	ntfs_fuse_fill_security_context(req, &security);
 #endif
-	ni = ntfs_inode_open(ctx->vol, INODE(ino));
+	ni = ntfs_fuse_open_locked(INODE(ino));
 	if (!ni) {
 		ret = -errno;
 		goto out;
@@ -3513,7 +4526,7 @@ static void ntfs_fuse_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 exit:
 	if (actx)
 		ntfs_attr_put_search_ctx(actx);
-	if (ntfs_inode_close(ni))
+	if (ntfs_fuse_close_locked(ni))
 		set_fuse_error(&ret);
 out :
 	if (ret < 0)
@@ -3560,6 +4573,7 @@ static void ntfs_fuse_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 	}
 #endif
 
+	prefetch_access(ino);
 	attr = ntfs_xattr_system_type(name,ctx->vol);
 	if (attr != XATTR_UNMAPPED) {
 		/*
@@ -3574,6 +4588,7 @@ static void ntfs_fuse_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 			ni = ntfs_check_access_xattr(req, &security, ino,
 					attr, FALSE);
 			if (ni) {
+				ntfs_inode_lock(ni);
 				if (ntfs_allowed_access(&security,ni,S_IREAD)) {
 					if (attr == XATTR_NTFS_DOS_NAME)
 						dir_ni = ntfs_dir_parent_inode(ni);
@@ -3585,7 +4600,7 @@ static void ntfs_fuse_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 						set_fuse_error(&res);
 				} else
 					res = -errno;
-				if (ntfs_inode_close(ni))
+				if (ntfs_fuse_close_locked(ni))
 					set_fuse_error(&res);
 			} else
 				res = -errno;
@@ -3594,7 +4609,7 @@ static void ntfs_fuse_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 			 * Standard access control has been done by fuse/kernel
 			 */
 		if (!size || value) {
-			ni = ntfs_inode_open(ctx->vol, INODE(ino));
+			ni = ntfs_fuse_open_locked(INODE(ino));
 			if (ni) {
 					/* user mapping not mandatory */
 				ntfs_fuse_fill_security_context(req, &security);
@@ -3606,7 +4621,7 @@ static void ntfs_fuse_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 					attr, ni, dir_ni, value, size);
 				if (dir_ni && ntfs_inode_close(dir_ni))
 					set_fuse_error(&res);
-				if (ntfs_inode_close(ni))
+				if (ntfs_fuse_close_locked(ni))
 					set_fuse_error(&res);
 			} else
 				res = -errno;
@@ -3641,7 +4656,7 @@ static void ntfs_fuse_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 		goto out;
 	}
 #endif
-	ni = ntfs_inode_open(ctx->vol, INODE(ino));
+	ni = ntfs_fuse_open_locked(INODE(ino));
 	if (!ni) {
 		res = -errno;
 		goto out;
@@ -3691,7 +4706,7 @@ exit:
 	if (na)
 		ntfs_attr_close(na);
 	free(lename);
-	if (ntfs_inode_close(ni))
+	if (ntfs_fuse_close_locked(ni))
 		set_fuse_error(&res);
 
 out :
@@ -3754,9 +4769,12 @@ static void ntfs_fuse_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 		ni = ntfs_check_access_xattr(req,&security,ino,attr,TRUE);
 		if (ni) {
 			if (ntfs_allowed_as_owner(&security, ni)) {
-				if (attr == XATTR_NTFS_DOS_NAME)
+				if (attr == XATTR_NTFS_DOS_NAME) {
 					dir_ni = ntfs_dir_parent_inode(ni);
-				else
+					if (dir_ni)
+						ntfs_fuse_notify_dos_name(ni,
+								dir_ni);
+				} else
 					dir_ni = (ntfs_inode*)NULL;
 				res = ntfs_xattr_system_setxattr(&security,
 					attr, ni, dir_ni, value, size, flags);
@@ -3788,9 +4806,12 @@ static void ntfs_fuse_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 				 */
 			if (!ntfs_fuse_fill_security_context(req, &security)
 			   || ntfs_allowed_as_owner(&security, ni)) {
-				if (attr == XATTR_NTFS_DOS_NAME)
+				if (attr == XATTR_NTFS_DOS_NAME) {
 					dir_ni = ntfs_dir_parent_inode(ni);
-				else
+					if (dir_ni)
+						ntfs_fuse_notify_dos_name(ni,
+								dir_ni);
+				} else
 					dir_ni = (ntfs_inode*)NULL;
 				res = ntfs_xattr_system_setxattr(&security,
 					attr, ni, dir_ni, value, size, flags);
@@ -3809,18 +4830,14 @@ static void ntfs_fuse_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 		} else
 			res = -errno;
 #endif
-#if CACHEING && !defined(FUSE_INTERNAL) && FUSE_VERSION >= 28
 		/*
 		 * Most of system xattr settings cause changes to some
 		 * file attribute (st_mode, st_nlink, st_mtime, etc.),
 		 * so we must invalidate cached data when cacheing is
-		 * in use (not possible with internal fuse or external
-		 * fuse before 2.8)
+		 * in use (not possible with external fuse before 2.8)
 		 */
-		if ((res >= 0)
-		    && fuse_lowlevel_notify_inval_inode(ctx->fc, ino, -1, 0))
-			res = -errno;
-#endif
+		if (res >= 0)
+			ntfs_fuse_notify_inode(ino);
 		if (res < 0)
 			fuse_reply_err(req, -res);
 		else
@@ -4001,9 +5018,12 @@ static void ntfs_fuse_removexattr(fuse_req_t req, fuse_ino_t ino, const char *na
 					attr,TRUE);
 			if (ni) {
 				if (ntfs_allowed_as_owner(&security, ni)) {
-					if (attr == XATTR_NTFS_DOS_NAME)
+					if (attr == XATTR_NTFS_DOS_NAME) {
 						dir_ni = ntfs_dir_parent_inode(ni);
-					else
+						if (dir_ni)
+							ntfs_fuse_notify_dos_name(ni,
+									dir_ni);
+					} else
 						dir_ni = (ntfs_inode*)NULL;
 					res = ntfs_xattr_system_removexattr(&security,
 							attr, ni, dir_ni);
@@ -4035,9 +5055,12 @@ static void ntfs_fuse_removexattr(fuse_req_t req, fuse_ino_t ino, const char *na
 				 */
 				if (!ntfs_fuse_fill_security_context(req, &security)
 				   || ntfs_allowed_as_owner(&security, ni)) {
-					if (attr == XATTR_NTFS_DOS_NAME)
+					if (attr == XATTR_NTFS_DOS_NAME) {
 						dir_ni = ntfs_dir_parent_inode(ni);
-					else
+						if (dir_ni)
+							ntfs_fuse_notify_dos_name(ni,
+									dir_ni);
+					} else
 						dir_ni = (ntfs_inode*)NULL;
 					res = ntfs_xattr_system_removexattr(&security,
 						attr, ni, dir_ni);
@@ -4056,19 +5079,14 @@ static void ntfs_fuse_removexattr(fuse_req_t req, fuse_ino_t ino, const char *na
 			} else
 				res = -errno;
 #endif
-#if CACHEING && !defined(FUSE_INTERNAL) && FUSE_VERSION >= 28
 		/*
 		 * Some allowed system xattr removals cause changes to
 		 * some file attribute (st_mode, st_nlink, etc.),
 		 * so we must invalidate cached data when cacheing is
-		 * in use (not possible with internal fuse or external
-		 * fuse before 2.8)
+		 * in use (not possible with external fuse before 2.8)
 		 */
-			if ((res >= 0)
-			    && fuse_lowlevel_notify_inval_inode(ctx->fc,
-						ino, -1, 0))
-				res = -errno;
-#endif
+			if (res >= 0)
+				ntfs_fuse_notify_inode(ino);
 			break;
 		}
 		if (res < 0)
@@ -4183,6 +5201,11 @@ static void register_internal_reparse_plugins(void)
 	static const plugin_operations_t wsl_ops = {
 		.getattr = wsl_getstat,
 	} ;
+	static const plugin_operations_t wof_ops = {
+		.getattr = wof_getstat,
+		.open = wof_open,
+		.read = wof_read,
+	} ;
 	register_reparse_plugin(ctx, IO_REPARSE_TAG_MOUNT_POINT,
 					&ops, (void*)NULL);
 	register_reparse_plugin(ctx, IO_REPARSE_TAG_SYMLINK,
@@ -4197,12 +5220,19 @@ static void register_internal_reparse_plugins(void)
 					&wsl_ops, (void*)NULL);
 	register_reparse_plugin(ctx, IO_REPARSE_TAG_LX_BLK,
 					&wsl_ops, (void*)NULL);
+	register_reparse_plugin(ctx, IO_REPARSE_TAG_WOF,
+					&wof_ops, (void*)NULL);
 }
 #endif /* DISABLE_PLUGINS */
 
 static void ntfs_close(void)
 {
 	struct SECURITY_CONTEXT security;
+	struct ntfs_device_cache_stats dstats;
+#if CACHE_INDEX_SIZE
+	struct INDEX_CACHE_STATS *stats;
+	int i;
+#endif
 
 	if (!ctx)
 		return;
@@ -4225,6 +5255,68 @@ static void ntfs_close(void)
 				 / ctx->seccache->head.p_reads % 10);
 			}
 		}
+		if (!ntfs_device_cache_stats(ctx->vol->dev, &dstats)
+		    && (dstats.hits + dstats.misses)) {
+			ntfs_log_info("Device cache : %llu reads, "
+				"%llu.%1llu%% hits, %llu bypassed, "
+				"%llu writebacks\n",
+			      (unsigned long long)(dstats.hits
+				+ dstats.misses),
+			      (unsigned long long)(100 * dstats.hits
+				/ (dstats.hits + dstats.misses)),
+			      (unsigned long long)(1000 * dstats.hits
+				/ (dstats.hits + dstats.misses) % 10),
+			      (unsigned long long)dstats.bypassed,
+			      (unsigned long long)dstats.writebacks);
+		}
+		if (ctx->vol->readahead_reads) {
+			ntfs_log_info("Read-ahead : %llu reads, %llu served "
+				"from %llu prefetches, %llu.%1llu%% hits\n",
+			      (unsigned long long)ctx->vol->readahead_reads,
+			      (unsigned long long)ctx->vol->readahead_hits,
+			      (unsigned long long)ctx->vol->readahead_prefetches,
+			      (unsigned long long)(100
+				* ctx->vol->readahead_hits
+				/ ctx->vol->readahead_reads),
+			      (unsigned long long)(1000
+				* ctx->vol->readahead_hits
+				/ ctx->vol->readahead_reads % 10));
+		}
+#if CACHE_CBLOCK_SIZE
+		if (ctx->vol->cblock_cache
+		    && ctx->vol->cblock_cache->reads) {
+			ntfs_log_info("Compressed blocks cache : %lu reads, "
+				"%lu.%1lu%% hits\n",
+			      ctx->vol->cblock_cache->reads,
+			      100 * ctx->vol->cblock_cache->hits
+				/ ctx->vol->cblock_cache->reads,
+			      1000 * ctx->vol->cblock_cache->hits
+				/ ctx->vol->cblock_cache->reads % 10);
+		}
+#endif
+#if CACHE_INDEX_SIZE
+		if (ctx->vol->index_cache
+		    && ctx->vol->index_cache->reads) {
+			ntfs_log_info("Index blocks cache : %lu reads, "
+				"%lu.%1lu%% hits\n",
+			      ctx->vol->index_cache->reads,
+			      100 * ctx->vol->index_cache->hits
+				/ ctx->vol->index_cache->reads,
+			      1000 * ctx->vol->index_cache->hits
+				/ ctx->vol->index_cache->reads % 10);
+			stats = ctx->vol->index_stats;
+			for (i=0; stats && (i<INDEX_STATS_DIRS); i++) {
+				if (stats[i].reads)
+					ntfs_log_info("  directory %llu : "
+						"%lu reads, %lu.%1lu%% hits\n",
+					(unsigned long long)stats[i].inum,
+					stats[i].reads,
+					100 * stats[i].hits / stats[i].reads,
+					1000 * stats[i].hits
+						/ stats[i].reads % 10);
+			}
+		}
+#endif
 		ntfs_destroy_security_context(&security);
 	}
         
@@ -4236,6 +5328,13 @@ static void ntfs_close(void)
 
 static void ntfs_fuse_destroy2(void *notused __attribute__((unused)))
 {
+#ifdef FUSE_INTERNAL
+	ntfs_fuse_flush_atimes();
+	free(atimes.mrefs);
+	atimes.mrefs = (MFT_REF*)NULL;
+	atimes.allocated = 0;
+#endif /* FUSE_INTERNAL */
+	prefetch_clear();
 	ntfs_close();
 }
 
@@ -4245,6 +5344,9 @@ static struct fuse_lowlevel_ops ntfs_3g_ops = {
 	.readlink	= ntfs_fuse_readlink,
 	.opendir	= ntfs_fuse_opendir,
 	.readdir	= ntfs_fuse_readdir,
+#ifdef FUSE_CAP_READDIRPLUS
+	.readdirplus	= ntfs_fuse_readdirplus,
+#endif /* FUSE_CAP_READDIRPLUS */
 	.releasedir	= ntfs_fuse_releasedir,
 	.open		= ntfs_fuse_open,
 	.release	= ntfs_fuse_release,
@@ -4283,6 +5385,9 @@ static struct fuse_lowlevel_ops ntfs_3g_ops = {
 	.setbkuptime	= ntfs_macfuse_setbkuptime,
 	.setchgtime	= ntfs_macfuse_setchgtime,
 #endif /* defined(__APPLE__) || defined(__DARWIN__) */
+#ifdef FUSE_INTERNAL
+	.lock		= ntfs_fuse_lock,
+#endif /* FUSE_INTERNAL */
 	.init		= ntfs_init
 };
 
@@ -4323,6 +5428,8 @@ static int ntfs_open(const char *device)
 		flags |= NTFS_MNT_RECOVER;
 	if (ctx->hiberfile)
 		flags |= NTFS_MNT_IGNORE_HIBERFILE;
+	if (ctx->io_uring)
+		flags |= NTFS_MNT_IO_URING;
 
 	ctx->vol = vol = ntfs_mount(device, flags);
 	if (!vol) {
@@ -4331,6 +5438,19 @@ static int ntfs_open(const char *device)
 	}
 	if (ctx->sync && ctx->vol->dev)
 		NDevSetSync(ctx->vol->dev);
+	if (ctx->devcache
+	    && ntfs_device_cache_init(ctx->vol->dev,
+			(s64)ctx->devcache << 10,
+			DCACHE_BLOCK_SIZE, ctx->devcache_flags))
+		ntfs_log_perror("Failed to set up the device cache");
+	if (ctx->readahead
+	    && ntfs_set_readahead(ctx->vol, (s64)ctx->readahead << 10))
+		goto err_out;
+	if (ctx->free_extents)
+		NVolSetFreeExtents(ctx->vol);
+	if (ctx->compress_level
+	    && ntfs_set_compress_level(ctx->vol, ctx->compress_level))
+		goto err_out;
 	if (ctx->compression)
 		NVolSetCompression(ctx->vol);
 	else
@@ -4352,12 +5472,6 @@ static int ntfs_open(const char *device)
 		goto err_out;
 	}
 
-	vol->free_mft_records = ntfs_get_nr_free_mft_records(vol);
-	if (vol->free_mft_records < 0) {
-		ntfs_log_perror("Failed to calculate free MFT records");
-		goto err_out;
-	}
-
 	if (ctx->hiberfile && ntfs_volume_check_hiberfile(vol, 0)) {
 		if (errno != EPERM)
 			goto err_out;
@@ -4840,13 +5954,29 @@ int main(int argc, char *argv[])
 		ntfs_log_info("%s", fuse26_kmod_msg);
 #endif  
 	setup_logging(parsed_options);
+		/* threads would not survive daemonizing */
+	if (ctx->compress_threads > 1)
+		ntfs_set_compress_threads(ctx->vol, ctx->compress_threads);
+#ifdef FUSE_INTERNAL
+	if ((ctx->threads > 1) && ntfs_volume_set_threaded(ctx->vol)) {
+		ntfs_log_error("Using a single thread\n");
+		ctx->threads = 1;
+	}
+#endif /* FUSE_INTERNAL */
 	if (failed_secure)
 		ntfs_log_info("%s\n",failed_secure);
 	if (permissions_mode)
 		ntfs_log_info("%s, configuration type %d\n",permissions_mode,
 			5 + POSIXACLS*6 - KERNELPERMS*3 + CACHEING);
         
-	fuse_session_loop(se);
+	ntfs_fuse_notify_start();
+#ifdef FUSE_INTERNAL
+	if (ctx->threads > 1)
+		fuse_session_loop_mt(se, ctx->threads);
+	else
+#endif /* FUSE_INTERNAL */
+		fuse_session_loop(se);
+	ntfs_fuse_notify_end();
 	fuse_remove_signal_handlers(se);
         
 	err = 0;
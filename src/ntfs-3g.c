@@ -93,6 +93,8 @@
 #include "attrib.h"
 #include "inode.h"
 #include "volume.h"
+#include "compress.h"
+#include "cache.h"
 #include "dir.h"
 #include "unistr.h"
 #include "layout.h"
@@ -271,16 +273,6 @@ static void ntfs_fuse_update_times(ntfs_inode *ni, ntfs_time_update_flags mask)
 	ntfs_inode_update_times(ni, mask);
 }
 
-static s64 ntfs_get_nr_free_mft_records(ntfs_volume *vol)
-{
-	ntfs_attr *na = vol->mftbmp_na;
-	s64 nr_free = ntfs_attr_get_free_bits(na);
-
-	if (nr_free >= 0)
-		nr_free += (na->allocated_size - na->data_size) << 3;
-	return nr_free;
-}
-
 /*
  *      Fill a security context as needed by security functions
  *      returns TRUE if there is a user mapping,
@@ -779,6 +771,92 @@ static int wsl_getattr(ntfs_inode *ni, const REPARSE_POINT *reparse,
 	return (res);
 }
 
+/*
+ *		Define attributes for a WOF compressed file
+ *		(internal plugin)
+ *
+ *	The size is the size of the uncompressed data
+ */
+
+static int wof_getattr(ntfs_inode *ni,
+			const REPARSE_POINT *reparse __attribute__((unused)),
+			struct stat *stbuf)
+{
+	ntfs_attr *na;
+	int res;
+
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (na) {
+		stbuf->st_size = na->data_size;
+		stbuf->st_blocks = (ni->allocated_size + 511) >> 9;
+		stbuf->st_mode = S_IFREG;
+		ntfs_attr_close(na);
+		res = 0;
+	} else
+		res = -errno;
+	return (res);
+}
+
+/*
+ *		Open a WOF compressed file, only for reading
+ */
+
+static int wof_open(ntfs_inode *ni __attribute__((unused)),
+			const REPARSE_POINT *reparse __attribute__((unused)),
+			struct fuse_file_info *fi)
+{
+	int res;
+
+	res = 0;
+	if (fi->flags & (O_WRONLY | O_RDWR))
+		res = -EOPNOTSUPP;
+	return (res);
+}
+
+/*
+ *		Read from a WOF compressed file
+ *
+ *	The data is decompressed by ntfs_attr_pread()
+ */
+
+static int wof_read(ntfs_inode *ni,
+			const REPARSE_POINT *reparse __attribute__((unused)),
+			char *buf, size_t size, off_t offset,
+			struct fuse_file_info *fi __attribute__((unused)))
+{
+	ntfs_attr *na;
+	s64 total;
+	s64 ret;
+	int res;
+
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (!na)
+		return (-errno);
+	if (offset >= na->data_size)
+		size = 0;
+	else
+		if ((s64)(offset + size) > na->data_size)
+			size = na->data_size - offset;
+	total = 0;
+	res = 0;
+	while (size > 0) {
+		ret = ntfs_attr_pread(na, offset, size, buf);
+		if (ret <= 0) {
+			if (!total)
+				res = (ret < 0 ? -errno : -EIO);
+			break;
+		}
+		size -= ret;
+		offset += ret;
+		buf += ret;
+		total += ret;
+	}
+	if (!res)
+		res = total;
+	ntfs_attr_close(na);
+	return (res);
+}
+
 /*
  *		Apply permission masks to st_mode returned by a reparse handler
  */
@@ -3882,6 +3960,11 @@ static void register_internal_reparse_plugins(void)
 	static const plugin_operations_t wsl_ops = {
 		.getattr = wsl_getattr,
 	} ;
+	static const plugin_operations_t wof_ops = {
+		.getattr = wof_getattr,
+		.open = wof_open,
+		.read = wof_read,
+	} ;
 
 	register_reparse_plugin(ctx, IO_REPARSE_TAG_MOUNT_POINT,
 					&ops, (void*)NULL);
@@ -3899,12 +3982,19 @@ static void register_internal_reparse_plugins(void)
 					&wsl_ops, (void*)NULL);
 	register_reparse_plugin(ctx, IO_REPARSE_TAG_LX_BLK,
 					&wsl_ops, (void*)NULL);
+	register_reparse_plugin(ctx, IO_REPARSE_TAG_WOF,
+					&wof_ops, (void*)NULL);
 }
 #endif /* DISABLE_PLUGINS */
 
 static void ntfs_close(void)
 {
 	struct SECURITY_CONTEXT security;
+	struct ntfs_device_cache_stats dstats;
+#if CACHE_INDEX_SIZE
+	struct INDEX_CACHE_STATS *stats;
+	int i;
+#endif
 
 	if (!ctx)
 		return;
@@ -3927,6 +4017,68 @@ static void ntfs_close(void)
 			         / ctx->seccache->head.p_reads % 10);
 			}
 		}
+		if (!ntfs_device_cache_stats(ctx->vol->dev, &dstats)
+		    && (dstats.hits + dstats.misses)) {
+			ntfs_log_info("Device cache : %llu reads, "
+				"%llu.%1llu%% hits, %llu bypassed, "
+				"%llu writebacks\n",
+			      (unsigned long long)(dstats.hits
+				+ dstats.misses),
+			      (unsigned long long)(100 * dstats.hits
+				/ (dstats.hits + dstats.misses)),
+			      (unsigned long long)(1000 * dstats.hits
+				/ (dstats.hits + dstats.misses) % 10),
+			      (unsigned long long)dstats.bypassed,
+			      (unsigned long long)dstats.writebacks);
+		}
+		if (ctx->vol->readahead_reads) {
+			ntfs_log_info("Read-ahead : %llu reads, %llu served "
+				"from %llu prefetches, %llu.%1llu%% hits\n",
+			      (unsigned long long)ctx->vol->readahead_reads,
+			      (unsigned long long)ctx->vol->readahead_hits,
+			      (unsigned long long)ctx->vol->readahead_prefetches,
+			      (unsigned long long)(100
+				* ctx->vol->readahead_hits
+				/ ctx->vol->readahead_reads),
+			      (unsigned long long)(1000
+				* ctx->vol->readahead_hits
+				/ ctx->vol->readahead_reads % 10));
+		}
+#if CACHE_CBLOCK_SIZE
+		if (ctx->vol->cblock_cache
+		    && ctx->vol->cblock_cache->reads) {
+			ntfs_log_info("Compressed blocks cache : %lu reads, "
+				"%lu.%1lu%% hits\n",
+			      ctx->vol->cblock_cache->reads,
+			      100 * ctx->vol->cblock_cache->hits
+				/ ctx->vol->cblock_cache->reads,
+			      1000 * ctx->vol->cblock_cache->hits
+				/ ctx->vol->cblock_cache->reads % 10);
+		}
+#endif
+#if CACHE_INDEX_SIZE
+		if (ctx->vol->index_cache
+		    && ctx->vol->index_cache->reads) {
+			ntfs_log_info("Index blocks cache : %lu reads, "
+				"%lu.%1lu%% hits\n",
+			      ctx->vol->index_cache->reads,
+			      100 * ctx->vol->index_cache->hits
+				/ ctx->vol->index_cache->reads,
+			      1000 * ctx->vol->index_cache->hits
+				/ ctx->vol->index_cache->reads % 10);
+			stats = ctx->vol->index_stats;
+			for (i=0; stats && (i<INDEX_STATS_DIRS); i++) {
+				if (stats[i].reads)
+					ntfs_log_info("  directory %llu : "
+						"%lu reads, %lu.%1lu%% hits\n",
+					(unsigned long long)stats[i].inum,
+					stats[i].reads,
+					100 * stats[i].hits / stats[i].reads,
+					1000 * stats[i].hits
+						/ stats[i].reads % 10);
+			}
+		}
+#endif
 		ntfs_destroy_security_context(&security);
 	}
 	
@@ -4034,6 +4186,8 @@ static int ntfs_open(const char *device)
 		flags |= NTFS_MNT_RECOVER;
 	if (ctx->hiberfile)
 		flags |= NTFS_MNT_IGNORE_HIBERFILE;
+	if (ctx->io_uring)
+		flags |= NTFS_MNT_IO_URING;
 
 	ctx->vol = ntfs_mount(device, flags);
 	if (!ctx->vol) {
@@ -4042,6 +4196,19 @@ static int ntfs_open(const char *device)
 	}
 	if (ctx->sync && ctx->vol->dev)
 		NDevSetSync(ctx->vol->dev);
+	if (ctx->devcache
+	    && ntfs_device_cache_init(ctx->vol->dev,
+			(s64)ctx->devcache << 10,
+			DCACHE_BLOCK_SIZE, ctx->devcache_flags))
+		ntfs_log_perror("Failed to set up the device cache");
+	if (ctx->readahead
+	    && ntfs_set_readahead(ctx->vol, (s64)ctx->readahead << 10))
+		goto err_out;
+	if (ctx->free_extents)
+		NVolSetFreeExtents(ctx->vol);
+	if (ctx->compress_level
+	    && ntfs_set_compress_level(ctx->vol, ctx->compress_level))
+		goto err_out;
 	if (ctx->compression)
 		NVolSetCompression(ctx->vol);
 	else
@@ -4060,12 +4227,6 @@ static int ntfs_open(const char *device)
 		goto err_out;
 	}
 
-	ctx->vol->free_mft_records = ntfs_get_nr_free_mft_records(ctx->vol);
-	if (ctx->vol->free_mft_records < 0) {
-		ntfs_log_perror("Failed to calculate free MFT records");
-		goto err_out;
-	}
-
 	if (ctx->hiberfile && ntfs_volume_check_hiberfile(ctx->vol, 0)) {
 		if (errno != EPERM)
 			goto err_out;
@@ -4566,6 +4727,9 @@ int main(int argc, char *argv[])
 		ntfs_log_info("%s", fuse26_kmod_msg);
 #endif	
 	setup_logging(parsed_options);
+		/* threads would not survive daemonizing */
+	if (ctx->compress_threads > 1)
+		ntfs_set_compress_threads(ctx->vol, ctx->compress_threads);
 	if (failed_secure)
 	        ntfs_log_info("%s\n",failed_secure);
 	if (permissions_mode)
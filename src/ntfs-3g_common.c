@@ -44,6 +44,10 @@
 #include <errno.h>
 #endif
 
+#ifdef ENABLE_VOLUME_LOCKS
+#include <pthread.h>
+#endif
+
 #include <getopt.h>
 #include <fuse.h>
 
@@ -128,6 +132,19 @@ const struct DEFOPTION optionlist[] = {
 	{ "efs_raw", OPT_EFS_RAW, FLGOPT_BOGUS },
 	{ "posix_nlink", OPT_POSIX_NLINK, FLGOPT_BOGUS },
 	{ "special_files", OPT_SPECIAL_FILES, FLGOPT_STRING },
+	{ "devcache", OPT_DEVCACHE, FLGOPT_DECIMAL },
+	{ "devcache_clock", OPT_DEVCACHE_CLOCK, FLGOPT_BOGUS },
+	{ "devcache_writeback", OPT_DEVCACHE_WRITEBACK, FLGOPT_BOGUS },
+	{ "io_uring", OPT_IO_URING, FLGOPT_BOGUS },
+	{ "readahead", OPT_READAHEAD, FLGOPT_DECIMAL },
+	{ "free_extents", OPT_FREE_EXTENTS, FLGOPT_BOGUS },
+	{ "compress_threads", OPT_COMPRESS_THREADS, FLGOPT_DECIMAL },
+	{ "compress_level", OPT_COMPRESS_LEVEL, FLGOPT_DECIMAL },
+	{ "threads", OPT_THREADS, FLGOPT_DECIMAL },
+	{ "splice", OPT_SPLICE, FLGOPT_BOGUS },
+	{ "writeback_cache", OPT_WRITEBACK_CACHE, FLGOPT_BOGUS },
+	{ "readdirplus", OPT_READDIRPLUS, FLGOPT_BOGUS },
+	{ "cache_timeout", OPT_CACHE_TIMEOUT, FLGOPT_DECIMAL },
 	{ (const char*)NULL, 0, 0 } /* end marker */
 } ;
 
@@ -515,6 +532,49 @@ char *parse_mount_options(ntfs_fuse_context_t *ctx,
 					goto err_exit;
 				}
 				break;
+			case OPT_DEVCACHE :
+				ctx->devcache = intarg;
+				break;
+			case OPT_DEVCACHE_CLOCK :
+				ctx->devcache_flags |= DCACHE_CLOCK;
+				break;
+			case OPT_DEVCACHE_WRITEBACK :
+				ctx->devcache_flags |= DCACHE_WRITEBACK;
+				break;
+			case OPT_IO_URING :
+				ctx->io_uring = TRUE;
+				break;
+			case OPT_READAHEAD :
+				ctx->readahead = intarg;
+				break;
+			case OPT_FREE_EXTENTS :
+				ctx->free_extents = TRUE;
+				break;
+			case OPT_COMPRESS_THREADS :
+				ctx->compress_threads = intarg;
+				break;
+			case OPT_COMPRESS_LEVEL :
+				ctx->compress_level = intarg;
+				break;
+			case OPT_THREADS :
+				ctx->threads = intarg;
+				break;
+			case OPT_SPLICE :
+				ctx->splice = TRUE;
+				break;
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+			case OPT_WRITEBACK_CACHE :
+				ctx->writeback_cache = TRUE;
+				break;
+#endif
+#ifdef FUSE_CAP_READDIRPLUS
+			case OPT_READDIRPLUS :
+				ctx->readdirplus = TRUE;
+				break;
+#endif
+			case OPT_CACHE_TIMEOUT :
+				ctx->cache_timeout = intarg;
+				break;
 			case OPT_FSNAME : /* Filesystem name. */
 			/*
 			 * We need this to be able to check whether filesystem
@@ -812,12 +872,18 @@ int register_reparse_plugin(ntfs_fuse_context_t *ctx, le32 tag,
  *		Get the reparse operations associated to an inode
  *
  *	The plugin able to process the reparse point is dynamically loaded
+ *	(the list of plugins is protected by a mutex, as requests on
+ *	different inodes may be processed concurrently)
  *
  *	When successful, returns the operations vector and the reparse
  *		data if requested,
  *	Otherwise returns NULL, with errno set.
  */
 
+#ifdef ENABLE_VOLUME_LOCKS
+static pthread_mutex_t plugins_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 const struct plugin_operations *select_reparse_plugin(ntfs_fuse_context_t *ctx,
 				ntfs_inode *ni, REPARSE_POINT **reparse_wanted)
 {
@@ -833,6 +899,9 @@ const struct plugin_operations *select_reparse_plugin(ntfs_fuse_context_t *ctx,
 	if (reparse) {
 		tag = reparse->reparse_tag;
 		seltag = tag & IO_REPARSE_PLUGIN_SELECT;
+#ifdef ENABLE_VOLUME_LOCKS
+		pthread_mutex_lock(&plugins_lock);
+#endif
 		for (plugin=ctx->plugins; plugin && (plugin->tag != seltag);
 						plugin = plugin->next) { }
 		if (plugin) {
@@ -874,6 +943,9 @@ const struct plugin_operations *select_reparse_plugin(ntfs_fuse_context_t *ctx,
 				ctx->errors_logged |= ERR_PLUGIN;
 			}
 		}
+#ifdef ENABLE_VOLUME_LOCKS
+		pthread_mutex_unlock(&plugins_lock);
+#endif
 		if (ops && reparse_wanted)
 			*reparse_wanted = reparse;
 		else
@@ -94,6 +94,19 @@ enum {
 	OPT_EFS_RAW,
 	OPT_POSIX_NLINK,
 	OPT_SPECIAL_FILES,
+	OPT_DEVCACHE,
+	OPT_DEVCACHE_CLOCK,
+	OPT_DEVCACHE_WRITEBACK,
+	OPT_IO_URING,
+	OPT_READAHEAD,
+	OPT_FREE_EXTENTS,
+	OPT_COMPRESS_THREADS,
+	OPT_COMPRESS_LEVEL,
+	OPT_THREADS,
+	OPT_SPLICE,
+	OPT_WRITEBACK_CACHE,
+	OPT_READDIRPLUS,
+	OPT_CACHE_TIMEOUT,
 } ;
 
 			/* Option flags */
@@ -157,6 +170,18 @@ typedef struct {
 	BOOL mounted;
 	BOOL posix_nlink;
 	ntfs_volume_special_files special_files;
+	unsigned int devcache;
+	int devcache_flags;
+	BOOL io_uring;
+	unsigned int readahead;
+	BOOL free_extents;
+	unsigned int compress_threads;
+	unsigned int compress_level;
+	unsigned int threads;
+	BOOL splice;
+	BOOL writeback_cache;
+	BOOL readdirplus;
+	unsigned int cache_timeout;
 #ifdef HAVE_SETXATTR	/* extended attributes interface required */
 	BOOL efs_raw;
 #ifdef XATTR_MAPPINGS
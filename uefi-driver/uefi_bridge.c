@@ -25,6 +25,7 @@
 
 #include "compat.h"
 #include "volume.h"
+#include "device.h"
 #include "unistr.h"
 #include "logging.h"
 #include "dir.h"
@@ -541,6 +542,15 @@ NtfsMountVolume(EFI_FS* FileSystem)
 	/* Store the serial to detect media change/removal */
 	FileSystem->NtfsVolumeSerial = vol->vol_serial;
 
+#if DEVICE_CACHE_SIZE > 0
+	if (ntfs_device_cache_init(vol->dev, (s64)DEVICE_CACHE_SIZE << 10,
+		DCACHE_BLOCK_SIZE, DEVICE_CACHE_FLAGS) < 0)
+		PrintWarning(L"Could not set up the device cache: %a\n", strerror(errno));
+#endif
+#if READAHEAD_SIZE > 0
+	ntfs_set_readahead(vol, (s64)READAHEAD_SIZE << 10);
+#endif
+
 	/* Population of free space must be done manually */
 	ntfs_volume_get_free_space(vol);
 	FileSystem->NtfsVolume = vol;
@@ -556,7 +566,19 @@ NtfsMountVolume(EFI_FS* FileSystem)
 EFI_STATUS
 NtfsUnmountVolume(EFI_FS* FileSystem)
 {
-	ntfs_umount(FileSystem->NtfsVolume, FALSE);
+	ntfs_volume* vol = (ntfs_volume*)FileSystem->NtfsVolume;
+	struct ntfs_device_cache_stats dstats;
+
+	if ((ntfs_device_cache_stats(vol->dev, &dstats) == 0) &&
+		(dstats.hits + dstats.misses > 0))
+		PrintInfo(L"Device cache: %lld hits, %lld misses, %lld bypassed, %lld writebacks\n",
+			dstats.hits, dstats.misses, dstats.bypassed,
+			dstats.writebacks);
+	if (vol->readahead_reads > 0)
+		PrintInfo(L"Read-ahead: %lld reads, %lld served from %lld prefetches\n",
+			vol->readahead_reads, vol->readahead_hits,
+			vol->readahead_prefetches);
+	ntfs_umount(vol, FALSE);
 
 	PrintInfo(L"Unmounted volume '%s'\n", FileSystem->NtfsVolumeLabel);
 	NtfsLookupFree(&FileSystem->LookupListHead);
@@ -666,6 +688,34 @@ NtfsOpenFile(EFI_NTFS_FILE** FilePointer)
 	return EFI_SUCCESS;
 }
 
+/*
+ * Get the unnamed $DATA attribute of a file, opening it on first use.
+ * The attribute is kept open for the lifetime of the file instance, so
+ * that subsequent reads do not have to look it up and map its runlist
+ * again.
+ */
+static ntfs_attr*
+NtfsGetDataAttr(EFI_NTFS_FILE* File)
+{
+	if (File->NtfsAttr == NULL)
+		File->NtfsAttr = ntfs_attr_open(File->NtfsInode, AT_DATA, AT_UNNAMED, 0);
+	return File->NtfsAttr;
+}
+
+/*
+ * Close the cached $DATA attribute of a file, if any. This must be
+ * called before the data or the inode of the file get modified or
+ * closed by other means than the cached attribute.
+ */
+static VOID
+NtfsReleaseDataAttr(EFI_NTFS_FILE* File)
+{
+	if (File->NtfsAttr != NULL) {
+		ntfs_attr_close(File->NtfsAttr);
+		File->NtfsAttr = NULL;
+	}
+}
+
 /*
  * Close an open file
  */
@@ -677,6 +727,7 @@ NtfsCloseFile(EFI_NTFS_FILE* File)
 
 	if (File == NULL || File->NtfsInode == NULL)
 		return;
+	NtfsReleaseDataAttr(File);
 	/*
 	 * If the inode is dirty, ntfs_inode_close() will issue an
 	 * ntfs_inode_sync() which may try to open the parent inode.
@@ -732,7 +783,7 @@ NtfsReadFile(EFI_NTFS_FILE* File, VOID* Data, UINTN* Len)
 
 	*Len = 0;
 
-	na = ntfs_attr_open(File->NtfsInode, AT_DATA, AT_UNNAMED, 0);
+	na = NtfsGetDataAttr(File);
 	if (!na) {
 		PrintError(L"%a failed: %a\n", __FUNCTION__, strerror(errno));
 		return ErrnoToEfiStatus();
@@ -742,7 +793,6 @@ NtfsReadFile(EFI_NTFS_FILE* File, VOID* Data, UINTN* Len)
 	if (File->Offset + size > max_read) {
 		if (File->Offset > max_read) {
 			/* Per UEFI specs */
-			ntfs_attr_close(na);
 			return EFI_DEVICE_ERROR;
 		}
 		size = max_read - File->Offset;
@@ -755,7 +805,8 @@ NtfsReadFile(EFI_NTFS_FILE* File, VOID* Data, UINTN* Len)
 				((ntfs_inode*)File->NtfsInode)->mft_no,
 				File->Offset, *Len, ret);
 		if (ret <= 0 || ret > size) {
-			ntfs_attr_close(na);
+			/* Reopen the attribute on next read */
+			NtfsReleaseDataAttr(File);
 			if (ret >= 0)
 				errno = EIO;
 			PrintError(L"%a failed: %a\n", __FUNCTION__, strerror(errno));
@@ -766,8 +817,6 @@ NtfsReadFile(EFI_NTFS_FILE* File, VOID* Data, UINTN* Len)
 		*Len += (UINTN)ret;
 	}
 
-	ntfs_attr_close(na);
-
 	if (!NtfsIsVolumeReadOnly(File->FileSystem->NtfsVolume))
 		ntfs_inode_update_times(File->NtfsInode, NTFS_UPDATE_MCTIME);
 
@@ -1041,6 +1090,7 @@ NtfsDeleteFile(EFI_NTFS_FILE* File)
 		return EFI_ACCESS_DENIED;
 
 	/* Delete the file */
+	NtfsReleaseDataAttr(File);
 	r = ntfs_delete(File->FileSystem->NtfsVolume, NULL, File->NtfsInode,
 		dir_ni, File->BaseName, (u8)SafeStrLen(File->BaseName));
 	NtfsLookupRem(File);
@@ -1086,6 +1136,8 @@ NtfsWriteFile(EFI_NTFS_FILE* File, VOID* Data, UINTN* Len)
 	if (ni->flags & FILE_ATTR_READONLY)
 		return EFI_WRITE_PROTECTED;
 
+	/* The cached attribute is not used for writing */
+	NtfsReleaseDataAttr(File);
 	na = ntfs_attr_open(File->NtfsInode, AT_DATA, AT_UNNAMED, 0);
 	if (!na) {
 		PrintError(L"%a failed (open): %a\n", __FUNCTION__, strerror(errno));
@@ -1137,6 +1189,9 @@ NtfsMoveFile(EFI_NTFS_FILE* File, CHAR16* NewPath)
 	if (IS_DIRTY(File->NtfsInode))
 		return EFI_ACCESS_DENIED;
 
+	/* The inode gets closed and reopened */
+	NtfsReleaseDataAttr(File);
+
 	FS_ASSERT(NewPath[0] == PATH_CHAR);
 	while (NewPath[--Len] != PATH_CHAR);
 	NewPath[Len] = 0;
@@ -1297,6 +1352,9 @@ NtfsSetFileInfo(EFI_NTFS_FILE* File, EFI_FILE_INFO* Info, BOOLEAN ReadOnly)
 
 	PrintExtra(L"NtfsSetInfo for inode: %lld\n", ni->mft_no);
 
+	/* The size or the inode may change */
+	NtfsReleaseDataAttr(File);
+
 	/* Per UEFI specs, trying to change type should return access denied */
 	if ((!IS_DIR(ni) && (Info->Attribute & EFI_FILE_DIRECTORY)) ||
 		(IS_DIR(ni) && !(Info->Attribute & EFI_FILE_DIRECTORY)))
@@ -1409,6 +1467,12 @@ NtfsFlushFile(EFI_NTFS_FILE* File)
 		PrintError(L"%a failed: %a\n", __FUNCTION__, strerror(errno));
 		Status = ErrnoToEfiStatus();
 	}
+	/* Write the blocks held by a write-back device cache */
+	if (!EFI_ERROR(Status) &&
+		ntfs_device_cache_flush(((ntfs_volume*)File->FileSystem->NtfsVolume)->dev) < 0) {
+		PrintError(L"%a failed: %a\n", __FUNCTION__, strerror(errno));
+		Status = ErrnoToEfiStatus();
+	}
 	if (Parent != NULL) {
 		Parent->NtfsInode = ntfs_inode_open(File->FileSystem->NtfsVolume, parent_inum);
 		if (Parent->NtfsInode == NULL) {